@@ -23,49 +23,113 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <utime.h>
 
+#include "libzsync/stamp.h"
 #include "libzsync/zsync.h"
 
 #include "curl.h"
 #include "progress.h"
 #include "url.h"
 
-/* read_seed_file(zsync, filename_str)
+/* split_seed_control(arg)
+ * A seed file given as file:file.zsync comes with its own .zsync. Returns
+ * that part of the argument, having cut it off the filename, or NULL. */
+static char *split_seed_control(char *arg) {
+    char *colon = strrchr(arg, ':');
+    size_t len = colon ? strlen(colon + 1) : 0;
+
+    if (!colon || len <= 6 || strcmp(colon + 1 + len - 6, ".zsync") || !access(arg, F_OK))
+        return NULL;
+    *colon = 0;
+    return colon + 1;
+}
+
+/* Bytes at the start of each seed file to have the kernel read ahead while
+ * the .zsync downloads */
+#define SEED_PREFETCH (64 << 20)
+
+/* prefetch_seed(arg)
+ * Have the kernel start reading the start of the seed file (given as to -i)
+ * into the page cache, in the background; so that it is there to scan as
+ * soon as we have the .zsync. */
+static void prefetch_seed(const char *arg) {
+    char *fname = strdup(arg);
+    int fd;
+
+    if (!fname)
+        return;
+    split_seed_control(fname);
+    fd = open(fname, O_RDONLY);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, SEED_PREFETCH, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+    free(fname);
+}
+
+/* read_seed_file(zsync, filename_str, clone)
  * Reads the given file and applies the rsync
  * checksum algorithm to it, so any data that is contained in the target file
  * is written to the in-progress target. So use this function to supply local
  * source files which are believed to have data in common with the target.
+ * If clone, it's the first seed file, and the target can start as a reflink
+ * of it where the filesystem supports that. Given as file:file.zsync, we find
+ * what the file has of the target by comparing the .zsyncs, and only scan the
+ * rest of it.
  */
-void read_seed_file(struct zsync_state *z, const char *fname) {
+void read_seed_file(struct zsync_state *z, const char *arg, bool clone) {
+    char *fname = strdup(arg);
+    char *control = fname ? split_seed_control(fname) : NULL;
+
+    if (!fname) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
     {
         /* Simple file - open it */
         FILE *f = fopen(fname, "r");
+        FILE *cf = control ? fopen(control, "r") : NULL;
+        if (control && !cf) {
+            perror(control);
+            fprintf(stderr, "reading seed file %s without it\n", fname);
+        }
         if (!f) {
             perror("open");
             fprintf(stderr, "not using seed file %s\n", fname);
         } else {
+            int rc;
 
             /* Give the contents to libzsync to read, to find any content that
              * is part of the target file. */
             if (!no_progress)
                 fprintf(stderr, "reading seed file %s: ", fname);
-            if (zsync_submit_source_file(z, f, !no_progress) < 0) {
+            if (cf)
+                rc = zsync_submit_source_join(z, f, cf, !no_progress);
+            else if (clone)
+                rc = zsync_submit_source_clone(z, f, !no_progress);
+            else
+                rc = zsync_submit_source_file(z, f, !no_progress);
+            if (rc < 0)
                 fprintf(stderr, "error reading seed file %s\n", fname);
-            }
 
             /* And close */
             if (fclose(f) != 0) {
                 perror("close");
             }
         }
+        if (cf)
+            fclose(cf);
     }
 
     { /* And print how far we've progressed towards the target file */
@@ -75,11 +139,26 @@ void read_seed_file(struct zsync_state *z, const char *fname) {
         if (!no_progress)
             fprintf(stderr, "\rDone reading %s. %02.1f%% of target obtained.      \n", fname, (100.0f * done) / total);
     }
+    free(fname);
 }
 
 long long http_down;
 char *referer;
 
+/* Map of the blocks in the .part, saved every RESUME_SAVE_SECS while we
+ * download and when we stop, so that a later run can carry on from it; and how
+ * many of those blocks that run checks before trusting it */
+#define RESUME_SAVE_SECS 30
+#define RESUME_CHECKS 64
+char *resume_map;
+static time_t next_save;
+static volatile sig_atomic_t interrupted;
+
+static void on_signal(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
 /* A ptrlist is a very simple structure for storing lists of pointers. This is
  * the only function in its API. The structure (not actually a struct) consists
  * of a (pointer to a) char*[] and an int giving the number of entries.
@@ -105,38 +184,208 @@ static char **append_ptrlist(int *n, char **p, void *a) {
     return p;
 }
 
-/* zs = read_zsync_control_file(location_str)
+/* curl_file(what)
+ * Returns the (malloced) name of a new empty temporary file for curl to keep
+ * something in (an ETag, the headers), or NULL */
+static char *curl_file(const char *what) {
+    const char *dir = getenv("TMPDIR");
+    char *path = malloc(strlen(dir ? dir : "/tmp") + strlen(what) + 16);
+    int fd;
+
+    if (!path)
+        return NULL;
+    sprintf(path, "%s/zsync-%s.XXXXXX", dir ? dir : "/tmp", what);
+    fd = mkstemp(path);
+    if (fd == -1) {
+        free(path);
+        return NULL;
+    }
+    close(fd);
+    return path;
+}
+
+/* read_local_control_file(filename, st, stamp)
+ * read_zsync_control_file for a .zsync that is a regular file here, with the
+ * given stat. We read it ourselves, not through curl, so that a binary
+ * checksum table (zsyncmake -2) can be taken from a mapping of the file. Its
+ * mtime stands in for Last-Modified. */
+static struct zsync_state *read_local_control_file(const char *p, const struct stat *st,
+                                                   struct target_stamp *stamp) {
+    struct zsync_state *zs;
+    FILE *f;
+
+    target_stamp_source(stamp, p);
+    if (stamp->modified && st->st_mtime <= stamp->modified)
+        return NULL;
+    f = fopen(p, "r");
+    if (!f) {
+        perror(p);
+        exit(1);
+    }
+    zs = zsync_begin(f, false);
+    fclose(f);
+    if (!zs)
+        exit(1);
+    stamp->etag[0] = 0;
+    stamp->modified = st->st_mtime;
+    return zs;
+}
+
+/* zs = read_zsync_control_file(location_str, stamp)
  * Reads a zsync control file from either a URL or filename specified in
  * location_str. This is treated as a URL if no local file exists of that name
  * and it starts with a URL scheme ; only http URLs are supported.
+ * A URL is read as it downloads, so the checksums are loaded while the rest of
+ * them are still on the way, and we never hold the whole file.
+ * If the stamp has an ETag or a Last-Modified date, the download is
+ * conditional on the .zsync having changed since (by its ETag, if we have one,
+ * else by the date), and this returns NULL if it hasn't. Either way the stamp
+ * gets the source, Last-Modified and ETag of this download.
  */
-struct zsync_state *read_zsync_control_file(const char *p) {
-    const char *curl_options[] = {
-        "--fail-with-body", "--silent", "--show-error", "--location", "--netrc", p, NULL,
+struct zsync_state *read_zsync_control_file(const char *p, struct target_stamp *stamp) {
+    const char *curl_options[16] = {
+        "--fail-with-body", "--silent", "--show-error", "--location", "--netrc",
     };
-    char *buffer = NULL;
-    size_t buffer_size = 0;
-    int ret = curl_get(curl_options, &buffer, &buffer_size);
+    int n = 5;
+    char *etag, *headers;
+    bool conditional = stamp->modified != 0 || stamp->etag[0];
+    struct zsync_state *zs = NULL;
+    struct stat st;
+    FILE *stream;
+    int c;
+
+    if (stat(p, &st) == 0 && S_ISREG(st.st_mode))
+        return read_local_control_file(p, &st, stamp);
+    etag = curl_file("etag");
+    headers = curl_file("headers");
+
+    if (etag && conditional && stamp->etag[0]) { /* If-None-Match */
+        FILE *f = fopen(etag, "w");
+        if (f) {
+            fprintf(f, "%s\n", stamp->etag);
+            fclose(f);
+            curl_options[n++] = "--etag-compare";
+            curl_options[n++] = etag;
+        }
+    }
+    /* If-Modified-Since, taken from the file's mtime: the server's own date for
+     * the .zsync, as our clock may not agree with its */
+    if (headers && stamp->modified) {
+        struct utimbuf u = {stamp->modified, stamp->modified};
+        if (utime(headers, &u) == 0) {
+            curl_options[n++] = "--time-cond";
+            curl_options[n++] = headers;
+        }
+    }
+    if (etag) {
+        curl_options[n++] = "--etag-save";
+        curl_options[n++] = etag;
+    }
+    if (headers) {
+        curl_options[n++] = "--dump-header";
+        curl_options[n++] = headers;
+    }
+    curl_options[n++] = p;
+
+    target_stamp_source(stamp, p);
+    stream = curl_open(curl_options);
+    if (!stream)
+        exit(1);
+
+    /* Read the .zsync, if there is one */
+    c = getc(stream);
+    if (c != EOF) {
+        ungetc(c, stream);
+        zs = zsync_begin(stream, false);
+    }
+
+    /* Let curl finish, with any error page that we couldn't read, so that its
+     * exit code says how the download went */
+    while (getc(stream) != EOF)
+        ;
+    int ret = curl_close(stream);
     if (ret) {
         fprintf(stderr, "curl exited %i, Failed to download %s\n", ret, p);
         exit(1);
     }
-    FILE *stream = fmemopen(buffer, buffer_size, "r");
-    if (!stream) {
-        perror("fmemopen");
-        exit(1);
+
+    /* Keep the ETag and Last-Modified that came with it */
+    stamp->etag[0] = 0;
+    if (etag) {
+        FILE *f = fopen(etag, "r");
+        if (f) {
+            if (fgets(stamp->etag, sizeof stamp->etag, f))
+                stamp->etag[strcspn(stamp->etag, "\r\n")] = 0;
+            fclose(f);
+        }
+        unlink(etag);
+        free(etag);
     }
-    /* Read the .zsync */
-    struct zsync_state *zs;
-    if ((zs = zsync_begin(stream, false)) == NULL) {
-        exit(1);
+    stamp->modified = 0;
+    if (headers) {
+        FILE *f = fopen(headers, "r");
+        if (f) {
+            stamp->modified = target_stamp_last_modified(f);
+            fclose(f);
+        }
+        unlink(headers);
+        free(headers);
     }
 
-    fclose(stream);
-    free(buffer);
+    /* Nothing at all, when we asked only for changes, means no changes */
+    if (c == EOF && conditional)
+        return NULL;
+
+    if (c == EOF)
+        fprintf(stderr, "%s is empty\n", p);
+    if (!zs)
+        exit(1);
     return zs;
 }
 
+/* up_to_date(zs, filename)
+ * Whether the file is stamped as the target of the .zsync, and unchanged since */
+static bool up_to_date(struct zsync_state *zs, const char *filename) {
+    struct target_stamp stamp;
+    const char *checksum = NULL;
+    const char *checksum_method = NULL;
+
+    zsync_get_checksum(zs, &checksum, &checksum_method);
+    return checksum && target_stamp_read(filename, &stamp) == 0 && !strcmp(stamp.checksum_method, checksum_method) &&
+           !strcasecmp(stamp.checksum, checksum) && stamp.length == zsync_get_filelength(zs);
+}
+
+/* stamp_target(stamp, zs)
+ * Fill in what the target of the .zsync is, for stamping it when it's in place.
+ * Returns false if we don't know, as the .zsync has no checksum. */
+static bool stamp_target(struct target_stamp *stamp, struct zsync_state *zs) {
+    const char *checksum = NULL;
+    const char *checksum_method = NULL;
+
+    zsync_get_checksum(zs, &checksum, &checksum_method);
+    if (!checksum || strlen(checksum) >= sizeof stamp->checksum ||
+        strlen(checksum_method) >= sizeof stamp->checksum_method)
+        return false;
+    strcpy(stamp->checksum, checksum);
+    strcpy(stamp->checksum_method, checksum_method);
+    stamp->length = zsync_get_filelength(zs);
+    return true;
+}
+
+/* guess_filename(url)
+ * The filename that the target of the .zsync at the URL probably has, before
+ * we have the .zsync to say: its name, less .zsync. Malloced, or NULL. */
+static char *guess_filename(const char *url) {
+    const char *base = strrchr(url, '/');
+    size_t len;
+
+    base = base ? base + 1 : url;
+    len = strlen(base);
+    if (len <= 6 || strcmp(base + len - 6, ".zsync"))
+        return NULL;
+    return strndup(base, len - 6);
+}
+
 /* str = get_filename_prefix(path_str)
  * Returns a (malloced) string of the alphanumeric leading segment of the
  * filename in the given file path.
@@ -241,15 +490,17 @@ int fetch_remaining_blocks_http(struct zsync_state *z, const char *u) {
 
         char *buf = NULL;
         size_t buf_size = 0;
-        int ret = curl_get(curl_options, &buf, &buf_size);
-        if (ret) {
-            fprintf(stderr, "curl exited %i, failed to download range %ld-%ld (%ldB)\n", ret, range_start, range_end,
+        int rc = curl_get(curl_options, &buf, &buf_size);
+        if (rc) {
+            fprintf(stderr, "curl exited %i, failed to download range %ld-%ld (%ldB)\n", rc, range_start, range_end,
                     len);
+            free(buf);
             ret = 1;
             break;
         }
         if (buf_size != len) {
             fprintf(stderr, "Unexpected size of curl read (got %ld, expected %ld)\n", buf_size, len);
+            free(buf);
             ret = 1;
             break;
         }
@@ -263,6 +514,15 @@ int fetch_remaining_blocks_http(struct zsync_state *z, const char *u) {
         // Needed in case next call returns len=0 and we need to signal where the EOF was.
         zoffset += len;
         http_down += buf_size;
+
+        if (resume_map && time(NULL) >= next_save) {
+            zsync_save_map(z, resume_map);
+            next_save = time(NULL) + RESUME_SAVE_SECS;
+        }
+        if (interrupted) {
+            ret = 1;
+            break;
+        }
     }
     /* Let the zsync receiver know that we're at EOF; there
      * could be data in its buffer that it can use or needs to process */
@@ -320,7 +580,7 @@ int fetch_remaining_blocks(struct zsync_state *zs) {
     status = calloc(n, sizeof *status);
 
     /* Keep going until we're done or have no useful URLs left */
-    while (zsync_status(zs) < 2 && ok_urls) {
+    while (zsync_status(zs) < 2 && ok_urls && !interrupted) {
         /* Still need data; pick a URL to use. */
         int try = rand() % n;
 
@@ -368,12 +628,22 @@ int main(int argc, char **argv) {
     char *filename = NULL;
     long long local_used;
     time_t mtime;
+    int scan_stride = 0;
+    bool copy_plan = false;
+    bool use_io_uring = false;
+    bool in_place = false;
+    bool resumed = false;
+    bool match_cache = true;
+    bool verified = false;
+    bool stamp_ok;
+    struct target_stamp stamp;
+    int target_fd = -1;
 
     srand(getpid());
     { /* Option parsing */
         int opt;
 
-        while ((opt = getopt(argc, argv, "o:i:qu:")) != -1) {
+        while ((opt = getopt(argc, argv, "o:i:IMqu:RS:W")) != -1) {
             switch (opt) {
             case 'o':
                 free(filename);
@@ -382,12 +652,27 @@ int main(int argc, char **argv) {
             case 'i':
                 seedfiles = append_ptrlist(&nseedfiles, seedfiles, optarg);
                 break;
+            case 'I':
+                in_place = true;
+                break;
+            case 'M':
+                match_cache = false;
+                break;
             case 'q':
                 no_progress = 1;
                 break;
             case 'u':
                 referer = strdup(optarg);
                 break;
+            case 'R':
+                copy_plan = true;
+                break;
+            case 'S':
+                scan_stride = atoi(optarg);
+                break;
+            case 'W':
+                use_io_uring = true;
+                break;
             }
         }
     }
@@ -405,32 +690,121 @@ int main(int argc, char **argv) {
     if (!isatty(0))
         no_progress = 1;
 
-    /* STEP 1: Read the zsync control file */
-    if ((zs = read_zsync_control_file(argv[optind])) == NULL)
-        exit(1);
+    /* STEP 1: Read the zsync control file; unless the server says that it
+     * hasn't changed since the target was put in place from it */
+    memset(&stamp, 0, sizeof stamp);
+    {
+        char *guess = filename ? NULL : guess_filename(argv[optind]);
+        const char *target = filename ? filename : guess;
+        struct target_stamp old;
+        int i;
+
+        /* Which we'll want as soon as we have the .zsync */
+        if (target)
+            prefetch_seed(target);
+        for (i = 0; i < nseedfiles; i++)
+            prefetch_seed(seedfiles[i]);
+
+        target_stamp_source(&stamp, argv[optind]);
+        if (target && target_stamp_read(target, &old) == 0 && !strcmp(old.source, stamp.source)) {
+            stamp.modified = old.modified;
+            strcpy(stamp.etag, old.etag);
+        }
+        if ((zs = read_zsync_control_file(argv[optind], &stamp)) == NULL) {
+            if (!no_progress)
+                printf("%s is up to date: %s has not changed\n", target, argv[optind]);
+            exit(0);
+        }
+        free(guess);
+    }
+
+    /* Override any Scan-Stride from the .zsync */
+    if (scan_stride && zsync_set_scan_stride(zs, scan_stride) != 0) {
+        fprintf(stderr, "-S %d: stride must be a power of 2, at most the blocksize\n", scan_stride);
+        exit(3);
+    }
+    zsync_set_copy_plan(zs, copy_plan);
+    if (match_cache)
+        zsync_use_match_cache(zs, NULL);
+    if (use_io_uring && zsync_use_io_uring(zs) != 0 && !no_progress)
+        fprintf(stderr, "io_uring is not available, writing as usual\n");
 
     /* Get eventual filename for output, and filename to write to while working */
     if (!filename)
         filename = get_filename(zs, argv[optind]);
-    temp_file = malloc(strlen(filename) + 6);
+    temp_file = malloc(strlen(filename) + 12);
     strcpy(temp_file, filename);
-    strcat(temp_file, ".part");
+    strcat(temp_file, in_place ? ".zs-journal" : ".part");
+
+    /* Nothing to do if the target is in place already, as the last run left it.
+     * Stamp it again, with this download of the .zsync, to ask about next time. */
+    if (up_to_date(zs, filename)) {
+        if (stamp_target(&stamp, zs))
+            target_stamp_write(filename, &stamp);
+        if (!no_progress)
+            printf("%s is up to date\n", filename);
+        free(zsync_end(zs));
+        free(temp_file);
+        free(filename);
+        free(referer);
+        exit(0);
+    }
+    target_stamp_remove(filename);
+
+    if (in_place) { /* STEP 2a: update the target file where it is */
+        long long done, total;
+
+        target_fd = open(filename, O_RDWR | O_CREAT, 0666);
+        if (target_fd == -1) {
+            perror(filename);
+            exit(1);
+        }
+        if (!no_progress)
+            fprintf(stderr, "reading %s to update it in place: ", filename);
+        if (zsync_submit_in_place(zs, target_fd, temp_file, !no_progress) < 0) {
+            fprintf(stderr, "failed to update %s in place\n", filename);
+            exit(1);
+        }
+        zsync_progress(zs, &done, &total);
+        if (!no_progress)
+            fprintf(stderr, "\rDone moving %s. %02.1f%% of target obtained.      \n", filename, (100.0f * done) / total);
+
+        /* From here on, any messages about where the download is mean it */
+        strcpy(temp_file, filename);
+    } else { /* STEP 2a: or carry on from an interrupted run, if its map is good */
+        resume_map = malloc(strlen(filename) + 11);
+        strcpy(resume_map, filename);
+        strcat(resume_map, ".zs-resume");
+        if (!access(temp_file, R_OK) && !access(resume_map, R_OK)) {
+            long long done, total;
+
+            resumed = zsync_resume(zs, temp_file, resume_map, RESUME_CHECKS) >= 0;
+            zsync_progress(zs, &done, &total);
+            if (!no_progress && resumed)
+                fprintf(stderr, "resuming from %s. %02.1f%% of target obtained.\n", temp_file,
+                        (100.0f * done) / total);
+            else if (!no_progress)
+                fprintf(stderr, "can't resume from %s, reading it instead\n", temp_file);
+        }
+    }
 
     { /* STEP 2: read available local data and fill in what we know in the
        * target file */
         int i;
 
         /* If the target file already exists, we're probably updating that file
-         * - so it's a seed file */
-        if (!access(filename, R_OK)) {
-            seedfiles = append_ptrlist(&nseedfiles, seedfiles, filename);
+         * - so it's a seed file; and the first, so we can start from a clone
+         * of it, and only write what has moved or changed */
+        if (!in_place && !access(filename, R_OK)) {
+            read_seed_file(zs, filename, !resumed);
         }
-        /* If the .part file exists, it's probably an interrupted earlier
-         * effort; a normal HTTP client would 'resume' from where it got to,
-         * but zsync can't (because we don't know this data corresponds to the
-         * current version on the remote) and doesn't need to, because we can
-         * treat it like any other local source of data. Use it now. */
-        if (!access(temp_file, R_OK)) {
+        /* If the .part file exists (and we didn't resume from it above), it's
+         * probably an interrupted earlier effort; a normal HTTP client would
+         * 'resume' from where it got to, but without its map zsync can't
+         * (because we don't know this data corresponds to the current version
+         * on the remote) and doesn't need to, because we can treat it like
+         * any other local source of data. Use it now. */
+        if (!in_place && !resumed && !access(temp_file, R_OK)) {
             seedfiles = append_ptrlist(&nseedfiles, seedfiles, temp_file);
         }
 
@@ -448,10 +822,12 @@ int main(int argc, char **argv) {
                 if (!strcmp(seedfiles[i], seedfiles[j]))
                     dup = 1;
             }
+            if (!strcmp(seedfiles[i], filename) || (resumed && !strcmp(seedfiles[i], temp_file)))
+                dup = 1; /* Read already */
 
             /* And now, if not a duplicate, read it */
             if (!dup)
-                read_seed_file(zs, seedfiles[i]);
+                read_seed_file(zs, seedfiles[i], false);
         }
         free(seedfiles);
 
@@ -476,16 +852,31 @@ int main(int argc, char **argv) {
      * in-progress run (which should be a superset of the old .part - unless
      * the content changed, in which case it still contains anything relevant
      * from the old .part). */
-    if (zsync_rename_file(zs, temp_file) != 0) {
+    if (!in_place && zsync_rename_file(zs, temp_file) != 0) {
         perror("rename");
         exit(1);
     }
-
-    /* STEP 3: fetch remaining blocks via the URLs from the .zsync */
+    if (resume_map && !resumed)
+        unlink(resume_map); /* Any old map is of the old .part */
+
+    /* STEP 3: fetch remaining blocks via the URLs from the .zsync. If we're
+     * stopped, save what we've got first. */
+    if (resume_map) {
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        next_save = time(NULL) + RESUME_SAVE_SECS;
+    }
     {
         int fetch_status = fetch_remaining_blocks(zs);
         int target_status = zsync_status(zs);
         if (target_status < 2) {
+            if (resume_map)
+                zsync_save_map(zs, resume_map);
+            if (interrupted) {
+                fprintf(stderr, "Interrupted. Incomplete transfer left in %s, to carry on from next time.\n",
+                        temp_file);
+                exit(3);
+            }
             fprintf(
                 stderr,
                 "%s. Incomplete transfer left in %s.\n(If this is the download filename with .part appended, zsync "
@@ -503,6 +894,13 @@ int main(int argc, char **argv) {
     { /* STEP 4: verify download */
         int r;
 
+        /* Whatever the outcome, the map is done with */
+        if (resume_map) {
+            unlink(resume_map);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+        }
+
         if (!no_progress)
             printf("verifying download...");
         r = zsync_complete(zs);
@@ -515,10 +913,20 @@ int main(int argc, char **argv) {
                 printf("no recognised checksum found\n");
             break;
         case 1:
+            verified = true;
             if (!no_progress)
                 printf("checksum matches OK\n");
             break;
         }
+        if (!no_progress) {
+            long long verify_bytes;
+            double verify_secs;
+
+            zsync_verify_stats(zs, &verify_bytes, &verify_secs);
+            if (verify_bytes)
+                printf("read back %lld bytes to verify in %.3fs (%.1f MB/s)\n", verify_bytes, verify_secs,
+                       verify_secs > 0 ? verify_bytes / verify_secs / 1e6 : 0.0);
+        }
     }
 
     free(temp_file);
@@ -527,10 +935,19 @@ int main(int argc, char **argv) {
      * down the zsync_state as we are done on the file transfer. Getting the
      * current name of the file at the same time. */
     mtime = zsync_mtime(zs);
+    stamp_ok = verified && stamp_target(&stamp, zs);
     temp_file = zsync_end(zs);
 
     /* STEP 5: Move completed .part file into place as the final target */
-    if (filename) {
+    if (in_place) {
+        /* It's there already */
+        close(target_fd);
+        if (mtime != -1)
+            set_mtime(filename, mtime);
+        if (stamp_ok)
+            target_stamp_write(filename, &stamp);
+        free(filename);
+    } else if (filename) {
         char *oldfile_backup = malloc(strlen(filename) + 8);
         int ok = 1;
 
@@ -560,6 +977,8 @@ int main(int argc, char **argv) {
                 /* final, final thing - set the mtime on the file if we have one */
                 if (mtime != -1)
                     set_mtime(filename, mtime);
+                if (stamp_ok)
+                    target_stamp_write(filename, &stamp);
             } else {
                 perror("rename");
                 fprintf(stderr, "Unable to back up old file %s - completed download left in %s\n", filename, temp_file);
@@ -578,6 +997,7 @@ int main(int argc, char **argv) {
         printf("used %lld (%.2f%%) local, fetched %lld (%.2f%%)\n", local_used, local_percent, http_down, http_percent);
     }
     free(referer);
+    free(resume_map);
     free(temp_file);
     return 0;
 }
@@ -81,3 +81,25 @@ int curl_get(const char **curl_options, char **restrict bufloc, size_t *sizeloc)
     free((void *)cmd_buf);
     return ret;
 }
+
+FILE *curl_open(const char **curl_options) {
+    const char *cmd_buf = make_curl_cmd(curl_options);
+    if (!cmd_buf) {
+        return NULL;
+    }
+    FILE *curl_stdout = popen(cmd_buf, "r");
+    if (!curl_stdout) {
+        perror("curl popen");
+    }
+    free((void *)cmd_buf);
+    return curl_stdout;
+}
+
+int curl_close(FILE *f) {
+    int ret = pclose(f);
+    if (ret == -1) {
+        perror("pclose(curl_stdout)");
+        return -1;
+    }
+    return WEXITSTATUS(ret);
+}
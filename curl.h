@@ -1,5 +1,11 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdio.h>
 
 int curl_get(const char **curl_options, char **bufloc, size_t *sizeloc);
+
+// Run curl with the options and read its output as it arrives, instead of all at once as curl_get does.
+// curl_close waits for it to finish and returns its exit code, or -1.
+FILE *curl_open(const char **curl_options);
+int curl_close(FILE *f);
@@ -107,11 +107,41 @@ void test_envvar_bad() {
     free(curl_stdout);
 }
 
+void test_stream() {
+    unsetenv("ZSYNC_CURL");
+    char url[PATH_MAX] = "file://";
+    char cwd[PATH_MAX] = {0};
+    getcwd(cwd, sizeof(cwd));
+    strcat(url, cwd);
+    strcat(url, "/curl_test.txt");
+    const char *options[] = {url, NULL};
+
+    FILE *f = curl_open(options);
+    char line[64];
+    if (!f || !fgets(line, sizeof line, f) || strcmp(line, "I'm a test file\n")) {
+        fprintf(stderr, "unexpected output from curl_open\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = curl_close(f);
+    if (ret) {
+        fprintf(stderr, "curl_close returned %i\n", ret);
+        exit(EXIT_FAILURE);
+    }
+
+    options[0] = "file:///This-file-does-not-exist";
+    f = curl_open(options);
+    if (!f || fgetc(f) != EOF || (ret = curl_close(f)) != 37) { // "Couldn't open file"
+        fprintf(stderr, "curl_close returned %i\n", ret);
+        exit(EXIT_FAILURE);
+    }
+}
+
 int main() {
     test_good();
     test_help();
     test_notfound();
     test_envvar_good();
     test_envvar_bad();
+    test_stream();
     return EXIT_SUCCESS;
 }
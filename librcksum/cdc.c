@@ -0,0 +1,260 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Content-defined chunking. Instead of fixed size blocks, the target is split
+ * into chunks at positions decided by the content (a gear hash over the
+ * preceding bytes, as in FastCDC), so an insertion or deletion only changes
+ * the chunks around it. The client splits its seed files with the same
+ * function and looks each chunk up by its strong checksum; there is no rolling
+ * checksum scan at all. */
+
+#include "zsglobal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "progress.h"
+
+/* The gear table: 256 fixed pseudo-random 64-bit values. They are part of the
+ * file format, as zsyncmake and the client must place boundaries identically,
+ * so they are generated from a fixed seed rather than stored; once, by
+ * pthread_once, as chunking can run on several threads. */
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void make_gear_table(void) {
+    uint64_t x = 0x7a73796e63334344ULL; /* splitmix64 */
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* mask = top_bits_mask(n)
+ * A mask of the top n bits of the 64-bit gear hash. The top bits depend on the
+ * last 64 bytes; the bottom ones only on the last few. */
+static inline uint64_t top_bits_mask(int n) { return n <= 0 ? 0 : ~0ULL << (64 - n); }
+
+/* len = rcksum_cdc_boundary(data, len, min, avg, max)
+ * Returns the length of the chunk starting at data[0]. Give it at least max
+ * bytes, unless data[] runs to the end of the file. Chunks are at least min
+ * and at most max bytes long (but the last in the file can be shorter), and
+ * avg (a power of 2) is the typical size. Uses FastCDC's normalised chunking:
+ * a stricter test before avg and a looser one after it, which keeps the chunk
+ * sizes closer to avg. */
+size_t rcksum_cdc_boundary(const unsigned char *data, size_t len, size_t min, size_t avg, size_t max) {
+    int bits = __builtin_ctzl(avg);
+    uint64_t mask_s = top_bits_mask(bits + 2);
+    uint64_t mask_l = top_bits_mask(bits - 2);
+    uint64_t h = 0;
+    size_t n = len < max ? len : max;
+    size_t mid = avg < n ? avg : n;
+    size_t i = min;
+
+    pthread_once(&gear_once, make_gear_table);
+    if (len <= min)
+        return len;
+
+    for (; i < mid; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & mask_s))
+            return i + 1;
+    }
+    for (; i < n; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & mask_l))
+            return i + 1;
+    }
+    return n;
+}
+
+/* rcksum_set_chunking(self, min, avg, max)
+ * Switch this rcksum_state from fixed size blocks to content-defined chunks
+ * with the given parameters. Must be called before any chunks are added with
+ * rcksum_add_target_chunk. Returns 0, or -1 if out of memory. */
+int rcksum_set_chunking(struct rcksum_state *z, size_t min, size_t avg, size_t max) {
+    z->chunk_offsets = calloc(z->blocks + 1, sizeof *z->chunk_offsets);
+    if (!z->chunk_offsets)
+        return -1;
+    z->chunk_min = min;
+    z->chunk_avg = avg;
+    z->chunk_max = max;
+    return 0;
+}
+
+/* chunk_key(checksum)
+ * The hash table is keyed on the struct rsum of each block. In chunk mode we
+ * have no rsums, so use the first 4 bytes of the strong checksum instead. */
+static inline struct rsum chunk_key(const unsigned char *checksum) {
+    struct rsum r;
+    r.a = (checksum[0] << 8) | checksum[1];
+    r.b = (checksum[2] << 8) | checksum[3];
+    return r;
+}
+
+/* rcksum_add_target_chunk(self, chunkid, length, checksum)
+ * Sets the length and checksum for a given chunk. Chunks must be added in
+ * order, as the offset of each is the sum of the lengths of those before. */
+void rcksum_add_target_chunk(struct rcksum_state *z, zs_blockid b, size_t len, void *checksum) {
+    if (b < z->blocks) {
+        struct hash_entry *e = z->blockhashes + b;
+        memcpy(e->checksum, checksum, z->checksum_bytes);
+        e->r = chunk_key(e->checksum);
+        z->chunk_offsets[b + 1] = z->chunk_offsets[b] + len;
+    }
+}
+
+/* rcksum_block_offset(self, blockid)
+ * Returns the offset in the target file at which the given block (or chunk)
+ * starts. Block id z->blocks gives the end of the last block. */
+off_t rcksum_block_offset(const struct rcksum_state *z, zs_blockid id) { return block_offset(z, id); }
+
+/* rcksum_block_at_offset(self, offset)
+ * Returns the id of the block (or chunk) containing the given offset. */
+zs_blockid rcksum_block_at_offset(const struct rcksum_state *z, off_t offset) {
+    zs_blockid lo = 0, hi = z->blocks;
+
+    if (!z->chunk_offsets)
+        return offset >> z->blockshift;
+
+    /* Binary search for the last chunk starting at or before offset */
+    while (hi - lo > 1) {
+        zs_blockid mid = lo + (hi - lo) / 2;
+        if (z->chunk_offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* submit_chunk(self, data, len, src)
+ * Look up the chunk of seed data[] (len bytes, from offset src in the seed
+ * file) by its strong checksum, and if we want it in the target, write it to
+ * every chunk of the target that has this content. Returns the number of
+ * chunks of the target obtained. */
+static int submit_chunk(struct rcksum_state *z, const unsigned char *data, size_t len, off_t src) {
+    struct hash_entry t;
+    const struct hash_entry *e;
+    unsigned h;
+    int got_blocks = 0;
+
+    rcksum_calc_checksum(t.checksum, data, len);
+    t.r = chunk_key(t.checksum);
+    h = calc_rhash_one(z, t.r); /* Chunks are always seq_matches 1 */
+
+    z->stats.checksummed++;
+    if (!(z->bithash[(h & z->bithashmask) >> 3] & (1 << (h & 7))))
+        return 0;
+
+    /* As in check_checksums_on_hash_chain, write_blocks may unlink entries from
+     * the chain as we go, so keep our place with z->rover */
+    z->rover = z->rsum_hash[h & z->hashmask];
+    while (z->rover) {
+        zs_blockid id;
+
+        e = z->rover;
+        z->rover = e->next;
+
+        z->stats.hashhit++;
+        if (e->r.a != t.r.a || e->r.b != t.r.b || memcmp(e->checksum, t.checksum, z->checksum_bytes))
+            continue;
+        id = get_HE_blockid(z, e);
+        if (block_offset(z, id + 1) - block_offset(z, id) != (off_t)len)
+            continue;
+
+        z->stats.stronghit++;
+        z->cur_position_in_file = src;
+        write_blocks(z, data, id, id, true);
+        got_blocks++;
+    }
+    return got_blocks;
+}
+
+/* rcksum_submit_source_chunks(self, stream, progress)
+ * Split the given stream into chunks, just as zsyncmake did the target, and
+ * take any chunks that are also in the target. This is a single linear pass
+ * with one strong checksum and hash lookup per chunk. Progress reports if
+ * progress != 0. Returns the number of chunks of the target obtained. */
+int rcksum_submit_source_chunks(struct rcksum_state *z, FILE *f, int progress) {
+    int got_blocks = 0;
+    off_t in = 0; /* offset in the stream of buf[0] */
+    int in_mb = 0;
+    off_t size = get_file_size(f);
+    struct progress *p;
+    size_t bufsize = z->chunk_max * 16;
+    size_t avail = 0;
+    unsigned char *buf;
+
+    if (bufsize < 0x100000)
+        bufsize = 0x100000;
+    buf = malloc(bufsize);
+    if (!buf)
+        return -1;
+
+    if (!z->rsum_hash)
+        if (!build_hash(z)) {
+            free(buf);
+            return -1;
+        }
+
+    if (progress) {
+        p = start_progress();
+        do_progress(p, 0, in);
+    }
+
+    for (;;) {
+        size_t pos = 0;
+        int eof;
+
+        avail += fread(buf + avail, 1, bufsize - avail, f);
+        if (ferror(f)) {
+            perror("fread");
+            break;
+        }
+        eof = feof(f);
+
+        /* Chunk all we can; we need max bytes to be sure of a boundary,
+         * unless we have the rest of the file */
+        while (pos < avail && (eof || avail - pos >= z->chunk_max)) {
+            size_t n = rcksum_cdc_boundary(buf + pos, avail - pos, z->chunk_min, z->chunk_avg, z->chunk_max);
+            got_blocks += submit_chunk(z, buf + pos, n, in + pos);
+            pos += n;
+        }
+
+        if (eof)
+            break;
+
+        /* Keep the incomplete chunk for the next read */
+        memmove(buf, buf + pos, avail - pos);
+        avail -= pos;
+        in += pos;
+
+        if (progress && in_mb != in / 1000000) {
+            do_progress(p, size ? 100.0 * in / size : 0, in);
+            in_mb = in / 1000000;
+        }
+    }
+    free(buf);
+    if (progress)
+        end_progress(p, 2);
+    return got_blocks;
+}
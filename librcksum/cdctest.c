@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+#include "rcksum.h"
+
+#define MIN 1024
+#define AVG 4096
+#define MAX 16384
+
+static void test_eq(long a, long b) {
+    if (a != b) {
+        fprintf(stderr, "%ld != %ld\n", a, b);
+        exit(1);
+    }
+}
+
+static void make_data(unsigned char *data, size_t len, unsigned seed) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+}
+
+/* chunk(data, len, offsets[])
+ * Split data as zsyncmake does, returning the number of chunks and filling in
+ * the offset of the end of each. */
+static int chunk(const unsigned char *data, size_t len, size_t *ends) {
+    size_t pos = 0;
+    int n = 0;
+    while (pos < len) {
+        pos += rcksum_cdc_boundary(data + pos, len - pos, MIN, AVG, MAX);
+        ends[n++] = pos;
+    }
+    return n;
+}
+
+/* Chunks are within the size limits (bar the last), cover the data, and are
+ * all there is to know about the content: same data, same chunks. */
+void test_bounds(void) {
+    size_t len = 1 << 20;
+    unsigned char *data = malloc(len);
+    size_t *ends = malloc(len / MIN * sizeof *ends + sizeof *ends);
+    size_t *ends2 = malloc(len / MIN * sizeof *ends + sizeof *ends);
+    int n, i;
+
+    make_data(data, len, 1);
+    n = chunk(data, len, ends);
+    test_eq(ends[n - 1], len);
+    for (i = 0; i < n; i++) {
+        size_t l = ends[i] - (i ? ends[i - 1] : 0);
+        if (l > MAX || (l < MIN && i < n - 1)) {
+            fprintf(stderr, "chunk %d has length %zu\n", i, l);
+            exit(1);
+        }
+    }
+
+    /* Not all cut at min or max - it should be around the average */
+    if (n < (int)(len / MAX) * 2 || n > (int)(len / MIN) / 2) {
+        fprintf(stderr, "%d chunks in %zu bytes\n", n, len);
+        exit(1);
+    }
+
+    test_eq(chunk(data, len, ends2), n);
+    test_eq(memcmp(ends, ends2, n * sizeof *ends), 0);
+    free(data);
+    free(ends);
+    free(ends2);
+}
+
+/* After an insertion, the chunk boundaries soon fall in the same places in the
+ * data again, so only the chunks around the change are different. */
+void test_resync(void) {
+    size_t len = 1 << 20, ins = 100, at = 50000;
+    unsigned char *data = malloc(len);
+    unsigned char *data2 = malloc(len + ins);
+    size_t *ends = malloc(len / MIN * sizeof *ends + sizeof *ends);
+    size_t *ends2 = malloc(len / MIN * sizeof *ends + 2 * sizeof *ends);
+    int n, n2, i, j = 0, common = 0;
+
+    make_data(data, len, 2);
+    memcpy(data2, data, at);
+    make_data(data2 + at, ins, 3);
+    memcpy(data2 + at + ins, data + at, len - at);
+
+    n = chunk(data, len, ends);
+    n2 = chunk(data2, len + ins, ends2);
+    for (i = 0; i < n; i++) {
+        size_t e = ends[i] < at ? ends[i] : ends[i] + ins;
+        while (j < n2 && ends2[j] < e)
+            j++;
+        if (j < n2 && ends2[j] == e)
+            common++;
+    }
+    if (common < n - 4) {
+        fprintf(stderr, "only %d of %d chunk boundaries survived an insertion\n", common, n);
+        exit(1);
+    }
+    free(data);
+    free(data2);
+    free(ends);
+    free(ends2);
+}
+
+/* Offsets of chunks in an rcksum_state, and finding the chunk at an offset */
+void test_chunk_offsets(void) {
+    unsigned char checksum[CHECKSUM_SIZE];
+    size_t lens[] = {1500, 4096, 1024, 9000};
+    struct rcksum_state *z = rcksum_init(4, 16384, 4, 4, 0, 1, true, NULL, 15620);
+    int i;
+
+    memset(checksum, 0, sizeof checksum);
+    test_eq(rcksum_set_chunking(z, MIN, AVG, MAX), 0);
+    for (i = 0; i < 4; i++)
+        rcksum_add_target_chunk(z, i, lens[i], checksum);
+
+    test_eq(rcksum_block_offset(z, 0), 0);
+    test_eq(rcksum_block_offset(z, 2), 5596);
+    test_eq(rcksum_block_offset(z, 4), 15620);
+    test_eq(rcksum_block_at_offset(z, 0), 0);
+    test_eq(rcksum_block_at_offset(z, 1499), 0);
+    test_eq(rcksum_block_at_offset(z, 1500), 1);
+    test_eq(rcksum_block_at_offset(z, 6620), 3);
+    test_eq(rcksum_block_at_offset(z, 15619), 3);
+    rcksum_end(z);
+}
+
+int main(void) {
+    test_bounds();
+    test_resync();
+    test_chunk_offsets();
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Copy-plan mode: rather than writing each matched block as the scan finds
+ * it, record where it is in the source file, and afterwards copy it all into
+ * the output in large ranges, inside the kernel - cloning extents where the
+ * filesystem can, else with copy_file_range. */
+
+#define _GNU_SOURCE
+#include "zsglobal.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "internal.h"
+#include "rcksum.h"
+
+/* rcksum_set_copy_plan(self, on)
+ * In copy-plan mode, data found in source files is not written out as it is
+ * found; it is only recorded in the reusable ranges. The caller must then
+ * rcksum_copy_reusable_ranges from each source file before it moves on to the
+ * next (which clears them) or reads back the output. */
+void rcksum_set_copy_plan(struct rcksum_state *z, bool on) { z->copy_plan = on; }
+
+/* rcksum_clone_source(self, srcfd)
+ * Make our output a clone of the file srcfd, sharing its extents, where the
+ * filesystem can (btrfs, XFS); do this before anything is written. Then
+ * rcksum_set_source_in_place while that file is submitted as a source.
+ * Returns 0, or -1 if not possible. */
+int rcksum_clone_source(struct rcksum_state *z, int srcfd) {
+#ifdef FICLONE
+    if (z->fd != -1 && ioctl(z->fd, FICLONE, srcfd) == 0) {
+        /* But where the target has zeros, the source needn't */
+        if (rcksum_write_zero_blocks(z) != 0) {
+            fprintf(stderr, "IO error: %s\n", strerror(errno));
+            exit(-1);
+        }
+        return 0;
+    }
+#else
+    (void)z;
+    (void)srcfd;
+#endif
+    return -1;
+}
+
+/* rcksum_set_source_in_place(self, on)
+ * Say whether our output already has the data of the current source file, at
+ * the same offsets (see rcksum_clone_source); if so, data that the scan finds
+ * at the same offset in the target is not written, only recorded as known. */
+void rcksum_set_source_in_place(struct rcksum_state *z, bool on) { z->source_in_place = on; }
+
+static int compare_src(const void *a, const void *b) {
+    const struct reuseable_range *x = a, *y = b;
+    return x->src < y->src ? -1 : x->src > y->src;
+}
+
+/* copy_file_data(srcfd, dstfd, fb, src, dst, len)
+ * Copy len bytes from offset src in srcfd to dst in dstfd inside the kernel,
+ * by the fastest means available, bar those that fb (kept with dstfd) says
+ * the kernel refused before. Bytes past the end of the source are left as
+ * they are (they can only be zeros that padded out the last block).
+ * Returns 0, or -1 if that's not possible, and it must be copied by hand. */
+int copy_file_data(int srcfd, int dstfd, struct rcksum_copy_fallback *fb, off_t src, off_t dst, size_t len) {
+#ifdef FICLONERANGE
+    /* Share the extents, if the filesystem can (it needs them aligned) */
+    if (!fb->no_clone) {
+        struct file_clone_range fcr = {srcfd, src, len, dst};
+        if (ioctl(dstfd, FICLONERANGE, &fcr) == 0)
+            return 0;
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+            fb->no_clone = true; /* Don't ask again */
+    }
+#endif
+
+    /* Copy in the kernel */
+    while (len && !fb->no_copy_file_range) {
+        loff_t in = src, out = dst;
+        ssize_t rc = copy_file_range(srcfd, &in, dstfd, &out, len, 0);
+
+        if (rc == 0)
+            return 0; /* EOF of the source */
+        if (rc < 0) {
+            if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+                fb->no_copy_file_range = true;
+            break;
+        }
+        src += rc;
+        dst += rc;
+        len -= rc;
+    }
+    return len ? -1 : 0;
+}
+
+/* copy_range(self, srcfd, src, dst, len)
+ * Copy len bytes from offset src in srcfd to dst in our output: by the sink's
+ * clone_range if it can, else through a buffer of our own. As copy_file_data,
+ * bytes past the end of the source are left alone. Returns 0 or -1. */
+static int copy_range(struct rcksum_state *z, int srcfd, off_t src, off_t dst, size_t len) {
+    unsigned char *buf;
+
+    if (z->sink.clone_range && z->sink.clone_range(z->sink.ctx, srcfd, src, dst, len) == 0)
+        return 0;
+
+    buf = malloc(len < 0x100000 ? len : 0x100000);
+    if (!buf)
+        return -1;
+    while (len) {
+        ssize_t got = pread(srcfd, buf, len < 0x100000 ? len : 0x100000, src);
+        ssize_t done = 0;
+
+        if (got <= 0) {
+            if (got < 0)
+                perror("pread");
+            free(buf);
+            return got < 0 ? -1 : 0;
+        }
+        while (done < got) {
+            ssize_t rc = z->sink.write(z->sink.ctx, buf + done, got - done, dst + done);
+            if (rc < 0) {
+                perror("write");
+                free(buf);
+                return -1;
+            }
+            done += rc;
+        }
+        src += got;
+        dst += got;
+        len -= got;
+    }
+    free(buf);
+    return 0;
+}
+
+/* rcksum_copy_reusable_ranges(self, srcfd)
+ * Copy the reusable ranges recorded in copy-plan mode from the source file
+ * srcfd into our output. They are copied in order of their position in the
+ * source, with ranges that follow on in both files joined together.
+ * Returns 0, or -1 on error. */
+int rcksum_copy_reusable_ranges(struct rcksum_state *z, int srcfd) {
+    struct reuseable_range *rr;
+    size_t i, n = 0;
+    int rc = 0;
+
+    if (!z->sink.write || !z->num_reusable_ranges)
+        return 0;
+    rcksum_flush(z);
+
+    rr = malloc(z->num_reusable_ranges * sizeof *rr);
+    if (!rr)
+        return -1;
+    memcpy(rr, z->reusable_ranges, z->num_reusable_ranges * sizeof *rr);
+    qsort(rr, z->num_reusable_ranges, sizeof *rr, compare_src);
+
+    /* Join up ranges */
+    for (i = 0; i < z->num_reusable_ranges; i++) {
+        if (n && rr[n - 1].src + (off_t)rr[n - 1].len == rr[i].src && rr[n - 1].dst + (off_t)rr[n - 1].len == rr[i].dst)
+            rr[n - 1].len += rr[i].len;
+        else
+            rr[n++] = rr[i];
+    }
+
+    for (i = 0; i < n && rc == 0; i++)
+        if (!z->source_in_place || rr[i].src != rr[i].dst)
+            rc = copy_range(z, srcfd, rr[i].src, rr[i].dst, rr[i].len);
+    free(rr);
+    return rc;
+}
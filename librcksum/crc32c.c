@@ -0,0 +1,81 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* CRC32C (Castagnoli polynomial, as used by iSCSI and ext4). This is only a
+ * cheap prefilter in front of the MD4 in librcksum, so all that matters is that
+ * it is fast and that zsyncmake and the client agree on the value. */
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/* Reflected form of the Castagnoli polynomial 0x1EDC6F41 */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+/* crc32c_make_table()
+ * Fill in the byte-at-a-time lookup table for the software fallback. Run
+ * once, by pthread_once, as scans on several threads can all need it. */
+static void crc32c_make_table(void) {
+    uint32_t i;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        int k;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[i] = c;
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t len) {
+    pthread_once(&crc32c_table_once, crc32c_make_table);
+    while (len--)
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* The SSE4.2 crc32 instruction computes exactly this CRC, 8 bytes per
+ * instruction. Compiled for sse4.2 regardless of the -march we are built for,
+ * and only called if the CPU says it has it. */
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, data, sizeof v);
+        c = __builtin_ia32_crc32di(c, v);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    return crc;
+}
+#endif
+
+/* crc32c(crc, data, len)
+ * Returns the CRC32C of data, continuing from a previous crc (0 to start). */
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32c_hw(crc, data, len);
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
@@ -0,0 +1,26 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC32C_LENGTH 4
+
+/* crc32c(crc, data, len)
+ * Continue a CRC32C (Castagnoli) over the given data. Start with crc = 0.
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, else a table. */
+uint32_t crc32c(uint32_t crc, const uint8_t *data, size_t len);
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "crc32c.h"
+#include "md4.h"
+
+static void test_eq(uint32_t a, uint32_t b) {
+    if (a != b) {
+        fprintf(stderr, "%08x != %08x\n", a, b);
+        exit(1);
+    }
+}
+
+/* Test vectors from RFC 3720 appendix B.4 */
+void test_rfc3720(void) {
+    unsigned char data[32];
+    int i;
+
+    memset(data, 0, sizeof(data));
+    test_eq(crc32c(0, data, sizeof(data)), 0x8a9136aa);
+
+    memset(data, 0xff, sizeof(data));
+    test_eq(crc32c(0, data, sizeof(data)), 0x62a8ab43);
+
+    for (i = 0; i < 32; i++)
+        data[i] = i;
+    test_eq(crc32c(0, data, sizeof(data)), 0x46dd794e);
+}
+
+void test_check_value(void) { test_eq(crc32c(0, (const uint8_t *)"123456789", 9), 0xe3069283); }
+
+/* Feeding the data in pieces, of lengths that aren't multiples of 8, must give
+ * the same answer as doing it in one go. */
+void test_continuation(void) {
+    unsigned char data[1000];
+    size_t i;
+
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = i * 7 + 3;
+
+    uint32_t whole = crc32c(0, data, sizeof(data));
+    uint32_t part = crc32c(0, data, 13);
+    part = crc32c(part, data + 13, 500);
+    part = crc32c(part, data + 513, sizeof(data) - 513);
+    test_eq(part, whole);
+}
+
+/* Compare the cost of the prefilter with the MD4 it saves, per 2 KiB block.
+ * This is what each false weak hit costs without and with the CRC32C column. */
+void perf_test_vs_md4(int n) {
+    struct timeval start, mid, end;
+    unsigned char data[2048];
+    unsigned char digest[MD4_DIGEST_LENGTH];
+    volatile uint32_t unused = 0;
+    int i;
+
+    for (i = 0; i < (int)sizeof(data); i++)
+        data[i] = i * 7 + 3;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < n; i++)
+        unused += crc32c(0, data, sizeof(data));
+    gettimeofday(&mid, NULL);
+    for (i = 0; i < n; i++) {
+        MD4_CTX ctx;
+        MD4Init(&ctx);
+        MD4Update(&ctx, data, sizeof(data));
+        MD4Final(digest, &ctx);
+        unused += digest[0];
+    }
+    gettimeofday(&end, NULL);
+
+    long crc_us = (mid.tv_sec - start.tv_sec) * 1000000L + mid.tv_usec - start.tv_usec;
+    long md4_us = (end.tv_sec - mid.tv_sec) * 1000000L + end.tv_usec - mid.tv_usec;
+    printf("%d blocks: crc32c %ld.%06lds, md4 %ld.%06lds\n", n, crc_us / 1000000, crc_us % 1000000, md4_us / 1000000,
+           md4_us % 1000000);
+}
+
+int main(void) {
+    test_rfc3720();
+    test_check_value();
+    test_continuation();
+
+#if 0
+    perf_test_vs_md4(1000000);
+#endif
+
+    return 0;
+}
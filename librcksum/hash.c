@@ -20,9 +20,11 @@
 
 #include "zsglobal.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "internal.h"
 #include "rcksum.h"
@@ -33,10 +35,11 @@
 #define UNUSED_BY_NDEBUG __attribute__((unused))
 #endif
 
-/* rcksum_add_target_block(self, blockid, rsum, checksum)
+/* rcksum_add_target_block(self, blockid, rsum, checksum, crc32c)
  * Sets the stored hash values for the given blockid to the given values.
+ * crc32c is ignored unless the rcksum_state was created with crc32c_bytes.
  */
-void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b, struct rsum r, void *checksum) {
+void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b, struct rsum r, void *checksum, uint32_t crc32c) {
     if (b < z->blocks) {
         /* Get hash entry with checksums for this block */
         struct hash_entry *e = &(z->blockhashes[b]);
@@ -45,6 +48,7 @@ void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b, struct rsum r
         memcpy(e->checksum, checksum, z->checksum_bytes);
         e->r.a = r.a & z->rsum_a_mask;
         e->r.b = r.b;
+        e->crc32c = crc32c & z->crc32c_mask;
 
         /* New checksums invalidate any existing checksum hash tables */
         if (z->rsum_hash) {
@@ -56,6 +60,84 @@ void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b, struct rsum r
     }
 }
 
+/* load_be(data, bytes)
+ * The big-endian number in the given bytes (at most 4) */
+static inline uint32_t load_be(const unsigned char *p, unsigned int bytes) {
+    switch (bytes) {
+    case 4:
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    case 3:
+        return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    case 2:
+        return (uint32_t)p[0] << 8 | p[1];
+    case 1:
+        return p[0];
+    default:
+        return 0;
+    }
+}
+
+/* add_blocks(self, e, n, data, rsum_bytes, checksum_bytes, crc32c_bytes)
+ * Fill in n hash entries from their records. Inlined into each case below,
+ * so that the field widths are constants and the copies simple moves. */
+static inline __attribute__((always_inline)) void add_blocks(const struct rcksum_state *z, struct hash_entry *e,
+                                                             zs_blockid n, const unsigned char *data,
+                                                             unsigned int rsum_bytes, unsigned int checksum_bytes,
+                                                             unsigned int crc32c_bytes) {
+    const size_t record = rsum_bytes + checksum_bytes + crc32c_bytes;
+    zs_blockid i;
+
+    for (i = 0; i < n; i++, e++, data += record) {
+        uint32_t r = load_be(data, rsum_bytes);
+
+        e->r.a = (r >> 16) & z->rsum_a_mask;
+        e->r.b = r;
+        memcpy(e->checksum, data + rsum_bytes, checksum_bytes);
+        e->crc32c = 0;
+        if (crc32c_bytes)
+            e->crc32c = load_be(data + rsum_bytes + checksum_bytes, crc32c_bytes) << (8 * (CRC32C_SIZE - crc32c_bytes));
+        e->crc32c &= z->crc32c_mask;
+    }
+}
+
+/* rcksum_add_target_blocks(self, first, n, data)
+ * Sets the stored hash values for n blocks from the given blockid, from their
+ * records as the .zsync has them: for each, the rsum, the checksum and any
+ * CRC32C, in as many bytes as the rcksum_state was created with, big-endian.
+ * The same as rcksum_add_target_block for each, but without the call, the
+ * byte swapping and the check for hash tables for every block, which add up
+ * when loading millions of blocks. */
+void rcksum_add_target_blocks(struct rcksum_state *z, zs_blockid first, zs_blockid n, const unsigned char *data) {
+    unsigned int rsum_bytes = z->rsum_bits / 8;
+    unsigned int crc32c_bytes = z->crc32c_mask ? CRC32C_SIZE - __builtin_ctz(z->crc32c_mask) / 8 : 0;
+    struct hash_entry *e = &z->blockhashes[first];
+
+    if (first >= z->blocks)
+        return;
+    if (n > z->blocks - first)
+        n = z->blocks - first;
+
+    /* The usual layouts from zsyncmake, then anything else */
+    if (!crc32c_bytes && rsum_bytes == 4 && z->checksum_bytes == 16)
+        add_blocks(z, e, n, data, 4, 16, 0);
+    else if (!crc32c_bytes && rsum_bytes == 2)
+        add_blocks(z, e, n, data, 2, z->checksum_bytes, 0);
+    else if (!crc32c_bytes && rsum_bytes == 3)
+        add_blocks(z, e, n, data, 3, z->checksum_bytes, 0);
+    else if (!crc32c_bytes && rsum_bytes == 4)
+        add_blocks(z, e, n, data, 4, z->checksum_bytes, 0);
+    else
+        add_blocks(z, e, n, data, rsum_bytes, z->checksum_bytes, crc32c_bytes);
+
+    /* New checksums invalidate any existing checksum hash tables */
+    if (z->rsum_hash) {
+        free(z->rsum_hash);
+        z->rsum_hash = NULL;
+        free(z->bithash);
+        z->bithash = NULL;
+    }
+}
+
 static void print_hashstats(const struct rcksum_state *z UNUSED_BY_NDEBUG) {
 #ifdef DEBUG
     int i;
@@ -129,18 +211,231 @@ static void print_hashstats(const struct rcksum_state *z UNUSED_BY_NDEBUG) {
 #endif
 }
 
-/* build_hash(self)
- * Build hash tables to quickly lookup a block based on its rsum value.
- * Returns non-zero if successful.
+/* hash_sizes(self, &hash_bits, &bithash_bits, &hash_func_shift)
+ * The size of the hash tables for these checksums, in bits, and the shift
+ * that the hash function needs to make use of them. build_hash sets up the
+ * tables with these; so must anything that loads tables prebuilt.
  */
-int build_hash(struct rcksum_state *z) {
-    zs_blockid id;
-    int avail_bits = z->seq_matches > 1 ? min(z->rsum_bits, 16) * 2 : z->rsum_bits;
+void hash_sizes(const struct rcksum_state *z, int *hash_bits_out, int *bithash_bits_out,
+                unsigned short *hash_func_shift) {
+    /* Bits of rsum data available per block that is hashed */
+    int block_bits = z->seq_matches > 1 ? (int)min(z->rsum_bits, 16) : z->rsum_bits;
+    int avail_bits = min(block_bits * z->seq_matches, 32);
     int hash_bits = avail_bits;
 
     /* Pick a hash size that is a power of two and gives a load factor of <1 */
     while (((1U << (hash_bits - 1)) > (unsigned int)z->blocks) && hash_bits > 5)
         hash_bits--;
+    *hash_bits_out = hash_bits;
+
+    /* Bit-table based on rsum. Aim is for 1/(1<<BITHASHBITS) load
+     * factor, so hash_vits shouls be hash_bits + BITHASHBITS if we have that
+     * many bits available. */
+    hash_bits = min(hash_bits + BITHASHBITS, avail_bits);
+    *bithash_bits_out = hash_bits;
+
+    /* We want the hash function to return hash_bits bits. We will xor one
+     * number with a second number that may have fewer than 16 bits of
+     * available data; set up an appropriate bit shift for the second number.
+     * With seq_matches > 2 there are more numbers, shifted by fractions of
+     * this; the last one gets the full shift. This is closely tied to
+     * calc_rhash().
+     */
+    if (z->seq_matches > 1) {
+        /* each following number has block_bits bits available. */
+        *hash_func_shift = hash_bits > block_bits ? hash_bits - block_bits : 0;
+    } else {
+        /* second number has avail_bits - 16 bits available. */
+        /* (not max(), which would take the negative difference of a small
+         * table as a large unsigned short) */
+        *hash_func_shift = hash_bits > avail_bits - 16 ? hash_bits - (avail_bits - 16) : 0;
+    }
+}
+
+/* set_hash_func_shift(self, hash_func_shift)
+ * Set the shift of the hash function, from hash_sizes; and for seq_matches
+ * > 2 the shift of each following block's rsum, so calc_rhash needn't work
+ * them out for every byte of the scan. */
+void set_hash_func_shift(struct rcksum_state *z, unsigned short hash_func_shift) {
+    int i;
+
+    z->hash_func_shift = hash_func_shift;
+    for (i = 1; i < z->seq_matches; i++)
+        z->hash_shift[i] = hash_func_shift * i / (z->seq_matches - 1);
+}
+
+/* Below this many blocks, build_hash does it all on this thread */
+#define PARALLEL_HASH_MIN_BLOCKS (1 << 20)
+#define MAX_HASH_THREADS 8
+
+/* The rsum hash is split into this many partitions, by the top bits of the
+ * bucket, for the threads to fill in */
+#define HASH_PARTITION_BITS 6
+#define HASH_PARTITIONS (1 << HASH_PARTITION_BITS)
+
+/* How many blocks ahead to prefetch when linking them into the chains */
+#define HASH_PREFETCH 32
+
+/* The blocks to hash, shared between the threads doing it. The blocks are
+ * split into nslices slices, in order; each slice's blocks are counted and
+ * then sorted into the partitions, so that within each partition they are
+ * still in order. */
+struct hash_job {
+    struct rcksum_state *z;
+    int phase; /* 0 to count, 1 to sort, 2 to link */
+    int nslices;
+    int part_shift;                         /* Bucket >> this is its partition */
+    zs_blockid (*counts)[HASH_PARTITIONS];  /* Per slice; then where it sorts to */
+    zs_blockid starts[HASH_PARTITIONS + 1]; /* Of each partition in sorted[] */
+    zs_blockid *sorted;                     /* Block ids, by partition */
+    int next;                               /* Next slice or partition to take; atomic */
+};
+
+/* hash_slice(job, slice)
+ * Count the blocks of the slice per partition; or (phase 1) sort them into
+ * their partitions */
+static void hash_slice(struct hash_job *job, int slice) {
+    struct rcksum_state *z = job->z;
+    zs_blockid *counts = job->counts[slice];
+    zs_blockid id = (zs_blockid)((long long)z->blocks * slice / job->nslices);
+    zs_blockid end = (zs_blockid)((long long)z->blocks * (slice + 1) / job->nslices);
+
+    for (; id < end; id++) {
+        if (already_got_block(z, id))
+            continue;
+
+        unsigned h = calc_rhash(z, &z->blockhashes[id]);
+        int part = (h & z->hashmask) >> job->part_shift;
+        if (job->phase == 0)
+            counts[part]++;
+        else
+            job->sorted[counts[part]++] = id;
+    }
+}
+
+/* hash_partition(job, part)
+ * Link the partition's blocks into their hash chains, as build_hash would:
+ * prepending, in reverse, so that the chains are in block order. And set
+ * their bits in the bithash; the partition's bits are in bytes of their own,
+ * as the top bits of the bucket are bits of the byte too. */
+static void hash_partition(struct hash_job *job, int part) {
+    struct rcksum_state *z = job->z;
+    zs_blockid i;
+
+    for (i = job->starts[part + 1]; i > job->starts[part];) {
+        struct hash_entry *e;
+        unsigned h;
+
+        /* The blocks are all over blockhashes, so ask for them in advance */
+        if (i > job->starts[part] + HASH_PREFETCH)
+            __builtin_prefetch(z->blockhashes + job->sorted[i - 1 - HASH_PREFETCH], 1);
+        e = z->blockhashes + job->sorted[--i];
+        h = calc_rhash(z, e);
+
+        e->next = z->rsum_hash[h & z->hashmask];
+        z->rsum_hash[h & z->hashmask] = e;
+        z->bithash[(h & z->bithashmask) >> 3] |= 1 << (h & 7);
+    }
+}
+
+/* hash_worker(job)
+ * Thread body: take slices or partitions for the current phase of the job
+ * until there are none left */
+static void *hash_worker(void *arg) {
+    struct hash_job *job = arg;
+    int n = job->phase == 2 ? HASH_PARTITIONS : job->nslices;
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < n) {
+        if (job->phase == 2)
+            hash_partition(job, i);
+        else
+            hash_slice(job, i);
+    }
+    return NULL;
+}
+
+/* run_hash_phase(job, phase, nthreads)
+ * Do the given phase of the job, on up to nthreads threads */
+static void run_hash_phase(struct hash_job *job, int phase, int nthreads) {
+    pthread_t threads[MAX_HASH_THREADS];
+    int started = 0, i;
+
+    job->phase = phase;
+    job->next = 0;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, hash_worker, job) != 0)
+            break;
+        started++;
+    }
+    hash_worker(job); /* This thread helps too */
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/* fill_hash_parallel(self, hash_bits, nthreads)
+ * Fill in the (empty) hash tables as build_hash does, on nthreads threads.
+ * Returns 0 if we hadn't the memory, and the tables are untouched. */
+static int fill_hash_parallel(struct rcksum_state *z, int hash_bits, int nthreads) {
+    struct hash_job job = {.z = z, .nslices = nthreads, .part_shift = hash_bits - HASH_PARTITION_BITS};
+    zs_blockid total = 0;
+    int part, slice;
+
+    job.counts = calloc(nthreads, sizeof *job.counts);
+    job.sorted = malloc(z->blocks * sizeof *job.sorted);
+    if (!job.counts || !job.sorted) {
+        free(job.counts);
+        free(job.sorted);
+        return 0;
+    }
+
+    /* Count, then turn the counts into where each slice's blocks go */
+    run_hash_phase(&job, 0, nthreads);
+    for (part = 0; part < HASH_PARTITIONS; part++) {
+        job.starts[part] = total;
+        for (slice = 0; slice < nthreads; slice++) {
+            zs_blockid n = job.counts[slice][part];
+            job.counts[slice][part] = total;
+            total += n;
+        }
+    }
+    job.starts[HASH_PARTITIONS] = total;
+
+    run_hash_phase(&job, 1, nthreads);
+    run_hash_phase(&job, 2, nthreads);
+
+    free(job.counts);
+    free(job.sorted);
+    return 1;
+}
+
+/* hash_threads(self)
+ * How many threads build_hash should use */
+static int hash_threads(const struct rcksum_state *z) {
+    long ncpu;
+
+    if (z->blocks < PARALLEL_HASH_MIN_BLOCKS)
+        return 1;
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return ncpu < 1 ? 1 : ncpu > MAX_HASH_THREADS ? MAX_HASH_THREADS : ncpu;
+}
+
+/* build_hash(self)
+ * Build hash tables to quickly lookup a block based on its rsum value.
+ * Returns non-zero if successful.
+ */
+int build_hash(struct rcksum_state *z) { return build_hash_threads(z, hash_threads(z)); }
+
+/* build_hash_threads(self, nthreads)
+ * build_hash, on up to nthreads threads. The tables come out the same however
+ * many threads. */
+int build_hash_threads(struct rcksum_state *z, int nthreads) {
+    zs_blockid id;
+    int hash_bits, bithash_bits;
+    unsigned short shift;
+
+    hash_sizes(z, &hash_bits, &bithash_bits, &shift);
+    set_hash_func_shift(z, shift);
 
     /* Allocate hash based on rsum */
     z->hashmask = (1U << hash_bits) - 1;
@@ -148,11 +443,8 @@ int build_hash(struct rcksum_state *z) {
     if (!z->rsum_hash)
         return 0;
 
-    /* Allocate bit-table based on rsum. Aim is for 1/(1<<BITHASHBITS) load
-     * factor, so hash_vits shouls be hash_bits + BITHASHBITS if we have that
-     * many bits available. */
-    hash_bits = min(hash_bits + BITHASHBITS, avail_bits);
-    z->bithashmask = (1U << hash_bits) - 1;
+    /* Allocate bit-table based on rsum */
+    z->bithashmask = (1U << bithash_bits) - 1;
     z->bithash = calloc(z->bithashmask + 1, 1);
     if (!z->bithash) {
         free(z->rsum_hash);
@@ -160,17 +452,15 @@ int build_hash(struct rcksum_state *z) {
         return 0;
     }
 
-    /* We want the hash function to return hash_bits bits. We will xor one
-     * number with a second number that may have fewer than 16 bits of
-     * available data; set up an appropriate bit shift for the second number.
-     * This is closely tied to calc_rhash().
-     */
-    if (z->seq_matches > 1 && avail_bits < 24) {
-        /* second number has (avail_bits/2) bits available. */
-        z->hash_func_shift = max(0, hash_bits - (avail_bits / 2));
-    } else {
-        /* second number has avail_bits - 16 bits available. */
-        z->hash_func_shift = max(0, hash_bits - (avail_bits - 16));
+    /* With millions of blocks, this is mostly waiting for memory, as each
+     * block goes to a random bucket; so we have threads each fill in a part
+     * of the tables, to wait in parallel. Else (or if short of memory for
+     * that) as follows. */
+    if (nthreads > MAX_HASH_THREADS)
+        nthreads = MAX_HASH_THREADS;
+    if (nthreads > 1 && hash_bits >= HASH_PARTITION_BITS + 3 && fill_hash_parallel(z, hash_bits, nthreads)) {
+        print_hashstats(z);
+        return 1;
     }
 
     /* Now fill in the hash tables.
@@ -183,6 +473,10 @@ int build_hash(struct rcksum_state *z) {
         /* Decrement the loop variable here, and get the hash entry. */
         struct hash_entry *e = z->blockhashes + (--id);
 
+        /* Blocks that we have already (e.g. zero blocks) we needn't find */
+        if (already_got_block(z, id))
+            continue;
+
         /* Prepend to linked list for this hash entry */
         unsigned h = calc_rhash(z, e);
         e->next = z->rsum_hash[h & z->hashmask];
@@ -24,12 +24,15 @@
 /* Two types of checksum -
  * rsum: rolling Adler-style checksum
  * checksum: hopefully-collision-resistant MD4 checksum of the block
+ * And optionally a CRC32C, which is cheap to check and saves us doing the MD4
+ * for most blocks that only match on the rsum.
  */
 
 struct hash_entry {
     struct hash_entry *next; /* next entry with the same rsum */
     struct rsum r;
     unsigned char checksum[CHECKSUM_SIZE];
+    uint32_t crc32c; /* Leading crc32c bytes, already masked with crc32c_mask */
 };
 
 /* An rcksum_state contains the set of checksums of the blocks of a target
@@ -39,7 +42,7 @@ struct hash_entry {
  * over data looking for matching blocks. */
 
 struct rcksum_state {
-    struct rsum r[2]; /* Current rsums */
+    struct rsum r[MAX_SEQ_MATCHES]; /* Current rsums, of seq_matches consecutive blocks */
 
     zs_blockid blocks;              /* Number of blocks in the target file */
     size_t blocksize;               /* And how many bytes per block */
@@ -47,11 +50,20 @@ struct rcksum_state {
     unsigned short rsum_a_mask;     /* The mask to apply to rsum values before looking up */
     unsigned short rsum_bits;       /* # of bits of rsum data in the .zsync for each block */
     unsigned short hash_func_shift; /* Config for the hash function */
+    unsigned char hash_shift[MAX_SEQ_MATCHES]; /* Shift of each block's rsum, for seq_matches > 2 */
     unsigned int checksum_bytes;    /* How many bytes of the MD4 checksum are available */
+    uint32_t crc32c_mask;           /* Which bits of the CRC32C are available; 0 if none */
     int seq_matches;
+    int stride;           /* Only try offsets in the source that are multiples of this */
     unsigned int context; /* precalculated blocksize * seq_matches */
     off_t filelen;
 
+    /* In content-defined chunking mode (see cdc.c), the offset of each chunk
+     * in the target, plus the end of the file at [blocks]; NULL otherwise.
+     * The blocks are then the chunks, and r holds a key from the checksum. */
+    off_t *chunk_offsets;
+    size_t chunk_min, chunk_avg, chunk_max;
+
     /* These are used by the library. Note, not thread safe. */
     int skip; /* skip forward on next submit_source_data */
     const struct hash_entry *rover;
@@ -66,6 +78,8 @@ struct rcksum_state {
     off_t cur_position_in_file;
     struct reuseable_range *reusable_ranges;
     size_t num_reusable_ranges;
+    bool copy_plan; /* Only record data from source files; see copy.c */
+    bool source_in_place; /* Our output is a clone of the current source */
 
     /* Hash table for rsync algorithm */
     unsigned int hashmask;
@@ -84,11 +98,22 @@ struct rcksum_state {
     struct {
         long long hashhit;
         int weakhit, stronghit, checksummed;
+        int crcchecked, crcrejected;
     } stats;
 
-    /* Temp file for output */
+    /* Ranges of blocks (inclusive, like ranges) that are all zeros */
+    int numzeros;
+    zs_blockid *zeros;
+
+    /* Where the output goes; by default, file_sink() */
+    struct rcksum_sink sink;
+
+    /* Temp file for output, and the io_uring writes queued to it if any */
     char *filename;
     int fd;
+    struct uring_writer *uring;
+    struct rcksum_copy_fallback copy; /* For copy_file_data into it */
+    bool preallocated; /* Space reserved in it for the target yet? */
 };
 
 #define BITHASHBITS 3
@@ -100,20 +125,80 @@ static inline zs_blockid get_HE_blockid(const struct rcksum_state *z, const stru
     return e - z->blockhashes;
 }
 
+/* Offset in the target file of the start of the given block or chunk */
+static inline off_t block_offset(const struct rcksum_state *z, zs_blockid id) {
+    return z->chunk_offsets ? z->chunk_offsets[id] : ((off_t)id) << z->blockshift;
+}
+
 void add_to_ranges(struct rcksum_state *z, zs_blockid n);
 int already_got_block(struct rcksum_state *z, zs_blockid n);
 zs_blockid next_known_block(struct rcksum_state *rs, zs_blockid x);
 
 struct hash_entry *calc_hash_entry(void *data, size_t len);
 
-/* Hash the checksum values for the given hash entry and return the hash value */
+/* The hash of calc_rhash with seq_matches == 1, of the one rsum r */
+static inline unsigned calc_rhash_one(const struct rcksum_state *const z, struct rsum r) {
+    return r.b ^ (r.a & z->rsum_a_mask) << z->hash_func_shift;
+}
+
+/* Hash the checksum values for the given hash entry and return the hash value.
+ * With seq_matches > 1 the hash covers the rsums of this and the following
+ * seq_matches-1 blocks; with more than 2, each following block's rsum is
+ * shifted a bit further (by hash_shift[], set by set_hash_func_shift), with
+ * the last one shifted by hash_func_shift. */
 static inline unsigned calc_rhash(const struct rcksum_state *const z, const struct hash_entry *const e) {
     unsigned h = e[0].r.b;
+    int i;
 
-    h ^= ((z->seq_matches > 1) ? e[1].r.b : e[0].r.a & z->rsum_a_mask) << z->hash_func_shift;
+    if (z->seq_matches <= 2)
+        return h ^ ((z->seq_matches > 1) ? e[1].r.b : e[0].r.a & z->rsum_a_mask) << z->hash_func_shift;
 
+    for (i = 1; i < z->seq_matches; i++)
+        h ^= (unsigned)e[i].r.b << z->hash_shift[i];
     return h;
 }
 
+/* The same hash as calc_rhash, for the rolling checksums currently in z->r;
+ * with z->seq_matches passed in, so that the scan can keep it in a register,
+ * and with the usual 1 or 2 blocks laid out as the straight path */
+static inline unsigned calc_rhash_rolling(const struct rcksum_state *const z, const int seq_matches) {
+    unsigned h = z->r[0].b;
+    int i;
+
+    if (__builtin_expect(seq_matches <= 2, 1))
+        return h ^ ((seq_matches > 1) ? z->r[1].b : z->r[0].a & z->rsum_a_mask) << z->hash_func_shift;
+
+    for (i = 1; i < seq_matches; i++)
+        h ^= (unsigned)z->r[i].b << z->hash_shift[i];
+    return h;
+}
+
+/* Roll the rsum (a, b) on by one byte, losing oldc and gaining newc */
+#define UPDATE_RSUM(a, b, oldc, newc, bshift)                                                                          \
+    do {                                                                                                               \
+        (a) += ((unsigned char)(newc)) - ((unsigned char)(oldc));                                                      \
+        (b) += (a) - ((oldc) << (bshift));                                                                             \
+    } while (0)
+
+void hash_sizes(const struct rcksum_state *z, int *hash_bits, int *bithash_bits, unsigned short *hash_func_shift);
+void set_hash_func_shift(struct rcksum_state *z, unsigned short hash_func_shift);
 int build_hash(struct rcksum_state *z);
+int build_hash_threads(struct rcksum_state *z, int nthreads);
 void remove_block_from_hash(struct rcksum_state *z, zs_blockid id);
+
+void write_blocks(struct rcksum_state *z, const unsigned char *data, zs_blockid bfrom, zs_blockid bto,
+                  bool from_source);
+int check_checksums_on_hash_chain(struct rcksum_state *z, const struct hash_entry *e, const unsigned char *data,
+                                  int onlyone);
+off_t get_file_size(FILE *f);
+
+/* The temp file sink (sink.c), and copying within the kernel (copy.c) */
+struct rcksum_sink file_sink(struct rcksum_state *z);
+int copy_file_data(int srcfd, int dstfd, struct rcksum_copy_fallback *fb, off_t src, off_t dst, size_t len);
+
+/* Writing the output through io_uring (uring.c) */
+struct uring_writer *uring_open(int fd);
+int uring_write(struct uring_writer *w, const unsigned char *data, size_t len, off_t offset);
+int uring_flush(struct uring_writer *w);
+void uring_close(struct uring_writer *w);
+int rcksum_submit_source_chunks(struct rcksum_state *z, FILE *f, int progress);
@@ -0,0 +1,180 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Matching a seed file by its own block checksums. If we have the checksums
+ * of the seed file (its .zsync, typically from the last version of the
+ * target), we can find which of its blocks are blocks of the target by
+ * comparing the two tables, without reading the seed file at all: a join on
+ * the checksums, costing time in the number of blocks rather than the number
+ * of bytes. This only finds the blocks at the offsets where the seed's table
+ * has them, so it needs both tables to have blocks of the same size, or both
+ * to have content-defined chunks made the same way (which are then the same
+ * chunks in both wherever their content is the same). */
+
+#include "zsglobal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "internal.h"
+#include "rcksum.h"
+
+/* What a block of the target is looked up by: its length, and as much of its
+ * checksums as both tables have, with the rest zeroed */
+struct join_key {
+    uint64_t len;
+    unsigned char checksum[CHECKSUM_SIZE];
+    unsigned short a, b;
+};
+
+struct join_entry {
+    struct join_key key;
+    zs_blockid id;
+};
+
+static int compare_keys(const struct join_key *a, const struct join_key *b) { return memcmp(a, b, sizeof *a); }
+
+/* compare_entries(a, b)
+ * For qsort, by key and then by block id */
+static int compare_entries(const void *a, const void *b) {
+    const struct join_entry *x = a, *y = b;
+    int c = compare_keys(&x->key, &y->key);
+    return c ? c : (x->id > y->id) - (x->id < y->id);
+}
+
+/* find_key(table, n, key)
+ * Index of the first entry in the sorted table with the key, or n if none */
+static size_t find_key(const struct join_entry *table, size_t n, const struct join_key *k) {
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_keys(&table[mid].key, k) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n && !compare_keys(&table[lo].key, k) ? lo : n;
+}
+
+/* make_key(self, blockid, checksum_bytes, a_mask, key)
+ * Key for the given block of z, with the given amount of checksum */
+static void make_key(const struct rcksum_state *z, zs_blockid id, unsigned int checksum_bytes,
+                     unsigned short a_mask, struct join_key *k) {
+    const struct hash_entry *e = &z->blockhashes[id];
+
+    memset(k, 0, sizeof *k);
+    k->len = z->chunk_offsets ? (uint64_t)(block_offset(z, id + 1) - block_offset(z, id)) : z->blocksize;
+    memcpy(k->checksum, e->checksum, checksum_bytes);
+    if (!z->chunk_offsets) { /* In chunk mode, r is made from the checksum */
+        k->a = e->r.a & a_mask;
+        k->b = e->r.b;
+    }
+}
+
+/* add_range(&rr, &n, dst, src, len)
+ * Append to the ranges, extending the last one if this carries on from it.
+ * Returns 0, or -1 if out of memory. */
+static int add_range(struct reuseable_range **rr, size_t *n, off_t dst, off_t src, size_t len) {
+    struct reuseable_range *last = *n ? &(*rr)[*n - 1] : NULL;
+
+    if (last && last->dst + (off_t)last->len == dst && last->src + (off_t)last->len == src) {
+        last->len += len;
+        return 0;
+    }
+    if (!(*n & (*n + 1))) { /* Grow to the next power of 2 */
+        struct reuseable_range *p = realloc(*rr, (2 * *n + 1) * sizeof *p);
+        if (!p)
+            return -1;
+        *rr = p;
+    }
+    (*rr)[*n].dst = dst;
+    (*rr)[*n].src = src;
+    (*rr)[*n].len = len;
+    (*n)++;
+    return 0;
+}
+
+/* rcksum_join(self, seed, &rr, &n)
+ * Find the blocks of the target that we still need in the seed file whose
+ * block checksums are in seed, by its checksums alone. Returns 0 with where
+ * they are as reusable ranges (malloced, in order of offset in the seed) in
+ * *rr and *n, to be taken (and checked) with rcksum_submit_source_ranges; or
+ * -1 if the tables can't be compared, or out of memory. */
+int rcksum_join(struct rcksum_state *z, const struct rcksum_state *seed, struct reuseable_range **rr, size_t *n) {
+    unsigned int checksum_bytes = z->checksum_bytes < seed->checksum_bytes ? z->checksum_bytes : seed->checksum_bytes;
+    unsigned short a_mask = z->rsum_a_mask & seed->rsum_a_mask;
+    struct join_entry *table;
+    unsigned char *done; /* For the first of each run of entries with a key */
+    size_t ntable = 0;
+    zs_blockid id, s;
+
+    *rr = NULL;
+    *n = 0;
+    if (!z->chunk_offsets != !seed->chunk_offsets || z->blocksize != seed->blocksize)
+        return -1;
+    if (z->chunk_offsets &&
+        (z->chunk_min != seed->chunk_min || z->chunk_avg != seed->chunk_avg || z->chunk_max != seed->chunk_max))
+        return -1;
+
+    /* The blocks that we need, sorted by key */
+    table = malloc(z->blocks * sizeof *table + 1);
+    done = calloc(z->blocks + 1, 1);
+    if (!table || !done) {
+        free(table);
+        free(done);
+        return -1;
+    }
+    for (id = 0; id < z->blocks; id++)
+        if (!already_got_block(z, id)) {
+            make_key(z, id, checksum_bytes, a_mask, &table[ntable].key);
+            table[ntable++].id = id;
+        }
+    qsort(table, ntable, sizeof *table, compare_entries);
+
+    /* Look up each block of the seed */
+    for (s = 0; s < seed->blocks && ntable; s++) {
+        struct join_key k;
+        size_t i;
+
+        /* All the blocks of the target with this key, unless an earlier
+         * block of the seed already gave us them */
+        make_key(seed, s, checksum_bytes, a_mask, &k);
+        i = find_key(table, ntable, &k);
+        if (i == ntable || done[i])
+            continue;
+        done[i] = 1;
+        for (; i < ntable && !compare_keys(&table[i].key, &k); i++) {
+            const struct join_entry *e = &table[i];
+            off_t dst = block_offset(z, e->id);
+            off_t len = block_offset(z, e->id + 1) - dst;
+
+            if (dst + len > z->filelen)
+                len = z->filelen - dst;
+            if (add_range(rr, n, dst, block_offset(seed, s), len) != 0) {
+                free(table);
+                free(done);
+                free(*rr);
+                *rr = NULL;
+                *n = 0;
+                return -1;
+            }
+        }
+    }
+    free(table);
+    free(done);
+    return 0;
+}
@@ -0,0 +1,384 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Scanning one source file for the blocks of several targets at once, e.g.
+ * the files of a new release from one big file of the last one; reading the
+ * file once, and rolling the checksums over it once for each blocksize,
+ * rather than once per target.
+ *
+ * The targets with the same blocksize (and stride) are a group, which rolls
+ * the rsums of as many consecutive blocks as any of them needs. Each group has
+ * a filter, one bit per key of the rsums, with the bits set for every block of
+ * every target of the group; only where that has the bit do we look in the
+ * targets' own hash tables. So for data that none of the targets has, which is
+ * most of it, we do one lookup per offset, as a scan for one target would.
+ *
+ * Each target otherwise goes about it as rcksum_submit_source_data does: after
+ * a match it skips the blocks that matched, and tries the following block of
+ * the target first, while the rest of the group goes on looking. So each finds
+ * what a scan of the file for it alone would. */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "internal.h"
+#include "rcksum.h"
+#include "../progress.h"
+
+#define MULTI_FILTER_BITS 28
+
+/* Targets with the same blocksize and stride */
+struct multi_group {
+    struct rcksum_state **z;
+    off_t *resume; /* Per target, where it next looks: after its last match */
+    int n;
+    size_t blocksize;
+    int blockshift;
+    int seq_matches; /* The most of any target */
+    size_t context;  /* blocksize * seq_matches */
+    int stride;
+
+    /* The filter, and what the key is made of: the bits of the first rsum
+     * that every target has, and the second rsum if every target has it */
+    unsigned char *filter;
+    int filter_shift;
+    unsigned short a_mask;
+    bool next_b;
+
+    struct rsum r[MAX_SEQ_MATCHES]; /* At x */
+    size_t x;                       /* Where we are in the buffer */
+    bool need_rsum;                 /* r is to be calculated afresh at x */
+    off_t next_resume;              /* Least of resume[] */
+    off_t last_resume;              /* Greatest of resume[] */
+};
+
+/* multi_key(group, r, next)
+ * The filter's key for the rsum r of a block and next of the block after */
+static inline uint32_t multi_key(const struct multi_group *g, struct rsum r, struct rsum next) {
+    uint32_t k = ((uint32_t)(r.a & g->a_mask) << 16 | r.b) * 2654435761U;
+
+    if (g->next_b)
+        k = (k ^ next.b) * 2654435761U;
+    return k >> g->filter_shift;
+}
+
+/* make_filter(group)
+ * Set up the group's filter, from the blocks of its targets that we need */
+static int make_filter(struct multi_group *g) {
+    long long blocks = 0;
+    int bits = 10, key_bits, i;
+
+    g->a_mask = 0xffff;
+    g->next_b = true;
+    for (i = 0; i < g->n; i++) {
+        g->a_mask &= g->z[i]->rsum_a_mask;
+        g->next_b = g->next_b && g->z[i]->seq_matches > 1;
+        blocks += g->z[i]->blocks;
+    }
+
+    /* A false hit costs a lookup in each target, so eight bits per block for
+     * each target, for as few of them per target as with its own bithash; up
+     * to 32MiB, and no more than the key has */
+    key_bits = 16 + __builtin_popcount(g->a_mask) + (g->next_b ? 16 : 0);
+    while (bits < MULTI_FILTER_BITS && (1LL << (bits - 3)) < blocks * g->n)
+        bits++;
+    if (bits > key_bits)
+        bits = key_bits > 32 ? 32 : key_bits;
+    g->filter_shift = 32 - bits;
+    g->filter = calloc((size_t)1 << (bits - 3), 1);
+    if (!g->filter)
+        return -1;
+
+    /* The blocks in the hash tables, as build_hash has them */
+    for (i = 0; i < g->n; i++) {
+        const struct rcksum_state *z = g->z[i];
+        zs_blockid id;
+
+        for (id = 0; id < z->blocks; id++) {
+            const struct hash_entry *e = &z->blockhashes[id];
+            uint32_t k;
+
+            if (already_got_block(g->z[i], id))
+                continue;
+            k = multi_key(g, e[0].r, g->next_b ? e[1].r : e[0].r);
+            g->filter[k >> 3] |= 1 << (k & 7);
+        }
+    }
+    return 0;
+}
+
+/* scan_window(group, data, offset)
+ * Look for the blocks of the group's targets in the window at data, at the
+ * given offset in the file. Returns the number of blocks got. */
+static int scan_window(struct multi_group *g, const unsigned char *data, off_t offset) {
+    uint32_t k = multi_key(g, g->r[0], g->r[1]);
+    bool hit = (g->filter[k >> 3] & (1 << (k & 7))) != 0;
+    bool matched = false;
+    int got_blocks = 0, i;
+
+    /* Nothing to do unless some target might have the block here, or has
+     * only just matched (and so tries its next block here) */
+    if (!hit && offset > g->last_resume)
+        return 0;
+
+    for (i = 0; i < g->n; i++) {
+        struct rcksum_state *z = g->z[i];
+        const struct hash_entry *e;
+        int thismatch;
+
+        if (g->resume[i] > offset)
+            continue;
+
+        /* Just after a match, try the block after those first */
+        if (g->resume[i] == offset && z->next_match && z->seq_matches > 1) {
+            memcpy(z->r, g->r, z->seq_matches * sizeof *z->r);
+            z->cur_position_in_file = offset;
+            thismatch = check_checksums_on_hash_chain(z, z->next_match, data, 1);
+            if (thismatch) {
+                got_blocks += thismatch;
+                g->resume[i] = offset + g->blocksize;
+                matched = true;
+                continue;
+            }
+        }
+        if (!hit)
+            continue;
+
+        /* Else look it up, as rcksum_submit_source_data would */
+        memcpy(z->r, g->r, z->seq_matches * sizeof *z->r);
+        unsigned hash = calc_rhash_rolling(z, z->seq_matches);
+        if ((z->bithash[(hash & z->bithashmask) >> 3] & (1 << (hash & 7))) != 0 &&
+            (e = z->rsum_hash[hash & z->hashmask]) != NULL) {
+            z->cur_position_in_file = offset;
+            thismatch = check_checksums_on_hash_chain(z, e, data, 0);
+            if (thismatch) {
+                got_blocks += thismatch;
+                g->resume[i] = offset + (off_t)g->blocksize * z->seq_matches;
+                matched = true;
+            }
+        }
+    }
+
+    if (matched) {
+        g->next_resume = g->last_resume = g->resume[0];
+        for (i = 1; i < g->n; i++) {
+            if (g->resume[i] < g->next_resume)
+                g->next_resume = g->resume[i];
+            if (g->resume[i] > g->last_resume)
+                g->last_resume = g->resume[i];
+        }
+    }
+    return got_blocks;
+}
+
+/* scan_buffer(group, buf, limit, pos)
+ * Scan the windows of the buffer (which is at offset pos in the file) from
+ * the group's x up to the limit, rolling the rsums along it. Returns the
+ * number of blocks got. */
+static int scan_buffer(struct multi_group *g, const unsigned char *buf, size_t limit, off_t pos) {
+    const size_t bs = g->blocksize;
+    const int seq_matches = g->seq_matches;
+    int got_blocks = 0;
+
+    while (g->x < limit) {
+        size_t x = g->x;
+        off_t offset = pos + x;
+        int i;
+
+        if (g->need_rsum) {
+            for (i = 0; i < seq_matches; i++)
+                g->r[i] = rcksum_calc_rsum_block(buf + x + bs * i, bs);
+            g->need_rsum = false;
+        }
+        if (!(offset & (g->stride - 1)))
+            got_blocks += scan_window(g, buf + x, offset);
+
+        /* If every target has just matched, skip to the first that looks
+         * again; it's cheaper to work out the rsums there afresh than to roll
+         * them over a whole block */
+        if (g->next_resume - offset >= (off_t)bs) {
+            g->x += g->next_resume - offset;
+            g->need_rsum = true;
+            continue;
+        }
+
+        {
+            unsigned char nc = buf[x + bs];
+            unsigned char oc = buf[x];
+            UPDATE_RSUM(g->r[0].a, g->r[0].b, oc, nc, g->blockshift);
+            for (i = 1; i < seq_matches; i++) {
+                oc = nc;
+                nc = buf[x + bs * (i + 1)];
+                UPDATE_RSUM(g->r[i].a, g->r[i].b, oc, nc, g->blockshift);
+            }
+        }
+        g->x++;
+    }
+    return got_blocks;
+}
+
+/* free_groups(groups, ngroups) */
+static void free_groups(struct multi_group *groups, int ngroups) {
+    int i;
+
+    for (i = 0; i < ngroups; i++) {
+        free(groups[i].z);
+        free(groups[i].resume);
+        free(groups[i].filter);
+    }
+    free(groups);
+}
+
+/* make_groups(z[], n, &ngroups)
+ * Sort the targets into groups, with their filters. Returns the groups, or
+ * NULL if we hadn't the memory. */
+static struct multi_group *make_groups(struct rcksum_state **z, int n, int *ngroups_out) {
+    struct multi_group *groups = calloc(n, sizeof *groups);
+    int ngroups = 0, i, j;
+
+    if (!groups)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        struct multi_group *g;
+
+        for (j = 0; j < ngroups; j++)
+            if (groups[j].blocksize == z[i]->blocksize && groups[j].stride == z[i]->stride)
+                break;
+        g = &groups[j];
+        if (j == ngroups) {
+            ngroups++;
+            g->blocksize = z[i]->blocksize;
+            g->blockshift = z[i]->blockshift;
+            g->stride = z[i]->stride;
+            g->z = malloc(n * sizeof *g->z);
+            g->resume = calloc(n, sizeof *g->resume);
+            g->need_rsum = true;
+            if (!g->z || !g->resume) {
+                free_groups(groups, ngroups);
+                return NULL;
+            }
+        }
+        g->z[g->n++] = z[i];
+        if (z[i]->seq_matches > g->seq_matches) {
+            g->seq_matches = z[i]->seq_matches;
+            g->context = z[i]->context;
+        }
+    }
+    for (j = 0; j < ngroups; j++) {
+        if (make_filter(&groups[j]) != 0) {
+            free_groups(groups, ngroups);
+            return NULL;
+        }
+    }
+    *ngroups_out = ngroups;
+    return groups;
+}
+
+/* rcksum_submit_source_file_multi(z[], n, stream, progress)
+ * rcksum_submit_source_file for each of the n targets, reading the stream
+ * once for all of them. The targets must not be in content-defined chunks.
+ * Returns the total number of blocks found, or -1 on error. */
+int rcksum_submit_source_file_multi(struct rcksum_state **z, int n, FILE *f, int progress) {
+    struct multi_group *groups;
+    int ngroups, got_blocks = 0, i;
+    size_t bufsize = 0, context = 0, len = 0, end = 0;
+    off_t pos = 0, size = 0, in_mb = 0;
+    bool at_end = false;
+    unsigned char *buf = NULL;
+    struct progress *p = NULL;
+
+    if (n < 1)
+        return 0;
+    for (i = 0; i < n; i++) {
+        if (z[i]->chunk_offsets)
+            return -1;
+        if (!z[i]->rsum_hash && !build_hash(z[i]))
+            return -1;
+        rcksum_clear_reusable_ranges(z[i]);
+        z[i]->next_match = NULL;
+    }
+
+    groups = make_groups(z, n, &ngroups);
+    if (!groups)
+        return -1;
+
+    /* Read 16 of the largest blocks at a time, keeping the last of the most
+     * context that any group needs for the next time */
+    for (i = 0; i < ngroups; i++) {
+        if (groups[i].blocksize * 16 > bufsize)
+            bufsize = groups[i].blocksize * 16;
+        if (groups[i].context > context)
+            context = groups[i].context;
+    }
+    buf = malloc(bufsize + context);
+    if (!buf) {
+        free_groups(groups, ngroups);
+        return -1;
+    }
+
+    if (progress) {
+        size = get_file_size(f);
+        p = start_progress();
+        do_progress(p, 0, 0);
+    }
+
+    while (!at_end) {
+        size_t got;
+
+        if (!len) {
+            got = len = fread(buf, 1, bufsize, f);
+        } else {
+            size_t shift = len - context;
+
+            memmove(buf, buf + shift, context);
+            pos += shift;
+            for (i = 0; i < ngroups; i++)
+                groups[i].x -= shift;
+            got = fread(buf + context, 1, bufsize - context, f);
+            len = context + got;
+        }
+        if (ferror(f)) {
+            perror("fread");
+            break;
+        }
+
+        /* At the end, zero pad to complete a block, and look at every offset
+         * up to the end */
+        if (feof(f)) {
+            memset(buf + len, 0, context);
+            end = len;
+            len += context;
+            at_end = true;
+        }
+
+        for (i = 0; i < ngroups; i++)
+            got_blocks += scan_buffer(&groups[i], buf, at_end ? end : len - groups[i].context, pos);
+
+        if (progress && in_mb != (pos + (off_t)len) / 1000000) {
+            in_mb = (pos + (off_t)len) / 1000000;
+            do_progress(p, size ? 100.0 * (pos + (off_t)len) / size : 0, pos + len);
+        }
+    }
+
+    free(buf);
+    free_groups(groups, ngroups);
+    if (progress)
+        end_progress(p, 2);
+    return got_blocks;
+}
@@ -131,6 +131,54 @@ zs_blockid next_known_block(struct rcksum_state *rs, zs_blockid x) {
     return rs->ranges[2 * r];
 }
 
+/* rcksum_forget_blocks(self, from, to)
+ * Mark the blocks from..to (inclusive) as unknown again, e.g. because the
+ * data that we had for them has been lost; they will then be needed again.
+ * Returns the number of blocks that were known. */
+int rcksum_forget_blocks(struct rcksum_state *rs, zs_blockid from, zs_blockid to) {
+    int i, n = 0, forgot = 0;
+
+    /* At most one more range than now, where we split a range in two */
+    zs_blockid *r = malloc((rs->numranges + 1) * 2 * sizeof *r);
+    if (!r)
+        return -1;
+
+    for (i = 0; i < rs->numranges; i++) {
+        zs_blockid s = rs->ranges[2 * i], e = rs->ranges[2 * i + 1];
+
+        if (e < from || s > to) { /* Untouched */
+            r[2 * n] = s;
+            r[2 * n + 1] = e;
+            n++;
+            continue;
+        }
+        forgot += 1 + (e < to ? e : to) - (s > from ? s : from);
+        if (s < from) { /* Keep the part before */
+            r[2 * n] = s;
+            r[2 * n + 1] = from - 1;
+            n++;
+        }
+        if (e > to) { /* And the part after */
+            r[2 * n] = to + 1;
+            r[2 * n + 1] = e;
+            n++;
+        }
+    }
+    free(rs->ranges);
+    rs->ranges = r;
+    rs->numranges = n;
+    rs->gotblocks -= forgot;
+
+    /* We took known blocks out of the hash; so start again with a new one */
+    if (forgot && rs->rsum_hash) {
+        free(rs->rsum_hash);
+        free(rs->bithash);
+        rs->rsum_hash = NULL;
+        rs->bithash = NULL;
+    }
+    return forgot;
+}
+
 /* rcksum_needed_block_ranges
  * Return the block ranges needed to complete the target file */
 zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state *rs, int *num, zs_blockid from, zs_blockid to) {
@@ -189,6 +237,15 @@ zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state *rs, int *num,
     return r;
 }
 
+/* rcksum_known_prefix
+ * Return the number of blocks at the start of the target file that we have
+ * all got, i.e. the first block that we don't have */
+zs_blockid rcksum_known_prefix(const struct rcksum_state *rs) {
+    if (rs->numranges && rs->ranges[0] == 0)
+        return rs->ranges[1] + 1;
+    return 0;
+}
+
 /* rcksum_blocks_todo
  * Return the number of blocks still needed to complete the target file */
 int rcksum_blocks_todo(const struct rcksum_state *rs) {
@@ -19,7 +19,9 @@
 /* This is the library interface. Very changeable at this stage. */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 struct rcksum_state;
 
@@ -40,10 +42,64 @@ struct rsum {
 } __attribute__((packed));
 
 #define CHECKSUM_SIZE 16
+#define CRC32C_SIZE 4
+
+/* Most consecutive blocks that can be required to match before we accept any */
+#define MAX_SEQ_MATCHES 4
+
+/* Where the target that we construct is written. By default (sink NULL) that
+ * is a temporary file; or the caller can supply their own. write and read are
+ * as pwrite(2) and pread(2); truncate sets the length of the target at the
+ * end. clone_range, if not NULL, can copy len bytes from srcfd at offset src
+ * to dst without going through user space, returning 0, or -1 to have us copy
+ * them; sync, if not NULL, waits for any writes still in progress; zero, if
+ * not NULL, makes len bytes at offset read as zeros without writing them (e.g.
+ * by punching a hole), returning 0, or -1 to have us write zeros there. */
+struct rcksum_sink {
+    void *ctx; /* Passed to each of these */
+    ssize_t (*write)(void *ctx, const void *buf, size_t len, off_t offset);
+    ssize_t (*read)(void *ctx, void *buf, size_t len, off_t offset);
+    int (*clone_range)(void *ctx, int srcfd, off_t src, off_t dst, size_t len);
+    int (*truncate)(void *ctx, off_t len);
+    int (*sync)(void *ctx);
+    int (*zero)(void *ctx, off_t offset, size_t len);
+};
+
+/* A sink that builds the target in a caller's buffer */
+struct rcksum_memory_sink {
+    struct rcksum_sink sink;
+    unsigned char *buf;
+    size_t size;
+    off_t len; /* Length of the target in buf so far */
+};
+void rcksum_memory_sink_init(struct rcksum_memory_sink *m, void *buf, size_t size);
+
+/* What the kernel has refused to do in copying into a file, so that we don't
+ * keep asking */
+struct rcksum_copy_fallback {
+    bool no_clone, no_copy_file_range;
+};
 
+/* A sink that writes to a file that the caller has open for reading and
+ * writing (e.g. to update it in place) */
+struct rcksum_fd_sink {
+    struct rcksum_sink sink;
+    int fd;
+    struct rcksum_copy_fallback copy;
+};
+void rcksum_fd_sink_init(struct rcksum_fd_sink *s, int fd);
+
+/* crc32c_bytes is the number of leading bytes of a per-block CRC32C available
+ * in the control file, 0 if there is no CRC32C column. The output goes to the
+ * sink, or if that is NULL to a temporary file, unless no_output. */
 struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_butes, unsigned int checksum_bytes,
-                                 int require_consecutive_matches, bool no_output, off_t filelen);
+                                 unsigned int crc32c_bytes, int require_consecutive_matches, bool no_output,
+                                 const struct rcksum_sink *sink, off_t filelen);
 void rcksum_end(struct rcksum_state *z);
+void rcksum_set_sink(struct rcksum_state *z, const struct rcksum_sink *sink);
+
+/* A checksum identifying the target, from all its block checksums */
+void rcksum_target_id(const struct rcksum_state *z, unsigned char id[CHECKSUM_SIZE]);
 
 /* These transfer out the filename and handle of the file backing the data retrieved.
  * Once you have transferred out the file handle, you can no longer read and write data through librcksum - it has
@@ -53,13 +109,61 @@ void rcksum_end(struct rcksum_state *z);
 char *rcksum_filename(struct rcksum_state *z);
 int rcksum_filehandle(struct rcksum_state *z);
 
-void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b, struct rsum r, void *checksum);
+/* Read back data already written to the target */
+ssize_t rcksum_read_target(const struct rcksum_state *z, void *buf, size_t len, off_t offset);
+int rcksum_truncate_target(struct rcksum_state *z, off_t len);
+
+/* Queue writes to the output with io_uring, rather than waiting for each; 0 if
+ * that is available. Then rcksum_flush before reading the output back. */
+int rcksum_use_io_uring(struct rcksum_state *z);
+void rcksum_flush(struct rcksum_state *z);
+
+void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b, struct rsum r, void *checksum, uint32_t crc32c);
+void rcksum_add_target_blocks(struct rcksum_state *z, zs_blockid first, zs_blockid n, const unsigned char *data);
+
+/* Blocks of the target that are all zeros are known without looking for them
+ * (see zero.c). Find them once all the target blocks have been added. */
+int rcksum_find_zero_blocks(struct rcksum_state *z);
+int rcksum_write_zero_blocks(struct rcksum_state *z);
+
+/* The block checksums as a binary table that loads without decoding, with the
+ * hash tables prebuilt if index (see table.c) */
+int rcksum_write_table(struct rcksum_state *z, FILE *f, int index);
+int rcksum_read_table(struct rcksum_state *z, FILE *f);
+
+/* Save the map of the blocks that we have, and take over the output of an
+ * interrupted run with its map (see resume.c) */
+int rcksum_save_known(struct rcksum_state *z, int fd);
+int rcksum_resume(struct rcksum_state *z, const char *filename, int mapfd, int checks);
+
+/* Content-defined chunking mode: the blocks are instead chunks of varying
+ * length, added in order with rcksum_add_target_chunk. */
+int rcksum_set_chunking(struct rcksum_state *z, size_t min, size_t avg, size_t max);
+void rcksum_add_target_chunk(struct rcksum_state *z, zs_blockid b, size_t len, void *checksum);
+
+/* Where blocks (or chunks) are in the target file */
+off_t rcksum_block_offset(const struct rcksum_state *z, zs_blockid id);
+zs_blockid rcksum_block_at_offset(const struct rcksum_state *z, off_t offset);
 
 int rcksum_submit_blocks(struct rcksum_state *z, const unsigned char *data, zs_blockid bfrom, zs_blockid bto);
 int rcksum_submit_source_data(struct rcksum_state *z, unsigned char *data, size_t len, off_t offset);
 int rcksum_submit_source_file(struct rcksum_state *z, FILE *f, int progress);
+/* Scan one source file for the blocks of n targets at once */
+int rcksum_submit_source_file_multi(struct rcksum_state **z, int n, FILE *f, int progress);
+int rcksum_set_stride(struct rcksum_state *z, int stride);
+int rcksum_submit_source_range(struct rcksum_state *z, FILE *f, off_t start, off_t length);
+int rcksum_submit_source_ranges(struct rcksum_state *z, int fd, const struct reuseable_range *rr, size_t n);
+
+/* Find the blocks that we need in a seed file from its own block checksums,
+ * in seed, without reading it (see join.c); then rcksum_submit_source_ranges */
+int rcksum_join(struct rcksum_state *z, const struct rcksum_state *seed, struct reuseable_range **rr, size_t *n);
 
 void rcksum_get_reusable_range(struct rcksum_state *z, struct reuseable_range **bpr_out, size_t *len_bpr_out);
+void rcksum_clear_reusable_ranges(struct rcksum_state *z);
+void rcksum_set_copy_plan(struct rcksum_state *z, bool on);
+int rcksum_copy_reusable_ranges(struct rcksum_state *z, int srcfd);
+int rcksum_clone_source(struct rcksum_state *z, int srcfd);
+void rcksum_set_source_in_place(struct rcksum_state *z, bool on);
 
 /* rcksum_needed_block_ranges tells you what blocks, within the given range,
  * are still unknown. It returns a list of block ranges in r[]
@@ -67,8 +171,14 @@ void rcksum_get_reusable_range(struct rcksum_state *z, struct reuseable_range **
  * these are half-open ranges, so r[0] <= x < r[1], r[2] <= x < r[3] etc are needed */
 zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state *z, int *num, zs_blockid from, zs_blockid to);
 int rcksum_blocks_todo(const struct rcksum_state *);
+int rcksum_forget_blocks(struct rcksum_state *z, zs_blockid from, zs_blockid to);
+zs_blockid rcksum_known_prefix(const struct rcksum_state *);
 
 /* For preparing rcksum control files - in both cases len is the block size. */
 struct rsum __attribute__((pure)) rcksum_calc_rsum_block(const unsigned char *data, size_t len);
 
 void rcksum_calc_checksum(unsigned char *c, const unsigned char *data, size_t len);
+uint32_t rcksum_calc_crc32c(const unsigned char *data, size_t len);
+
+/* Length of the content-defined chunk starting at data[0]; see cdc.c */
+size_t rcksum_cdc_boundary(const unsigned char *data, size_t len, size_t min, size_t avg, size_t max);
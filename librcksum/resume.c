@@ -0,0 +1,188 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Resuming an interrupted run. We save which blocks of the target we have, as
+ * the ranges from range.c, with a checksum identifying the target; a later run
+ * for the same target can then take over the output file that we left, and
+ * trust that it has those blocks, rather than scan it all again to find them.
+ *
+ * The saved map is:
+ *   8 bytes  magic
+ *   16 bytes rcksum_target_id
+ *   8 bytes  number of blocks
+ *   8 bytes  number of ranges
+ *   then the ranges, 8 bytes for the first block and 8 for the last of each.
+ * in host byte order, as it is only for use on this machine. */
+
+#include "zsglobal.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "md4.h"
+#include "rcksum.h"
+
+static const char map_magic[8] = "zsRSmap1";
+
+#define MAP_HEADER (sizeof map_magic + MD4_DIGEST_LENGTH + 2 * sizeof(uint64_t))
+
+/* rcksum_save_known(self, fd)
+ * Write the map of the blocks that we have to fd, once what we have written
+ * of them is safely on disk. Returns 0, or -1 on error. */
+int rcksum_save_known(struct rcksum_state *z, int fd) {
+    size_t len = MAP_HEADER + z->numranges * 2 * sizeof(uint64_t);
+    unsigned char *buf = malloc(len);
+    uint64_t *p;
+    int i, rc = 0;
+
+    if (!buf)
+        return -1;
+    memcpy(buf, map_magic, sizeof map_magic);
+    rcksum_target_id(z, buf + sizeof map_magic);
+    p = (uint64_t *)(buf + sizeof map_magic + MD4_DIGEST_LENGTH);
+    *p++ = z->blocks;
+    *p++ = z->numranges;
+    for (i = 0; i < 2 * z->numranges; i++)
+        *p++ = z->ranges[i];
+
+    rcksum_flush(z);
+    if (z->fd != -1 && fdatasync(z->fd) != 0)
+        rc = -1;
+    else if (pwrite(fd, buf, len, 0) != (ssize_t)len || ftruncate(fd, len) != 0)
+        rc = -1;
+    free(buf);
+    return rc;
+}
+
+/* check_block(self, fd, blockid, buf)
+ * Whether the given block in the file open on fd has the right checksum */
+static int check_block(const struct rcksum_state *z, int fd, zs_blockid id, unsigned char *buf) {
+    off_t offset = block_offset(z, id);
+    size_t len = z->chunk_offsets ? (size_t)(block_offset(z, id + 1) - offset) : z->blocksize;
+    unsigned char checksum[CHECKSUM_SIZE];
+    ssize_t got = pread(fd, buf, len, offset);
+
+    if (got < 0)
+        return 0;
+    memset(buf + got, 0, len - got); /* Padding at the end of the file */
+    rcksum_calc_checksum(checksum, buf, len);
+    return !memcmp(checksum, z->blockhashes[id].checksum, z->checksum_bytes);
+}
+
+/* read_map(self, mapfd, &nranges)
+ * Read the saved map from mapfd, and return its ranges (malloced), if it is
+ * for our target. Returns NULL if it's not usable. */
+static uint64_t *read_map(const struct rcksum_state *z, int mapfd, size_t *nranges) {
+    unsigned char header[MAP_HEADER];
+    unsigned char id[MD4_DIGEST_LENGTH];
+    uint64_t n[2], *r;
+    size_t i;
+
+    if (pread(mapfd, header, sizeof header, 0) != (ssize_t)sizeof header ||
+        memcmp(header, map_magic, sizeof map_magic))
+        return NULL;
+    rcksum_target_id(z, id);
+    if (memcmp(header + sizeof map_magic, id, sizeof id))
+        return NULL;
+    memcpy(n, header + sizeof map_magic + sizeof id, sizeof n);
+    if (n[0] != (uint64_t)z->blocks || n[1] > (uint64_t)z->blocks)
+        return NULL;
+
+    r = malloc((n[1] + 1) * 2 * sizeof *r);
+    if (!r)
+        return NULL;
+    if (pread(mapfd, r, n[1] * 2 * sizeof *r, sizeof header) != (ssize_t)(n[1] * 2 * sizeof *r)) {
+        free(r);
+        return NULL;
+    }
+
+    /* The ranges must be in order, and within the target */
+    for (i = 0; i < n[1]; i++)
+        if (r[2 * i] > r[2 * i + 1] || r[2 * i + 1] >= n[0] || (i && r[2 * i] <= r[2 * i - 1])) {
+            free(r);
+            return NULL;
+        }
+    *nranges = n[1];
+    return r;
+}
+
+/* rcksum_resume(self, filename, mapfd, checks)
+ * Take over the file left by an interrupted run for this target, given the
+ * map that it saved on mapfd: the file becomes our output, in place of our
+ * temporary file, and the blocks in the map are known. Call this before
+ * anything is written. First we check up to the given number of the blocks,
+ * spread through the file, against their checksums; if any is wrong, or the
+ * map is for another target, we leave things as they were. Returns the
+ * number of blocks that the map gave us, or -1 if not usable. */
+int rcksum_resume(struct rcksum_state *z, const char *filename, int mapfd, int checks) {
+    size_t nranges, i;
+    uint64_t *r = read_map(z, mapfd, &nranges);
+    unsigned char *buf = malloc(z->blocksize);
+    long long known = 0, step, next = 0, seen = 0;
+    int fd = -1, found = 0;
+    bool ok = r && buf && z->fd != -1;
+    bool uring;
+
+    if (ok && (fd = open(filename, O_RDWR)) == -1)
+        ok = false;
+
+    /* Check every step-th known block */
+    for (i = 0; ok && i < nranges; i++)
+        known += r[2 * i + 1] - r[2 * i] + 1;
+    step = checks > 0 && known > checks ? known / checks : 1;
+    for (i = 0; ok && checks > 0 && i < nranges; i++) {
+        zs_blockid b;
+        for (b = r[2 * i]; ok && b <= (zs_blockid)r[2 * i + 1]; b++, seen++)
+            if (seen == next) {
+                ok = check_block(z, fd, b, buf);
+                next += step;
+            }
+    }
+    free(buf);
+    if (!ok) {
+        if (fd != -1)
+            close(fd);
+        free(r);
+        return -1;
+    }
+
+    /* It's good: drop our temporary file, and make this our output */
+    uring = z->uring != NULL;
+    rcksum_set_sink(z, &z->sink);
+    z->fd = fd;
+    z->copy.no_clone = z->copy.no_copy_file_range = false;
+    z->filename = strdup(filename);
+    z->sink = file_sink(z);
+    if (uring)
+        rcksum_use_io_uring(z);
+
+    for (i = 0; i < nranges; i++) {
+        zs_blockid b;
+        for (b = r[2 * i]; b <= (zs_blockid)r[2 * i + 1]; b++)
+            if (!already_got_block(z, b)) {
+                if (z->rsum_hash)
+                    remove_block_from_hash(z, b);
+                add_to_ranges(z, b);
+                found++;
+            }
+    }
+    free(r);
+    return found;
+}
@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "crc32c.h"
 #include "internal.h"
 #include "md4.h"
 #include "rcksum.h"
@@ -35,12 +36,6 @@
  * and by the library, which is ugly. */
 #include "../progress.h"
 
-#define UPDATE_RSUM(a, b, oldc, newc, bshift)                                                                          \
-    do {                                                                                                               \
-        (a) += ((unsigned char)(newc)) - ((unsigned char)(oldc));                                                      \
-        (b) += (a) - ((oldc) << (bshift));                                                                             \
-    } while (0)
-
 /* rcksum_calc_rsum_block(data, data_len)
  * Calculate the rsum for a single block of data. */
 /* Note int len here, not size_t, because the compiler is stupid and expands
@@ -70,17 +65,26 @@ void rcksum_calc_checksum(unsigned char *c, const unsigned char *data, size_t le
     MD4Final(c, &ctx);
 }
 
-/* write_blocks(rcksum_state, buf, startblock, endblock)
+/* rcksum_calc_crc32c(data, data_len)
+ * Returns the CRC32C of the given data block */
+uint32_t rcksum_calc_crc32c(const unsigned char *data, size_t len) { return crc32c(0, data, len); }
+
+/* write_blocks(rcksum_state, buf, startblock, endblock, from_source)
  * Writes the block range (inclusive) from the supplied buffer to our
- * under-construction output file */
-static void write_blocks(struct rcksum_state *z, const unsigned char *data, zs_blockid bfrom, zs_blockid bto) {
-    off_t len = ((off_t)(bto - bfrom + 1)) << z->blockshift;
-    off_t dst = ((off_t)bfrom) << z->blockshift;
+ * under-construction output file. from_source says whether the data is from
+ * the current source file, at cur_position_in_file; in copy-plan mode that
+ * is only recorded, to be copied later. */
+void write_blocks(struct rcksum_state *z, const unsigned char *data, zs_blockid bfrom, zs_blockid bto,
+                  bool from_source) {
+    off_t dst = block_offset(z, bfrom);
+    off_t len = block_offset(z, bto + 1) - dst;
     off_t src = z->cur_position_in_file;
 
     struct reuseable_range *lastrange = NULL;
     bool add_new_reusable_range = true;
-    if (z->num_reusable_ranges) {
+    if (z->copy_plan && !from_source) {
+        add_new_reusable_range = false; /* Not from the source; just write it */
+    } else if (z->num_reusable_ranges) {
         lastrange = &z->reusable_ranges[z->num_reusable_ranges - 1];
         bool dst_match = lastrange->dst + (off_t)lastrange->len == dst;
         bool src_match = src == lastrange->src + (off_t)lastrange->len;
@@ -97,13 +101,16 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data, zs_b
         lastrange->len = len;
         lastrange->src = src;
     }
-    if (lastrange->dst + (off_t)lastrange->len > z->filelen) {
+    if (lastrange && lastrange->dst + (off_t)lastrange->len > z->filelen) {
         lastrange->len = z->filelen - lastrange->dst;
     }
 
-    if (z->fd == -1) {
+    if (!z->sink.write || (z->copy_plan && from_source)) {
         len = 0;
     }
+    if (from_source && z->source_in_place && src == dst) {
+        len = 0; /* It's there already */
+    }
     while (len) {
         size_t l = (size_t)len;
         ssize_t rc;
@@ -114,7 +121,7 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data, zs_b
             l = 0x8000000;
 
         /* Write */
-        rc = pwrite(z->fd, data, l, dst);
+        rc = z->sink.write(z->sink.ctx, data, l, dst);
         if (rc == -1) {
             fprintf(stderr, "IO error: %s\n", strerror(errno));
             exit(-1);
@@ -142,7 +149,8 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data, zs_b
 }
 
 /* rcksum_submit_blocks(self, data, startblock, endblock)
- * The data in data[] (which should be (endblock - startblock + 1) * blocksize * bytes)
+ * The data in data[] (which should be (endblock - startblock + 1) * blocksize * bytes,
+ * or the total length of those chunks in chunk mode)
  * is tested block-by-block as valid data against the target checksums for
  * those blocks and, if valid, accepted and written to the working output.
  *
@@ -153,6 +161,7 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data, zs_b
 int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data, zs_blockid bfrom, zs_blockid bto) {
     zs_blockid x;
     unsigned char md4sum[CHECKSUM_SIZE];
+    off_t start = block_offset(z, bfrom);
 
     /* Build checksum hash tables if we don't have them yet */
     if (!z->rsum_hash)
@@ -161,19 +170,107 @@ int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data
 
     /* Check each block */
     for (x = bfrom; x <= bto; x++) {
-        rcksum_calc_checksum(&md4sum[0], data + ((x - bfrom) << z->blockshift), z->blocksize);
+        off_t offset = block_offset(z, x);
+        rcksum_calc_checksum(&md4sum[0], data + (offset - start), block_offset(z, x + 1) - offset);
         if (memcmp(&md4sum, &(z->blockhashes[x].checksum[0]), z->checksum_bytes)) {
             if (x > bfrom) /* Write any good blocks we did get */
-                write_blocks(z, data, bfrom, x - 1);
+                write_blocks(z, data, bfrom, x - 1, false);
             return -1;
         }
     }
 
     /* All blocks are valid; write them and update our state */
-    write_blocks(z, data, bfrom, bto);
+    write_blocks(z, data, bfrom, bto, false);
     return 0;
 }
 
+/* submit_cached_range(self, fd, range, &buf, &bufsize)
+ * For rcksum_submit_source_ranges, one range, reading it into buf (which is
+ * grown as needed). Returns the number of blocks got, or -1. */
+static int submit_cached_range(struct rcksum_state *const z, int fd, const struct reuseable_range *rr,
+                               unsigned char **buf, size_t *bufsize) {
+    unsigned char md4sum[CHECKSUM_SIZE];
+    int got_blocks = 0;
+    zs_blockid x, bto;
+
+    if (rr->dst < 0 || rr->src < 0 || !rr->len || rr->dst + (off_t)rr->len > z->filelen)
+        return -1;
+    x = rcksum_block_at_offset(z, rr->dst);
+    bto = rcksum_block_at_offset(z, rr->dst + rr->len - 1);
+    if (block_offset(z, x) != rr->dst || bto >= z->blocks)
+        return -1;
+
+    /* Read whole blocks, about 1MiB at a time */
+    while (x <= bto) {
+        off_t start = block_offset(z, x);
+        off_t src = rr->src + (start - rr->dst);
+        zs_blockid y = x, b, run = x;
+        size_t len;
+        ssize_t got;
+
+        while (y < bto && block_offset(z, y + 2) - start <= 0x100000)
+            y++;
+        len = block_offset(z, y + 1) - start;
+        if (len > *bufsize) {
+            unsigned char *p = realloc(*buf, len);
+            if (!p)
+                return -1;
+            *buf = p;
+            *bufsize = len;
+        }
+        got = pread(fd, *buf, len, src);
+        if (got < 0)
+            return -1;
+        /* The scan zero-pads the end of the file, so may have matched it */
+        memset(*buf + got, 0, len - got);
+
+        /* Check each block, and write each run of blocks that we need */
+        for (b = x; b <= y + 1; b++) {
+            if (b <= y && !already_got_block(z, b)) {
+                off_t offset = block_offset(z, b);
+                rcksum_calc_checksum(md4sum, *buf + (offset - start), block_offset(z, b + 1) - offset);
+                if (memcmp(md4sum, z->blockhashes[b].checksum, z->checksum_bytes))
+                    return -1;
+                continue;
+            }
+            if (b > run) {
+                z->cur_position_in_file = src + (block_offset(z, run) - start);
+                write_blocks(z, *buf + (block_offset(z, run) - start), run, b - 1, true);
+                got_blocks += b - run;
+            }
+            run = b + 1;
+        }
+        x = y + 1;
+    }
+    return got_blocks;
+}
+
+/* rcksum_submit_source_ranges(self, fd, rr, n)
+ * Take the data for the given reusable ranges of the target from the source
+ * file open on fd, where an earlier scan of the same file found them (e.g. as
+ * saved in a cache), rather than scanning it all again. Each block is checked
+ * against its checksum, and blocks that we already have are skipped. Returns
+ * the number of blocks got, or -1 on error or if any block does not match
+ * (the file is not what it was), when the caller should scan it as usual. */
+int rcksum_submit_source_ranges(struct rcksum_state *const z, int fd, const struct reuseable_range *rr, size_t n) {
+    unsigned char *buf = NULL;
+    size_t bufsize = 0, i;
+    int got_blocks = 0;
+
+    /* Build checksum hash tables if we don't have them yet */
+    if (!z->rsum_hash)
+        if (!build_hash(z))
+            return -1;
+    rcksum_clear_reusable_ranges(z);
+
+    for (i = 0; i < n && got_blocks >= 0; i++) {
+        int rc = submit_cached_range(z, fd, &rr[i], &buf, &bufsize);
+        got_blocks = rc < 0 ? -1 : got_blocks + rc;
+    }
+    free(buf);
+    return got_blocks;
+}
+
 /* check_checksums_on_hash_chain(self, &hash_entry, data[], onlyone)
  * Given a hash table entry, check the data in this block against every entry
  * in the linked list for this hash entry, checking the checksums for this
@@ -185,10 +282,12 @@ int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data
  *
  * Return the number of blocks successfully obtained.
  */
-static int check_checksums_on_hash_chain(struct rcksum_state *const z, const struct hash_entry *e,
-                                         const unsigned char *data, int onlyone) {
-    unsigned char md4sum[2][CHECKSUM_SIZE];
+int check_checksums_on_hash_chain(struct rcksum_state *const z, const struct hash_entry *e, const unsigned char *data,
+                                  int onlyone) {
+    unsigned char md4sum[MAX_SEQ_MATCHES][CHECKSUM_SIZE];
     signed int done_md4 = -1;
+    uint32_t crcsum[MAX_SEQ_MATCHES];
+    signed int done_crc = -1;
     int got_blocks = 0;
     register struct rsum r = z->r[0];
 
@@ -217,8 +316,14 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z, const str
 
         id = get_HE_blockid(z, e);
 
-        if (!onlyone && z->seq_matches > 1 && (e[1].r.a != (z->r[1].a & z->rsum_a_mask) || e[1].r.b != z->r[1].b)) {
-            continue;
+        /* And the weak checksums of the following blocks, if we need them to match too */
+        if (!onlyone && z->seq_matches > 1) {
+            int i;
+            for (i = 1; i < z->seq_matches; i++)
+                if (e[i].r.a != (z->r[i].a & z->rsum_a_mask) || e[i].r.b != z->r[i].b)
+                    break;
+            if (i < z->seq_matches)
+                continue;
         }
 
         z->stats.weakhit++;
@@ -232,6 +337,22 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z, const str
              * or these could be preceding blocks that we have verified
              * already. */
             do {
+                /* If we have CRC32Cs, try that first: it is a fraction of the
+                 * cost of the MD4, and rules out nearly all false weak hits.
+                 * Again, calculated at most once per block of data. */
+                if (z->crc32c_mask) {
+                    if (check_md4 > done_crc) {
+                        crcsum[check_md4] = rcksum_calc_crc32c(data + z->blocksize * check_md4, z->blocksize);
+                        done_crc = check_md4;
+                        z->stats.crcchecked++;
+                    }
+                    if ((crcsum[check_md4] & z->crc32c_mask) != e[check_md4].crc32c) {
+                        z->stats.crcrejected++;
+                        ok = 0;
+                        break;
+                    }
+                }
+
                 /* We only calculate the MD4 once we need it; but need not do so twice */
                 if (check_md4 > done_md4) {
                     rcksum_calc_checksum(&md4sum[check_md4][0], data + z->blocksize * check_md4, z->blocksize);
@@ -271,7 +392,7 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z, const str
                 }
 
                 /* Write out the matched blocks that we don't yet know */
-                write_blocks(z, data, id, id + num_write_blocks - 1);
+                write_blocks(z, data, id, id + num_write_blocks - 1, true);
                 got_blocks += num_write_blocks;
             }
         }
@@ -279,6 +400,44 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z, const str
     return got_blocks;
 }
 
+/* roll_rsums(self, data, bs, seq_matches)
+ * Roll the rsums in z->r of the seq_matches windows starting at data[0] on by
+ * one byte. Each following window loses the byte that the previous one
+ * gained. The usual 1 or 2 windows are done without a loop, as this is run
+ * for every byte of the scan. */
+static inline void roll_rsums(struct rcksum_state *const z, const unsigned char *data, size_t bs, int seq_matches) {
+    unsigned char nc = data[bs];
+    unsigned char oc = data[0];
+    int i;
+
+    UPDATE_RSUM(z->r[0].a, z->r[0].b, oc, nc, z->blockshift);
+    if (__builtin_expect(seq_matches <= 2, 1)) {
+        if (seq_matches > 1)
+            UPDATE_RSUM(z->r[1].a, z->r[1].b, nc, data[bs * 2], z->blockshift);
+        return;
+    }
+    for (i = 1; i < seq_matches; i++) {
+        oc = nc;
+        nc = data[bs * (i + 1)];
+        UPDATE_RSUM(z->r[i].a, z->r[i].b, oc, nc, z->blockshift);
+    }
+}
+
+/* lookup_rolling(self, data, seq_matches)
+ * Look up the rolling checksums in z->r for the data at the current offset:
+ * first in the bithash (fast negative check) and then in the rsum hash, and
+ * if there is a hit, check the block against all the entries on its hash
+ * chain. Returns the number of blocks of the output file we got. */
+static inline int lookup_rolling(struct rcksum_state *const z, const unsigned char *data, int seq_matches) {
+    const struct hash_entry *e;
+    unsigned hash = calc_rhash_rolling(z, seq_matches);
+
+    if ((z->bithash[(hash & z->bithashmask) >> 3] & (1 << (hash & 7))) != 0 &&
+        (e = z->rsum_hash[hash & z->hashmask]) != NULL)
+        return check_checksums_on_hash_chain(z, e, data, 0);
+    return 0;
+}
+
 /* rcksum_submit_source_data(self, data, datalen, offset)
  * Reads the supplied data (length datalen) and identifies any contained blocks
  * of data that can be used to make up the target file.
@@ -297,6 +456,7 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z, const str
  *        us past the end of the buffer
  * r[0] - rolling checksum of the first blocksize bytes of the buffer
  * r[1] - rolling checksum of the next blocksize bytes of the buffer (if seq_matches > 1)
+ * ...    and so on, up to r[seq_matches - 1]
  */
 int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data, size_t len, off_t offset) {
     /* The window in data[] currently being considered is [x, x+bs) */
@@ -312,12 +472,19 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
         z->cur_position_in_file += z->skip;
     } else {
         z->next_match = NULL;
+
+        /* With a stride, we only look at offsets in the file that are
+         * multiples of it */
+        if (z->stride > 1 && z->cur_position_in_file % z->stride) {
+            x = z->stride - z->cur_position_in_file % z->stride;
+            z->cur_position_in_file += x;
+        }
     }
 
-    if (x || !offset) {
-        z->r[0] = rcksum_calc_rsum_block(data + x, z->blocksize);
-        if (z->seq_matches > 1)
-            z->r[1] = rcksum_calc_rsum_block(data + x + z->blocksize, z->blocksize);
+    if ((x || !offset) && x <= x_limit) {
+        int i;
+        for (i = 0; i < z->seq_matches; i++)
+            z->r[i] = rcksum_calc_rsum_block(data + x + z->blocksize * i, z->blocksize);
     }
     z->skip = 0;
 
@@ -339,6 +506,7 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
          * know they are invariants. */
         register const int seq_matches = z->seq_matches;
         register const size_t bs = z->blocksize;
+        register const int stride = z->stride;
 
         /* If the previous block was a match, but we're looking for
          * sequential matches, then test this block against the block in
@@ -355,41 +523,44 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
          * table at all.
          * Advance one byte at a time through the input stream, looking up the
          * rolling checksum in the rsum hash table. */
-        while (0 == blocks_matched && x < x_limit) {
-            /* # of blocks of the output file we got from this data */
-            int thismatch = 0;
-            {
-                const struct hash_entry *e;
-
-                /* Do a hash table lookup - first in the bithash (fast negative
-                 * check) and then in the rsum hash */
-                unsigned hash = z->r[0].b;
-                hash ^= ((seq_matches > 1) ? z->r[1].b : z->r[0].a & z->rsum_a_mask) << z->hash_func_shift;
-
-                if ((z->bithash[(hash & z->bithashmask) >> 3] & (1 << (hash & 7))) != 0 &&
-                    (e = z->rsum_hash[hash & z->hashmask]) != NULL) {
-
-                    /* Okay, we have a hash hit. Follow the hash chain and
-                     * check our block against all the entries. */
-                    thismatch = check_checksums_on_hash_chain(z, e, data + x, 0);
-                    if (thismatch) {
-                        blocks_matched = seq_matches;
-                    }
+        if (stride == 1) {
+            while (0 == blocks_matched && x < x_limit) {
+                /* # of blocks of the output file we got from this data */
+                int thismatch = lookup_rolling(z, data + x, seq_matches);
+                if (thismatch) {
+                    got_blocks += thismatch;
+                    blocks_matched = seq_matches;
+                }
+
+                /* (If we didn't match any data) advance the window by 1 byte
+                 * - update the rolling checksum and our offset in the buffer */
+                else {
+                    roll_rsums(z, data + x, bs, seq_matches);
+                    x++;
+                    z->cur_position_in_file++;
                 }
             }
-            got_blocks += thismatch;
-
-            /* (If we didn't match any data) advance the window by 1 byte -
-             * update the rolling checksum and our offset in the buffer */
-            if (!blocks_matched) {
-                unsigned char Nc = data[x + bs * 2];
-                unsigned char nc = data[x + bs];
-                unsigned char oc = data[x];
-                UPDATE_RSUM(z->r[0].a, z->r[0].b, oc, nc, z->blockshift);
-                if (seq_matches > 1)
-                    UPDATE_RSUM(z->r[1].a, z->r[1].b, nc, Nc, z->blockshift);
-                x++;
-                z->cur_position_in_file++;
+        }
+
+        /* With a stride, the same, but (if we didn't match any data) advance
+         * the window by the stride, rolling the checksums over the bytes in
+         * between without looking any of them up. If that goes past the end
+         * of the buffer, the next call works them out afresh (z->skip). */
+        else {
+            while (0 == blocks_matched && x < x_limit) {
+                int thismatch = lookup_rolling(z, data + x, seq_matches);
+                if (thismatch) {
+                    got_blocks += thismatch;
+                    blocks_matched = seq_matches;
+                } else {
+                    if (x + stride <= x_limit) {
+                        int k;
+                        for (k = 0; k < stride; k++, x++)
+                            roll_rsums(z, data + x, bs, seq_matches);
+                    } else
+                        x += stride;
+                    z->cur_position_in_file += stride;
+                }
             }
         }
 
@@ -397,7 +568,7 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
          * at x, it's highly unlikely to get a hit at x+1 as all the
          * target's blocks are multiples of the blocksize apart. */
         if (blocks_matched) {
-            off_t incr = z->blocksize + (blocks_matched > 1 ? z->blocksize : 0);
+            off_t incr = z->blocksize * blocks_matched;
             x += incr;
             z->cur_position_in_file += incr;
 
@@ -407,14 +578,16 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
                  * return. */
             } else {
                 /* If we are moving forward just 1 block, we already have the
-                 * following block rsum. If we are skipping both, then
-                 * recalculate both */
-                if (z->seq_matches > 1 && blocks_matched == 1)
-                    z->r[0] = z->r[1];
-                else
-                    z->r[0] = rcksum_calc_rsum_block(data + x, z->blocksize);
-                if (z->seq_matches > 1)
-                    z->r[1] = rcksum_calc_rsum_block(data + x + z->blocksize, z->blocksize);
+                 * rsums of all but the last of the following blocks; shift
+                 * them down. If we are skipping them all, then recalculate
+                 * them all */
+                int i = 0;
+                if (z->seq_matches > 1 && blocks_matched == 1) {
+                    memmove(&z->r[0], &z->r[1], (z->seq_matches - 1) * sizeof z->r[0]);
+                    i = z->seq_matches - 1;
+                }
+                for (; i < z->seq_matches; i++)
+                    z->r[i] = rcksum_calc_rsum_block(data + x + z->blocksize * i, z->blocksize);
             }
         }
     }
@@ -432,7 +605,7 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
 /* off_t get_file_size(FILE*)
  * Returns the size of the given file, if available. 0 otherwise.
  */
-static off_t get_file_size(FILE *f) {
+off_t get_file_size(FILE *f) {
     struct stat st;
     int fd = fileno(f);
     if (fd == -1)
@@ -444,30 +617,56 @@ static off_t get_file_size(FILE *f) {
     return st.st_size;
 }
 
+/* rcksum_set_stride(self, stride)
+ * Only look for blocks at offsets in the source files that are multiples of
+ * stride, rather than at every byte offset; for data that only ever moves by
+ * whole sectors, e.g. disk images. stride must be a power of 2, no more than
+ * the blocksize; 1 (the default) looks everywhere. Returns 0, or -1 if stride
+ * is not usable. */
+int rcksum_set_stride(struct rcksum_state *z, int stride) {
+    if (stride < 1 || (stride & (stride - 1)) || (size_t)stride > z->blocksize)
+        return -1;
+    z->stride = stride;
+    return 0;
+}
+
 void rcksum_get_reusable_range(struct rcksum_state *z, struct reuseable_range **rr_out, size_t *len_rr_out) {
     *len_rr_out = z->num_reusable_ranges;
     *rr_out = z->reusable_ranges;
 }
 
-/* rcksum_submit_source_file(self, stream, progress)
- * Read the given stream, applying the rsync rolling checksum algorithm to
- * identify any blocks of data in common with the target file. Blocks found are
- * written to our working target output. Progress reports if progress != 0
+/* rcksum_clear_reusable_ranges(self)
+ * Forget the reusable ranges recorded so far, e.g. before starting on a new
+ * source file. */
+void rcksum_clear_reusable_ranges(struct rcksum_state *z) { z->num_reusable_ranges = 0; }
+
+/* submit_source_stream(self, stream, start, length, progress)
+ * Read length bytes (or to EOF, if length is -1) of the given stream from
+ * offset start, applying the rsync rolling checksum algorithm to identify any
+ * blocks of data in common with the target file. Blocks found are written to
+ * our working target output. Progress reports if progress != 0
+ * Only if we read to EOF is the data padded to complete the last block; a
+ * block that starts within the last z->context bytes of a shorter range is not
+ * looked at.
  */
-int rcksum_submit_source_file(struct rcksum_state *z, FILE *f, int progress) {
+static int submit_source_stream(struct rcksum_state *z, FILE *f, off_t start, off_t length, int progress) {
     /* Track progress */
     int got_blocks = 0;
     off_t in = 0;
-    off_t position_in_file = 0;
-    z->cur_position_in_file = 0;
-    z->num_reusable_ranges = 0;
+    off_t position_in_file = start;
+    off_t remaining = length;
+    bool at_end = false;
     int in_mb = 0;
-    off_t size = get_file_size(f);
+    off_t size = length >= 0 ? length : get_file_size(f);
     struct progress *p;
 
     /* Allocate buffer of 16 blocks */
     register size_t bufsize = z->blocksize * 16;
-    unsigned char *buf = malloc(bufsize + z->context);
+    unsigned char *buf;
+
+    if (length == 0)
+        return 0;
+    buf = malloc(bufsize + z->context);
     if (!buf)
         return -1;
 
@@ -478,18 +677,29 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE *f, int progress) {
             return -1;
         }
 
+    z->cur_position_in_file = start;
+    if (start && fseeko(f, start, SEEK_SET) != 0) {
+        perror("fseeko");
+        free(buf);
+        return -1;
+    }
+
     if (progress) {
         p = start_progress();
         do_progress(p, 0, in);
     }
 
-    while (!feof(f)) {
-        size_t len;
+    while (!at_end) {
+        size_t len, got;
         off_t start_in = in;
+        size_t want = in ? bufsize - z->context : bufsize;
+
+        if (remaining >= 0 && (off_t)want > remaining)
+            want = remaining;
 
         /* If this is the start, fill the buffer for the first time */
         if (!in) {
-            len = fread(buf, 1, bufsize, f);
+            got = len = fread(buf, 1, want, f);
             in += len;
         }
 
@@ -500,7 +710,8 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE *f, int progress) {
             z->cur_position_in_file = position_in_file;
             memcpy(buf, buf + (bufsize - z->context), z->context);
             in += bufsize - z->context;
-            len = z->context + fread(buf + z->context, 1, bufsize - z->context, f);
+            got = fread(buf + z->context, 1, want, f);
+            len = z->context + got;
         }
 
         /* If either fread above failed, or EOFed */
@@ -511,9 +722,14 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE *f, int progress) {
                 end_progress(p, 0);
             return got_blocks;
         }
+        if (remaining >= 0)
+            remaining -= got;
         if (feof(f)) { /* 0 pad to complete a block */
             memset(buf + len, 0, z->context);
             len += z->context;
+            at_end = true;
+        } else if (remaining == 0) {
+            at_end = true;
         }
 
         /* Process the data in the buffer, and report progress */
@@ -529,3 +745,23 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE *f, int progress) {
     }
     return got_blocks;
 }
+
+/* rcksum_submit_source_file(self, stream, progress)
+ * Read the given stream, applying the rsync rolling checksum algorithm to
+ * identify any blocks of data in common with the target file. Blocks found are
+ * written to our working target output. Progress reports if progress != 0
+ */
+int rcksum_submit_source_file(struct rcksum_state *z, FILE *f, int progress) {
+    rcksum_clear_reusable_ranges(z);
+    if (z->chunk_offsets)
+        return rcksum_submit_source_chunks(z, f, progress);
+    return submit_source_stream(z, f, 0, -1, progress);
+}
+
+/* rcksum_submit_source_range(self, stream, start, length)
+ * As rcksum_submit_source_file, but only for length bytes of the stream
+ * starting at offset start (or to EOF if length is -1). The stream must be
+ * seekable. The reusable ranges found are added to any already recorded. */
+int rcksum_submit_source_range(struct rcksum_state *z, FILE *f, off_t start, off_t length) {
+    return submit_source_stream(z, f, start, length, 0);
+}
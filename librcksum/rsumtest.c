@@ -1,7 +1,10 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "internal.h"
 #include "md4.h"
@@ -76,13 +79,1187 @@ void perf_test_fc000000(int n) {
     printf("%d iterations, took %d.%06ds\n", n, took_us / 1000000, took_us % 1000000);
 }
 
+#define STRIDE_BS 4096
+#define STRIDE_NBLOCKS 256
+
+static void make_random_data(unsigned char *data, size_t len, unsigned seed) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 24; /* The high bits repeat least often */
+    }
+}
+
+/* stride_scan(target, seed, seedlen, stride)
+ * Set up the blocks of target, scan seed for them with the given stride, and
+ * return how many blocks are still to do afterwards. */
+static int stride_scan(const unsigned char *target, const unsigned char *seed, size_t seedlen, int stride) {
+    struct rcksum_state *z =
+        rcksum_init(STRIDE_NBLOCKS, STRIDE_BS, 4, 16, 0, 1, true, NULL, (off_t)STRIDE_NBLOCKS * STRIDE_BS);
+    FILE *f = tmpfile();
+    zs_blockid id;
+    int todo;
+
+    for (id = 0; id < STRIDE_NBLOCKS; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+        rcksum_calc_checksum(checksum, target + id * STRIDE_BS, STRIDE_BS);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(target + id * STRIDE_BS, STRIDE_BS), checksum, 0);
+    }
+    test_eq(rcksum_set_stride(z, stride), 0);
+
+    fwrite(seed, 1, seedlen, f);
+    rewind(f);
+    rcksum_submit_source_file(z, f, 0);
+    fclose(f);
+    todo = rcksum_blocks_todo(z);
+    rcksum_end(z);
+    return todo;
+}
+
+/* With a stride, blocks moved by a multiple of it are all found, and blocks
+ * moved by anything else are not looked for. */
+void test_stride(void) {
+    size_t len = STRIDE_NBLOCKS * STRIDE_BS;
+    unsigned char *target = malloc(len);
+    unsigned char *seed = malloc(len + STRIDE_BS);
+    struct rcksum_state *z = rcksum_init(1, STRIDE_BS, 4, 16, 0, 1, true, NULL, STRIDE_BS);
+
+    test_eq(rcksum_set_stride(z, 0), -1);
+    test_eq(rcksum_set_stride(z, 768), -1);
+    test_eq(rcksum_set_stride(z, 2 * STRIDE_BS), -1);
+    rcksum_end(z);
+
+    make_random_data(target, len, 1);
+
+    /* Shifted by 3 sectors, all the blocks are found */
+    make_random_data(seed, 3 * 512, 2);
+    memcpy(seed + 3 * 512, target, len);
+    test_eq(stride_scan(target, seed, len + 3 * 512, 512), 0);
+    test_eq(stride_scan(target, seed, len + 3 * 512, 1), 0);
+
+    /* Shifted by a byte, they are only found by looking at every offset */
+    make_random_data(seed, 1, 2);
+    memcpy(seed + 1, target, len);
+    test_eq(stride_scan(target, seed, len + 1, 512), STRIDE_NBLOCKS);
+    test_eq(stride_scan(target, seed, len + 1, 1), 0);
+
+    free(target);
+    free(seed);
+}
+
+#define SEQ_NBLOCKS 37
+
+/* seq_scan(target, len, seq_matches, seed, seedlen)
+ * Scan seed for the 512-byte blocks of target (the last of them zero-padded),
+ * needing seq_matches consecutive blocks to match; returns how many blocks
+ * are still to do afterwards. */
+static int seq_scan(const unsigned char *target, size_t len, int seq_matches, const unsigned char *seed,
+                    size_t seedlen) {
+    zs_blockid n = (len + 511) / 512, id;
+    struct rcksum_state *z = rcksum_init(n, 512, 4, 16, 0, seq_matches, true, NULL, len);
+    FILE *f = tmpfile();
+    int todo;
+
+    for (id = 0; id < n; id++) {
+        unsigned char block[512] = {0}, checksum[CHECKSUM_SIZE];
+
+        memcpy(block, target + id * 512, id < n - 1 ? 512 : len - id * 512);
+        rcksum_calc_checksum(checksum, block, 512);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(block, 512), checksum, 0);
+    }
+    fwrite(seed, 1, seedlen, f);
+    rewind(f);
+    rcksum_submit_source_file(z, f, 0);
+    fclose(f);
+    todo = rcksum_blocks_todo(z);
+    rcksum_end(z);
+    return todo;
+}
+
+/* With 3 or 4 consecutive blocks needed to match: runs that long are found,
+ * and continued a block at a time beyond that, to the end of the file; but
+ * shorter runs on their own are not */
+void test_seq_matches(void) {
+    size_t len = SEQ_NBLOCKS * 512 - 100;
+    unsigned char *target = malloc(len);
+    unsigned char *seed = malloc(2 * len);
+    int seq;
+
+    make_random_data(target, len, 30);
+    for (seq = 3; seq <= 4; seq++) {
+        /* All of it, moved by an odd amount: found, the last partial block too */
+        make_random_data(seed, 77, 31);
+        memcpy(seed + 77, target, len);
+        test_eq(seq_scan(target, len, seq, seed, 77 + len), 0);
+
+        /* A block changed in the middle breaks the run, and just that block
+         * is missing; the rest after it is found again */
+        seed[77 + 17 * 512 + 200] ^= 1;
+        test_eq(seq_scan(target, len, seq, seed, 77 + len), 1);
+
+        /* seq + 2 blocks, then junk: the first seq are a match, and the two
+         * after that follow on from it (next_match) */
+        memcpy(seed + 77, target + 5 * 512, (seq + 2) * 512);
+        make_random_data(seed + 77 + (seq + 2) * 512, 3000, 32);
+        test_eq(seq_scan(target, len, seq, seed, 77 + (seq + 2) * 512 + 3000), SEQ_NBLOCKS - seq - 2);
+
+        /* But a run of one block fewer than seq is not found at all */
+        make_random_data(seed + 77 + (seq - 1) * 512, 3000, 33);
+        test_eq(seq_scan(target, len, seq, seed, 77 + (seq - 1) * 512 + 3000), SEQ_NBLOCKS);
+        test_eq(seq_scan(target, len, 1, seed, 77 + (seq - 1) * 512 + 3000), SEQ_NBLOCKS - seq + 1);
+
+        /* The last blocks of the file, where the blocks after them are the
+         * spare entries: found, as far as the end of the seed */
+        memcpy(seed + 77, target + len - (seq + 1) * 512 + 100, (seq + 1) * 512 - 100);
+        test_eq(seq_scan(target, len, seq, seed, 77 + (seq + 1) * 512 - 100), SEQ_NBLOCKS - seq - 1);
+    }
+    free(target);
+    free(seed);
+}
+
+/* Time a scan of a large seed with nothing in common with the target */
+void perf_test_stride(int stride) {
+    struct timeval start, end;
+    size_t len = STRIDE_NBLOCKS * STRIDE_BS, seedlen = 64 << 20;
+    unsigned char *target = malloc(len);
+    unsigned char *seed = malloc(seedlen);
+
+    make_random_data(target, len, 1);
+    make_random_data(seed, seedlen, 2);
+
+    gettimeofday(&start, NULL);
+    stride_scan(target, seed, seedlen, stride);
+    gettimeofday(&end, NULL);
+
+    int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+    printf("stride %d, took %d.%06ds\n", stride, took_us / 1000000, took_us % 1000000);
+    free(target);
+    free(seed);
+}
+
+/* Time a scan of a seed that has nothing in common with the target, but with
+ * only the 2-byte rsums to go on, so that one offset in sixteen is a false
+ * weak hit: with and without the CRC32Cs to rule those out before the MD4 */
+void perf_test_weak_collisions(bool crc) {
+    struct timeval start, end;
+    zs_blockid n = 4096, id;
+    size_t bs = 1024, len = (size_t)n * bs, seedlen = 16 << 20;
+    unsigned char *target = malloc(len);
+    unsigned char *seed = malloc(seedlen);
+    struct rcksum_state *z = rcksum_init(n, bs, 2, 16, crc ? CRC32C_SIZE : 0, 1, true, NULL, (off_t)len);
+    FILE *f = tmpfile();
+
+    make_random_data(target, len, 1);
+    make_random_data(seed, seedlen, 2);
+    for (id = 0; id < n; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+        rcksum_calc_checksum(checksum, target + id * bs, bs);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(target + id * bs, bs), checksum,
+                                crc ? rcksum_calc_crc32c(target + id * bs, bs) : 0);
+    }
+    fwrite(seed, 1, seedlen, f);
+    rewind(f);
+
+    gettimeofday(&start, NULL);
+    rcksum_submit_source_file(z, f, 0);
+    gettimeofday(&end, NULL);
+
+    int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+    printf("crc32c %s: %d weak hits, %d (%.1f%%) rejected by crc32c, %d crc32cs, %d MD4s, took %d.%06ds\n",
+           crc ? "on" : "off", z->stats.weakhit, z->stats.crcrejected,
+           z->stats.weakhit ? 100.0 * z->stats.crcrejected / z->stats.weakhit : 0.0, z->stats.crcchecked,
+           z->stats.checksummed, took_us / 1000000, took_us % 1000000);
+    rcksum_end(z);
+    fclose(f);
+    free(target);
+    free(seed);
+}
+
+/* write_scattered(target, nblocks, uring, sink)
+ * Submit the blocks of target one at a time, in a scattered order, to an
+ * rcksum_state writing to the sink, or a file with or without io_uring.
+ * Returns the state, with the output flushed; the caller rcksum_ends it. */
+static struct rcksum_state *write_scattered(const unsigned char *target, zs_blockid nblocks, bool uring,
+                                            const struct rcksum_sink *sink) {
+    struct rcksum_state *z = rcksum_init(nblocks, 512, 4, 16, 0, 1, false, sink, (off_t)nblocks * 512);
+    zs_blockid id;
+
+    for (id = 0; id < nblocks; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+        rcksum_calc_checksum(checksum, target + id * 512, 512);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(target + id * 512, 512), checksum, 0);
+    }
+    if (uring)
+        rcksum_use_io_uring(z); /* (else, or if not available, pwrite) */
+
+    /* nblocks is a power of 2, so stepping by an odd number visits them all */
+    for (id = 0; id < nblocks; id++) {
+        zs_blockid b = (id * 257) & (nblocks - 1);
+        test_eq(rcksum_submit_blocks(z, target + b * 512, b, b), 0);
+    }
+    rcksum_flush(z);
+    return z;
+}
+
+/* Blocks written through io_uring all get to the file */
+void test_uring(void) {
+    size_t len = 1024 * 512;
+    unsigned char *target = malloc(len);
+    unsigned char *back = malloc(len);
+    struct rcksum_state *z;
+
+    make_random_data(target, len, 3);
+    z = write_scattered(target, 1024, true, NULL);
+    test_eq(rcksum_read_target(z, back, len, 0), len);
+    test_eq(memcmp(target, back, len), 0);
+    test_eq(rcksum_blocks_todo(z), 0);
+    rcksum_end(z);
+    free(target);
+    free(back);
+}
+
+/* A memory sink gets the target, without the padding past its end */
+void test_memory_sink(void) {
+    size_t len = 1024 * 512;
+    unsigned char *target = malloc(len);
+    unsigned char *buf = malloc(len - 100);
+    struct rcksum_memory_sink m;
+    struct rcksum_state *z;
+
+    make_random_data(target, len, 4);
+    rcksum_memory_sink_init(&m, buf, len - 100);
+    z = write_scattered(target, 1024, true, &m.sink); /* No io_uring for a sink */
+    test_eq(m.len, len - 100);
+    test_eq(memcmp(target, buf, len - 100), 0);
+    test_eq(rcksum_filehandle(z), -1);
+    test_eq(rcksum_truncate_target(z, len - 200), 0);
+    test_eq(m.len, len - 200);
+    test_eq(rcksum_truncate_target(z, len), -1);
+    test_eq(rcksum_blocks_todo(z), 0);
+    rcksum_end(z);
+    free(target);
+    free(buf);
+}
+
+/* Blocks can be forgotten, and are then needed again */
+void test_forget(void) {
+    size_t len = 16 * 512;
+    unsigned char *target = malloc(len);
+    struct rcksum_state *z;
+    zs_blockid *r;
+    int n;
+
+    make_random_data(target, len, 5);
+    z = write_scattered(target, 16, false, NULL);
+    test_eq(rcksum_forget_blocks(z, 4, 7), 4);
+    test_eq(rcksum_blocks_todo(z), 4);
+    r = rcksum_needed_block_ranges(z, &n, 0, 16);
+    test_eq(n, 1);
+    test_eq(r[0], 4);
+    test_eq(r[1], 8);
+    free(r);
+    test_eq(rcksum_forget_blocks(z, 0, 5), 4);
+    test_eq(rcksum_blocks_todo(z), 8);
+    test_eq(rcksum_known_prefix(z), 0);
+
+    /* And got again */
+    test_eq(rcksum_submit_blocks(z, target, 0, 7), 0);
+    test_eq(rcksum_blocks_todo(z), 0);
+    rcksum_end(z);
+    free(target);
+}
+
+/* A memory sink that counts the bytes written to it */
+struct counting_sink {
+    struct rcksum_memory_sink m;
+    long long written;
+};
+
+static ssize_t counting_write(void *ctx, const void *buf, size_t len, off_t offset) {
+    struct counting_sink *c = ctx;
+    c->written += len;
+    return c->m.sink.write(&c->m, buf, len, offset);
+}
+
+static ssize_t counting_read(void *ctx, void *buf, size_t len, off_t offset) {
+    struct counting_sink *c = ctx;
+    return c->m.sink.read(&c->m, buf, len, offset);
+}
+
+/* update_written(target, seed, len, in_place)
+ * Build the target (len bytes, 512-byte blocks) from the seed, in place of a
+ * copy of the seed if in_place, and return how many bytes that wrote */
+static long long update_written(const unsigned char *target, const unsigned char *seed, size_t len, bool in_place) {
+    zs_blockid id, nblocks = len / 512;
+    unsigned char *buf = malloc(len);
+    struct counting_sink c;
+    struct rcksum_sink sink = {&c, counting_write, counting_read, NULL, NULL, NULL, NULL};
+    struct rcksum_state *z = rcksum_init(nblocks, 512, 4, 16, 0, 1, false, &sink, len);
+    FILE *f = tmpfile();
+    int i, n;
+    zs_blockid *todo;
+
+    rcksum_memory_sink_init(&c.m, buf, len);
+    c.written = 0;
+    for (id = 0; id < nblocks; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+        rcksum_calc_checksum(checksum, target + id * 512, 512);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(target + id * 512, 512), checksum, 0);
+    }
+    if (in_place) { /* As if rcksum_clone_source */
+        memcpy(buf, seed, len);
+        c.m.len = len;
+        rcksum_set_source_in_place(z, true);
+    }
+    fwrite(seed, 1, len, f);
+    rewind(f);
+    rcksum_submit_source_file(z, f, 0);
+    fclose(f);
+
+    /* Whichever way, what we know of the target is right */
+    todo = rcksum_needed_block_ranges(z, &n, 0, nblocks);
+    for (i = 0, id = 0; i <= n; i++) {
+        zs_blockid end = i < n ? todo[2 * i] : nblocks;
+        test_eq(memcmp(buf + id * 512, target + id * 512, (end - id) * 512), 0);
+        if (i < n)
+            id = todo[2 * i + 1];
+    }
+    free(todo);
+    rcksum_end(z);
+    free(buf);
+    return c.written;
+}
+
+/* Updating a copy of the seed in place writes only the data that moved */
+void test_source_in_place(void) {
+    size_t len = 256 * 512;
+    unsigned char *seed = malloc(len);
+    unsigned char *target = malloc(len);
+
+    make_random_data(seed, len, 6);
+    memcpy(target, seed, len);
+    make_random_data(target + 100 * 512, 512, 7);
+    memcpy(target + 200 * 512, seed + 10 * 512, 512);
+    test_eq(update_written(target, seed, len, true), 512);
+    test_eq(update_written(target, seed, len, false), 255 * 512);
+    free(seed);
+    free(target);
+}
+
+/* target_state(target, nblocks, sink)
+ * An rcksum_state for the target, with 512-byte blocks, writing to the sink
+ * (or a temporary file) */
+static struct rcksum_state *target_state(const unsigned char *target, zs_blockid nblocks,
+                                         const struct rcksum_sink *sink) {
+    struct rcksum_state *z = rcksum_init(nblocks, 512, 4, 16, 0, 1, false, sink, (off_t)nblocks * 512);
+    zs_blockid id;
+
+    for (id = 0; id < nblocks; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+        rcksum_calc_checksum(checksum, target + id * 512, 512);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(target + id * 512, 512), checksum, 0);
+    }
+    return z;
+}
+
+/* Blocks of zeros are known from the start; not looked for, nor written to a
+ * new file, but written over anything else */
+void test_zero_blocks(void) {
+    size_t len = 64 * 512;
+    unsigned char *target = malloc(len);
+    unsigned char *back = malloc(len);
+    struct rcksum_memory_sink m;
+    struct rcksum_state *z;
+    zs_blockid *r;
+    FILE *f = tmpfile();
+    int n;
+
+    make_random_data(target, len, 8);
+    memset(target + 10 * 512, 0, 10 * 512);
+    memset(target + 40 * 512, 0, 512);
+    memset(target + 63 * 512, 0, 512);
+    fwrite(target, 1, len, f);
+
+    z = target_state(target, 64, NULL);
+    test_eq(rcksum_find_zero_blocks(z), 12);
+    test_eq(rcksum_blocks_todo(z), 52);
+    r = rcksum_needed_block_ranges(z, &n, 0, 64);
+    test_eq(n, 3);
+    test_eq(r[1], 10);
+    test_eq(r[2], 20);
+    test_eq(r[3], 40);
+    test_eq(r[4], 41);
+    test_eq(r[5], 63);
+    free(r);
+    rewind(f);
+    test_eq(rcksum_submit_source_file(z, f, 0), 52);
+    test_eq(rcksum_blocks_todo(z), 0);
+    test_eq(rcksum_truncate_target(z, len), 0);
+    test_eq(rcksum_read_target(z, back, len, 0), len);
+    test_eq(memcmp(target, back, len), 0);
+    rcksum_end(z);
+
+    memset(back, 0xff, len);
+    rcksum_memory_sink_init(&m, back, len);
+    m.len = len;
+    z = target_state(target, 64, &m.sink);
+    test_eq(rcksum_find_zero_blocks(z), 12);
+    test_eq(back[10 * 512], 0);
+    test_eq(back[20 * 512 - 1], 0);
+    test_eq(back[20 * 512], 0xff);
+    test_eq(back[len - 1], 0);
+    rcksum_end(z);
+
+    fclose(f);
+    free(target);
+    free(back);
+}
+
+/* The output of an interrupted run can be taken over with its saved map of
+ * known blocks, but only by the same target, and if the blocks check out */
+void test_resume(void) {
+    size_t len = 64 * 512;
+    unsigned char *target = malloc(len);
+    unsigned char *other = malloc(len);
+    unsigned char *back = malloc(len);
+    FILE *map = tmpfile();
+    struct rcksum_state *z;
+    char *name;
+    int fd;
+
+    make_random_data(target, len, 9);
+    make_random_data(other, len, 10);
+    z = write_scattered(target, 64, false, NULL);
+    test_eq(rcksum_forget_blocks(z, 10, 19), 10);
+    test_eq(rcksum_save_known(z, fileno(map)), 0);
+    name = rcksum_filename(z);
+    rcksum_end(z);
+
+    /* Not for another target */
+    z = target_state(other, 64, NULL);
+    test_eq(rcksum_resume(z, name, fileno(map), 64), -1);
+    rcksum_end(z);
+
+    /* Nor if a block that we check is wrong */
+    fd = open(name, O_RDWR);
+    test_eq(pwrite(fd, "x", 1, 30 * 512), 1);
+    z = target_state(target, 64, NULL);
+    test_eq(rcksum_resume(z, name, fileno(map), 64), -1);
+    test_eq(rcksum_blocks_todo(z), 64);
+    rcksum_end(z);
+    test_eq(pwrite(fd, target + 30 * 512, 1, 30 * 512), 1);
+    close(fd);
+
+    z = target_state(target, 64, NULL);
+    test_eq(rcksum_resume(z, name, fileno(map), 8), 54);
+    test_eq(rcksum_blocks_todo(z), 10);
+    test_eq(rcksum_submit_blocks(z, target + 10 * 512, 10, 19), 0);
+    test_eq(rcksum_read_target(z, back, len, 0), len);
+    test_eq(memcmp(target, back, len), 0);
+    free(rcksum_filename(z));
+    rcksum_end(z);
+
+    unlink(name);
+    free(name);
+    fclose(map);
+    free(target);
+    free(other);
+    free(back);
+}
+
+/* What a scan of a seed file found can be taken again from the same file
+ * without scanning it, but only while it's unchanged */
+void test_source_ranges(void) {
+    size_t len = 64 * 512;
+    unsigned char *target = malloc(len);
+    unsigned char *seed = malloc(len + 100);
+    unsigned char *back = malloc(len);
+    struct reuseable_range *rr, *found;
+    struct rcksum_state *z;
+    FILE *f = tmpfile();
+    size_t n, i;
+
+    /* The second half, some junk, then the first half but for a block */
+    make_random_data(target, len, 11);
+    memcpy(seed, target + len / 2, len / 2);
+    make_random_data(seed + len / 2, 100, 12);
+    memcpy(seed + len / 2 + 100, target, len / 2);
+    make_random_data(seed + len / 2 + 100 + 5 * 512, 512, 13);
+    fwrite(seed, 1, len + 100, f);
+    fflush(f);
+
+    z = target_state(target, 64, NULL);
+    rewind(f);
+    test_eq(rcksum_submit_source_file(z, f, 0), 63);
+    rcksum_get_reusable_range(z, &rr, &n);
+    found = malloc(n * sizeof *found);
+    memcpy(found, rr, n * sizeof *found);
+    rcksum_end(z);
+
+    z = target_state(target, 64, NULL);
+    test_eq(rcksum_submit_source_ranges(z, fileno(f), found, n), 63);
+    test_eq(rcksum_blocks_todo(z), 1);
+    rcksum_get_reusable_range(z, &rr, &i);
+    test_eq(i, n);
+    test_eq(memcmp(rr, found, n * sizeof *found), 0);
+    test_eq(rcksum_submit_blocks(z, target + 5 * 512, 5, 5), 0);
+    test_eq(rcksum_read_target(z, back, len, 0), len);
+    test_eq(memcmp(target, back, len), 0);
+    rcksum_end(z);
+
+    /* Blocks that we have already are skipped */
+    z = target_state(target, 64, NULL);
+    test_eq(rcksum_submit_blocks(z, target, 0, 3), 0);
+    test_eq(rcksum_submit_source_ranges(z, fileno(f), found, n), 59);
+    rcksum_end(z);
+
+    /* Not if the file has changed since */
+    test_eq(pwrite(fileno(f), "x", 1, 8 * 512), 1); /* Block 40 */
+    z = target_state(target, 64, NULL);
+    test_eq(rcksum_submit_source_ranges(z, fileno(f), found, n), -1);
+    rcksum_end(z);
+
+    fclose(f);
+    free(found);
+    free(target);
+    free(seed);
+    free(back);
+}
+
+/* The blocks of the target in a seed file, where its own block checksums say
+ * they are, are found from the checksums alone */
+void test_join(void) {
+    size_t len = 64 * 512;
+    unsigned char *target = malloc(len);
+    unsigned char *seed = malloc(len);
+    unsigned char *back = malloc(len);
+    struct rcksum_state *z, *s;
+    struct reuseable_range *rr;
+    FILE *f = tmpfile();
+    size_t n;
+
+    /* Blocks 32-63, then junk and blocks 0-15 but moved by 100 bytes, then
+     * blocks 16-31 but for block 20 */
+    make_random_data(target, len, 14);
+    memcpy(seed, target + len / 2, len / 2);
+    make_random_data(seed + len / 2, 100, 15);
+    memcpy(seed + len / 2 + 100, target, 16 * 512 - 100);
+    memcpy(seed + len / 2 + 16 * 512, target + 16 * 512, 16 * 512);
+    make_random_data(seed + len / 2 + 20 * 512, 512, 16);
+    fwrite(seed, 1, len, f);
+    fflush(f);
+
+    z = target_state(target, 64, NULL);
+    s = target_state(seed, 64, NULL);
+    test_eq(rcksum_join(z, s, &rr, &n), 0);
+    test_eq(n, 3);
+    test_eq(rr[0].dst, 32 * 512);
+    test_eq(rr[0].src, 0);
+    test_eq(rr[0].len, 32 * 512);
+    test_eq(rr[1].dst, 16 * 512);
+    test_eq(rr[1].src, 48 * 512);
+    test_eq(rr[1].len, 4 * 512);
+    test_eq(rr[2].dst, 21 * 512);
+    test_eq(rr[2].len, 11 * 512);
+    test_eq(rcksum_submit_source_ranges(z, fileno(f), rr, n), 47);
+    free(rr);
+    rcksum_end(s);
+
+    /* Not with another blocksize */
+    s = rcksum_init(32, 1024, 4, 16, 0, 1, true, NULL, len);
+    test_eq(rcksum_join(z, s, &rr, &n), -1);
+    rcksum_end(s);
+
+    test_eq(rcksum_submit_blocks(z, target, 0, 15), 0);
+    test_eq(rcksum_submit_blocks(z, target + 20 * 512, 20, 20), 0);
+    test_eq(rcksum_read_target(z, back, len, 0), len);
+    test_eq(memcmp(target, back, len), 0);
+    rcksum_end(z);
+
+    fclose(f);
+    free(target);
+    free(seed);
+    free(back);
+}
+
+/* Bytes written for small edits to a 64MiB file, from a copy or not */
+void perf_test_source_in_place(void) {
+    size_t len = 64 << 20;
+    unsigned char *seed = malloc(len);
+    unsigned char *target = malloc(len);
+
+    make_random_data(seed, len, 6);
+    memcpy(target, seed, len);
+    make_random_data(target + len / 2, 100, 7); /* Change 100 bytes */
+    printf("change 100 bytes: wrote %lld bytes in place of a copy, %lld to a new file\n",
+           update_written(target, seed, len, true), update_written(target, seed, len, false));
+    memmove(target + len / 2 + 100, seed + len / 2, len / 2 - 100); /* Insert 100 bytes */
+    printf("insert 100 bytes: wrote %lld bytes in place of a copy, %lld to a new file\n",
+           update_written(target, seed, len, true), update_written(target, seed, len, false));
+    free(seed);
+    free(target);
+}
+
+/* Time writing 64MiB of 512-byte blocks in a scattered order */
+void perf_test_uring(bool uring) {
+    struct timeval start, end;
+    size_t len = 64 << 20;
+    unsigned char *target = malloc(len);
+
+    make_random_data(target, len, 3);
+    gettimeofday(&start, NULL);
+    rcksum_end(write_scattered(target, len / 512, uring, NULL));
+    gettimeofday(&end, NULL);
+
+    int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+    printf("io_uring %d, took %d.%06ds\n", uring, took_us / 1000000, took_us % 1000000);
+    free(target);
+}
+
+/* add_records(z, records, n, rsum_bytes, checksum_bytes, crc32c_bytes)
+ * Add the blocks from .zsync records one at a time, as zsync used to */
+static void add_records(struct rcksum_state *z, const unsigned char *p, zs_blockid n, int rsum_bytes,
+                        int checksum_bytes, int crc32c_bytes) {
+    zs_blockid id;
+
+    for (id = 0; id < n; id++) {
+        struct rsum r = {0, 0};
+        uint32_t crc = 0;
+
+        memcpy((char *)&r + 4 - rsum_bytes, p, rsum_bytes);
+        p += rsum_bytes;
+        r.a = ntohs(r.a);
+        r.b = ntohs(r.b);
+        memcpy(&crc, p + checksum_bytes, crc32c_bytes);
+        rcksum_add_target_block(z, id, r, (void *)p, ntohl(crc));
+        p += checksum_bytes + crc32c_bytes;
+    }
+}
+
+/* Adding blocks in bulk from their records gives what adding them one at a
+ * time does, for every size of each field */
+void test_add_target_blocks(void) {
+    int rsum_bytes, checksum_bytes, crc32c_bytes;
+    zs_blockid n = 100, id;
+
+    for (rsum_bytes = 1; rsum_bytes <= 4; rsum_bytes++)
+        for (checksum_bytes = 3; checksum_bytes <= 16; checksum_bytes++)
+            for (crc32c_bytes = 0; crc32c_bytes <= 4; crc32c_bytes += 2) {
+                size_t len = n * (rsum_bytes + checksum_bytes + crc32c_bytes);
+                unsigned char *records = malloc(len);
+                struct rcksum_state *one = rcksum_init(n, 512, rsum_bytes, checksum_bytes, crc32c_bytes, 1, true,
+                                                       NULL, (off_t)n * 512);
+                struct rcksum_state *bulk = rcksum_init(n, 512, rsum_bytes, checksum_bytes, crc32c_bytes, 1, true,
+                                                        NULL, (off_t)n * 512);
+
+                make_random_data(records, len, rsum_bytes * 100 + checksum_bytes * 10 + crc32c_bytes);
+                add_records(one, records, n, rsum_bytes, checksum_bytes, crc32c_bytes);
+                rcksum_add_target_blocks(bulk, 0, n / 2, records);
+                rcksum_add_target_blocks(bulk, n / 2, n, records + len / 2); /* Past the end is ignored */
+                for (id = 0; id < n; id++) {
+                    const struct hash_entry *e = &one->blockhashes[id], *f = &bulk->blockhashes[id];
+                    test_eq(e->r.a, f->r.a);
+                    test_eq(e->r.b, f->r.b);
+                    test_eq(memcmp(e->checksum, f->checksum, checksum_bytes), 0);
+                    test_eq(e->crc32c, f->crc32c);
+                }
+                rcksum_end(one);
+                rcksum_end(bulk);
+                free(records);
+            }
+}
+
+/* Time loading the checksums of a target of n blocks, as from a .zsync (e.g.
+ * 20M blocks, for an 80GB disk image with 4KiB blocks), one at a time and
+ * in bulk */
+void perf_test_add_target_blocks(zs_blockid n) {
+    struct timeval start, end;
+    size_t len = (size_t)n * 20;
+    unsigned char *records = malloc(len);
+    int bulk;
+
+    make_random_data(records, len, 8);
+    for (bulk = 0; bulk < 2; bulk++) {
+        struct rcksum_state *z = rcksum_init(n, 4096, 4, 16, 0, 1, true, NULL, (off_t)n * 4096);
+
+        gettimeofday(&start, NULL);
+        if (bulk)
+            rcksum_add_target_blocks(z, 0, n, records);
+        else
+            add_records(z, records, n, 4, 16, 0);
+        gettimeofday(&end, NULL);
+
+        int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+        printf("%s: %d blocks, took %d.%06ds\n", bulk ? "bulk" : "one at a time", (int)n, took_us / 1000000,
+               took_us % 1000000);
+        rcksum_end(z);
+    }
+    free(records);
+}
+
+/* check_same_hash(z, y)
+ * y has the same hash tables as z; the same chains, in the same order */
+static void check_same_hash(struct rcksum_state *z, struct rcksum_state *y) {
+    unsigned int i;
+
+    test_eq(y->hashmask, z->hashmask);
+    test_eq(y->bithashmask, z->bithashmask);
+    test_eq(y->hash_func_shift, z->hash_func_shift);
+    test_eq(memcmp(y->bithash, z->bithash, (z->bithashmask >> 3) + 1), 0);
+    for (i = 0; i <= z->hashmask; i++) {
+        const struct hash_entry *e = z->rsum_hash[i], *f = y->rsum_hash[i];
+        for (; e && f; e = e->next, f = f->next)
+            test_eq(e - z->blockhashes, f - y->blockhashes);
+        test_eq(e == NULL && f == NULL, 1);
+    }
+}
+
+/* read_back(z, f, offset, target, index)
+ * Load the checksums of the target from the table at offset in f into a new
+ * state, check that they are z's, and that the new state finds the target;
+ * and that f is left after the table, at the "x" we put there */
+static void read_back(struct rcksum_state *z, FILE *f, long offset, const unsigned char *target, size_t len,
+                      bool index) {
+    struct rcksum_state *y = rcksum_init(z->blocks, 512, 4, 16, 0, 1, false, NULL, len);
+    unsigned char *back = malloc(len);
+    zs_blockid id;
+    FILE *seed;
+
+    fseek(f, offset, SEEK_SET);
+    test_eq(rcksum_read_table(y, f), 0);
+    test_eq(getc(f), 'x');
+    for (id = 0; id < z->blocks; id++) {
+        test_eq(y->blockhashes[id].r.a, z->blockhashes[id].r.a);
+        test_eq(y->blockhashes[id].r.b, z->blockhashes[id].r.b);
+        test_eq(memcmp(y->blockhashes[id].checksum, z->blockhashes[id].checksum, 16), 0);
+    }
+    test_eq(rcksum_blocks_todo(y), rcksum_blocks_todo(z));
+    test_eq(y->rsum_hash != NULL, index);
+    if (index)
+        check_same_hash(z, y);
+
+    seed = fmemopen((void *)target, len, "r");
+    test_eq(rcksum_submit_source_file(y, seed, 0), rcksum_blocks_todo(z));
+    fclose(seed);
+    test_eq(rcksum_blocks_todo(y), 0);
+    test_eq(rcksum_read_target(y, back, len, 0), len);
+    test_eq(memcmp(target, back, len), 0);
+    rcksum_end(y);
+    free(back);
+}
+
+/* The binary table loads the same checksums, and the same hash tables as
+ * build_hash makes, whether mapped from a file or read through a stream; and
+ * bad hash tables are rebuilt */
+void test_table(void) {
+    zs_blockid nblocks = 256;
+    size_t len = nblocks * 512;
+    unsigned char *target = malloc(len);
+    struct rcksum_state *z, *other;
+    int index;
+
+    make_random_data(target, len, 9);
+    memset(target + 5 * 512, 0, 5 * 512);
+    z = target_state(target, nblocks, NULL);
+    test_eq(rcksum_find_zero_blocks(z), 5);
+
+    for (index = 0; index < 2; index++) {
+        FILE *f = tmpfile();
+        char *buf;
+        long size, table_offset;
+        uint64_t index_offset;
+        uint32_t bad = 1;
+        FILE *m;
+
+        fputs("headers\n", f);
+        test_eq(rcksum_write_table(z, f, index), 0);
+        putc('x', f);
+        size = ftell(f);
+        test_eq(index ? z->rsum_hash != NULL : 1, 1);
+
+        read_back(z, f, 8, target, len, index);
+
+        /* Not mapped */
+        buf = malloc(size);
+        rewind(f);
+        test_eq(fread(buf, 1, size, f), size);
+        m = fmemopen(buf, size, "r");
+        read_back(z, m, 8, target, len, index);
+        fclose(m);
+
+        /* A chain that goes back is not used */
+        if (index) {
+            table_offset = 64;
+            memcpy(&index_offset, buf + table_offset + 40, sizeof index_offset);
+            fseek(f, table_offset + index_offset + 16, SEEK_SET);
+            fwrite(&bad, sizeof bad, 1, f);
+            fflush(f);
+            read_back(z, f, 8, target, len, false);
+        }
+        free(buf);
+
+        /* Nor is the table for other checksums */
+        other = rcksum_init(nblocks, 512, 4, 8, 0, 1, true, NULL, len);
+        fseek(f, 8, SEEK_SET);
+        test_eq(rcksum_read_table(other, f), -1);
+        rcksum_end(other);
+        fclose(f);
+    }
+    rcksum_end(z);
+    free(target);
+}
+
+/* read_corrupt(f, size, field, value)
+ * Whether a table with the header field at that offset set to value is
+ * turned away, both mapped and read through a stream */
+static void read_corrupt(FILE *f, long size, int field, uint64_t value, zs_blockid nblocks) {
+    struct rcksum_state *y = rcksum_init(nblocks, 512, 4, 16, 0, 1, false, NULL, nblocks * 512);
+    char *buf = malloc(size);
+    FILE *m;
+
+    rewind(f);
+    test_eq(fread(buf, 1, size, f), size);
+    memcpy(buf + 64 + field, &value, sizeof value);
+    rewind(f);
+    fwrite(buf, 1, size, f);
+    fflush(f);
+    fseek(f, 8, SEEK_SET);
+    test_eq(rcksum_read_table(y, f), -1);
+
+    m = fmemopen(buf, size, "r");
+    fseek(m, 8, SEEK_SET);
+    test_eq(rcksum_read_table(y, m), -1);
+    fclose(m);
+    rcksum_end(y);
+    free(buf);
+}
+
+/* A table whose header puts sections outside it, or it outside the file, is
+ * turned away; however far off, so offsets that wrap when added don't pass */
+void test_corrupt_table(void) {
+    zs_blockid nblocks = 256;
+    size_t len = nblocks * 512;
+    unsigned char *target = malloc(len);
+    struct rcksum_state *z;
+    struct {
+        int field;
+        uint64_t value;
+    } bad[] = {
+        {24, 4},                                   /* rsum_offset in the header */
+        {24, UINT64_MAX - 7},                      /* rsum_offset, wrapping */
+        {32, 0},                                   /* checksum_offset before the rsums */
+        {32, UINT64_MAX - 7},                      /* checksum_offset, wrapping */
+        {32, 0 - (uint64_t)nblocks * 16 + 4096},   /* checksum_offset, wrapping to just after the rsums */
+        {40, 0 - (uint64_t)16},                    /* index_offset, wrapping */
+        {48, UINT64_MAX},                          /* index_len */
+        {56, UINT64_MAX},                          /* len, past the end of the file */
+        {56, 64},                                  /* len, less than the sections */
+    };
+    size_t i;
+
+    make_random_data(target, len, 10);
+    z = target_state(target, nblocks, NULL);
+    for (i = 0; i < sizeof bad / sizeof bad[0]; i++) {
+        FILE *f = tmpfile();
+        long size;
+
+        fputs("headers\n", f);
+        test_eq(rcksum_write_table(z, f, 1), 0);
+        putc('x', f);
+        size = ftell(f);
+        read_corrupt(f, size, bad[i].field, bad[i].value, nblocks);
+        fclose(f);
+    }
+    rcksum_end(z);
+    free(target);
+}
+
+/* build_hash makes the same hash tables on any number of threads; with
+ * chains in block order, however many blocks share a bucket, and without the
+ * blocks that we have already */
+void test_parallel_hash(void) {
+    zs_blockid n = 100000, id;
+    size_t record = 2 + 16;
+    unsigned char *records = malloc(n * record);
+    int seq_matches, threads;
+
+    make_random_data(records, n * record, 10);
+    for (id = 1000; id < n; id += 7) /* Identical blocks */
+        memcpy(records + id * record, records + (id % 1000) * record, record);
+
+    for (seq_matches = 1; seq_matches <= 2; seq_matches++) {
+        struct rcksum_state *z = rcksum_init(n, 512, 2, 16, 0, seq_matches, true, NULL, (off_t)n * 512);
+
+        rcksum_add_target_blocks(z, 0, n, records);
+        for (id = 500; id < n; id += 997)
+            add_to_ranges(z, id);
+        test_eq(build_hash_threads(z, 1), 1);
+
+        for (threads = 2; threads <= 9; threads++) {
+            struct rcksum_state *y = rcksum_init(n, 512, 2, 16, 0, seq_matches, true, NULL, (off_t)n * 512);
+
+            rcksum_add_target_blocks(y, 0, n, records);
+            for (id = 500; id < n; id += 997)
+                add_to_ranges(y, id);
+            test_eq(build_hash_threads(y, threads), 1);
+            check_same_hash(z, y);
+            rcksum_end(y);
+        }
+        rcksum_end(z);
+    }
+    free(records);
+}
+
+/* Time to build the hash tables for n blocks, on one thread and on as many
+ * as build_hash uses */
+void perf_test_build_hash(zs_blockid n) {
+    size_t len = (size_t)n * 20;
+    unsigned char *records = malloc(len);
+    int parallel;
+
+    make_random_data(records, len, 11);
+    for (parallel = 0; parallel < 2; parallel++) {
+        struct rcksum_state *z = rcksum_init(n, 4096, 4, 16, 0, 1, true, NULL, (off_t)n * 4096);
+        struct timeval start, end;
+
+        rcksum_add_target_blocks(z, 0, n, records);
+        gettimeofday(&start, NULL);
+        if (parallel)
+            build_hash(z);
+        else
+            build_hash_threads(z, 1);
+        gettimeofday(&end, NULL);
+
+        int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+        printf("%s: %d blocks, took %d.%06ds\n", parallel ? "parallel" : "serial", (int)n, took_us / 1000000,
+               took_us % 1000000);
+        rcksum_end(z);
+    }
+    free(records);
+}
+
+/* multi_target(data, nblocks, bs, rsum_bytes, seq_matches, stride)
+ * An rcksum_state for a target of nblocks of size bs, with nothing written */
+static struct rcksum_state *multi_target(const unsigned char *data, zs_blockid nblocks, size_t bs, int rsum_bytes,
+                                         int seq_matches, int stride) {
+    struct rcksum_state *z = rcksum_init(nblocks, bs, rsum_bytes, 16, 0, seq_matches, true, NULL, (off_t)nblocks * bs);
+    zs_blockid id;
+
+    for (id = 0; id < nblocks; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+        rcksum_calc_checksum(checksum, data + id * bs, bs);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(data + id * bs, bs), checksum, 0);
+    }
+    test_eq(rcksum_set_stride(z, stride), 0);
+    return z;
+}
+
+#define MULTI_TARGETS 6
+
+/* A scan of a seed for several targets at once finds for each just what a
+ * scan for it alone does */
+void test_multi(void) {
+    /* The blocksize, rsum bytes, sequential matches and stride of each */
+    static const int shape[MULTI_TARGETS][4] = {
+        {512, 4, 1, 1}, {512, 3, 2, 1}, {1024, 4, 2, 1}, {512, 4, 1, 512}, {512, 4, 1, 1}, {2048, 2, 1, 1},
+    };
+    size_t len = 64 * 1024, seedlen = 0;
+    unsigned char *data = malloc(len), *seed = malloc(4 * len);
+    struct rcksum_state *z[MULTI_TARGETS];
+    struct reuseable_range *alone[MULTI_TARGETS];
+    size_t nalone[MULTI_TARGETS];
+    int todo[MULTI_TARGETS];
+    FILE *f = tmpfile();
+    int i, got = 0;
+
+    /* The targets are overlapping parts of the data. The seed has pieces of
+     * it from all over, of up to a few blocks, moved by odd amounts, with a
+     * few bytes between; some aligned to a sector, as the stride needs. */
+    make_random_data(data, len, 20);
+    srand(21);
+    while (seedlen < 3 * len) {
+        unsigned r = rand();
+        size_t from = r % len, n = r % 3 ? r / len % 50 : (512 + from % 512 - seedlen % 512) % 512;
+
+        make_random_data(seed + seedlen, n, r);
+        seedlen += n;
+        n = r / len % 5000;
+        n = from + n > len ? len - from : n;
+        memcpy(seed + seedlen, data + from, n);
+        seedlen += n;
+    }
+    fwrite(seed, 1, seedlen, f);
+    fflush(f);
+
+    /* Each alone */
+    for (i = 0; i < MULTI_TARGETS; i++) {
+        const unsigned char *t = data + i * len / 8;
+        zs_blockid n = len / 4 / shape[i][0];
+        struct rcksum_state *y = multi_target(t, n, shape[i][0], shape[i][1], shape[i][2], shape[i][3]);
+        struct reuseable_range *rr;
+
+        z[i] = multi_target(t, n, shape[i][0], shape[i][1], shape[i][2], shape[i][3]);
+        if (i == 4) { /* And with some blocks that we have already */
+            test_eq(rcksum_submit_blocks(y, t, 0, 9), 0);
+            test_eq(rcksum_submit_blocks(z[i], t, 0, 9), 0);
+        }
+        rewind(f);
+        got += rcksum_submit_source_file(y, f, 0);
+        todo[i] = rcksum_blocks_todo(y);
+        rcksum_get_reusable_range(y, &rr, &nalone[i]);
+        alone[i] = malloc(nalone[i] * sizeof *rr + 1);
+        memcpy(alone[i], rr, nalone[i] * sizeof *rr);
+        rcksum_end(y);
+    }
+    test_eq(todo[3] > 0 && todo[3] < (int)(len / 4 / 512), 1);
+
+    /* All together */
+    rewind(f);
+    test_eq(rcksum_submit_source_file_multi(z, MULTI_TARGETS, f, 0), got);
+    for (i = 0; i < MULTI_TARGETS; i++) {
+        struct reuseable_range *rr;
+        size_t n;
+
+        test_eq(rcksum_blocks_todo(z[i]), todo[i]);
+        rcksum_get_reusable_range(z[i], &rr, &n);
+        test_eq(n, nalone[i]);
+        test_eq(memcmp(rr, alone[i], n * sizeof *rr), 0);
+        rcksum_end(z[i]);
+        free(alone[i]);
+    }
+
+    /* No targets, and an empty seed */
+    rewind(f);
+    test_eq(rcksum_submit_source_file_multi(z, 0, f, 0), 0);
+    z[0] = multi_target(data, 8, 512, 4, 2, 1);
+    test_eq(ftruncate(fileno(f), 0), 0);
+    rewind(f);
+    test_eq(rcksum_submit_source_file_multi(z, 1, f, 0), 0);
+    test_eq(rcksum_blocks_todo(z[0]), 8);
+    rcksum_end(z[0]);
+
+    fclose(f);
+    free(data);
+    free(seed);
+}
+
+/* Time a scan of a large seed for n targets of 4096-byte blocks, with nothing
+ * in common with it: once per target, and all at once */
+void perf_test_multi(int n) {
+    size_t len = 4096 * 4096, seedlen = 256 << 20;
+    unsigned char *data = malloc(len), *seed = malloc(seedlen);
+    struct rcksum_state **z = malloc(n * sizeof *z);
+    FILE *f = tmpfile();
+    int multi, i;
+
+    make_random_data(seed, seedlen, 25);
+    fwrite(seed, 1, seedlen, f);
+    fflush(f);
+    for (multi = 0; multi < 2; multi++) {
+        struct timeval start, end;
+
+        for (i = 0; i < n; i++) {
+            make_random_data(data, len, 26 + i);
+            z[i] = multi_target(data, len / 4096, 4096, 4, 2, 1);
+        }
+        gettimeofday(&start, NULL);
+        if (multi) {
+            rewind(f);
+            rcksum_submit_source_file_multi(z, n, f, 0);
+        } else {
+            for (i = 0; i < n; i++) {
+                rewind(f);
+                rcksum_submit_source_file(z[i], f, 0);
+            }
+        }
+        gettimeofday(&end, NULL);
+        for (i = 0; i < n; i++)
+            rcksum_end(z[i]);
+
+        int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+        printf("%s: %d targets, took %d.%06ds\n", multi ? "multi" : "separate", n, took_us / 1000000,
+               took_us % 1000000);
+    }
+    fclose(f);
+    free(z);
+    free(data);
+    free(seed);
+}
+
+/* Time from having the checksums of a target of n blocks to being ready to
+ * scan: decoding them from .zsync records and building the hash tables, or
+ * loading them from a binary table with the hash tables in it */
+void perf_test_table(zs_blockid n) {
+    struct timeval start, end;
+    size_t len = (size_t)n * 20;
+    unsigned char *records = malloc(len);
+    struct rcksum_state *z = rcksum_init(n, 4096, 4, 16, 0, 1, true, NULL, (off_t)n * 4096);
+    FILE *f = tmpfile();
+    int table;
+
+    make_random_data(records, len, 8);
+    rcksum_add_target_blocks(z, 0, n, records);
+    rcksum_find_zero_blocks(z);
+    rcksum_write_table(z, f, 1);
+    fflush(f);
+    rcksum_end(z);
+
+    for (table = 0; table < 2; table++) {
+        gettimeofday(&start, NULL);
+        z = rcksum_init(n, 4096, 4, 16, 0, 1, true, NULL, (off_t)n * 4096);
+        if (table) {
+            rewind(f);
+            rcksum_read_table(z, f);
+        } else {
+            rcksum_add_target_blocks(z, 0, n, records);
+            rcksum_find_zero_blocks(z);
+        }
+        if (!z->rsum_hash)
+            build_hash(z);
+        gettimeofday(&end, NULL);
+
+        int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+        printf("%s: %d blocks, took %d.%06ds\n", table ? "table" : "records", (int)n, took_us / 1000000,
+               took_us % 1000000);
+        rcksum_end(z);
+    }
+    fclose(f);
+    free(records);
+}
+
 int main(void) {
     test_00000000();
     test_abcde();
     test_fc000000();
+    test_stride();
+    test_seq_matches();
+    test_uring();
+    test_memory_sink();
+    test_forget();
+    test_source_in_place();
+    test_zero_blocks();
+    test_resume();
+    test_source_ranges();
+    test_join();
+    test_add_target_blocks();
+    test_table();
+    test_corrupt_table();
+    test_parallel_hash();
+    test_multi();
 
 #if 0
     perf_test_fc000000(10000000);
+    perf_test_stride(1);
+    perf_test_stride(512);
+    perf_test_weak_collisions(false);
+    perf_test_weak_collisions(true);
+    perf_test_uring(false);
+    perf_test_uring(true);
+    perf_test_source_in_place();
+    perf_test_add_target_blocks(20000000);
+    perf_test_table(20000000);
+    perf_test_build_hash(25000000);
+    perf_test_multi(8);
 #endif
 
     return 0;
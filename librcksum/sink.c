@@ -0,0 +1,200 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* The output sinks that we provide: the temporary file that is the default,
+ * and a caller's memory buffer. */
+
+#define _GNU_SOURCE
+#include "zsglobal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "rcksum.h"
+
+/* punch_hole(fd, offset, len)
+ * Make the given range of the file read as zeros, freeing the space that it
+ * took up. Returns 0, or -1 if the filesystem can't. */
+static int punch_hole(int fd, off_t offset, size_t len) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+    return -1;
+#endif
+}
+
+/* The temporary file sink, with z->fd and (if enabled) z->uring */
+
+/* preallocate(self)
+ * Reserve space in the temporary file for the target, bar its zero blocks, so
+ * that the filesystem can lay it out in large extents, however scattered the
+ * order that we write it in. Just a hint: if it fails, we carry on. */
+static void preallocate(struct rcksum_state *z) {
+    off_t start = 0;
+    int i;
+
+    z->preallocated = true;
+#ifdef FALLOC_FL_KEEP_SIZE
+    for (i = 0; i <= z->numzeros; i++) {
+        off_t end = i < z->numzeros ? block_offset(z, z->zeros[2 * i]) : z->filelen;
+        if (end > z->filelen)
+            end = z->filelen;
+        if (end > start && fallocate(z->fd, 0, start, end - start) != 0)
+            return;
+        if (i < z->numzeros)
+            start = block_offset(z, z->zeros[2 * i + 1] + 1);
+    }
+#else
+    (void)start;
+    (void)i;
+#endif
+}
+
+static ssize_t file_write(void *ctx, const void *buf, size_t len, off_t offset) {
+    struct rcksum_state *z = ctx;
+    if (!z->preallocated)
+        preallocate(z);
+    if (z->uring)
+        return uring_write(z->uring, buf, len, offset) == 0 ? (ssize_t)len : -1;
+    return pwrite(z->fd, buf, len, offset);
+}
+
+static ssize_t file_read(void *ctx, void *buf, size_t len, off_t offset) {
+    const struct rcksum_state *z = ctx;
+    return pread(z->fd, buf, len, offset);
+}
+
+static int file_truncate(void *ctx, off_t len) {
+    const struct rcksum_state *z = ctx;
+    return ftruncate(z->fd, len);
+}
+
+static int file_sync(void *ctx) {
+    struct rcksum_state *z = ctx;
+    return z->uring ? uring_flush(z->uring) : 0;
+}
+
+static int file_clone_range(void *ctx, int srcfd, off_t src, off_t dst, size_t len) {
+    struct rcksum_state *z = ctx;
+    return copy_file_data(srcfd, z->fd, &z->copy, src, dst, len);
+}
+
+static int file_zero(void *ctx, off_t offset, size_t len) {
+    struct rcksum_state *z = ctx;
+    if (z->uring && uring_flush(z->uring) != 0)
+        return -1;
+    return punch_hole(z->fd, offset, len);
+}
+
+/* file_sink(self)
+ * Returns the sink that writes to our temporary file */
+struct rcksum_sink file_sink(struct rcksum_state *z) {
+    struct rcksum_sink s = {z, file_write, file_read, file_clone_range, file_truncate, file_sync, file_zero};
+    return s;
+}
+
+/* A caller's file */
+
+static ssize_t fd_write(void *ctx, const void *buf, size_t len, off_t offset) {
+    const struct rcksum_fd_sink *s = ctx;
+    return pwrite(s->fd, buf, len, offset);
+}
+
+static ssize_t fd_read(void *ctx, void *buf, size_t len, off_t offset) {
+    const struct rcksum_fd_sink *s = ctx;
+    return pread(s->fd, buf, len, offset);
+}
+
+static int fd_truncate(void *ctx, off_t len) {
+    const struct rcksum_fd_sink *s = ctx;
+    return ftruncate(s->fd, len);
+}
+
+static int fd_clone_range(void *ctx, int srcfd, off_t src, off_t dst, size_t len) {
+    struct rcksum_fd_sink *s = ctx;
+    return copy_file_data(srcfd, s->fd, &s->copy, src, dst, len);
+}
+
+static int fd_zero(void *ctx, off_t offset, size_t len) {
+    const struct rcksum_fd_sink *s = ctx;
+    return punch_hole(s->fd, offset, len);
+}
+
+/* rcksum_fd_sink_init(self, fd)
+ * Set up a sink that writes the target to the file open on fd, which the
+ * caller keeps and closes. */
+void rcksum_fd_sink_init(struct rcksum_fd_sink *s, int fd) {
+    struct rcksum_sink k = {s, fd_write, fd_read, fd_clone_range, fd_truncate, NULL, fd_zero};
+    s->sink = k;
+    s->fd = fd;
+    s->copy.no_clone = s->copy.no_copy_file_range = false;
+}
+
+/* The memory sink */
+
+static ssize_t memory_write(void *ctx, const void *buf, size_t len, off_t offset) {
+    struct rcksum_memory_sink *m = ctx;
+
+    /* Past the end can only be the padding of the last block; drop it */
+    if (offset < (off_t)m->size)
+        memcpy(m->buf + offset, buf, m->size - offset < len ? m->size - offset : len);
+    if (offset + (off_t)len > m->len)
+        m->len = offset + len < m->size ? offset + len : m->size;
+    return len;
+}
+
+static ssize_t memory_read(void *ctx, void *buf, size_t len, off_t offset) {
+    const struct rcksum_memory_sink *m = ctx;
+
+    if (offset >= m->len)
+        return 0;
+    if ((off_t)len > m->len - offset)
+        len = m->len - offset;
+    memcpy(buf, m->buf + offset, len);
+    return len;
+}
+
+static int memory_truncate(void *ctx, off_t len) {
+    struct rcksum_memory_sink *m = ctx;
+
+    if (len > (off_t)m->size) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (len > m->len) /* Like a file, the extension reads as zeros */
+        memset(m->buf + m->len, 0, len - m->len);
+    m->len = len;
+    return 0;
+}
+
+/* rcksum_memory_sink_init(self, buf, size)
+ * Set up a sink that builds the target in the caller's buffer, which must be
+ * at least the length of the target. Pass &self->sink to rcksum_init; the
+ * target is then in buf, and its length in self->len. */
+void rcksum_memory_sink_init(struct rcksum_memory_sink *m, void *buf, size_t size) {
+    struct rcksum_sink s = {m, memory_write, memory_read, NULL, memory_truncate, NULL, NULL};
+    m->sink = s;
+    m->buf = buf;
+    m->size = size;
+    m->len = 0;
+}
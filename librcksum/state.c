@@ -21,19 +21,24 @@
 
 #include "zsglobal.h"
 
+#include <errno.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "internal.h"
+#include "md4.h"
 #include "rcksum.h"
 
-/* rcksum_init(num_blocks, block_size, rsum_bytes, checksum_bytes, require_consecutive_matches)
+/* rcksum_init(num_blocks, block_size, rsum_bytes, checksum_bytes, crc32c_bytes, require_consecutive_matches,
+ *             no_output, sink, filelen)
  * Creates and returns an rcksum_state with the given properties
  */
 struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_bytes, unsigned int checksum_bytes,
-                                 int require_consecutive_matches, bool no_output, off_t filelen) {
+                                 unsigned int crc32c_bytes, int require_consecutive_matches, bool no_output,
+                                 const struct rcksum_sink *sink, off_t filelen) {
     /* Allocate memory for the object */
     struct rcksum_state *z = malloc(sizeof(struct rcksum_state));
     if (z == NULL)
@@ -45,22 +50,36 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_
     z->rsum_a_mask = rsum_bytes < 3 ? 0 : rsum_bytes == 3 ? 0xff : 0xffff;
     z->rsum_bits = rsum_bytes * 8;
     z->checksum_bytes = checksum_bytes;
+    z->crc32c_mask = crc32c_bytes ? 0xffffffffu << (8 * (CRC32C_SIZE - crc32c_bytes)) : 0;
     z->seq_matches = require_consecutive_matches;
+    z->stride = 1;
+    z->copy_plan = false;
+    z->source_in_place = false;
     z->filelen = filelen;
+    z->chunk_offsets = NULL;
 
     /* require_consecutive_matches is 1 if true; and if true we need 1 block of
      * context to do block matching */
     z->context = blocksize * require_consecutive_matches;
 
     /* Temporary file to hold the target file as we get blocks for it */
-    z->filename = no_output ? NULL : strdup("rcksum-XXXXXX");
+    z->filename = no_output || sink ? NULL : strdup("rcksum-XXXXXX");
     z->fd = -1;
+    z->uring = NULL;
+    z->copy.no_clone = z->copy.no_copy_file_range = false;
+    z->preallocated = false;
+    if (sink)
+        z->sink = *sink;
+    else
+        memset(&z->sink, 0, sizeof z->sink);
 
     /* Initialise to 0 various state & stats */
     z->gotblocks = 0;
     memset(&(z->stats), 0, sizeof(z->stats));
     z->ranges = NULL;
     z->numranges = 0;
+    z->zeros = NULL;
+    z->numzeros = 0;
 
     z->reusable_ranges = NULL;
     z->num_reusable_ranges = 0;
@@ -80,6 +99,7 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_
             free(z);
             return NULL;
         }
+        z->sink = file_sink(z);
     }
 
     if (!(z->blocksize & (z->blocksize - 1)) && z->blocks) {
@@ -93,7 +113,9 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_
                 }
         }
 
-        z->blockhashes = malloc(sizeof(z->blockhashes[0]) * (z->blocks + z->seq_matches));
+        /* seq_matches - 1 spare entries after the last block, so that we
+         * can look at the following blocks' checksums of any block */
+        z->blockhashes = calloc(z->blocks + z->seq_matches, sizeof(z->blockhashes[0]));
         if (z->blockhashes != NULL)
             return z;
 
@@ -106,6 +128,24 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_
     return NULL;
 }
 
+/* rcksum_target_id(self, id)
+ * Checksum of all the block checksums (and offsets) of the target, which
+ * tells one target from another, e.g. to check that saved state is for ours */
+void rcksum_target_id(const struct rcksum_state *z, unsigned char id[CHECKSUM_SIZE]) {
+    MD4_CTX ctx;
+    uint64_t n[2] = {z->blocks, z->blocksize};
+    zs_blockid b;
+
+    MD4Init(&ctx);
+    MD4Update(&ctx, (const uint8_t *)n, sizeof n);
+    for (b = 0; b < z->blocks; b++) {
+        uint64_t offset = block_offset(z, b);
+        MD4Update(&ctx, z->blockhashes[b].checksum, z->checksum_bytes);
+        MD4Update(&ctx, (const uint8_t *)&offset, sizeof offset);
+    }
+    MD4Final(id, &ctx);
+}
+
 /* rcksum_filename(self)
  * Returns temporary filename to caller as malloced string.
  * Ownership of the file passes to the caller - the function returns NULL if
@@ -122,13 +162,82 @@ char *rcksum_filename(struct rcksum_state *rs) {
  * called again, and it is up to the caller to close it. */
 int rcksum_filehandle(struct rcksum_state *rs) {
     int h = rs->fd;
+    if (rs->uring) {
+        uring_close(rs->uring);
+        rs->uring = NULL;
+    }
+    if (h != -1)
+        memset(&rs->sink, 0, sizeof rs->sink);
     rs->fd = -1;
     return h;
 }
 
+/* rcksum_set_sink(self, sink)
+ * Write the output to the given sink from now on. Any temporary file is
+ * deleted, so do this before anything has been written. */
+void rcksum_set_sink(struct rcksum_state *rs, const struct rcksum_sink *sink) {
+    if (rs->uring) {
+        uring_close(rs->uring);
+        rs->uring = NULL;
+    }
+    if (rs->fd != -1) {
+        close(rs->fd);
+        rs->fd = -1;
+    }
+    if (rs->filename) {
+        unlink(rs->filename);
+        free(rs->filename);
+        rs->filename = NULL;
+    }
+    rs->sink = *sink;
+}
+
+/* rcksum_use_io_uring(self)
+ * Write the output through io_uring from now on: writes are queued and
+ * submitted in batches, so we don't wait for each. Returns 0, or -1 if
+ * io_uring isn't available (and we carry on with pwrite). */
+int rcksum_use_io_uring(struct rcksum_state *rs) {
+    if (rs->fd == -1)
+        return -1;
+    if (!rs->uring)
+        rs->uring = uring_open(rs->fd);
+    return rs->uring ? 0 : -1;
+}
+
+/* rcksum_flush(self)
+ * Wait for any queued writes to the output to be done. */
+void rcksum_flush(struct rcksum_state *rs) {
+    if (rs->sink.sync && rs->sink.sync(rs->sink.ctx) != 0) {
+        fprintf(stderr, "IO error: %s\n", strerror(errno));
+        exit(-1);
+    }
+}
+
+/* rcksum_read_target(self, buf, len, offset)
+ * Reads back data that we have written to the target so far, e.g. to verify
+ * it. As pread(2); returns -1 if there is no output file. Safe to call from
+ * several threads at once. Do rcksum_flush first if using io_uring. */
+ssize_t rcksum_read_target(const struct rcksum_state *rs, void *buf, size_t len, off_t offset) {
+    if (!rs->sink.read)
+        return -1;
+    return rs->sink.read(rs->sink.ctx, buf, len, offset);
+}
+
+/* rcksum_truncate_target(self, len)
+ * Set the length of the target in our output (it may have padding from the
+ * last block after the end). Returns 0, or -1 on error. */
+int rcksum_truncate_target(struct rcksum_state *rs, off_t len) {
+    if (!rs->sink.truncate)
+        return -1;
+    rcksum_flush(rs);
+    return rs->sink.truncate(rs->sink.ctx, len);
+}
+
 /* rcksum_end - destructor */
 void rcksum_end(struct rcksum_state *z) {
     /* Free temporary file resources */
+    if (z->uring)
+        uring_close(z->uring);
     if (z->fd != -1)
         close(z->fd);
     if (z->filename) {
@@ -141,10 +250,15 @@ void rcksum_end(struct rcksum_state *z) {
     free(z->blockhashes);
     free(z->bithash);
     free(z->ranges); // Should be NULL already
+    free(z->zeros);
     free(z->reusable_ranges);
+    free(z->chunk_offsets);
 #ifdef DEBUG
     fprintf(stderr, "hashhit %lld, weakhit %d, checksummed %d, stronghit %d\n", z->stats.hashhit, z->stats.weakhit,
             z->stats.checksummed, z->stats.stronghit);
+    if (z->crc32c_mask)
+        fprintf(stderr, "crc32c checked %d, rejected %d (%.1f%% of weak hits)\n", z->stats.crcchecked,
+                z->stats.crcrejected, z->stats.weakhit ? 100.0 * z->stats.crcrejected / z->stats.weakhit : 0.0);
 #endif
     free(z);
 }
@@ -0,0 +1,455 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* The block checksums as a binary table, laid out as we hold them rather
+ * than packed big-endian as in a 0.6.2 .zsync: so loading them is straight
+ * copies, with no decoding, and from the file's pages where we can map it.
+ * It can also carry the hash tables that build_hash would make, so that we
+ * can start scanning without hashing every block first.
+ *
+ * Zero bytes up to a multiple of 64 bytes into the file, then:
+ *   8 bytes  magic
+ *   4 bytes  byte order mark, TABLE_BYTE_ORDER as the writer had it
+ *   4 bytes  checksum bytes per block
+ *   8 bytes  number of blocks
+ *   8 bytes  offset of the rsums: a struct rsum per block
+ *   8 bytes  offset of the checksums: checksum bytes per block
+ *   8 bytes  offset of the hash tables, or 0 if there are none
+ *   8 bytes  length of the hash tables
+ *   8 bytes  length of the whole table
+ * with the offsets from the start of the magic, each a multiple of 8. The
+ * hash tables are:
+ *   4 bytes each  hash bits, bithash bits, hash_func_shift, and 0
+ *   4 bytes each  for each block, 1 + the next block in its chain, or 0
+ *   4 bytes each  for each hash bucket, 1 + the first block in its chain, or 0
+ *   then the bithash.
+ * All in the writer's byte order. Where that isn't ours, we swap the rsums
+ * and leave the hash tables for build_hash. */
+
+#include "zsglobal.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "rcksum.h"
+
+static const char table_magic[8] = "zsTable2";
+
+#define TABLE_BYTE_ORDER 0x01020304
+#define TABLE_HEADER 64
+#define TABLE_ALIGN 64
+
+/* Entries to convert at a time, when going through a buffer */
+#define TABLE_SLAB 65536
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+struct table_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t checksum_bytes;
+    uint64_t blocks;
+    uint64_t rsum_offset;
+    uint64_t checksum_offset;
+    uint64_t index_offset;
+    uint64_t index_len;
+    uint64_t len;
+};
+
+/* table_layout(self, index, &header)
+ * Where everything goes in the table for these checksums */
+static void table_layout(const struct rcksum_state *z, int index, struct table_header *h) {
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, table_magic, sizeof table_magic);
+    h->byte_order = TABLE_BYTE_ORDER;
+    h->checksum_bytes = z->checksum_bytes;
+    h->blocks = z->blocks;
+    h->rsum_offset = TABLE_HEADER;
+    h->checksum_offset = ALIGN8(h->rsum_offset + h->blocks * sizeof(struct rsum));
+    h->len = h->checksum_offset + h->blocks * h->checksum_bytes;
+    if (index) {
+        h->index_offset = ALIGN8(h->len);
+        h->index_len = 4 * sizeof(uint32_t) + ((uint64_t)z->hashmask + 1 + h->blocks) * sizeof(uint32_t) +
+                       (z->bithashmask >> 3) + 1;
+        h->len = h->index_offset + h->index_len;
+    }
+}
+
+/* write_zeros(f, n) */
+static int write_zeros(FILE *f, size_t n) {
+    static const char zeros[TABLE_ALIGN];
+    return fwrite(zeros, 1, n, f) == n ? 0 : -1;
+}
+
+/* write_ids(f, ptrs, stride, n, blockhashes)
+ * Write 1 + the block id of each of n hash_entry pointers, which are stride
+ * bytes apart from ptrs; or 0 for NULL */
+static int write_ids(FILE *f, const unsigned char *ptrs, size_t stride, uint64_t n,
+                     const struct hash_entry *blockhashes) {
+    uint32_t *buf = malloc(TABLE_SLAB * sizeof *buf);
+    uint64_t i = 0;
+    int rc = 0;
+
+    if (!buf)
+        return -1;
+    while (rc == 0 && i < n) {
+        size_t j, m = n - i < TABLE_SLAB ? n - i : TABLE_SLAB;
+
+        for (j = 0; j < m; j++, i++) {
+            const struct hash_entry *e;
+            memcpy(&e, ptrs + i * stride, sizeof e);
+            buf[j] = e ? (uint32_t)(e - blockhashes) + 1 : 0;
+        }
+        if (fwrite(buf, sizeof *buf, m, f) != m)
+            rc = -1;
+    }
+    free(buf);
+    return rc;
+}
+
+/* rcksum_write_table(self, FILE*, index)
+ * Write the block checksums to f as a binary table, with the hash tables if
+ * index (so after rcksum_find_zero_blocks, as the hash tables leave out the
+ * blocks that we have already). f must be a file, as the table is aligned to
+ * where it is in the file. Returns 0, or -1 on error. */
+int rcksum_write_table(struct rcksum_state *z, FILE *f, int index) {
+    struct table_header h;
+    long pos = ftell(f);
+    zs_blockid id;
+
+    if (pos < 0) {
+        perror("ftell");
+        return -1;
+    }
+    if (index && !z->rsum_hash)
+        if (!build_hash(z))
+            return -1;
+    table_layout(z, index, &h);
+
+    if (write_zeros(f, (TABLE_ALIGN - pos % TABLE_ALIGN) % TABLE_ALIGN) != 0 || fwrite(&h, sizeof h, 1, f) != 1)
+        return -1;
+
+    for (id = 0; id < z->blocks; id++)
+        if (fwrite(&z->blockhashes[id].r, sizeof(struct rsum), 1, f) != 1)
+            return -1;
+    if (write_zeros(f, h.checksum_offset - h.rsum_offset - h.blocks * sizeof(struct rsum)) != 0)
+        return -1;
+    for (id = 0; id < z->blocks; id++)
+        if (fwrite(z->blockhashes[id].checksum, z->checksum_bytes, 1, f) != 1)
+            return -1;
+
+    if (index) {
+        uint32_t params[4];
+        int hash_bits, bithash_bits;
+        unsigned short shift;
+
+        hash_sizes(z, &hash_bits, &bithash_bits, &shift);
+        params[0] = hash_bits;
+        params[1] = bithash_bits;
+        params[2] = z->hash_func_shift;
+        params[3] = 0;
+        if (write_zeros(f, h.index_offset - h.checksum_offset - h.blocks * h.checksum_bytes) != 0 ||
+            fwrite(params, sizeof params, 1, f) != 1 ||
+            write_ids(f, (const unsigned char *)&z->blockhashes[0].next, sizeof *z->blockhashes, h.blocks,
+                      z->blockhashes) != 0 ||
+            write_ids(f, (const unsigned char *)z->rsum_hash, sizeof *z->rsum_hash, (uint64_t)z->hashmask + 1,
+                      z->blockhashes) != 0 ||
+            fwrite(z->bithash, (z->bithashmask >> 3) + 1, 1, f) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Reading the table, from a mapping of the file where we can, or else
+ * through a buffer, in which case the caller must ask for the bytes in order */
+struct table_reader {
+    FILE *f;
+    const unsigned char *map; /* The file, if mapped */
+    size_t map_len;
+    long start;   /* Where the table is in the file */
+    uint64_t pos; /* And where we are in the table, if not mapped */
+    unsigned char *buf;
+    size_t buf_len;
+};
+
+/* in_table(offset, len, size)
+ * Whether the len bytes at offset are within size bytes; checked without
+ * adding them up, as they come from the file and the sum could wrap */
+static inline bool in_table(uint64_t offset, uint64_t len, uint64_t size) {
+    return offset <= size && len <= size - offset;
+}
+
+/* table_get(reader, offset, len)
+ * Returns the len bytes at offset in the table, or NULL if the file ends
+ * first (or, if not mapped, they are before where the last call left off) */
+static const unsigned char *table_get(struct table_reader *t, uint64_t offset, size_t len) {
+    if (t->map)
+        return in_table(offset, len, t->map_len - t->start) ? t->map + t->start + offset : NULL;
+
+    if (offset < t->pos)
+        return NULL;
+    for (; t->pos < offset; t->pos++)
+        if (getc(t->f) == EOF)
+            return NULL;
+    if (len > t->buf_len) {
+        unsigned char *b = realloc(t->buf, len);
+        if (!b)
+            return NULL;
+        t->buf = b;
+        t->buf_len = len;
+    }
+    if (fread(t->buf, 1, len, t->f) != len)
+        return NULL;
+    t->pos += len;
+    return t->buf;
+}
+
+/* load_blocks(self, first, n, rsums, checksums, checksum_bytes, next, swap)
+ * Fill in n blocks from first from the rsums and the checksums, and link
+ * their hash chains from next, from the table; skipping any that are NULL.
+ * Each chain must only go forward, so that none is circular; returns -1 if
+ * one doesn't (but fills in the rest anyway), else 0. */
+static int load_blocks(struct rcksum_state *z, zs_blockid first, zs_blockid n, const unsigned char *rsums,
+                       const unsigned char *checksums, const unsigned char *next, bool swap) {
+    struct hash_entry *e = &z->blockhashes[first];
+    zs_blockid i;
+    int rc = 0;
+
+    for (i = 0; i < n; i++, e++) {
+        if (rsums) {
+            struct rsum r;
+            memcpy(&r, rsums + i * sizeof r, sizeof r);
+            if (swap) {
+                r.a = __builtin_bswap16(r.a);
+                r.b = __builtin_bswap16(r.b);
+            }
+            e->r.a = r.a & z->rsum_a_mask;
+            e->r.b = r.b;
+        }
+        if (checksums)
+            memcpy(e->checksum, checksums + (size_t)i * z->checksum_bytes, z->checksum_bytes);
+        if (next) {
+            uint32_t v;
+            memcpy(&v, next + i * sizeof v, sizeof v);
+            if (v > (uint32_t)z->blocks || (v && v <= (uint32_t)(first + i) + 1)) {
+                next = NULL;
+                rc = -1;
+            } else {
+                e->next = v ? &z->blockhashes[v - 1] : NULL;
+            }
+        }
+    }
+    return rc;
+}
+
+/* index_usable(self, reader, header)
+ * Whether the hash tables in the table are for the same hash as build_hash
+ * would make here; 0 if so, else -1 */
+static int index_usable(const struct rcksum_state *z, struct table_reader *t, const struct table_header *h) {
+    uint32_t params[4];
+    int hash_bits, bithash_bits;
+    unsigned short shift;
+    const unsigned char *p;
+
+    hash_sizes(z, &hash_bits, &bithash_bits, &shift);
+    if (!(p = table_get(t, h->index_offset, sizeof params)))
+        return -1;
+    memcpy(params, p, sizeof params);
+    if (params[0] != (uint32_t)hash_bits || params[1] != (uint32_t)bithash_bits || params[2] != shift ||
+        h->index_len != sizeof params + ((1ULL << hash_bits) + h->blocks) * sizeof(uint32_t) +
+                            ((1ULL << bithash_bits) - 1) / 8 + 1)
+        return -1;
+    return 0;
+}
+
+/* load_index(self, reader, header)
+ * Set up the rest of the hash tables, as build_hash would have them, once the
+ * chains are linked. Returns 0, or -1 if they are bad. */
+static int load_index(struct rcksum_state *z, struct table_reader *t, const struct table_header *h) {
+    int hash_bits, bithash_bits;
+    unsigned short shift;
+    uint64_t offset = h->index_offset + (4 + h->blocks) * sizeof(uint32_t);
+    size_t i, bithash_len;
+    const unsigned char *p;
+
+    hash_sizes(z, &hash_bits, &bithash_bits, &shift);
+    set_hash_func_shift(z, shift);
+    z->hashmask = (1U << hash_bits) - 1;
+    z->bithashmask = (1U << bithash_bits) - 1;
+    bithash_len = (z->bithashmask >> 3) + 1;
+    z->rsum_hash = calloc(z->hashmask + 1, sizeof *z->rsum_hash);
+    z->bithash = calloc(z->bithashmask + 1, 1);
+    if (!z->rsum_hash || !z->bithash)
+        return -1;
+
+    for (i = 0; i <= z->hashmask;) {
+        size_t j, n = z->hashmask + 1 - i < TABLE_SLAB ? z->hashmask + 1 - i : TABLE_SLAB;
+
+        if (!(p = table_get(t, offset + i * sizeof(uint32_t), n * sizeof(uint32_t))))
+            return -1;
+        for (j = 0; j < n; j++, i++) {
+            uint32_t v;
+            memcpy(&v, p + j * sizeof v, sizeof v);
+            if (v > (uint32_t)z->blocks)
+                return -1;
+            z->rsum_hash[i] = v ? &z->blockhashes[v - 1] : NULL;
+        }
+    }
+
+    if (!(p = table_get(t, h->index_offset + h->index_len - bithash_len, bithash_len)))
+        return -1;
+    memcpy(z->bithash, p, bithash_len);
+    return 0;
+}
+
+/* read_table(self, reader)
+ * The body of rcksum_read_table, once the reader is set up */
+static int read_table(struct rcksum_state *z, struct table_reader *t) {
+    struct table_header h;
+    const unsigned char *p;
+    bool swap, index;
+    zs_blockid id;
+    uint64_t next_offset, rsums_len, checksums_len;
+
+    if (!(p = table_get(t, 0, sizeof h)))
+        return -1;
+    memcpy(&h, p, sizeof h);
+    if (memcmp(h.magic, table_magic, sizeof table_magic))
+        return -1;
+    swap = h.byte_order != TABLE_BYTE_ORDER;
+    if (swap) {
+        if (h.byte_order != __builtin_bswap32(TABLE_BYTE_ORDER))
+            return -1;
+        h.checksum_bytes = __builtin_bswap32(h.checksum_bytes);
+        h.blocks = __builtin_bswap64(h.blocks);
+        h.rsum_offset = __builtin_bswap64(h.rsum_offset);
+        h.checksum_offset = __builtin_bswap64(h.checksum_offset);
+        h.index_offset = 0; /* Only usable in the writer's byte order */
+        h.len = __builtin_bswap64(h.len);
+    }
+
+    /* Each section must be after the last and within the table, and the table
+     * within the file; each field bounded on its own before any sums */
+    if (h.checksum_bytes != z->checksum_bytes || h.blocks != (uint64_t)z->blocks ||
+        __builtin_mul_overflow(h.blocks, sizeof(struct rsum), &rsums_len) ||
+        __builtin_mul_overflow(h.blocks, h.checksum_bytes, &checksums_len) || h.rsum_offset < sizeof h ||
+        !in_table(h.rsum_offset, rsums_len, h.len) || !in_table(h.checksum_offset, checksums_len, h.len) ||
+        h.checksum_offset < h.rsum_offset + rsums_len ||
+        (h.index_offset &&
+         (!in_table(h.index_offset, h.index_len, h.len) || h.index_offset < h.checksum_offset + checksums_len ||
+          h.index_len < 4 * sizeof(uint32_t))) ||
+        (t->map && h.len > t->map_len - t->start))
+        return -1;
+    next_offset = h.index_offset + 4 * sizeof(uint32_t);
+
+    /* New checksums invalidate any existing checksum hash tables */
+    free(z->rsum_hash);
+    z->rsum_hash = NULL;
+    free(z->bithash);
+    z->bithash = NULL;
+
+    if (t->map) {
+        /* All in one pass over the blocks */
+        const unsigned char *rsums = table_get(t, h.rsum_offset, rsums_len);
+        const unsigned char *checksums = table_get(t, h.checksum_offset, checksums_len);
+        const unsigned char *next = NULL;
+
+        if (!rsums || !checksums)
+            return -1;
+        index = h.index_offset && index_usable(z, t, &h) == 0;
+        if (index)
+            next = table_get(t, next_offset, h.blocks * sizeof(uint32_t));
+        index = load_blocks(z, 0, z->blocks, rsums, checksums, next, swap) == 0 && next;
+    } else {
+        /* Each section in turn, a slab at a time */
+        for (id = 0; id < z->blocks; id += TABLE_SLAB) {
+            zs_blockid n = z->blocks - id < TABLE_SLAB ? z->blocks - id : TABLE_SLAB;
+            if (!(p = table_get(t, h.rsum_offset + id * sizeof(struct rsum), n * sizeof(struct rsum))))
+                return -1;
+            load_blocks(z, id, n, p, NULL, NULL, swap);
+        }
+        for (id = 0; id < z->blocks; id += TABLE_SLAB) {
+            zs_blockid n = z->blocks - id < TABLE_SLAB ? z->blocks - id : TABLE_SLAB;
+            if (!(p = table_get(t, h.checksum_offset + (uint64_t)id * h.checksum_bytes, n * h.checksum_bytes)))
+                return -1;
+            load_blocks(z, id, n, NULL, p, NULL, swap);
+        }
+        index = h.index_offset && index_usable(z, t, &h) == 0;
+        for (id = 0; index && id < z->blocks; id += TABLE_SLAB) {
+            zs_blockid n = z->blocks - id < TABLE_SLAB ? z->blocks - id : TABLE_SLAB;
+            p = table_get(t, next_offset + id * sizeof(uint32_t), n * sizeof(uint32_t));
+            index = p && load_blocks(z, id, n, NULL, NULL, p, swap) == 0;
+        }
+    }
+
+    /* The hash tables leave out blocks of zeros, so find those first */
+    if (rcksum_find_zero_blocks(z) < 0)
+        return -1;
+    if (index && load_index(z, t, &h) != 0) {
+        free(z->rsum_hash);
+        z->rsum_hash = NULL;
+        free(z->bithash);
+        z->bithash = NULL;
+    }
+
+    /* And leave the file after the table */
+    if (t->map)
+        return fseek(t->f, t->start + h.len, SEEK_SET);
+    if (h.len > t->pos && !table_get(t, h.len, 0))
+        return -1;
+    return 0;
+}
+
+/* rcksum_read_table(self, FILE*)
+ * Set the checksums of all the blocks from the table that rcksum_write_table
+ * wrote, which f is reading from (at the zeros before it); and find the zero
+ * blocks, as rcksum_find_zero_blocks. With the hash tables too, if it has
+ * them and they are for the same settings as ours. Returns 0, or -1 if the
+ * table is bad or for other checksums. */
+int rcksum_read_table(struct rcksum_state *z, FILE *f) {
+    struct table_reader t = {.f = f};
+    struct stat st;
+    int c, n, rc;
+
+    for (n = 0; (c = getc(f)) == 0 && n < TABLE_ALIGN; n++)
+        ;
+    if (c == EOF || ungetc(c, f) == EOF)
+        return -1;
+
+    /* Map it where we can; so it is read straight from the page cache */
+    t.start = ftell(f);
+    if (t.start >= 0 && t.start % 8 == 0 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > t.start) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+            t.map = map;
+            t.map_len = st.st_size;
+        }
+    }
+
+    rc = read_table(z, &t);
+    if (t.map)
+        munmap((void *)t.map, t.map_len);
+    free(t.buf);
+    return rc;
+}
@@ -0,0 +1,302 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Writing the output through io_uring: each write is copied into one of a set
+ * of buffers registered with the kernel and queued, and the queue is
+ * submitted in batches, so the caller only waits for the disk when all the
+ * buffers are in flight. Talks to the kernel directly, so needs no liburing.
+ */
+
+#define _GNU_SOURCE
+#include "zsglobal.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#define URING_SLOTS 64
+#define URING_SLOT_SIZE (128 * 1024)
+#define URING_BATCH 16 /* Queued writes to collect before submitting them */
+
+struct uring_writer {
+    int ringfd, fd;
+    bool fixed; /* Whether the buffers are registered */
+
+    /* The rings, shared with the kernel */
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    struct io_uring_cqe *cqes;
+
+    /* The buffers; what is in each, and which are free */
+    unsigned char *bufs;
+    struct {
+        off_t offset;
+        size_t len;
+    } slot[URING_SLOTS];
+    int free_slots[URING_SLOTS];
+    int nfree;
+    unsigned queued; /* Queued but not yet submitted */
+    int err;         /* First error from a completed write */
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nargs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/* uring_open(fd)
+ * Returns a writer for the given file, or NULL if io_uring is not available,
+ * in which case the caller should just pwrite. */
+struct uring_writer *uring_open(int fd) {
+    struct io_uring_params p;
+    struct uring_writer *w = calloc(1, sizeof *w);
+    int i;
+
+    if (!w)
+        return NULL;
+    memset(&p, 0, sizeof p);
+    w->fd = fd;
+    w->ringfd = sys_io_uring_setup(URING_SLOTS, &p);
+    if (w->ringfd < 0) {
+        free(w);
+        return NULL;
+    }
+
+    /* Map the rings */
+    w->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    w->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        w->sq_len = w->cq_len = w->sq_len > w->cq_len ? w->sq_len : w->cq_len;
+    w->sq_ptr = mmap(NULL, w->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ringfd, IORING_OFF_SQ_RING);
+    w->cq_ptr = w->sq_ptr;
+    if (w->sq_ptr != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        w->cq_ptr =
+            mmap(NULL, w->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ringfd, IORING_OFF_CQ_RING);
+    w->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    w->sqes = mmap(NULL, w->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ringfd, IORING_OFF_SQES);
+    w->bufs = malloc(URING_SLOTS * URING_SLOT_SIZE);
+    if (w->sq_ptr == MAP_FAILED || w->cq_ptr == MAP_FAILED || w->sqes == MAP_FAILED || !w->bufs) {
+        if (w->sq_ptr != MAP_FAILED)
+            munmap(w->sq_ptr, w->sq_len);
+        if (w->cq_ptr != MAP_FAILED && w->cq_ptr != w->sq_ptr)
+            munmap(w->cq_ptr, w->cq_len);
+        if (w->sqes != MAP_FAILED)
+            munmap(w->sqes, w->sqes_len);
+        free(w->bufs);
+        close(w->ringfd);
+        free(w);
+        return NULL;
+    }
+    w->sq_head = (unsigned *)((char *)w->sq_ptr + p.sq_off.head);
+    w->sq_tail = (unsigned *)((char *)w->sq_ptr + p.sq_off.tail);
+    w->sq_mask = (unsigned *)((char *)w->sq_ptr + p.sq_off.ring_mask);
+    w->sq_array = (unsigned *)((char *)w->sq_ptr + p.sq_off.array);
+    w->cq_head = (unsigned *)((char *)w->cq_ptr + p.cq_off.head);
+    w->cq_tail = (unsigned *)((char *)w->cq_ptr + p.cq_off.tail);
+    w->cq_mask = (unsigned *)((char *)w->cq_ptr + p.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *)((char *)w->cq_ptr + p.cq_off.cqes);
+
+    /* Register the buffers, so the kernel needn't map them for every write.
+     * This can fail under a low RLIMIT_MEMLOCK; plain writes work anyway. */
+    {
+        struct iovec iov[URING_SLOTS];
+        for (i = 0; i < URING_SLOTS; i++) {
+            iov[i].iov_base = w->bufs + (size_t)i * URING_SLOT_SIZE;
+            iov[i].iov_len = URING_SLOT_SIZE;
+        }
+        w->fixed = sys_io_uring_register(w->ringfd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == 0;
+    }
+
+    for (i = 0; i < URING_SLOTS; i++)
+        w->free_slots[i] = i;
+    w->nfree = URING_SLOTS;
+    return w;
+}
+
+/* reap(self)
+ * Collect the completed writes, freeing their buffers. A short write (which
+ * a regular file should not do) is finished off synchronously. */
+static void reap(struct uring_writer *w) {
+    unsigned head = *w->cq_head;
+    unsigned tail = __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+        int s = (int)cqe->user_data;
+        size_t done = cqe->res < 0 ? 0 : (size_t)cqe->res;
+
+        if (cqe->res < 0 && !w->err)
+            w->err = -cqe->res;
+        while (!w->err && done < w->slot[s].len) {
+            ssize_t rc = pwrite(w->fd, w->bufs + (size_t)s * URING_SLOT_SIZE + done, w->slot[s].len - done,
+                                w->slot[s].offset + done);
+            if (rc <= 0)
+                w->err = rc < 0 ? errno : EIO;
+            else
+                done += rc;
+        }
+        w->free_slots[w->nfree++] = s;
+    }
+    __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* submit(self, wait_for)
+ * Submit what is queued, and wait for at least wait_for writes to complete. */
+static void submit(struct uring_writer *w, unsigned wait_for) {
+    while (w->queued || wait_for) {
+        int rc = sys_io_uring_enter(w->ringfd, w->queued, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (!w->err)
+                w->err = errno;
+            return;
+        }
+        w->queued -= (unsigned)rc < w->queued ? (unsigned)rc : w->queued;
+        wait_for = 0;
+    }
+}
+
+/* uring_write(self, data, len, offset)
+ * Queue a write of the given data; the data is copied, so the caller can
+ * reuse its buffer straight away. Returns 0, or -1 if an earlier write failed
+ * (with errno set). */
+int uring_write(struct uring_writer *w, const unsigned char *data, size_t len, off_t offset) {
+    while (len && !w->err) {
+        size_t l = len < URING_SLOT_SIZE ? len : URING_SLOT_SIZE;
+        unsigned tail = *w->sq_tail;
+        unsigned idx = tail & *w->sq_mask;
+        struct io_uring_sqe *sqe = &w->sqes[idx];
+        int s;
+
+        /* Need a free buffer: collect finished writes, waiting if need be.
+         * If still none, the rest is not written: that must be an error. */
+        reap(w);
+        if (!w->nfree) {
+            submit(w, 1);
+            reap(w);
+            if (!w->nfree && !w->err)
+                w->err = EAGAIN;
+            if (!w->nfree)
+                break;
+        }
+        s = w->free_slots[--w->nfree];
+        memcpy(w->bufs + (size_t)s * URING_SLOT_SIZE, data, l);
+        w->slot[s].offset = offset;
+        w->slot[s].len = l;
+
+        memset(sqe, 0, sizeof *sqe);
+        sqe->opcode = w->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = w->fd;
+        sqe->off = offset;
+        sqe->addr = (unsigned long)(w->bufs + (size_t)s * URING_SLOT_SIZE);
+        sqe->len = l;
+        sqe->buf_index = w->fixed ? s : 0;
+        sqe->user_data = s;
+        w->sq_array[idx] = idx;
+        __atomic_store_n(w->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if (++w->queued >= URING_BATCH)
+            submit(w, 0);
+        data += l;
+        len -= l;
+        offset += l;
+    }
+    if (w->err) {
+        errno = w->err;
+        return -1;
+    }
+    return 0;
+}
+
+/* uring_flush(self)
+ * Wait for all the queued writes to be done. Returns 0, or -1 if any failed
+ * (with errno set). */
+int uring_flush(struct uring_writer *w) {
+    while (w->nfree < URING_SLOTS && !w->err) {
+        submit(w, 1);
+        reap(w);
+    }
+    if (w->err) {
+        errno = w->err;
+        return -1;
+    }
+    return 0;
+}
+
+/* uring_close(self)
+ * Finish any writes and free the writer. */
+void uring_close(struct uring_writer *w) {
+    if (uring_flush(w) != 0)
+        perror("write");
+    munmap(w->sqes, w->sqes_len);
+    if (w->cq_ptr != w->sq_ptr)
+        munmap(w->cq_ptr, w->cq_len);
+    munmap(w->sq_ptr, w->sq_len);
+    close(w->ringfd);
+    free(w->bufs);
+    free(w);
+}
+
+#else /* No io_uring here */
+
+struct uring_writer *uring_open(int fd) {
+    (void)fd;
+    return NULL;
+}
+
+int uring_write(struct uring_writer *w, const unsigned char *data, size_t len, off_t offset) {
+    (void)w;
+    (void)data;
+    (void)len;
+    (void)offset;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_flush(struct uring_writer *w) {
+    (void)w;
+    return 0;
+}
+
+void uring_close(struct uring_writer *w) { (void)w; }
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Blocks of the target that are all zeros, as in sparse disk images. We know
+ * their content from the checksums alone, so there is no need to download
+ * them or look for them in the seed files; nor to write them, as a new file
+ * reads as zeros wherever nothing has been written (and takes no space there,
+ * if the filesystem supports sparse files). Only where the output already has
+ * other data do we have to zero them, by punching holes if we can. */
+
+#include "zsglobal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "internal.h"
+#include "rcksum.h"
+
+/* add_zero_block(self, blockid)
+ * Append the block to the ranges of zero blocks; they must be added in order.
+ * Returns 0, or -1 if out of memory. */
+static int add_zero_block(struct rcksum_state *z, zs_blockid id) {
+    zs_blockid *r;
+
+    if (z->numzeros && z->zeros[2 * z->numzeros - 1] == id - 1) {
+        z->zeros[2 * z->numzeros - 1] = id;
+        return 0;
+    }
+    r = realloc(z->zeros, (z->numzeros + 1) * 2 * sizeof *r);
+    if (!r)
+        return -1;
+    z->zeros = r;
+    z->zeros[2 * z->numzeros] = z->zeros[2 * z->numzeros + 1] = id;
+    z->numzeros++;
+    return 0;
+}
+
+/* rcksum_find_zero_blocks(self)
+ * Find the blocks of the target whose checksums are those of a block of
+ * zeros, and mark them as known. Call this after adding all the target
+ * blocks, before any data. Unless the output is our own new temporary file,
+ * the zeros are written to it now. Returns the number of blocks found, or -1
+ * on error. */
+int rcksum_find_zero_blocks(struct rcksum_state *z) {
+    unsigned char *zeros = calloc(1, z->blocksize);
+    unsigned char checksum[CHECKSUM_SIZE];
+    uint32_t crc = 0;
+    size_t zerolen = 0, runlen = z->blocksize;
+    zs_blockid id;
+    int found = 0;
+
+    if (!zeros)
+        return -1;
+
+    /* In chunk mode, a run of zeros is cut into chunks of the same length
+     * (bar the last chunk of the file), so we need only look at those */
+    if (z->chunk_offsets)
+        runlen = rcksum_cdc_boundary(zeros, z->blocksize, z->chunk_min, z->chunk_avg, z->chunk_max);
+
+    for (id = 0; id < z->blocks; id++) {
+        const struct hash_entry *e = &z->blockhashes[id];
+        size_t len = z->chunk_offsets ? (size_t)(block_offset(z, id + 1) - block_offset(z, id)) : z->blocksize;
+
+        if (z->chunk_offsets ? (len != runlen && id != z->blocks - 1) : (e->r.a || e->r.b))
+            continue;
+
+        /* Checksums of a block of zeros of this length */
+        if (len != zerolen) {
+            rcksum_calc_checksum(checksum, zeros, len);
+            crc = rcksum_calc_crc32c(zeros, len) & z->crc32c_mask;
+            zerolen = len;
+        }
+        if (memcmp(e->checksum, checksum, z->checksum_bytes) || e->crc32c != crc)
+            continue;
+
+        if (add_zero_block(z, id) != 0) {
+            free(zeros);
+            return -1;
+        }
+        if (z->rsum_hash)
+            remove_block_from_hash(z, id);
+        add_to_ranges(z, id);
+        found++;
+    }
+    free(zeros);
+
+    if (found && z->fd == -1 && rcksum_write_zero_blocks(z) != 0)
+        return -1;
+    return found;
+}
+
+/* rcksum_write_zero_blocks(self)
+ * Make the zero blocks read as zeros in our output, where something else
+ * (e.g. cloning a seed file, or moving data about in place) has put other
+ * data. Returns 0, or -1 on error. */
+int rcksum_write_zero_blocks(struct rcksum_state *z) {
+    static const unsigned char zeros[65536];
+    int i;
+
+    if (!z->sink.write)
+        return 0;
+
+    for (i = 0; i < z->numzeros; i++) {
+        off_t offset = block_offset(z, z->zeros[2 * i]);
+        off_t end = block_offset(z, z->zeros[2 * i + 1] + 1);
+
+        /* Not the padding of the last block */
+        if (end > z->filelen)
+            end = z->filelen;
+        if (offset >= end)
+            continue;
+
+        if (z->sink.zero && z->sink.zero(z->sink.ctx, offset, end - offset) == 0)
+            continue;
+        while (offset < end) {
+            size_t l = end - offset < (off_t)sizeof zeros ? (size_t)(end - offset) : sizeof zeros;
+            ssize_t rc = z->sink.write(z->sink.ctx, zeros, l, offset);
+            if (rc <= 0)
+                return -1;
+            offset += rc;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,279 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* The cache of matches found in seed files; see cache.h.
+ *
+ * An entry is named after (the start of) the SHA-256 of its key, and holds:
+ *   8 bytes  magic
+ *   the key, in full
+ *   8 bytes  number of ranges
+ *   then the ranges, 8 bytes each for dst, src and len.
+ * in host byte order, as it is only for use on this machine. */
+
+#include "zsglobal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "sha256.h"
+
+static const char cache_magic[8] = "zsMatch2";
+
+/* Length of an entry's name, in hex digits */
+#define NAME_LEN 32
+
+/* Temporary files older than this are left over from a run that was killed */
+#define STALE_SECS 3600
+
+struct cache_entry {
+    char name[NAME_LEN + 1];
+    struct timespec mtime;
+    off_t size;
+};
+
+/* match_cache_key(key, target, scan, fd) */
+int match_cache_key(struct match_cache_key *k, const uint8_t target[CHECKSUM_SIZE], const struct match_cache_scan *scan,
+                    int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    memset(k, 0, sizeof *k);
+    memcpy(k->target, target, sizeof k->target);
+    k->scan = *scan;
+    k->dev = st.st_dev;
+    k->ino = st.st_ino;
+    k->size = st.st_size;
+    k->mtime_sec = st.st_mtim.tv_sec;
+    k->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/* entry_path(dir, key)
+ * Returns the (malloced) filename of the cache entry for the key */
+static char *entry_path(const char *dir, const struct match_cache_key *k) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_CTX ctx;
+    char *path = malloc(strlen(dir) + NAME_LEN + 2);
+    int i, n;
+
+    if (!path)
+        return NULL;
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, (const uint8_t *)k, sizeof *k);
+    SHA256Final(digest, &ctx);
+
+    n = sprintf(path, "%s/", dir);
+    for (i = 0; i < NAME_LEN / 2; i++)
+        n += sprintf(path + n, "%02x", digest[i]);
+    return path;
+}
+
+/* match_cache_load(dir, key, &rr, &n) */
+int match_cache_load(const char *dir, const struct match_cache_key *k, struct reuseable_range **rr, size_t *n) {
+    unsigned char header[sizeof cache_magic + sizeof *k + sizeof(uint64_t)];
+    uint64_t count, *data = NULL;
+    struct stat st;
+    char *path = entry_path(dir, k);
+    int fd = path ? open(path, O_RDONLY) : -1;
+    int rc = -1;
+    size_t i;
+
+    free(path);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == 0 && pread(fd, header, sizeof header, 0) == (ssize_t)sizeof header &&
+        !memcmp(header, cache_magic, sizeof cache_magic) && !memcmp(header + sizeof cache_magic, k, sizeof *k)) {
+        memcpy(&count, header + sizeof cache_magic + sizeof *k, sizeof count);
+
+        /* The ranges must be all there is in the file */
+        if (count == (st.st_size - sizeof header) / (3 * sizeof *data) &&
+            (st.st_size - sizeof header) % (3 * sizeof *data) == 0)
+            data = malloc(count * 3 * sizeof *data + 1);
+        *rr = data ? malloc(count * sizeof **rr + 1) : NULL;
+        if (*rr && pread(fd, data, count * 3 * sizeof *data, sizeof header) == (ssize_t)(count * 3 * sizeof *data)) {
+            for (i = 0; i < count; i++) {
+                (*rr)[i].dst = data[3 * i];
+                (*rr)[i].src = data[3 * i + 1];
+                (*rr)[i].len = data[3 * i + 2];
+            }
+            *n = count;
+            rc = 0;
+
+            /* Mark it as recently used */
+            futimens(fd, NULL);
+        } else {
+            free(*rr);
+            *rr = NULL;
+        }
+        free(data);
+    }
+    close(fd);
+    return rc;
+}
+
+/* compare_mtime(a, b)
+ * For qsort, oldest entries first */
+static int compare_mtime(const void *a, const void *b) {
+    const struct cache_entry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/* trim_cache(dir, max)
+ * Delete the least recently used entries until the cache is at most max
+ * bytes, and any temporary files left behind by runs that were killed */
+static void trim_cache(const char *dir, off_t max) {
+    struct cache_entry *entries = NULL;
+    size_t nentries = 0, i;
+    off_t total = 0;
+    struct dirent *d;
+    DIR *dp = opendir(dir);
+    time_t now = time(NULL);
+
+    if (!dp)
+        return;
+    while ((d = readdir(dp)) != NULL) {
+        struct stat st;
+
+        if (fstatat(dirfd(dp), d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (!strncmp(d->d_name, "tmp.", 4)) {
+            if (now - st.st_mtim.tv_sec > STALE_SECS)
+                unlinkat(dirfd(dp), d->d_name, 0);
+            continue;
+        }
+        if (strlen(d->d_name) != NAME_LEN || strspn(d->d_name, "0123456789abcdef") != NAME_LEN)
+            continue;
+
+        if (!(nentries & (nentries + 1))) { /* Grow to the next power of 2 */
+            struct cache_entry *p = realloc(entries, (2 * nentries + 1) * sizeof *entries);
+            if (!p)
+                break;
+            entries = p;
+        }
+        memcpy(entries[nentries].name, d->d_name, NAME_LEN + 1);
+        entries[nentries].mtime = st.st_mtim;
+        entries[nentries].size = st.st_size;
+        total += st.st_size;
+        nentries++;
+    }
+
+    if (total > max) {
+        qsort(entries, nentries, sizeof *entries, compare_mtime);
+        for (i = 0; i < nentries && total > max; i++)
+            if (unlinkat(dirfd(dp), entries[i].name, 0) == 0 || errno == ENOENT)
+                total -= entries[i].size;
+    }
+    closedir(dp);
+    free(entries);
+}
+
+/* match_cache_save(dir, key, rr, n, max) */
+int match_cache_save(const char *dir, const struct match_cache_key *k, const struct reuseable_range *rr, size_t n,
+                     off_t max) {
+    size_t header = sizeof cache_magic + sizeof *k + sizeof(uint64_t);
+    size_t len = header + n * 3 * sizeof(uint64_t);
+    unsigned char *buf = malloc(len);
+    char *path = entry_path(dir, k);
+    char *tmp = malloc(strlen(dir) + 12);
+    uint64_t *p;
+    int fd = -1, rc = -1;
+    size_t i;
+
+    if (buf && path && tmp) {
+        memcpy(buf, cache_magic, sizeof cache_magic);
+        memcpy(buf + sizeof cache_magic, k, sizeof *k);
+        p = (uint64_t *)(buf + sizeof cache_magic + sizeof *k);
+        *p++ = n;
+        for (i = 0; i < n; i++) {
+            *p++ = rr[i].dst;
+            *p++ = rr[i].src;
+            *p++ = rr[i].len;
+        }
+
+        /* Write it where no-one else will look at it, then move it in */
+        sprintf(tmp, "%s/tmp.XXXXXX", dir);
+        fd = mkstemp(tmp);
+    }
+    if (fd != -1) {
+        if (write(fd, buf, len) == (ssize_t)len && close(fd) == 0 && rename(tmp, path) == 0)
+            rc = 0;
+        else
+            unlink(tmp);
+    }
+    free(buf);
+    free(path);
+    free(tmp);
+
+    if (rc == 0)
+        trim_cache(dir, max);
+    return rc;
+}
+
+/* match_cache_drop(dir, key) */
+void match_cache_drop(const char *dir, const struct match_cache_key *k) {
+    char *path = entry_path(dir, k);
+    if (path)
+        unlink(path);
+    free(path);
+}
+
+/* make_dir(path)
+ * mkdir, if it's not there already. Returns 0 or -1 */
+static int make_dir(const char *path) { return mkdir(path, 0700) == 0 || errno == EEXIST ? 0 : -1; }
+
+/* match_cache_dir() */
+char *match_cache_dir(void) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *dir;
+
+    /* The XDG spec says to ignore relative paths */
+    if (base && base[0] == '/') {
+        dir = malloc(strlen(base) + 8);
+        if (!dir)
+            return NULL;
+        sprintf(dir, "%s/zsync", base);
+        if (make_dir(base) == 0 && make_dir(dir) == 0)
+            return dir;
+    } else if (home && home[0] == '/') {
+        dir = malloc(strlen(home) + 15);
+        if (!dir)
+            return NULL;
+        sprintf(dir, "%s/.cache", home);
+        if (make_dir(dir) == 0) {
+            strcat(dir, "/zsync");
+            if (make_dir(dir) == 0)
+                return dir;
+        }
+    } else {
+        return NULL;
+    }
+    free(dir);
+    return NULL;
+}
@@ -0,0 +1,72 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "librcksum/rcksum.h"
+
+/* A cache of what scanning seed files found. The scan of a seed file for a
+ * target gives a list of reusable ranges; we save them in the cache directory,
+ * one file for each seed file and target, so that the next run with the same
+ * seed file and .zsync (e.g. after a failed download, or zsyncranges before
+ * the real thing) can take them from there instead of scanning the whole file
+ * again. A seed file is known by its device, inode, size and mtime, and the
+ * target by rcksum_target_id; as that doesn't prove that the file is
+ * unchanged, the blocks are checked again when they are used.
+ *
+ * Each entry is written to a temporary file and renamed into place, so runs
+ * at the same time never see a partial entry (the last to finish wins). An
+ * entry's mtime is updated whenever it is used, and when the cache grows past
+ * its size limit the entries used least recently are deleted. */
+
+/* Default size limit of the cache */
+#define MATCH_CACHE_MAX (16 << 20)
+
+/* How a seed file was scanned. A scan with a stride, or wanting more blocks in
+ * a row, can find less than a plain scan. */
+struct match_cache_scan {
+    uint32_t stride, seq_matches;
+};
+
+struct match_cache_key {
+    uint8_t target[CHECKSUM_SIZE];
+    struct match_cache_scan scan;
+    uint64_t dev, ino, size, mtime_sec, mtime_nsec;
+};
+
+/* Fill in the key for the file open on fd, with the given target id, scanned
+ * as in scan. Returns 0, or -1 if the file can't be cached (e.g. it's not a
+ * regular file). */
+int match_cache_key(struct match_cache_key *k, const uint8_t target[CHECKSUM_SIZE], const struct match_cache_scan *scan,
+                    int fd);
+
+/* Look up the key in the cache in dir. Returns 0 with the ranges (malloced)
+ * in *rr and *n, or -1 if it is not there. */
+int match_cache_load(const char *dir, const struct match_cache_key *k, struct reuseable_range **rr, size_t *n);
+
+/* Save the ranges for the key in the cache in dir, then trim the cache to at
+ * most max bytes. Returns 0 or -1. */
+int match_cache_save(const char *dir, const struct match_cache_key *k, const struct reuseable_range *rr, size_t n,
+                     off_t max);
+
+/* Forget the entry for the key, e.g. if it turned out to be wrong */
+void match_cache_drop(const char *dir, const struct match_cache_key *k);
+
+/* The usual cache directory, $XDG_CACHE_HOME/zsync or ~/.cache/zsync, created
+ * if need be; malloced, or NULL if there's nowhere for it. */
+char *match_cache_dir(void);
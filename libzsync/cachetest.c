@@ -0,0 +1,167 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#include "zsglobal.h"
+
+#include "cache.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+static void test_eq(long long a, long long b) {
+    if (a != b) {
+        fprintf(stderr, "%lld != %lld\n", a, b);
+        exit(1);
+    }
+}
+
+static char dir[] = "/tmp/cachetest-XXXXXX";
+
+/* count_entries()
+ * How many files there are in the cache directory */
+static int count_entries(void) {
+    DIR *dp = opendir(dir);
+    struct dirent *d;
+    int n = 0;
+
+    while ((d = readdir(dp)) != NULL)
+        if (d->d_name[0] != '.')
+            n++;
+    closedir(dp);
+    return n;
+}
+
+/* tick()
+ * Wait long enough for the next file mtime to be later */
+static void tick(void) {
+    struct timespec t = {0, 10000000};
+    nanosleep(&t, NULL);
+}
+
+/* make_key(key, target, contents)
+ * Key for a new temporary file with the given contents */
+static void make_key(struct match_cache_key *k, int target, const char *contents) {
+    struct match_cache_scan scan = {1, 1};
+    uint8_t id[CHECKSUM_SIZE];
+    FILE *f = tmpfile();
+
+    memset(id, target, sizeof id);
+    fputs(contents, f);
+    fflush(f);
+    test_eq(match_cache_key(k, id, &scan, fileno(f)), 0);
+    fclose(f);
+}
+
+/* What is saved for a file and target is found for them, and only them */
+void test_save_load(void) {
+    struct reuseable_range rr[3] = {{0, 100, 4096}, {8192, 0, 512}, {4096, 9000, 100}}, *got;
+    struct match_cache_key k, other;
+    size_t n;
+
+    make_key(&k, 1, "seed");
+    test_eq(match_cache_load(dir, &k, &got, &n), -1);
+    test_eq(match_cache_save(dir, &k, rr, 3, MATCH_CACHE_MAX), 0);
+    test_eq(match_cache_load(dir, &k, &got, &n), 0);
+    test_eq(n, 3);
+    test_eq(memcmp(got, rr, sizeof rr), 0);
+    free(got);
+
+    /* Another target, or another file */
+    other = k;
+    other.target[0] = 2;
+    test_eq(match_cache_load(dir, &other, &got, &n), -1);
+    other = k;
+    other.mtime_nsec++;
+    test_eq(match_cache_load(dir, &other, &got, &n), -1);
+
+    /* The same file scanned another way: what a strided or longer-run scan
+     * found is not all that a plain scan would */
+    other = k;
+    other.scan.stride = 512;
+    test_eq(match_cache_load(dir, &other, &got, &n), -1);
+    other = k;
+    other.scan.seq_matches = 2;
+    test_eq(match_cache_load(dir, &other, &got, &n), -1);
+
+    /* Nothing found is worth saving too */
+    test_eq(match_cache_save(dir, &k, rr, 0, MATCH_CACHE_MAX), 0);
+    test_eq(match_cache_load(dir, &k, &got, &n), 0);
+    test_eq(n, 0);
+    free(got);
+
+    match_cache_drop(dir, &k);
+    test_eq(match_cache_load(dir, &k, &got, &n), -1);
+    test_eq(count_entries(), 0);
+
+    /* Pipes and the like can't be cached */
+    {
+        struct match_cache_scan scan = {1, 1};
+        uint8_t id[CHECKSUM_SIZE] = {0};
+        int p[2];
+        test_eq(pipe(p), 0);
+        test_eq(match_cache_key(&k, id, &scan, p[0]), -1);
+        close(p[0]);
+        close(p[1]);
+    }
+}
+
+/* Past the size limit, the entries used least recently go */
+void test_evict(void) {
+    struct reuseable_range rr[100], *got;
+    struct match_cache_key k[4];
+    size_t n;
+    int i;
+
+    memset(rr, 0, sizeof rr);
+    for (i = 0; i < 4; i++) {
+        make_key(&k[i], 3, "seed");
+        k[i].ino = i; /* As if four different files */
+    }
+
+    /* Each entry is a bit over 2400 bytes: room for 3 */
+    for (i = 0; i < 3; i++) {
+        test_eq(match_cache_save(dir, &k[i], rr, 100, 8000), 0);
+        tick();
+    }
+    test_eq(match_cache_load(dir, &k[0], &got, &n), 0);
+    free(got);
+    tick();
+    test_eq(match_cache_save(dir, &k[3], rr, 100, 8000), 0);
+
+    /* 1 was used least recently */
+    test_eq(count_entries(), 3);
+    test_eq(match_cache_load(dir, &k[1], &got, &n), -1);
+    for (i = 0; i < 4; i++) {
+        if (i == 1)
+            continue;
+        test_eq(match_cache_load(dir, &k[i], &got, &n), 0);
+        free(got);
+        match_cache_drop(dir, &k[i]);
+    }
+}
+
+int main(void) {
+    test_eq(mkdtemp(dir) != NULL, 1);
+
+    test_save_load();
+    test_evict();
+
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,546 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Planning and carrying out the moves to update a file in place; see
+ * inplace.h. */
+
+#include "zsglobal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "inplace.h"
+
+/* A move, or a piece of one; these are the nodes of our dependency graph */
+struct piece {
+    off_t src, dst;
+    size_t len;
+};
+
+enum piece_state { PENDING, SAVED, DONE };
+
+struct planner {
+    struct piece *pieces; /* In order of dst */
+    size_t n;
+
+    /* There is an edge a -> b if b writes over data that a reads, so a must
+     * come first. indeg[b] is the number of edges into b from pieces that
+     * haven't read their data yet; pred[predstart[b]..predstart[b+1]) are all
+     * the pieces with edges into b. */
+    size_t *indeg, *predstart, *pred;
+    unsigned char *state;
+    size_t *slot; /* Scratch slot holding a SAVED piece */
+
+    size_t *queue; /* Pieces that nothing still waits on */
+    size_t qhead, qtail;
+
+    size_t *mark; /* For finding cycles */
+    size_t stamp, next_start;
+
+    size_t *free_slots, nfree;
+    size_t piece_size;
+
+    struct inplace_plan *plan;
+    size_t ops_alloc, dropped_alloc;
+};
+
+static int compare_dst(const void *a, const void *b) {
+    const struct reuseable_range *x = a, *y = b;
+    return x->dst < y->dst ? -1 : x->dst > y->dst;
+}
+
+/* first_write_after(self, offset)
+ * Returns the first piece that writes anything after offset */
+static size_t first_write_after(const struct planner *pl, off_t offset) {
+    size_t lo = 0, hi = pl->n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (pl->pieces[mid].dst + (off_t)pl->pieces[mid].len > offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Loop over the pieces b that write over what piece a reads */
+#define FOR_EACH_OVERWRITER(pl, a, b)                                                                                  \
+    for (b = first_write_after(pl, pl->pieces[a].src);                                                                 \
+         b < pl->n && pl->pieces[b].dst < pl->pieces[a].src + (off_t)pl->pieces[a].len; b++)                          \
+        if (b != a)
+
+static int emit(struct planner *pl, enum inplace_kind kind, off_t src, off_t dst, size_t len) {
+    struct inplace_plan *p = pl->plan;
+
+    if (p->nops == pl->ops_alloc) {
+        struct inplace_op *o;
+        pl->ops_alloc = pl->ops_alloc ? 2 * pl->ops_alloc : 64;
+        o = realloc(p->ops, pl->ops_alloc * sizeof *o);
+        if (!o)
+            return -1;
+        p->ops = o;
+    }
+    p->ops[p->nops].kind = kind;
+    p->ops[p->nops].src = src;
+    p->ops[p->nops].dst = dst;
+    p->ops[p->nops].len = len;
+    p->nops++;
+
+    /* Track how much scratch space we use */
+    if (kind == INPLACE_SAVE && (size_t)dst + len > p->scratch)
+        p->scratch = dst + len;
+    return 0;
+}
+
+static int drop(struct planner *pl, size_t a) {
+    struct inplace_plan *p = pl->plan;
+
+    if (p->ndropped == pl->dropped_alloc) {
+        struct reuseable_range *d;
+        pl->dropped_alloc = pl->dropped_alloc ? 2 * pl->dropped_alloc : 16;
+        d = realloc(p->dropped, pl->dropped_alloc * sizeof *d);
+        if (!d)
+            return -1;
+        p->dropped = d;
+    }
+    p->dropped[p->ndropped].src = pl->pieces[a].src;
+    p->dropped[p->ndropped].dst = pl->pieces[a].dst;
+    p->dropped[p->ndropped].len = pl->pieces[a].len;
+    p->ndropped++;
+    return 0;
+}
+
+/* read_done(self, a)
+ * Piece a has read its data, so the pieces that write over it can go ahead */
+static void read_done(struct planner *pl, size_t a) {
+    size_t b;
+    FOR_EACH_OVERWRITER(pl, a, b) {
+        if (--pl->indeg[b] == 0 && pl->state[b] != DONE)
+            pl->queue[pl->qtail++] = b;
+    }
+}
+
+/* find_cycle(self)
+ * When every piece left is waiting for another, follow them back until we
+ * come round to one that we have seen: it is in a cycle. */
+static size_t find_cycle(struct planner *pl) {
+    size_t a;
+
+    while (pl->state[pl->next_start] == DONE)
+        pl->next_start++;
+    a = pl->next_start;
+    pl->stamp++;
+    while (pl->mark[a] != pl->stamp) {
+        size_t i;
+        pl->mark[a] = pl->stamp;
+
+        /* There is one, as it's waiting */
+        for (i = pl->predstart[a]; pl->state[pl->pred[i]] != PENDING; i++)
+            ;
+        a = pl->pred[i];
+    }
+    return a;
+}
+
+/* build_graph(self)
+ * Fill in the edges between the pieces. Returns 0 or -1. */
+static int build_graph(struct planner *pl) {
+    size_t a, b, *fill;
+
+    pl->indeg = calloc(pl->n + 1, sizeof *pl->indeg);
+    pl->predstart = calloc(pl->n + 1, sizeof *pl->predstart);
+    fill = calloc(pl->n + 1, sizeof *fill);
+    if (!pl->indeg || !pl->predstart || !fill) {
+        free(fill);
+        return -1;
+    }
+    for (a = 0; a < pl->n; a++)
+        FOR_EACH_OVERWRITER(pl, a, b) { pl->indeg[b]++; }
+    for (b = 0; b < pl->n; b++)
+        pl->predstart[b + 1] = pl->predstart[b] + pl->indeg[b];
+    pl->pred = malloc((pl->predstart[pl->n] + 1) * sizeof *pl->pred);
+    if (!pl->pred) {
+        free(fill);
+        return -1;
+    }
+    for (a = 0; a < pl->n; a++)
+        FOR_EACH_OVERWRITER(pl, a, b) { pl->pred[pl->predstart[b] + fill[b]++] = a; }
+    free(fill);
+    return 0;
+}
+
+/* split_moves(self, moves, n)
+ * Make the pieces: the moves that do something, in order of dst, in pieces of
+ * at most piece_size bytes. Returns 0 or -1. */
+static int split_moves(struct planner *pl, const struct reuseable_range *moves, size_t n) {
+    struct reuseable_range *m = malloc((n + 1) * sizeof *m);
+    size_t i, count = 0;
+
+    if (!m)
+        return -1;
+    if (n)
+        memcpy(m, moves, n * sizeof *m);
+    qsort(m, n, sizeof *m, compare_dst);
+    for (i = 0; i < n; i++)
+        if (m[i].src != m[i].dst)
+            count += (m[i].len + pl->piece_size - 1) / pl->piece_size;
+
+    pl->pieces = malloc((count + 1) * sizeof *pl->pieces);
+    if (!pl->pieces) {
+        free(m);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        size_t done;
+        if (m[i].src == m[i].dst)
+            continue;
+        for (done = 0; done < m[i].len; done += pl->piece_size) {
+            struct piece *p = &pl->pieces[pl->n++];
+            p->src = m[i].src + done;
+            p->dst = m[i].dst + done;
+            p->len = m[i].len - done < pl->piece_size ? m[i].len - done : pl->piece_size;
+        }
+    }
+    free(m);
+    return 0;
+}
+
+/* order(self)
+ * Work through the graph, emitting the ops. Returns 0 or -1. */
+static int order(struct planner *pl) {
+    size_t a, ndone = 0;
+
+    for (a = 0; a < pl->n; a++)
+        if (!pl->indeg[a])
+            pl->queue[pl->qtail++] = a;
+
+    while (ndone < pl->n) {
+        while (pl->qhead < pl->qtail) {
+            const struct piece *p = &pl->pieces[a = pl->queue[pl->qhead++]];
+            off_t gap = p->src > p->dst ? p->src - p->dst : p->dst - p->src;
+
+            if (pl->state[a] == SAVED) {
+                /* Put it in place from the scratch space */
+                if (emit(pl, INPLACE_RESTORE, pl->slot[a] * pl->piece_size, p->dst, p->len))
+                    return -1;
+                pl->free_slots[pl->nfree++] = pl->slot[a];
+            } else if (gap >= (off_t)p->len) {
+                if (emit(pl, INPLACE_COPY, p->src, p->dst, p->len))
+                    return -1;
+                read_done(pl, a);
+            } else if (pl->nfree) {
+                /* It overlaps itself, so go via the scratch space */
+                off_t s = pl->free_slots[pl->nfree - 1] * pl->piece_size;
+                if (emit(pl, INPLACE_SAVE, p->src, s, p->len) || emit(pl, INPLACE_RESTORE, s, p->dst, p->len))
+                    return -1;
+                read_done(pl, a);
+            } else {
+                if (drop(pl, a))
+                    return -1;
+                read_done(pl, a);
+            }
+            pl->state[a] = DONE;
+            ndone++;
+        }
+        if (ndone == pl->n)
+            break;
+
+        /* Only cycles are left. Save one piece of one to the scratch space,
+         * keeping a slot for pieces that overlap themselves; else drop it. */
+        a = find_cycle(pl);
+        if (pl->nfree > 1) {
+            pl->slot[a] = pl->free_slots[--pl->nfree];
+            if (emit(pl, INPLACE_SAVE, pl->pieces[a].src, pl->slot[a] * pl->piece_size, pl->pieces[a].len))
+                return -1;
+            pl->state[a] = SAVED;
+        } else {
+            if (drop(pl, a))
+                return -1;
+            pl->state[a] = DONE;
+            ndone++;
+        }
+        read_done(pl, a);
+    }
+    return 0;
+}
+
+/* inplace_plan(plan, moves, n, piece, scratch)
+ * Plan the given moves within a file, splitting them into pieces of at most
+ * piece bytes, and using at most scratch bytes of scratch space. */
+int inplace_plan(struct inplace_plan *p, const struct reuseable_range *moves, size_t n, size_t piece,
+                 size_t scratch) {
+    struct planner pl;
+    size_t i, nslots = scratch / piece;
+    int rc = -1;
+
+    memset(p, 0, sizeof *p);
+    memset(&pl, 0, sizeof pl);
+    pl.plan = p;
+    pl.piece_size = piece;
+
+    if (split_moves(&pl, moves, n) == 0 && build_graph(&pl) == 0) {
+        pl.state = calloc(pl.n + 1, 1);
+        pl.slot = calloc(pl.n + 1, sizeof *pl.slot);
+        pl.queue = malloc((pl.n + 1) * sizeof *pl.queue);
+        pl.mark = calloc(pl.n + 1, sizeof *pl.mark);
+        pl.free_slots = malloc((nslots + 1) * sizeof *pl.free_slots);
+        if (pl.state && pl.slot && pl.queue && pl.mark && pl.free_slots) {
+            /* Take the slots from the start of the space first */
+            for (i = 0; i < nslots; i++)
+                pl.free_slots[pl.nfree++] = nslots - 1 - i;
+            rc = order(&pl);
+        }
+    }
+
+    free(pl.pieces);
+    free(pl.indeg);
+    free(pl.predstart);
+    free(pl.pred);
+    free(pl.state);
+    free(pl.slot);
+    free(pl.queue);
+    free(pl.mark);
+    free(pl.free_slots);
+    if (rc)
+        inplace_plan_free(p);
+    return rc;
+}
+
+void inplace_plan_free(struct inplace_plan *p) {
+    free(p->ops);
+    free(p->dropped);
+    memset(p, 0, sizeof *p);
+}
+
+/* The journal is:
+ *   magic[8] dev ino nops done ops[nops] scratch...
+ * with the numbers as 64-bit, in our byte order. The magic is written last, so
+ * a journal without it was never finished, and nothing was done from it. */
+#define JOURNAL_MAGIC "zsIPjnl1"
+#define JOURNAL_DONE 32
+#define JOURNAL_OPS 40
+
+struct journal_header {
+    char magic[8];
+    uint64_t dev, ino, nops, done;
+};
+
+static int write_all(int fd, const void *buf, size_t len, off_t offset) {
+    while (len) {
+        ssize_t rc = pwrite(fd, buf, len, offset);
+        if (rc < 0) {
+            perror("write");
+            return -1;
+        }
+        buf = (const char *)buf + rc;
+        len -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/* read_all(fd, buf, len, offset)
+ * Read len bytes; past the end of file reads as zeros. Returns 0 or -1. */
+static int read_all(int fd, void *buf, size_t len, off_t offset) {
+    while (len) {
+        ssize_t rc = pread(fd, buf, len, offset);
+        if (rc < 0) {
+            perror("read");
+            return -1;
+        }
+        if (rc == 0) {
+            memset(buf, 0, len);
+            break;
+        }
+        buf = (char *)buf + rc;
+        len -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/* sync_dir(path)
+ * Make sure that the directory entry for the file at path is on disk */
+static void sync_dir(const char *path) {
+    char *p = strdup(path);
+    int fd = p ? open(dirname(p), O_RDONLY) : -1;
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(p);
+}
+
+/* inplace_write_journal(fd, journal, plan)
+ * Returns 0, or -1 on error (and there's no journal) */
+int inplace_write_journal(int fd, const char *journal, const struct inplace_plan *p) {
+    struct journal_header h;
+    struct stat st;
+    int jfd;
+
+    if (fstat(fd, &st) != 0) {
+        perror("stat");
+        return -1;
+    }
+    memset(&h, 0, sizeof h);
+    h.dev = st.st_dev;
+    h.ino = st.st_ino;
+    h.nops = p->nops;
+
+    jfd = open(journal, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (jfd == -1) {
+        perror(journal);
+        return -1;
+    }
+    if (write_all(jfd, &h, sizeof h, 0) || write_all(jfd, p->ops, p->nops * sizeof *p->ops, JOURNAL_OPS) ||
+        fdatasync(jfd) != 0 || write_all(jfd, JOURNAL_MAGIC, 8, 0) || fdatasync(jfd) != 0) {
+        fprintf(stderr, "failed to write %s\n", journal);
+        close(jfd);
+        unlink(journal);
+        return -1;
+    }
+    close(jfd);
+    sync_dir(journal);
+    return 0;
+}
+
+/* A place that an op reads from, not yet recorded as done in the journal */
+struct pending_read {
+    bool journal;
+    off_t start, end;
+};
+
+#define MAX_PENDING 256 /* Record progress at least this often */
+
+/* checkpoint(fd, jfd, done)
+ * Make what we have done so far durable, and record that ops before done are
+ * done. */
+static int checkpoint(int fd, int jfd, uint64_t done) {
+    if (fdatasync(fd) != 0 || fdatasync(jfd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    if (write_all(jfd, &done, sizeof done, JOURNAL_DONE))
+        return -1;
+    if (fdatasync(jfd) != 0) {
+        perror("fdatasync");
+        return -1;
+    }
+    return 0;
+}
+
+/* inplace_step(fd, journal, max)
+ * Each op only reads data that no earlier op writes over. Once its data is
+ * written, no op that comes after it writes over what it read until the
+ * journal records it as done; so the ops since the last record can always be
+ * done again after an interruption. */
+int inplace_step(int fd, const char *journal, size_t max) {
+    struct journal_header h;
+    struct inplace_op *ops = NULL;
+    struct pending_read pending[MAX_PENDING];
+    unsigned char *buf = NULL;
+    size_t npending = 0, maxlen = 0;
+    uint64_t i;
+    off_t data;
+    struct stat st, jst;
+    int rc = -1;
+    int jfd = open(journal, O_RDWR);
+
+    if (jfd == -1) {
+        if (errno == ENOENT)
+            return 1;
+        perror(journal);
+        return -1;
+    }
+    if (read_all(jfd, &h, sizeof h, 0) || fstat(fd, &st) != 0 || fstat(jfd, &jst) != 0)
+        goto out;
+    if (memcmp(h.magic, JOURNAL_MAGIC, 8)) {
+        /* Never finished writing it, so nothing was done */
+        close(jfd);
+        unlink(journal);
+        return 1;
+    }
+    if (h.dev != (uint64_t)st.st_dev || h.ino != (uint64_t)st.st_ino) {
+        fprintf(stderr, "%s is the journal for a different file\n", journal);
+        goto out;
+    }
+    if (h.done > h.nops || h.nops > (uint64_t)jst.st_size / sizeof *ops) {
+        fprintf(stderr, "%s is corrupt\n", journal);
+        goto out;
+    }
+
+    ops = malloc(h.nops * sizeof *ops + 1);
+    if (!ops || read_all(jfd, ops, h.nops * sizeof *ops, JOURNAL_OPS))
+        goto out;
+    data = JOURNAL_OPS + h.nops * sizeof *ops;
+    for (i = h.done; i < h.nops; i++)
+        if (ops[i].len > maxlen)
+            maxlen = ops[i].len;
+    buf = malloc(maxlen + 1);
+    if (!buf)
+        goto out;
+
+    for (i = h.done; i < h.nops && max; i++, max--) {
+        const struct inplace_op *o = &ops[i];
+        bool read_journal = o->kind == INPLACE_RESTORE, write_journal = o->kind == INPLACE_SAVE;
+        off_t r = o->src + (read_journal ? data : 0), w = o->dst + (write_journal ? data : 0);
+        size_t j;
+
+        /* If this writes over what an op since the last checkpoint read, we
+         * must not do that op again: record it as done first */
+        for (j = 0; j < npending; j++)
+            if (pending[j].journal == write_journal && pending[j].start < w + (off_t)o->len && pending[j].end > w)
+                break;
+        if (j < npending || npending == MAX_PENDING) {
+            if (checkpoint(fd, jfd, i))
+                goto out;
+            npending = 0;
+        }
+
+        if (read_all(read_journal ? jfd : fd, buf, o->len, r) || write_all(write_journal ? jfd : fd, buf, o->len, w))
+            goto out;
+        pending[npending].journal = read_journal;
+        pending[npending].start = r;
+        pending[npending].end = r + o->len;
+        npending++;
+    }
+
+    if (i < h.nops) {
+        rc = 0;
+    } else if (fdatasync(fd) != 0) {
+        perror("fdatasync");
+    } else {
+        /* All done and on disk */
+        unlink(journal);
+        rc = 1;
+    }
+
+out:
+    free(buf);
+    free(ops);
+    close(jfd);
+    return rc;
+}
+
+/* inplace_replay(fd, journal) */
+int inplace_replay(int fd, const char *journal) { return inplace_step(fd, journal, SIZE_MAX) < 0 ? -1 : 0; }
@@ -0,0 +1,77 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "librcksum/rcksum.h"
+
+/* Updating a file in place. Given the moves of data within the file that make
+ * up the new version (as reusable ranges, src to dst), we plan an order for
+ * them in which nothing is overwritten before it has been read. Where moves
+ * depend on each other in a cycle, one of them is saved to scratch space in
+ * the journal, and put in place later; and a move whose source and
+ * destination overlap goes through the scratch space too. If the scratch space
+ * is full, a move is dropped instead, and its data must be got some other way.
+ *
+ * The plan is written to a journal file, and carried out from there, with the
+ * journal recording how far it has got; so if it is interrupted, running the
+ * journal again finishes it. */
+
+/* Default size of the pieces that moves are split into, and scratch space */
+#define INPLACE_PIECE (4 << 20)
+#define INPLACE_SCRATCH (64 << 20)
+
+enum inplace_kind {
+    INPLACE_COPY,    /* From src in the file to dst in the file */
+    INPLACE_SAVE,    /* From src in the file to dst in the scratch space */
+    INPLACE_RESTORE, /* From src in the scratch space to dst in the file */
+};
+
+/* One step of a plan, as stored in the journal */
+struct inplace_op {
+    uint64_t kind;
+    uint64_t src;
+    uint64_t dst;
+    uint64_t len;
+};
+
+struct inplace_plan {
+    struct inplace_op *ops;
+    size_t nops;
+    struct reuseable_range *dropped; /* Parts of moves not done */
+    size_t ndropped;
+    size_t scratch; /* Bytes of scratch space that the ops use */
+};
+
+/* The moves must not overlap where they write; those with src == dst need
+ * nothing doing, and are left out. Returns 0, or -1 if out of memory. */
+int inplace_plan(struct inplace_plan *p, const struct reuseable_range *moves, size_t n, size_t piece,
+                 size_t scratch);
+void inplace_plan_free(struct inplace_plan *p);
+
+/* Write the journal to carry out the plan on the file open on fd */
+int inplace_write_journal(int fd, const char *journal, const struct inplace_plan *p);
+
+/* Carry out at most max more steps from the journal, if there is one. Returns
+ * 1 if it is finished (and the journal deleted), 0 if there is more to do, -1
+ * on error. Steps done since the journal last recorded its progress may be
+ * done again next time, which is harmless. */
+int inplace_step(int fd, const char *journal, size_t max);
+
+/* Finish whatever is in the journal, if there is one. Returns 0 or -1. */
+int inplace_replay(int fd, const char *journal);
@@ -0,0 +1,163 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#include "zsglobal.h"
+
+#include "inplace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+static void test_eq(long long a, long long b) {
+    if (a != b) {
+        fprintf(stderr, "%lld != %lld\n", a, b);
+        exit(1);
+    }
+}
+
+static char journal[] = "/tmp/inplacetest-XXXXXX";
+
+/* make_file(data, len)
+ * Returns a file descriptor for a new temporary file holding the data */
+static int make_file(const unsigned char *data, size_t len) {
+    char name[] = "/tmp/inplacetest-XXXXXX";
+    int fd = mkstemp(name);
+    test_eq(fd == -1, 0);
+    unlink(name);
+    test_eq(pwrite(fd, data, len, 0), len);
+    return fd;
+}
+
+/* check_moved(fd, before, moves, n, plan)
+ * The file should have the data of each move (except any dropped) in place */
+static void check_moved(int fd, const unsigned char *before, const struct reuseable_range *moves, size_t n,
+                        const struct inplace_plan *plan) {
+    size_t i, j;
+    for (i = 0; i < n; i++) {
+        unsigned char *got = malloc(moves[i].len);
+        test_eq(pread(fd, got, moves[i].len, moves[i].dst), moves[i].len);
+        for (j = 0; j < moves[i].len; j++) {
+            off_t dst = moves[i].dst + j;
+            size_t k;
+            for (k = 0; k < plan->ndropped; k++)
+                if (dst >= plan->dropped[k].dst && dst < plan->dropped[k].dst + (off_t)plan->dropped[k].len)
+                    break;
+            if (k == plan->ndropped)
+                test_eq(got[j], before[moves[i].src + j]);
+        }
+        free(got);
+    }
+}
+
+/* move(data, len, moves, n, piece, scratch, plan, steps)
+ * Plan and carry out the moves on a file with the given data, stopping after
+ * steps ops and starting again (as if interrupted), then check the result */
+static void move(const unsigned char *data, size_t len, const struct reuseable_range *moves, size_t n, size_t piece,
+                 size_t scratch, struct inplace_plan *plan, size_t steps) {
+    int fd = make_file(data, len);
+
+    test_eq(inplace_plan(plan, moves, n, piece, scratch), 0);
+    test_eq(plan->scratch <= scratch, 1);
+    test_eq(inplace_write_journal(fd, journal, plan), 0);
+    test_eq(inplace_step(fd, journal, steps), steps >= plan->nops);
+    test_eq(inplace_replay(fd, journal), 0);
+    test_eq(access(journal, F_OK), -1);
+    check_moved(fd, data, moves, n, plan);
+    close(fd);
+}
+
+static void make_random_data(unsigned char *data, size_t len, unsigned seed) {
+    size_t i;
+    srand(seed);
+    for (i = 0; i < len; i++)
+        data[i] = rand();
+}
+
+/* Swapping two blocks needs one saved to the scratch space */
+void test_swap(void) {
+    unsigned char data[8192];
+    struct reuseable_range moves[] = {{0, 4096, 4096}, {4096, 4096, 0}};
+    struct inplace_plan plan;
+
+    make_random_data(data, sizeof data, 1);
+    move(data, sizeof data, moves, 2, 4096, 8192, &plan, -1);
+    test_eq(plan.nops, 3);
+    test_eq(plan.ops[0].kind, INPLACE_SAVE);
+    test_eq(plan.ndropped, 0);
+    inplace_plan_free(&plan);
+
+    /* Without room for it, one is dropped */
+    move(data, sizeof data, moves, 2, 4096, 4096, &plan, -1);
+    test_eq(plan.nops, 1);
+    test_eq(plan.ndropped, 1);
+    inplace_plan_free(&plan);
+}
+
+/* Data already in place needs nothing doing; data shifted along a little
+ * overlaps itself */
+void test_shift(void) {
+    size_t len = 100000;
+    unsigned char *data = malloc(len);
+    struct reuseable_range moves[] = {{0, 1000, 0}, {1000, 50000, 1100}, {60000, 30000, 59990}};
+    struct inplace_plan plan;
+    size_t i;
+
+    make_random_data(data, len, 2);
+    move(data, len, moves, 3, 4096, 8192, &plan, -1);
+    test_eq(plan.ndropped, 0);
+    for (i = 0; i < plan.nops; i++)
+        test_eq(plan.ops[i].src == plan.ops[i].dst && plan.ops[i].kind == INPLACE_COPY, 0);
+    inplace_plan_free(&plan);
+    free(data);
+}
+
+/* A random shuffle of the blocks of a file, some repeated, interrupted at
+ * various points and finished from the journal */
+void test_shuffle(void) {
+    size_t nblocks = 256, bs = 1024, len = nblocks * bs;
+    unsigned char *data = malloc(len);
+    struct reuseable_range *moves = malloc(nblocks * sizeof *moves);
+    struct inplace_plan plan;
+    size_t i, steps;
+
+    make_random_data(data, len, 3);
+    for (i = 0; i < nblocks; i++) {
+        moves[i].dst = i * bs;
+        moves[i].src = (rand() % nblocks) * bs;
+        moves[i].len = bs;
+    }
+    for (steps = 0; steps < 400; steps += 37) {
+        move(data, len, moves, nblocks, bs, 16 * bs, &plan, steps);
+        inplace_plan_free(&plan);
+    }
+
+    /* And with no scratch space to spare, cycles are broken by dropping */
+    move(data, len, moves, nblocks, bs, bs, &plan, 100);
+    test_eq(plan.ndropped > 0, 1);
+    inplace_plan_free(&plan);
+    free(moves);
+    free(data);
+}
+
+int main(void) {
+    close(mkstemp(journal));
+    unlink(journal);
+
+    test_swap();
+    test_shift();
+    test_shuffle();
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* SHA-256, straight from FIPS 180-4. Used for the tree hash of the target. */
+
+#include "zsglobal.h"
+
+#include "sha256.h"
+#include <string.h>
+
+#define ror(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/* SHA256Transform(state, block)
+ * Hash a single 512-bit block. This is the core of the algorithm. */
+static void SHA256Transform(uint32_t state[8], const uint8_t block[SHA256_BLOCK_LENGTH]) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 |
+               block[4 * i + 3];
+    for (; i < 64; i++) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+
+    for (i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/* SHA256Init - Initialize new context */
+void SHA256Init(SHA256_CTX *context) {
+    static const uint32_t H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(context->state, H0, sizeof H0);
+    context->count = 0;
+}
+
+/* SHA256Update - Run your data through this. */
+void SHA256Update(SHA256_CTX *context, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    size_t j = (size_t)((context->count >> 3) & 63);
+
+    context->count += ((uint64_t)len << 3);
+    if ((j + len) > 63) {
+        memcpy(&context->buffer[j], data, (i = 64 - j));
+        SHA256Transform(context->state, context->buffer);
+        for (; i + 63 < len; i += 64)
+            SHA256Transform(context->state, &data[i]);
+        j = 0;
+    }
+    memcpy(&context->buffer[j], &data[i], len - i);
+}
+
+/* SHA256Final - Add padding and return the message digest. */
+void SHA256Final(uint8_t digest[SHA256_DIGEST_LENGTH], SHA256_CTX *context) {
+    uint8_t finalcount[8];
+    unsigned int i;
+
+    for (i = 0; i < 8; i++)
+        finalcount[i] = (uint8_t)(context->count >> ((7 - i) * 8));
+    SHA256Update(context, (const uint8_t *)"\200", 1);
+    while ((context->count & 504) != 448)
+        SHA256Update(context, (const uint8_t *)"\0", 1);
+    SHA256Update(context, finalcount, 8); /* Should cause a SHA256Transform() */
+
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        digest[i] = (uint8_t)(context->state[i >> 2] >> ((3 - (i & 3)) * 8));
+    memset(context, 0, sizeof *context);
+}
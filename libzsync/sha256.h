@@ -0,0 +1,35 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include "zsglobal.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_LENGTH 64
+#define SHA256_DIGEST_LENGTH 32
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t count;
+    uint8_t buffer[SHA256_BLOCK_LENGTH];
+} SHA256_CTX;
+
+void SHA256Init(SHA256_CTX *);
+void SHA256Update(SHA256_CTX *, const uint8_t *, size_t) ZS_DECL_BOUNDED(__string__, 2, 3);
+void SHA256Final(uint8_t[SHA256_DIGEST_LENGTH], SHA256_CTX *) ZS_DECL_BOUNDED(__minbytes__, 1, SHA256_DIGEST_LENGTH);
+
+#endif /* _SHA256_H */
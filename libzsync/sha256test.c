@@ -0,0 +1,114 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#include "zsglobal.h"
+
+#include "sha256.h"
+#include "treehash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+static void check(const uint8_t *digest, const char *hex) {
+    char s[2 * SHA256_DIGEST_LENGTH + 1];
+    int i;
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        sprintf(s + 2 * i, "%02x", digest[i]);
+    if (strcmp(s, hex)) {
+        fprintf(stderr, "%s != %s\n", s, hex);
+        exit(1);
+    }
+}
+
+static void sha256(uint8_t *digest, const char *s, size_t len) {
+    SHA256_CTX ctx;
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, (const uint8_t *)s, len);
+    SHA256Final(digest, &ctx);
+}
+
+/* From FIPS 180-2 appendix B */
+void test_vectors(void) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+
+    sha256(digest, "", 0);
+    check(digest, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    sha256(digest, "abc", 3);
+    check(digest, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    sha256(digest, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56);
+    check(digest, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+    { /* A million repetitions of "a", in uneven pieces */
+        SHA256_CTX ctx;
+        char a[1000];
+        int i;
+
+        memset(a, 'a', sizeof a);
+        SHA256Init(&ctx);
+        for (i = 0; i < 1000; i++) {
+            SHA256Update(&ctx, (const uint8_t *)a, 333);
+            SHA256Update(&ctx, (const uint8_t *)a, 667);
+        }
+        SHA256Final(digest, &ctx);
+        check(digest, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    }
+}
+
+/* The tree of a single leaf is the leaf; of three leaves is ((0,1),2) */
+void test_tree(void) {
+    uint8_t leaves[3][SHA256_DIGEST_LENGTH];
+    uint8_t expect[SHA256_DIGEST_LENGTH];
+    uint8_t root[SHA256_DIGEST_LENGTH];
+    uint8_t buf[1 + 2 * SHA256_DIGEST_LENGTH];
+    SHA256_CTX ctx;
+
+    tree_hash_leaf(leaves[0], (const uint8_t *)"abc", 3);
+    buf[0] = 0;
+    memcpy(buf + 1, "abc", 3);
+    sha256(expect, (const char *)buf, 4);
+    if (memcmp(leaves[0], expect, sizeof expect)) {
+        fprintf(stderr, "leaf hash wrong\n");
+        exit(1);
+    }
+    tree_hash_root(root, leaves, 1);
+    if (memcmp(root, expect, sizeof expect)) {
+        fprintf(stderr, "single leaf root wrong\n");
+        exit(1);
+    }
+
+    tree_hash_leaf(leaves[0], (const uint8_t *)"a", 1);
+    tree_hash_leaf(leaves[1], (const uint8_t *)"b", 1);
+    tree_hash_leaf(leaves[2], (const uint8_t *)"c", 1);
+    buf[0] = 1;
+    memcpy(buf + 1, leaves[0], SHA256_DIGEST_LENGTH);
+    memcpy(buf + 1 + SHA256_DIGEST_LENGTH, leaves[1], SHA256_DIGEST_LENGTH);
+    sha256(expect, (const char *)buf, sizeof buf);
+    memcpy(buf + 1, expect, SHA256_DIGEST_LENGTH);
+    memcpy(buf + 1 + SHA256_DIGEST_LENGTH, leaves[2], SHA256_DIGEST_LENGTH);
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, buf, sizeof buf);
+    SHA256Final(expect, &ctx);
+    tree_hash_root(root, leaves, 3);
+    if (memcmp(root, expect, sizeof expect)) {
+        fprintf(stderr, "three leaf root wrong\n");
+        exit(1);
+    }
+}
+
+int main(void) {
+    test_vectors();
+    test_tree();
+    return 0;
+}
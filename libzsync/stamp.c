@@ -0,0 +1,160 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Stamps on installed targets; see stamp.h.
+ *
+ * A stamp is one line of text: a magic word, the fields of the struct (with
+ * "-" for no ETag), then the device, inode, size and mtime of the file. */
+
+#define _GNU_SOURCE /* For timegm */
+#include "zsglobal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "sha256.h"
+#include "stamp.h"
+
+#define STAMP_XATTR "user.zsync.stamp"
+#define STAMP_SUFFIX ".zs-stamp"
+
+/* Longest stamp; the fields, the numbers, and the spaces between */
+#define STAMP_MAX 640
+
+/* sidecar_path(path)
+ * Returns the (malloced) filename of the stamp file for the given file */
+static char *sidecar_path(const char *path) {
+    char *p = malloc(strlen(path) + sizeof STAMP_SUFFIX);
+    if (p) {
+        strcpy(p, path);
+        strcat(p, STAMP_SUFFIX);
+    }
+    return p;
+}
+
+/* target_stamp_source(stamp, url) */
+void target_stamp_source(struct target_stamp *s, const char *url) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256_CTX ctx;
+    int i;
+
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, (const uint8_t *)url, strlen(url));
+    SHA256Final(digest, &ctx);
+    for (i = 0; i < (int)sizeof s->source / 2; i++)
+        sprintf(s->source + 2 * i, "%02x", digest[i]);
+}
+
+/* target_stamp_read(path, stamp) */
+int target_stamp_read(const char *path, struct target_stamp *s) {
+    char buf[STAMP_MAX + 1];
+    unsigned long long dev, ino;
+    long long size, mtime_sec, modified;
+    long mtime_nsec;
+    struct stat st;
+    ssize_t len = getxattr(path, STAMP_XATTR, buf, STAMP_MAX);
+
+    if (len < 0) { /* Then it might be in a file alongside */
+        char *sidecar = sidecar_path(path);
+        FILE *f = sidecar ? fopen(sidecar, "r") : NULL;
+
+        free(sidecar);
+        if (!f)
+            return -1;
+        len = fread(buf, 1, STAMP_MAX, f);
+        fclose(f);
+    }
+    buf[len] = 0;
+
+    memset(s, 0, sizeof *s);
+    if (sscanf(buf, "zsStamp2 %15s %128s %lld %32s %lld %255s %llu %llu %lld %lld %ld", s->checksum_method,
+               s->checksum, &s->length, s->source, &modified, s->etag, &dev, &ino, &size, &mtime_sec,
+               &mtime_nsec) != 11)
+        return -1;
+    s->modified = modified;
+    if (!strcmp(s->etag, "-"))
+        s->etag[0] = 0;
+
+    /* And is the file still as it was then? */
+    if (stat(path, &st) != 0 || st.st_dev != dev || st.st_ino != ino || st.st_size != size ||
+        st.st_mtim.tv_sec != mtime_sec || st.st_mtim.tv_nsec != mtime_nsec)
+        return -1;
+    return 0;
+}
+
+/* target_stamp_write(path, stamp) */
+int target_stamp_write(const char *path, const struct target_stamp *s) {
+    char buf[STAMP_MAX + 1];
+    char *sidecar = sidecar_path(path);
+    struct stat st;
+    int len, rc = -1;
+
+    /* ETags can't have spaces in, but a broken server might give one */
+    bool etag = s->etag[0] && !strpbrk(s->etag, " \t\r\n");
+
+    if (sidecar && stat(path, &st) == 0) {
+        len = snprintf(buf, sizeof buf, "zsStamp2 %s %s %lld %s %lld %s %llu %llu %lld %lld %ld\n",
+                       s->checksum_method, s->checksum, s->length, s->source, (long long)s->modified,
+                       etag ? s->etag : "-", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+                       (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        if (len > 0 && len <= STAMP_MAX) {
+            if (setxattr(path, STAMP_XATTR, buf, len, 0) == 0) {
+                unlink(sidecar); /* From before the file was somewhere with xattrs */
+                rc = 0;
+            } else {
+                FILE *f = fopen(sidecar, "w");
+                if (f && fwrite(buf, 1, len, f) == (size_t)len)
+                    rc = 0;
+                if (f && fclose(f) != 0)
+                    rc = -1;
+            }
+        }
+    }
+    free(sidecar);
+    return rc;
+}
+
+/* target_stamp_remove(path) */
+void target_stamp_remove(const char *path) {
+    char *sidecar = sidecar_path(path);
+
+    removexattr(path, STAMP_XATTR);
+    if (sidecar)
+        unlink(sidecar);
+    free(sidecar);
+}
+
+/* target_stamp_last_modified(f) */
+time_t target_stamp_last_modified(FILE *f) {
+    char line[512];
+    time_t t = 0;
+
+    while (fgets(line, sizeof line, f)) {
+        struct tm tm = {0};
+
+        if (!strncmp(line, "HTTP/", 5)) /* The next response, after a redirect */
+            t = 0;
+        else if (!strncasecmp(line, "Last-Modified:", 14) && strptime(line + 14, " %a, %d %b %Y %H:%M:%S GMT", &tm))
+            t = timegm(&tm);
+    }
+    return t > 0 ? t : 0;
+}
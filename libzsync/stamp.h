@@ -0,0 +1,55 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+/* A stamp on a target that zsync has put in place, saying what it is (the
+ * checksum and length from the .zsync) and where the .zsync came from; so that
+ * the next run can tell that there is nothing to do without reading the file,
+ * or even without downloading the .zsync again if the server says that it
+ * hasn't changed.
+ *
+ * It is kept in an xattr on the file, or in a file next to it (filename.zs-stamp)
+ * where the filesystem has no xattrs. It can't see later changes to the file,
+ * so it holds the file's device, inode, size and mtime, and only counts while
+ * those are the same. */
+
+struct target_stamp {
+    char checksum_method[16];
+    char checksum[129];
+    long long length;
+    char source[33]; /* Of the URL of the .zsync; see target_stamp_source */
+    time_t modified; /* The .zsync's Last-Modified then, by the server's clock; or 0 */
+    char etag[256];  /* And its ETag, or "" */
+};
+
+/* Set the source of the stamp to the given URL of the .zsync */
+void target_stamp_source(struct target_stamp *s, const char *url);
+
+/* Read the stamp of the file at path. Returns 0, or -1 if it has none, or has
+ * changed since it was stamped. */
+int target_stamp_read(const char *path, struct target_stamp *s);
+
+/* Stamp the file at path, as it is now. Returns 0 or -1. */
+int target_stamp_write(const char *path, const struct target_stamp *s);
+
+/* Remove any stamp, before changing the file */
+void target_stamp_remove(const char *path);
+
+/* The Last-Modified date in the headers that curl --dump-header wrote to f,
+ * from the last response (after any redirects); or 0 if it had none */
+time_t target_stamp_last_modified(FILE *f);
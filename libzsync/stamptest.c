@@ -0,0 +1,170 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#include "zsglobal.h"
+
+#include "stamp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+static void test_eq(long long a, long long b) {
+    if (a != b) {
+        fprintf(stderr, "%lld != %lld\n", a, b);
+        exit(1);
+    }
+}
+
+static char dir[] = "/tmp/stamptest-XXXXXX";
+static char path[64], sidecar[64];
+
+/* make_file(contents)
+ * (Re)write the test file */
+static void make_file(const char *contents) {
+    FILE *f = fopen(path, "w");
+    fputs(contents, f);
+    fclose(f);
+}
+
+/* make_stamp(stamp)
+ * A stamp as if for a download of http://example.com/x.zsync */
+static void make_stamp(struct target_stamp *s) {
+    memset(s, 0, sizeof *s);
+    strcpy(s->checksum_method, "SHA-1");
+    strcpy(s->checksum, "b1b8d0c324b78a99abfd2eec90260b1c2ba02eb8");
+    s->length = 1057;
+    target_stamp_source(s, "http://example.com/x.zsync");
+    s->modified = 1700000000;
+    strcpy(s->etag, "\"abc-123\"");
+}
+
+/* What is stamped is read back, while the file is unchanged */
+void test_read_write(void) {
+    struct target_stamp s, got, other;
+
+    make_file("target");
+    make_stamp(&s);
+    test_eq(target_stamp_read(path, &got), -1);
+    test_eq(target_stamp_write(path, &s), 0);
+    test_eq(target_stamp_read(path, &got), 0);
+    test_eq(memcmp(&got, &s, sizeof s), 0);
+
+    /* Only the same URL has the same source */
+    target_stamp_source(&other, "http://example.com/x.zsync");
+    test_eq(strcmp(other.source, s.source), 0);
+    target_stamp_source(&other, "http://example.com/y.zsync");
+    test_eq(strcmp(other.source, s.source) != 0, 1);
+
+    /* No ETag */
+    s.etag[0] = 0;
+    test_eq(target_stamp_write(path, &s), 0);
+    test_eq(target_stamp_read(path, &got), 0);
+    test_eq(got.etag[0], 0);
+
+    target_stamp_remove(path);
+    test_eq(target_stamp_read(path, &got), -1);
+}
+
+/* A file changed or replaced since it was stamped isn't as stamped */
+void test_changed(void) {
+    struct target_stamp s, got;
+
+    make_file("target");
+    make_stamp(&s);
+    test_eq(target_stamp_write(path, &s), 0);
+    make_file("changed");
+    test_eq(target_stamp_read(path, &got), -1);
+
+    test_eq(target_stamp_write(path, &s), 0);
+    unlink(path);
+    make_file("replaced");
+    test_eq(target_stamp_read(path, &got), -1);
+    target_stamp_remove(path);
+}
+
+/* Where there are no xattrs, the stamp is in a file alongside */
+void test_sidecar(void) {
+    struct target_stamp s, got;
+    char buf[1024];
+    ssize_t len;
+    FILE *f;
+
+    make_file("target");
+    make_stamp(&s);
+    test_eq(target_stamp_write(path, &s), 0);
+    len = getxattr(path, "user.zsync.stamp", buf, sizeof buf);
+    if (len < 0) /* Already in a sidecar; nothing more to see */
+        return;
+    removexattr(path, "user.zsync.stamp");
+    f = fopen(sidecar, "w");
+    fwrite(buf, 1, len, f);
+    fclose(f);
+
+    test_eq(target_stamp_read(path, &got), 0);
+    test_eq(memcmp(&got, &s, sizeof s), 0);
+    target_stamp_remove(path);
+    test_eq(access(sidecar, F_OK), -1);
+}
+
+/* header_file(text)
+ * A temporary file holding text, as if from curl --dump-header, to read */
+static FILE *header_file(const char *text) {
+    FILE *f = tmpfile();
+    fputs(text, f);
+    rewind(f);
+    return f;
+}
+
+/* The server's Last-Modified is read from the headers of the last response */
+void test_last_modified(void) {
+    FILE *f;
+
+    f = header_file("HTTP/1.1 200 OK\r\nETag: \"abc\"\r\nlast-modified: Tue, 14 Nov 2023 22:13:20 GMT\r\n\r\n");
+    test_eq(target_stamp_last_modified(f), 1700000000);
+    fclose(f);
+
+    /* After a redirect, only the date of the .zsync itself counts */
+    f = header_file("HTTP/1.1 302 Found\r\nLast-Modified: Tue, 14 Nov 2023 22:13:20 GMT\r\nLocation: /x\r\n\r\n"
+                    "HTTP/1.1 200 OK\r\nLast-Modified: Thu, 01 Jan 2015 00:00:00 GMT\r\n\r\n");
+    test_eq(target_stamp_last_modified(f), 1420070400);
+    fclose(f);
+    f = header_file("HTTP/1.1 302 Found\r\nLast-Modified: Tue, 14 Nov 2023 22:13:20 GMT\r\nLocation: /x\r\n\r\n"
+                    "HTTP/2 200\r\ncontent-length: 10\r\n\r\n");
+    test_eq(target_stamp_last_modified(f), 0);
+    fclose(f);
+
+    /* None, or none that we can read: then the next download is unconditional */
+    f = header_file("HTTP/1.1 200 OK\r\nLast-Modified: yesterday\r\n\r\n");
+    test_eq(target_stamp_last_modified(f), 0);
+    fclose(f);
+}
+
+int main(void) {
+    test_eq(mkdtemp(dir) != NULL, 1);
+    sprintf(path, "%s/target", dir);
+    sprintf(sidecar, "%s/target.zs-stamp", dir);
+
+    test_read_write();
+    test_changed();
+    test_sidecar();
+    test_last_modified();
+
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#include "zsglobal.h"
+
+#include "treehash.h"
+#include <string.h>
+
+/* tree_hash_leaf(out, data, len)
+ * Hash of one leaf of the tree */
+void tree_hash_leaf(uint8_t out[SHA256_DIGEST_LENGTH], const uint8_t *data, size_t len) {
+    SHA256_CTX ctx;
+    SHA256Init(&ctx);
+    SHA256Update(&ctx, (const uint8_t *)"\0", 1);
+    SHA256Update(&ctx, data, len);
+    SHA256Final(out, &ctx);
+}
+
+/* tree_hash_root(root, leaves, n)
+ * Combine the n leaf hashes into the root of the tree. Overwrites leaves[]. */
+void tree_hash_root(uint8_t root[SHA256_DIGEST_LENGTH], uint8_t (*leaves)[SHA256_DIGEST_LENGTH], size_t n) {
+    while (n > 1) {
+        size_t i;
+        for (i = 0; i + 1 < n; i += 2) {
+            SHA256_CTX ctx;
+            SHA256Init(&ctx);
+            SHA256Update(&ctx, (const uint8_t *)"\1", 1);
+            SHA256Update(&ctx, leaves[i], SHA256_DIGEST_LENGTH);
+            SHA256Update(&ctx, leaves[i + 1], SHA256_DIGEST_LENGTH);
+            SHA256Final(leaves[i / 2], &ctx);
+        }
+        /* Odd one out moves up a level as it is */
+        if (n & 1)
+            memmove(leaves[n / 2], leaves[n - 1], SHA256_DIGEST_LENGTH);
+        n = (n + 1) / 2;
+    }
+    if (n)
+        memcpy(root, leaves[0], SHA256_DIGEST_LENGTH);
+    else
+        tree_hash_leaf(root, NULL, 0);
+}
@@ -0,0 +1,32 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/* The Tree-Hash of a file: a SHA-256 Merkle tree over fixed size leaves.
+ * Leaf i covers bytes [i*leafsize, (i+1)*leafsize) of the file (the last one
+ * may be shorter); it is hashed as SHA-256(0x00 || data). Each interior node is
+ * SHA-256(0x01 || left || right), pairing nodes up level by level; a node left
+ * over at the end of a level is carried up unchanged. An empty file has one
+ * empty leaf. The prefixes keep leaves and nodes from being confused. */
+
+#define TREE_HASH_METHOD "SHA-256"
+
+void tree_hash_leaf(uint8_t out[SHA256_DIGEST_LENGTH], const uint8_t *data, size_t len);
+void tree_hash_root(uint8_t root[SHA256_DIGEST_LENGTH], uint8_t (*leaves)[SHA256_DIGEST_LENGTH], size_t n);
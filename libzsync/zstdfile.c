@@ -0,0 +1,188 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Streams through zstd; see zstdfile.h. They are stdio streams of our own
+ * (fopencookie), so that the code that reads and writes the checksum table
+ * needn't know whether it is compressed. */
+
+#define _GNU_SOURCE
+#include "zsglobal.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <zstd.h>
+
+#include "zstdfile.h"
+
+/* Repeated blocks are repeated rows of the table, however far apart, so
+ * look back a long way for matches; this is also the most memory that the
+ * reader needs without being told that it may use more */
+#define ZSTD_TABLE_WINDOW_LOG 27
+
+struct zstd_file {
+    FILE *f;
+    ZSTD_DCtx *d; /* Reading, or */
+    ZSTD_CCtx *c; /* writing */
+    void *buf;    /* Compressed data, on its way from or to f */
+    size_t buf_size;
+    ZSTD_inBuffer in;
+    size_t frame_left; /* When reading, 0 if at the end of a frame */
+    bool started;      /* When reading, whether the frame has begun */
+    off64_t pos;       /* In the uncompressed data */
+};
+
+/* zstd_read(cookie, buf, size)
+ * Decompress up to size bytes into buf */
+static ssize_t zstd_read(void *cookie, char *buf, size_t size) {
+    struct zstd_file *z = cookie;
+    ZSTD_outBuffer out = {buf, size, 0};
+
+    while (out.pos < out.size && !(z->started && !z->frame_left)) {
+        if (z->in.pos == z->in.size) {
+            size_t n = fread(z->buf, 1, z->buf_size, z->f);
+            if (!n) {
+                if (z->started && !out.pos) { /* Cut short */
+                    errno = EIO;
+                    return -1;
+                }
+                break;
+            }
+            z->in.src = z->buf;
+            z->in.size = n;
+            z->in.pos = 0;
+        }
+        z->started = true;
+        z->frame_left = ZSTD_decompressStream(z->d, &out, &z->in);
+        if (ZSTD_isError(z->frame_left)) {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(z->frame_left));
+            errno = EIO;
+            return -1;
+        }
+    }
+    z->pos += out.pos;
+    return out.pos;
+}
+
+/* zstd_write(cookie, buf, size)
+ * Compress the size bytes in buf, writing out what we can of them so far */
+static ssize_t zstd_write(void *cookie, const char *buf, size_t size) {
+    struct zstd_file *z = cookie;
+    ZSTD_inBuffer in = {buf, size, 0};
+
+    while (in.pos < in.size) {
+        ZSTD_outBuffer out = {z->buf, z->buf_size, 0};
+        size_t r = ZSTD_compressStream2(z->c, &out, &in, ZSTD_e_continue);
+
+        if (ZSTD_isError(r) || fwrite(z->buf, 1, out.pos, z->f) != out.pos) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    z->pos += size;
+    return size;
+}
+
+/* zstd_seek(cookie, &offset, whence)
+ * Only to say where we are, for ftell */
+static int zstd_seek(void *cookie, off64_t *offset, int whence) {
+    struct zstd_file *z = cookie;
+
+    if (whence != SEEK_CUR || *offset != 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+    *offset = z->pos;
+    return 0;
+}
+
+/* zstd_close(cookie)
+ * Finish the compressed data (when reading, read to its end so that it is
+ * checked), and free everything but f */
+static int zstd_close(void *cookie) {
+    struct zstd_file *z = cookie;
+    int rc = 0;
+
+    if (z->c) {
+        size_t left;
+        do {
+            ZSTD_inBuffer in = {NULL, 0, 0};
+            ZSTD_outBuffer out = {z->buf, z->buf_size, 0};
+
+            left = ZSTD_compressStream2(z->c, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(left) || fwrite(z->buf, 1, out.pos, z->f) != out.pos) {
+                rc = -1;
+                break;
+            }
+        } while (left);
+        ZSTD_freeCCtx(z->c);
+    }
+    if (z->d) {
+        char rest[4096];
+        ssize_t n;
+
+        while ((n = zstd_read(z, rest, sizeof rest)) > 0)
+            ;
+        if (n < 0)
+            rc = -1;
+        ZSTD_freeDCtx(z->d);
+    }
+    free(z->buf);
+    free(z);
+    return rc;
+}
+
+/* zstd_open(f, reading, level)
+ * The stream for zstd_open_read or zstd_open_write */
+static FILE *zstd_open(FILE *f, bool reading, int level) {
+    static const cookie_io_functions_t read_functions = {zstd_read, NULL, zstd_seek, zstd_close};
+    static const cookie_io_functions_t write_functions = {NULL, zstd_write, zstd_seek, zstd_close};
+    struct zstd_file *z = calloc(1, sizeof *z);
+    FILE *stream;
+
+    if (!z)
+        return NULL;
+    z->f = f;
+    if (reading) {
+        z->d = ZSTD_createDCtx();
+        z->buf_size = ZSTD_DStreamInSize();
+    } else {
+        z->c = ZSTD_createCCtx();
+        z->buf_size = ZSTD_CStreamOutSize();
+        if (z->c) {
+            ZSTD_CCtx_setParameter(z->c, ZSTD_c_compressionLevel, level);
+            ZSTD_CCtx_setParameter(z->c, ZSTD_c_enableLongDistanceMatching, 1);
+            ZSTD_CCtx_setParameter(z->c, ZSTD_c_windowLog, ZSTD_TABLE_WINDOW_LOG);
+            ZSTD_CCtx_setParameter(z->c, ZSTD_c_checksumFlag, 1);
+        }
+    }
+    z->buf = malloc(z->buf_size);
+    stream = z->buf && (z->c || z->d) ? fopencookie(z, reading ? "r" : "w", reading ? read_functions : write_functions)
+                                      : NULL;
+    if (!stream) {
+        ZSTD_freeCCtx(z->c);
+        ZSTD_freeDCtx(z->d);
+        free(z->buf);
+        free(z);
+    }
+    return stream;
+}
+
+/* zstd_open_read(f) */
+FILE *zstd_open_read(FILE *f) { return zstd_open(f, true, 0); }
+
+/* zstd_open_write(f, level) */
+FILE *zstd_open_write(FILE *f, int level) { return zstd_open(f, false, level); }
@@ -0,0 +1,33 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+/* Streams through zstd, for the compressed checksum table of a .zsync
+ * (Table-Compression: zstd). What is read from the stream that
+ * zstd_open_read returns is decompressed from f as it is read, up to the end
+ * of one zstd frame (reading ahead in f); what is written to the stream from
+ * zstd_open_write is compressed into f, as one frame. Closing the stream
+ * finishes the frame (or, when reading, fails if it was cut short or
+ * corrupt), and leaves f open. ftell on the stream gives the position in the
+ * uncompressed data; it can't seek. */
+
+/* Compression level for the table; higher levels gain next to nothing on
+ * checksums, which are mostly random */
+#define ZSTD_TABLE_LEVEL 3
+
+FILE *zstd_open_read(FILE *f);
+FILE *zstd_open_write(FILE *f, int level);
@@ -0,0 +1,218 @@
+/*
+ *   zsync - client side rsync over http
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "librcksum/rcksum.h"
+#include "zstdfile.h"
+
+static void test_eq(long long a, long long b) {
+    if (a != b) {
+        fprintf(stderr, "%lld != %lld\n", a, b);
+        exit(1);
+    }
+}
+
+/* make_data(data, len, seed)
+ * Some random bytes, some zeros and some repeats, to compress a bit */
+static void make_data(unsigned char *data, size_t len, unsigned seed) {
+    size_t i;
+
+    srand(seed);
+    for (i = 0; i < len; i++)
+        data[i] = i % 4096 < 1024 ? 0 : rand();
+}
+
+/* What goes through the streams comes out the same, however it is read and
+ * written, and is smaller in between */
+void test_round_trip(void) {
+    size_t len = 1 << 20;
+    unsigned char *data = malloc(len), *back = malloc(len);
+    FILE *f = tmpfile(), *z;
+    size_t i, n;
+
+    make_data(data, len, 1);
+    z = zstd_open_write(f, ZSTD_TABLE_LEVEL);
+    for (i = 0; i < len; i += n) {
+        n = rand() % 10000;
+        n = n < len - i ? n : len - i;
+        test_eq(fwrite(data + i, 1, n, z), n);
+        test_eq(ftell(z), i + n);
+    }
+    test_eq(fclose(z), 0);
+    test_eq(ftell(f) < (long)len, 1);
+    fputs("after", f);
+
+    rewind(f);
+    z = zstd_open_read(f);
+    back[0] = getc(z);
+    test_eq(ftell(z), 1);
+    test_eq(fread(back + 1, 1, len - 1, z), len - 1);
+    test_eq(memcmp(data, back, len), 0);
+    test_eq(getc(z), EOF);
+    test_eq(fclose(z), 0);
+
+    /* Closing part way is fine */
+    rewind(f);
+    z = zstd_open_read(f);
+    test_eq(fread(back, 1, 1000, z), 1000);
+    test_eq(fclose(z), 0);
+
+    free(data);
+    free(back);
+    fclose(f);
+}
+
+/* Compressed data that is cut short, or isn't compressed, is an error */
+void test_bad(void) {
+    size_t len = 1 << 16;
+    unsigned char *data = malloc(len), *back = malloc(len);
+    FILE *f = tmpfile(), *z;
+    long size;
+
+    make_data(data, len, 2);
+    z = zstd_open_write(f, ZSTD_TABLE_LEVEL);
+    fwrite(data, 1, len, z);
+    fclose(z);
+    fflush(f);
+    size = ftell(f);
+
+    /* Only the frame's checksum is missing, which we find out when closing */
+    test_eq(ftruncate(fileno(f), size - 1), 0);
+    rewind(f);
+    z = zstd_open_read(f);
+    test_eq(fread(back, 1, len, z), len);
+    test_eq(fclose(z), EOF);
+
+    rewind(f);
+    z = zstd_open_read(f);
+    test_eq(fread(back, 1, 1000, z), 1000);
+    test_eq(fclose(z), EOF);
+
+    test_eq(ftruncate(fileno(f), size / 2), 0);
+    rewind(f);
+    z = zstd_open_read(f);
+    test_eq(fread(back, 1, len, z) < len, 1);
+    test_eq(ferror(z) != 0, 1);
+    test_eq(fclose(z), EOF);
+
+    rewind(f);
+    fwrite(data + 2048, 1, 100, f);
+    rewind(f);
+    z = zstd_open_read(f);
+    test_eq(fread(back, 1, len, z), 0);
+    test_eq(fclose(z), EOF);
+
+    free(data);
+    free(back);
+    fclose(f);
+}
+
+/* Size of the checksums of a disk-like image of n 4KiB blocks (a third zeros,
+ * a third copies of earlier blocks, a third random), with 4-byte rsums and
+ * 16-byte checksums: as records, as a table with its index (zsyncmake -2) and
+ * compressed (zsyncmake -z); and the time to load each, up to being ready to
+ * look up the first block of the seed. */
+void perf_test_table_compression(zs_blockid n) {
+    struct rcksum_state *z = rcksum_init(n, 4096, 4, 16, 0, 1, true, NULL, (off_t)n * 4096);
+    unsigned char *records = malloc((size_t)n * 20);
+    unsigned char block[4096];
+    FILE *table = tmpfile(), *zf = tmpfile(), *w;
+    unsigned long long x = 88172645463325252ULL;
+    zs_blockid id;
+    int pass;
+
+    srand(3);
+    for (id = 0; id < n; id++) {
+        unsigned char *r = records + (size_t)id * 20;
+        struct rsum rs;
+        int kind = rand() % 3;
+
+        if (kind == 0 || id == 0) {
+            memset(block, 0, sizeof block);
+        } else if (kind == 1) {
+            memcpy(r, records + (size_t)(rand() % id) * 20, 20);
+            continue;
+        } else {
+            size_t i;
+            for (i = 0; i < sizeof block; i += sizeof x) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                memcpy(block + i, &x, sizeof x);
+            }
+        }
+        rs = rcksum_calc_rsum_block(block, sizeof block);
+        r[0] = rs.a >> 8;
+        r[1] = rs.a;
+        r[2] = rs.b >> 8;
+        r[3] = rs.b;
+        rcksum_calc_checksum(r + 4, block, sizeof block);
+    }
+    rcksum_add_target_blocks(z, 0, n, records);
+    rcksum_find_zero_blocks(z);
+    rcksum_write_table(z, table, 1);
+    w = zstd_open_write(zf, ZSTD_TABLE_LEVEL);
+    rcksum_write_table(z, w, 0);
+    fclose(w);
+    printf("records %zu bytes, table %ld bytes, compressed %ld bytes\n", (size_t)n * 20, ftell(table), ftell(zf));
+    rcksum_end(z);
+
+    for (pass = 0; pass < 3; pass++) {
+        struct timeval start, end;
+
+        gettimeofday(&start, NULL);
+        z = rcksum_init(n, 4096, 4, 16, 0, 1, true, NULL, (off_t)n * 4096);
+        if (pass == 0) {
+            rcksum_add_target_blocks(z, 0, n, records);
+            rcksum_find_zero_blocks(z);
+        } else if (pass == 1) {
+            rewind(table);
+            rcksum_read_table(z, table);
+        } else {
+            rewind(zf);
+            w = zstd_open_read(zf);
+            rcksum_read_table(z, w);
+            fclose(w);
+        }
+        memset(block, 1, sizeof block);
+        rcksum_submit_source_data(z, block, sizeof block, 0);
+        gettimeofday(&end, NULL);
+        rcksum_end(z);
+
+        int took_us = (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec;
+        printf("%s: %d blocks, took %d.%06ds\n", pass == 0 ? "records" : pass == 1 ? "table" : "compressed", (int)n,
+               took_us / 1000000, took_us % 1000000);
+    }
+    fclose(table);
+    fclose(zf);
+    free(records);
+}
+
+int main(void) {
+    test_round_trip();
+    test_bad();
+
+#if 0
+    perf_test_table_compression(5000000);
+#endif
+
+    return 0;
+}
@@ -30,24 +30,39 @@
  */
 #include "zsglobal.h"
 
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <pthread.h>
 
+#include "cache.h"
+#include "inplace.h"
 #include "librcksum/rcksum.h"
 #include "sha1.h"
+#include "treehash.h"
 #include "zsync.h"
+#include "zstdfile.h"
 
 /* Probably we really want a table of checksum methods here. But I've only
  * implemented SHA1 so this is it for now. */
 static const char ckmeth_sha1[] = {"SHA-1"};
 
+/* How many block checksums to read from the .zsync at a time */
+#define BLOCKSUMS_PER_READ 65536
+
+/* Advance the running SHA-1 by at least this much at a time: each advance
+ * waits for all the writes so far, which with io_uring would otherwise be
+ * after nearly every range downloaded */
+#define SHA1_ADVANCE_STEP (1024 * 1024)
+
 /****************************************************************************
  *
  * zsync_state object and methods
@@ -64,16 +79,52 @@ struct zsync_state {
     int blocks;              /* Number of blocks in the target */
     size_t blocksize;        /* Blocksize */
 
+    int seq_matches; /* Hash-Lengths seq_matches of the fine table */
+    int stride;      /* See zsync_set_scan_stride */
+
+    /* Content-defined chunking parameters, from Chunking; chunk_avg is 0 for
+     * the usual fixed size blocks. In this mode blocks is the number of chunks
+     * and blocksize is at least the largest chunk. */
+    size_t chunk_min, chunk_avg, chunk_max;
+
     /* Checksum of the entire file, and checksum alg */
     char *checksum;
     const char *checksum_method;
 
+    /* SHA-1 of the target so far: of all the data before sha1_frontier, which
+     * we advance as the run of blocks we have from the start grows */
+    SHA1_CTX sha1_ctx;
+    off_t sha1_frontier;
+
+    /* How much zsync_complete read back to verify, and how long it took */
+    long long verify_bytes;
+    double verify_secs;
+
+    /* Tree-Hash of the file, if in the .zsync (tree_leafsize is 0 if not), and
+     * the hashes of the leaves that we have verified so far */
+    size_t tree_leafsize;
+    uint8_t tree_root[SHA256_DIGEST_LENGTH];
+    size_t tree_nleaves;
+    uint8_t (*tree_leaves)[SHA256_DIGEST_LENGTH];
+    unsigned char *tree_leaf_done;
+
     /* URLs to versions of the target */
     char **url;
     int nurl;
 
     char *cur_filename; /* If we have taken the filename from rcksum, it is here */
     bool no_output;
+    bool copy_plan; /* See zsync_set_copy_plan */
+
+    /* Cache of what we found in seed files (see cache.h), if any; and how
+     * many blocks we had to find when we started using it, to tell whether we
+     * are scanning a seed file with nothing else known yet */
+    char *cache_dir;
+    int cache_todo;
+
+    /* Where the target is being written, if not to a temporary file */
+    const struct rcksum_sink *sink;
+    struct rcksum_fd_sink fd_sink; /* For zsync_submit_in_place */
 
     /* Hints for the output file, from the .zsync */
     char *filename; /* The Filename: header */
@@ -81,9 +132,15 @@ struct zsync_state {
     time_t mtime; /* MTime: from the .zsync, or -1 */
 };
 
-static int zsync_read_blocksums(struct zsync_state *zs, FILE *f, int rsum_bytes, unsigned int checksum_bytes,
-                                int seq_matches);
+static struct rcksum_state *zsync_read_blocksums(FILE *f, zs_blockid blocks, size_t blocksize, off_t filelen,
+                                                 int rsum_bytes, unsigned int checksum_bytes, unsigned int crc32c_bytes,
+                                                 int seq_matches, bool table, bool no_output,
+                                                 const struct rcksum_sink *sink);
+static struct rcksum_state *zsync_read_chunksums(struct zsync_state *zs, FILE *f, unsigned int checksum_bytes);
 static int zsync_sha1(struct zsync_state *zs, int fh);
+static int zsync_tree_hash(struct zsync_state *zs, const struct rcksum_state *rs, int fh);
+static void zsync_tree_hash_completed(struct zsync_state *zs);
+static void zsync_sha1_advance(struct zsync_state *zs);
 static time_t parse_822(const char *ts);
 
 /* char*[] = append_ptrlist(&num, &char[], "to add")
@@ -102,13 +159,29 @@ static char **append_ptrlist(int *n, char **p, char *a) {
     return p;
 }
 
-/* Constructor */
-struct zsync_state *zsync_begin(FILE *f, bool no_output) {
+/* zsync_begin_to(FILE*, no_output, sink)
+ * Constructor: read the .zsync, and set up to write the target to the sink
+ * or, if that is NULL, to a temporary file (unless no_output). */
+static struct zsync_state *zsync_begin_to(FILE *f, bool no_output, const struct rcksum_sink *sink) {
     /* Defaults for the checksum bytes and sequential matches properties of the
      * rcksum_state. These are the defaults from versions of zsync before these
      * were variable. */
     int checksum_bytes = 16, rsum_bytes = 4, seq_matches = 1;
 
+    /* Optional CRC32C column, added by zsyncmake -c */
+    int crc32c_bytes = 0;
+
+    /* Hint from zsyncmake -S to only scan at multiples of this offset */
+    int scan_stride = 1;
+
+    /* Number of chunks, for content-defined chunking (zsyncmake -C) */
+    int chunks = 0;
+
+    /* The checksums are a binary table (zsyncmake -2), not 0.6.2 records;
+     * and compressed (zsyncmake -z) */
+    bool table = false;
+    bool table_zstd = false;
+
     /* Field names that we can ignore if present and not
      * understood. This allows new headers to be added without breaking
      * backwards compatibility, and conversely to add headers that do break
@@ -123,8 +196,11 @@ struct zsync_state *zsync_begin(FILE *f, bool no_output) {
 
     /* Any non-zero defaults here. */
     zs->mtime = -1;
+    zs->stride = 1;
+    SHA1Init(&zs->sha1_ctx);
 
     zs->no_output = no_output;
+    zs->sink = sink;
 
     for (;;) {
         char buf[1024];
@@ -173,11 +249,31 @@ struct zsync_state *zsync_begin(FILE *f, bool no_output) {
                 zs->blocksize = (size_t)blocksize;
             } else if (!strcmp(buf, "Hash-Lengths")) {
                 if (sscanf(p, "%d,%d,%d", &seq_matches, &rsum_bytes, &checksum_bytes) != 3 || rsum_bytes < 1 ||
-                    rsum_bytes > 4 || checksum_bytes < 3 || checksum_bytes > 16 || seq_matches > 2 || seq_matches < 1) {
+                    rsum_bytes > 4 || checksum_bytes < 3 || checksum_bytes > 16 || seq_matches > MAX_SEQ_MATCHES ||
+                    seq_matches < 1) {
                     fprintf(stderr, "nonsensical hash lengths line %s\n", p);
                     free(zs);
                     return NULL;
                 }
+            } else if (!strcmp(buf, "CRC32C-Length")) {
+                crc32c_bytes = atoi(p);
+                if (crc32c_bytes < 1 || crc32c_bytes > CRC32C_SIZE) {
+                    fprintf(stderr, "nonsensical CRC32C length %s\n", p);
+                    free(zs);
+                    return NULL;
+                }
+            } else if (!strcmp(buf, "Chunking")) {
+                if (sscanf(p, "gear,%zu,%zu,%zu", &zs->chunk_min, &zs->chunk_avg, &zs->chunk_max) != 3 ||
+                    zs->chunk_avg < 4 || (zs->chunk_avg & (zs->chunk_avg - 1)) || zs->chunk_min > zs->chunk_avg ||
+                    zs->chunk_avg > zs->chunk_max || zs->chunk_max > 0x1000000) {
+                    fprintf(stderr, "nonsensical chunking %s\n", p);
+                    free(zs);
+                    return NULL;
+                }
+            } else if (!strcmp(buf, "Scan-Stride")) {
+                scan_stride = atoi(p);
+            } else if (!strcmp(buf, "Chunks")) {
+                chunks = atoi(p);
             } else if (!strcmp(buf, ckmeth_sha1)) {
                 if (strlen(p) != SHA1_DIGEST_LENGTH * 2) {
                     fprintf(stderr, "SHA-1 digest from control file is wrong length.\n");
@@ -185,6 +281,36 @@ struct zsync_state *zsync_begin(FILE *f, bool no_output) {
                     zs->checksum = strdup(p);
                     zs->checksum_method = ckmeth_sha1;
                 }
+            } else if (!strcmp(buf, "Tree-Hash")) {
+                char method[16], hex[2 * SHA256_DIGEST_LENGTH + 1];
+                int i;
+
+                if (sscanf(p, "%15s %zu %64s", method, &zs->tree_leafsize, hex) != 3 ||
+                    strcmp(method, TREE_HASH_METHOD) || strlen(hex) != 2 * SHA256_DIGEST_LENGTH ||
+                    zs->tree_leafsize < 1024 || (zs->tree_leafsize & (zs->tree_leafsize - 1))) {
+                    fprintf(stderr, "ignoring unsupported Tree-Hash %s\n", p);
+                    zs->tree_leafsize = 0;
+                } else {
+                    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+                        unsigned int j;
+                        sscanf(&hex[2 * i], "%2x", &j);
+                        zs->tree_root[i] = j;
+                    }
+                }
+            } else if (!strcmp(buf, "Table-Layout")) {
+                if (strcmp(p, "2")) {
+                    fprintf(stderr, "unsupported Table-Layout %s - you need a newer version of zsync.\n", p);
+                    free(zs);
+                    return NULL;
+                }
+                table = true;
+            } else if (!strcmp(buf, "Table-Compression")) {
+                if (strcmp(p, "zstd")) {
+                    fprintf(stderr, "unsupported Table-Compression %s - you need a newer version of zsync.\n", p);
+                    free(zs);
+                    return NULL;
+                }
+                table_zstd = true;
             } else if (!strcmp(buf, "Safe")) {
                 safelines = strdup(p);
             } else if (!(strcmp(buf, "Z-Filename") || strcmp(buf, "Z-URL") || strcmp(buf, "Z-Map2") ||
@@ -215,52 +341,182 @@ struct zsync_state *zsync_begin(FILE *f, bool no_output) {
         free(zs);
         return NULL;
     }
-    if (zsync_read_blocksums(zs, f, rsum_bytes, checksum_bytes, seq_matches) != 0) {
+    if (zs->tree_leafsize) {
+        zs->tree_nleaves = zs->filelen ? (zs->filelen + zs->tree_leafsize - 1) / zs->tree_leafsize : 1;
+        zs->tree_leaves = malloc(zs->tree_nleaves * sizeof *zs->tree_leaves);
+        zs->tree_leaf_done = calloc(zs->tree_nleaves, 1);
+        if (!zs->tree_leaves || !zs->tree_leaf_done) {
+            free(zs);
+            return NULL;
+        }
+    }
+
+    if (zs->chunk_avg) {
+        /* Chunks are looked up by strong checksum alone, keyed on its first 4
+         * bytes, and the 4 bytes before it in each record are the length */
+        if (chunks < 1 || seq_matches != 1 || rsum_bytes != 4 || checksum_bytes < 4 || crc32c_bytes || table) {
+            fprintf(stderr, "bad chunk table description\n");
+            free(zs);
+            return NULL;
+        }
+        zs->blocks = chunks;
+        for (zs->blocksize = 1; zs->blocksize < zs->chunk_max; zs->blocksize <<= 1)
+            ;
+        if (!(zs->rs = zsync_read_chunksums(zs, f, checksum_bytes))) {
+            fprintf(stderr, "zsync_read_chunksums failed\n");
+            free(zs);
+            return NULL;
+        }
+        return zs;
+    }
+
+    /* The table has no CRC32Cs */
+    if ((table && crc32c_bytes) || (table_zstd && !table)) {
+        fprintf(stderr, "bad table description\n");
+        free(zs);
+        return NULL;
+    }
+
+    /* Which we decompress as we read it */
+    FILE *tf = table_zstd ? zstd_open_read(f) : f;
+    if (!tf) {
+        perror("zstd");
+        free(zs);
+        return NULL;
+    }
+
+    zs->seq_matches = seq_matches;
+    zs->rs = zsync_read_blocksums(tf, zs->blocks, zs->blocksize, zs->filelen, rsum_bytes, checksum_bytes,
+                                  crc32c_bytes, seq_matches, table, zs->no_output, zs->sink);
+    if (table_zstd && fclose(tf) != 0 && zs->rs) {
+        fprintf(stderr, "bad compressed checksum table\n");
+        rcksum_end(zs->rs);
+        zs->rs = NULL;
+    }
+    if (!zs->rs) {
         fprintf(stderr, "zsync_read_blocksums failed\n");
         free(zs);
         return NULL;
     }
+
+    if (scan_stride != 1 && zsync_set_scan_stride(zs, scan_stride) != 0)
+        fprintf(stderr, "ignoring unusable Scan-Stride %d\n", scan_stride);
     return zs;
 }
 
-/* zsync_read_blocksums(self, FILE*, rsum_bytes, checksum_bytes, seq_matches)
- * Called during construction only, this creates the rcksum_state that stores
- * the per-block checksums of the target file and holds the local working copy
- * of the in-progress target. And it populates the per-block checksums from the
- * given file handle, which must be reading from the .zsync at the start of the
- * checksums.
- * rsum_bytes, checksum_bytes, seq_matches are settings for the checksums,
- * passed through to the rcksum_state. */
-static int zsync_read_blocksums(struct zsync_state *zs, FILE *f, int rsum_bytes, unsigned int checksum_bytes,
-                                int seq_matches) {
+/* zsync_read_blocksums(FILE*, blocks, blocksize, filelen, rsum_bytes, checksum_bytes, crc32c_bytes, seq_matches,
+ *                      table, no_output, sink)
+ * Called during construction only, this creates an rcksum_state that stores
+ * the per-block checksums of the target file and (unless no_output) holds the
+ * local working copy of the in-progress target. And it populates the per-block
+ * checksums from the given file handle, which must be reading from the .zsync
+ * at the start of the checksums.
+ * rsum_bytes, checksum_bytes, crc32c_bytes, seq_matches are settings for the
+ * checksums, passed through to the rcksum_state; table if they are in a binary
+ * table (Table-Layout: 2) rather than records. Returns NULL on failure. */
+static struct rcksum_state *zsync_read_blocksums(FILE *f, zs_blockid blocks, size_t blocksize, off_t filelen,
+                                                 int rsum_bytes, unsigned int checksum_bytes, unsigned int crc32c_bytes,
+                                                 int seq_matches, bool table, bool no_output,
+                                                 const struct rcksum_sink *sink) {
+    struct rcksum_state *rs;
+
     /* Make the rcksum_state first */
-    if (!(zs->rs = rcksum_init(zs->blocks, zs->blocksize, rsum_bytes, checksum_bytes, seq_matches, zs->no_output,
-                               zs->filelen))) {
-        return -1;
+    if (!(rs = rcksum_init(blocks, blocksize, rsum_bytes, checksum_bytes, crc32c_bytes, seq_matches, no_output, sink,
+                           filelen))) {
+        return NULL;
+    }
+
+    /* Which loads straight in, and finds the zero blocks too */
+    if (table) {
+        if (rcksum_read_table(rs, f) != 0) {
+            fprintf(stderr, "bad checksum table in control file\n");
+            rcksum_end(rs);
+            return NULL;
+        }
+        return rs;
     }
 
-    /* Now read in and store the checksums */
+    /* Now read in and store the checksums, many blocks at a time */
+    size_t record = rsum_bytes + checksum_bytes + crc32c_bytes;
+    zs_blockid per_read = blocks < BLOCKSUMS_PER_READ ? blocks : BLOCKSUMS_PER_READ;
+    unsigned char *buf = malloc(per_read * record + 1);
     zs_blockid id = 0;
-    for (; id < zs->blocks; id++) {
-        struct rsum r = {0, 0};
-        unsigned char checksum[CHECKSUM_SIZE];
 
-        /* Read in */
-        if (fread(((char *)&r) + 4 - rsum_bytes, rsum_bytes, 1, f) < 1 ||
-            fread((void *)&checksum, checksum_bytes, 1, f) < 1) {
+    if (!buf) {
+        perror("malloc");
+        rcksum_end(rs);
+        return NULL;
+    }
+    while (id < blocks) {
+        zs_blockid n = blocks - id < per_read ? blocks - id : per_read;
 
+        if (fread(buf, record, n, f) < (size_t)n) {
             /* Error - free the rcksum_state and tell the caller to bail */
             fprintf(stderr, "short read on control file; %s\n", strerror(ferror(f)));
-            rcksum_end(zs->rs);
-            return -1;
+            free(buf);
+            rcksum_end(rs);
+            return NULL;
         }
+        rcksum_add_target_blocks(rs, id, n, buf);
+        id += n;
+    }
+    free(buf);
 
-        /* Convert to host endian and store */
-        r.a = ntohs(r.a);
-        r.b = ntohs(r.b);
-        rcksum_add_target_block(zs->rs, id, r, checksum);
+    /* We needn't look for blocks of zeros */
+    if (rcksum_find_zero_blocks(rs) < 0) {
+        perror("zeros");
+        rcksum_end(rs);
+        return NULL;
     }
-    return 0;
+    return rs;
+}
+
+/* zsync_read_chunksums(self, FILE*, checksum_bytes)
+ * As zsync_read_blocksums, but for a table of content-defined chunks: each
+ * record is the chunk length (4 bytes, network endian) and then its
+ * checksum. The lengths must add up to the file length. */
+static struct rcksum_state *zsync_read_chunksums(struct zsync_state *zs, FILE *f, unsigned int checksum_bytes) {
+    struct rcksum_state *rs;
+    off_t total = 0;
+    zs_blockid id;
+
+    if (!(rs = rcksum_init(zs->blocks, zs->blocksize, 4, checksum_bytes, 0, 1, zs->no_output, zs->sink, zs->filelen)))
+        return NULL;
+    if (rcksum_set_chunking(rs, zs->chunk_min, zs->chunk_avg, zs->chunk_max) != 0) {
+        rcksum_end(rs);
+        return NULL;
+    }
+
+    for (id = 0; id < zs->blocks; id++) {
+        uint32_t len;
+        unsigned char checksum[CHECKSUM_SIZE];
+
+        if (fread(&len, sizeof len, 1, f) < 1 || fread(checksum, checksum_bytes, 1, f) < 1) {
+            fprintf(stderr, "short read on control file; %s\n", strerror(ferror(f)));
+            rcksum_end(rs);
+            return NULL;
+        }
+        len = ntohl(len);
+        if (len == 0 || len > zs->chunk_max) {
+            fprintf(stderr, "bad chunk length %u in control file\n", len);
+            rcksum_end(rs);
+            return NULL;
+        }
+        rcksum_add_target_chunk(rs, id, len, checksum);
+        total += len;
+    }
+    if (total != zs->filelen) {
+        fprintf(stderr, "chunk lengths add up to %lld, not the file length %lld\n", (long long)total,
+                (long long)zs->filelen);
+        rcksum_end(rs);
+        return NULL;
+    }
+    if (rcksum_find_zero_blocks(rs) < 0) {
+        perror("zeros");
+        rcksum_end(rs);
+        return NULL;
+    }
+    return rs;
 }
 
 /* parse_822(buf[])
@@ -316,12 +572,15 @@ int zsync_status(const struct zsync_state *zs) {
  */
 void zsync_progress(const struct zsync_state *zs, long long *got, long long *total) {
 
+    /* Chunks vary in size, so count them as the average */
+    size_t blocksize = zs->chunk_avg ? (size_t)(zs->filelen / zs->blocks) : zs->blocksize;
+
     if (got) {
         int todo = zs->blocks - rcksum_blocks_todo(zs->rs);
-        *got = todo * (long long)zs->blocksize;
+        *got = todo * (long long)blocksize;
     }
     if (total)
-        *total = zs->blocks * (long long)zs->blocksize;
+        *total = zs->blocks * (long long)blocksize;
 }
 
 /* zsync_get_urls(self, &num)
@@ -356,13 +615,10 @@ off_t *zsync_needed_byte_ranges(struct zsync_state *zs, int *num) {
         return NULL;
     }
 
-    /* Now convert blocks to bytes.
-     * Note: Must cast one operand to off_t as both blocksize and blrange[x]
-     * are int's whereas the product must be a file offfset. Needed so we don't
-     * truncate file offsets to 32bits on 32bit platforms. */
+    /* Now convert blocks (or chunks) to bytes. */
     for (i = 0; i < nrange; i++) {
-        byterange[2 * i] = blrange[2 * i] * (off_t)zs->blocksize;
-        byterange[2 * i + 1] = blrange[2 * i + 1] * (off_t)zs->blocksize - 1;
+        byterange[2 * i] = rcksum_block_offset(zs->rs, blrange[2 * i]);
+        byterange[2 * i + 1] = rcksum_block_offset(zs->rs, blrange[2 * i + 1]) - 1;
     }
     free(blrange); /* And release the blocks, we're done with them */
 
@@ -374,13 +630,428 @@ off_t *zsync_needed_byte_ranges(struct zsync_state *zs, int *num) {
     return byterange;
 }
 
+/* Constructors: the target goes to a temporary file (see zsync_rename_file),
+ * or to the given sink */
+struct zsync_state *zsync_begin(FILE *f, bool no_output) { return zsync_begin_to(f, no_output, NULL); }
+
+struct zsync_state *zsync_begin_sink(FILE *f, const struct rcksum_sink *sink) { return zsync_begin_to(f, false, sink); }
+
+/* zsync_set_scan_stride(self, stride)
+ * Only look for matching blocks at offsets in the seed files that are
+ * multiples of stride (a power of 2, up to the blocksize), rather than at
+ * every byte. Much faster, and loses nothing for data that moves only in
+ * whole sectors, like disk images. Returns 0, or -1 if the stride is not
+ * usable for this file. */
+int zsync_set_scan_stride(struct zsync_state *zs, int stride) {
+    if (zs->chunk_avg)
+        return -1; /* There's no scan to stride */
+    if (rcksum_set_stride(zs->rs, stride) != 0)
+        return -1;
+    zs->stride = stride;
+    return 0;
+}
+
+/* zsync_set_copy_plan(self, on)
+ * Rather than writing out data from each source file as the scan finds it,
+ * copy it all in one go afterwards, sorted and joined up into large ranges,
+ * and inside the kernel (sharing the extents if the filesystem can). */
+void zsync_set_copy_plan(struct zsync_state *zs, bool on) {
+    zs->copy_plan = on;
+    if (zs->rs)
+        rcksum_set_copy_plan(zs->rs, on);
+}
+
+/* zsync_use_io_uring(self)
+ * Queue writes to the local copy of the target with io_uring, so that we don't
+ * wait for the disk while scanning or downloading. Returns 0, or -1 if
+ * io_uring is not available here (which is fine: we write as usual). */
+int zsync_use_io_uring(struct zsync_state *zs) { return zs->rs ? rcksum_use_io_uring(zs->rs) : -1; }
+
+/* zsync_scan_gaps(self, FILE*, rr, n)
+ * Do the rolling checksum scan of the file, but only over the parts not
+ * covered by the given ranges, which are where we have already taken data
+ * from (in order of src; not our own reusable ranges, which the scan adds
+ * to), plus enough either side to find blocks straddling the edges. The file
+ * must be seekable. Returns the number of blocks found, or -1. */
+static int zsync_scan_gaps(struct zsync_state *zs, FILE *f, const struct reuseable_range *rr, size_t n) {
+    off_t context = (off_t)zs->blocksize * zs->seq_matches;
+    off_t scan_from = 0;
+    int got_blocks = 0, rc;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (rr[i].src > scan_from) {
+            off_t end = rr[i].src + context - 1;
+            rc = rcksum_submit_source_range(zs->rs, f, scan_from, end - scan_from);
+            if (rc < 0)
+                return -1;
+            got_blocks += rc;
+        }
+        if (rr[i].src + (off_t)rr[i].len - context + 1 > scan_from)
+            scan_from = rr[i].src + rr[i].len - context + 1;
+    }
+
+    /* And the rest of the file */
+    rc = rcksum_submit_source_range(zs->rs, f, scan_from, -1);
+    if (rc < 0)
+        return -1;
+    return got_blocks + rc;
+}
+
+/* zsync_use_match_cache(self, dir)
+ * Keep what we find in each seed file in the cache in dir, or if that is NULL
+ * the usual cache directory, and take it from there rather than scan the file
+ * again when it's there. Call before submitting any source file. Returns 0,
+ * or -1 if we can't have a cache. */
+int zsync_use_match_cache(struct zsync_state *zs, const char *dir) {
+    if (!zs->rs)
+        return -1;
+    free(zs->cache_dir);
+    zs->cache_dir = dir ? strdup(dir) : match_cache_dir();
+    if (!zs->cache_dir)
+        return -1;
+    zs->cache_todo = rcksum_blocks_todo(zs->rs);
+    return 0;
+}
+
+/* What we know of a seed file from the match cache */
+struct cache_scan {
+    struct match_cache_key key;
+    bool cached; /* We have a key for the file */
+    bool fresh;  /* We knew nothing of the target, so a scan is the whole story */
+};
+
+/* zsync_scan_from_cache(self, FILE*, &cs, &rc)
+ * If the match cache has what an earlier scan of this file found, take that
+ * (once checked) instead of scanning it; returns true with the number of
+ * blocks got (or -1 on error) in rc. Else returns false, with what we need to
+ * save what the scan finds in cs. */
+static bool zsync_scan_from_cache(struct zsync_state *zs, FILE *f, struct cache_scan *cs, int *rc) {
+    uint8_t id[CHECKSUM_SIZE];
+
+    cs->cached = cs->fresh = false;
+    if (zs->cache_dir) {
+        /* A scan that skips offsets, or wants longer runs, finds less */
+        struct match_cache_scan scan = {zs->stride, zs->seq_matches};
+
+        rcksum_target_id(zs->rs, id);
+        cs->cached = match_cache_key(&cs->key, id, &scan, fileno(f)) == 0;
+        cs->fresh = rcksum_blocks_todo(zs->rs) == zs->cache_todo;
+    }
+    if (cs->cached) {
+        struct reuseable_range *rr;
+        size_t n;
+
+        if (match_cache_load(zs->cache_dir, &cs->key, &rr, &n) == 0) {
+            *rc = rcksum_submit_source_ranges(zs->rs, fileno(f), rr, n);
+            free(rr);
+            if (*rc >= 0)
+                return true;
+
+            /* The file is not what it was. We may have taken some of it, so
+             * what we find now is not the whole story. */
+            match_cache_drop(zs->cache_dir, &cs->key);
+            cs->fresh = false;
+            if (zs->copy_plan && rcksum_copy_reusable_ranges(zs->rs, fileno(f)) != 0) {
+                *rc = -1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* zsync_scan_to_cache(self, &cs)
+ * After a scan of the file, save what it found, if it's the whole story */
+static void zsync_scan_to_cache(struct zsync_state *zs, const struct cache_scan *cs) {
+    if (cs->cached && cs->fresh) {
+        struct reuseable_range *rr;
+        size_t n;
+
+        rcksum_get_reusable_range(zs->rs, &rr, &n);
+        match_cache_save(zs->cache_dir, &cs->key, rr, n, MATCH_CACHE_MAX);
+    }
+}
+
+/* zsync_submit_source_scan(self, FILE*, progress)
+ * Scan the file for data in common with the target, by way of the match
+ * cache if we have one: if it has what an earlier scan of this file found,
+ * we take that (once checked) instead; else we save what this scan finds, if
+ * it's the whole story, i.e. we knew nothing of the target before. */
+static int zsync_submit_source_scan(struct zsync_state *zs, FILE *f, int progress) {
+    struct cache_scan cs;
+    int rc;
+
+    if (zsync_scan_from_cache(zs, f, &cs, &rc))
+        return rc;
+    rc = rcksum_submit_source_file(zs->rs, f, progress);
+    if (rc >= 0)
+        zsync_scan_to_cache(zs, &cs);
+    return rc;
+}
+
+/* zsync_source_done(self, FILE*, got_blocks)
+ * After taking got_blocks blocks from the given source file */
+static int zsync_source_done(struct zsync_state *zs, FILE *f, int rc) {
+    /* In copy-plan mode, now put in place what we found */
+    if (rc > 0 && zs->copy_plan && rcksum_copy_reusable_ranges(zs->rs, fileno(f)) != 0)
+        return -1;
+
+    /* Verify what we can against the tree hash while it's still in the cache */
+    if (rc > 0) {
+        zsync_tree_hash_completed(zs);
+        zsync_sha1_advance(zs);
+    }
+    return rc;
+}
+
 /* zsync_submit_source_file(self, FILE*, progress)
  * Read the given stream, applying the rsync rolling checksum algorithm to
  * identify any blocks of data in common with the target file. Blocks found are
  * written to our local copy of the target in progress. Progress reports if
  * progress != 0  */
 int zsync_submit_source_file(struct zsync_state *zs, FILE *f, int progress) {
-    return rcksum_submit_source_file(zs->rs, f, progress);
+    return zsync_source_done(zs, f, zsync_submit_source_scan(zs, f, progress));
+}
+
+/* zsync_submit_source_file_multi(zs[], n, FILE*, progress)
+ * zsync_submit_source_file for each of the n targets, reading the stream once
+ * for all of them (see rcksum_submit_source_file_multi) but for those with
+ * content-defined chunks, which each have a pass of their own afterwards; for which the file must be seekable. Returns the total
+ * number of blocks got, or -1 if we failed for any of the targets. */
+int zsync_submit_source_file_multi(struct zsync_state **zs, int n, FILE *f, int progress) {
+    struct cache_scan *cs = malloc(n * sizeof *cs);
+    struct rcksum_state **rs = malloc(n * sizeof *rs);
+    int *rc = malloc(n * sizeof *rc);
+    bool *scan = malloc(n * sizeof *scan);
+    int nrs = 0, total = 0, i;
+
+    if (!cs || !rs || !rc || !scan) {
+        total = -1;
+        goto out;
+    }
+
+    /* What we have from the cache, and the targets that we scan for together
+     * (rc has what they need, to tell what the scan found for each) */
+    for (i = 0; i < n; i++) {
+        scan[i] = !zsync_scan_from_cache(zs[i], f, &cs[i], &rc[i]);
+        if (scan[i] && !zs[i]->chunk_avg) {
+            rc[i] = rcksum_blocks_todo(zs[i]->rs);
+            rs[nrs++] = zs[i]->rs;
+        }
+    }
+    if (nrs) {
+        bool ok = rcksum_submit_source_file_multi(rs, nrs, f, progress) >= 0;
+
+        for (i = 0; i < n; i++)
+            if (scan[i] && !zs[i]->chunk_avg)
+                rc[i] = ok ? rc[i] - rcksum_blocks_todo(zs[i]->rs) : -1;
+    }
+
+    /* Then the rest, each alone */
+    for (i = 0; i < n; i++) {
+        if (scan[i] && zs[i]->chunk_avg)
+            rc[i] = fseeko(f, 0, SEEK_SET) == 0 ? rcksum_submit_source_file(zs[i]->rs, f, progress) : -1;
+        if (scan[i] && rc[i] >= 0)
+            zsync_scan_to_cache(zs[i], &cs[i]);
+        rc[i] = zsync_source_done(zs[i], f, rc[i]);
+        if (rc[i] < 0 || total < 0)
+            total = -1;
+        else
+            total += rc[i];
+    }
+
+out:
+    free(cs);
+    free(rs);
+    free(rc);
+    free(scan);
+    return total;
+}
+
+/* zsync_submit_source_join(self, FILE*, cf, progress)
+ * As zsync_submit_source_file, for a source file whose own .zsync we have on
+ * cf (e.g. the last version of the target): the blocks of the target that it
+ * has at the offsets of its own blocks are found by comparing the two .zsyncs
+ * (see rcksum_join), and taken from the file once checked; then only the rest
+ * of the file needs the rolling checksum scan. If the .zsyncs can't be
+ * compared, or the file isn't what its .zsync says, we scan it all as usual. */
+int zsync_submit_source_join(struct zsync_state *zs, FILE *f, FILE *cf, int progress) {
+    struct zsync_state *seed = zs->rs ? zsync_begin(cf, true) : NULL;
+    struct reuseable_range *rr = NULL;
+    size_t n = 0;
+    int rc = -1;
+
+    if (seed && seed->rs && rcksum_join(zs->rs, seed->rs, &rr, &n) == 0)
+        rc = rcksum_submit_source_ranges(zs->rs, fileno(f), rr, n);
+    if (seed)
+        free(zsync_end(seed));
+
+    if (rc < 0) {
+        free(rr);
+        if (zs->copy_plan && rcksum_copy_reusable_ranges(zs->rs, fileno(f)) != 0)
+            return -1;
+        return zsync_submit_source_file(zs, f, progress);
+    }
+
+    /* Content-defined chunks of the file are just those in its .zsync, so the
+     * join found all there is to find. Else scan between what it found. */
+    if (!zs->chunk_avg) {
+        int gaps = zsync_scan_gaps(zs, f, rr, n);
+        rc = gaps < 0 ? -1 : rc + gaps;
+    }
+    free(rr);
+    return rc < 0 ? -1 : zsync_source_done(zs, f, rc);
+}
+
+/* zsync_diff(self, old, &rr, &n)
+ * What of this target we could take from the old version of it, whose .zsync
+ * is loaded in old, without reading either file: the blocks in the old file,
+ * where its .zsync has them, that are blocks we still need (see rcksum_join).
+ * Returns 0 with them as reusable ranges (malloced, in order of offset in the
+ * old file) in *rr and *n, or -1 if the .zsyncs can't be compared. Changes
+ * neither; safe to call for several old versions at once in threads. */
+int zsync_diff(struct zsync_state *zs, const struct zsync_state *old, struct reuseable_range **rr, size_t *n) {
+    if (!zs->rs || !old->rs)
+        return -1;
+    return rcksum_join(zs->rs, old->rs, rr, n);
+}
+
+/* zsync_submit_in_place(self, fd, journal, progress)
+ * Make the file open read-write on fd into the target in place, rather than
+ * building a new copy of the target: data already in the right place is used
+ * where it is, and data in the wrong place is moved, in an order that doesn't
+ * overwrite any before it is read. The moves are carried out from the
+ * journal, so that if they are interrupted, they are finished the next time
+ * that we are called with that journal - which we do first.
+ * From then on the target is written to fd. Call this before submitting any
+ * other source file. Returns the number of blocks found, or -1 on error. */
+int zsync_submit_in_place(struct zsync_state *zs, int fd, const char *journal, int progress) {
+    struct inplace_plan plan;
+    struct reuseable_range *rr;
+    size_t nrr, i;
+    FILE *f;
+    int rc;
+
+    if (!zs->rs || zs->no_output || zs->sink)
+        return -1;
+    if (inplace_replay(fd, journal) != 0)
+        return -1;
+
+    rcksum_fd_sink_init(&zs->fd_sink, fd);
+    rcksum_set_sink(zs->rs, &zs->fd_sink.sink);
+    zs->sink = &zs->fd_sink.sink;
+
+    /* Find what's there, without writing anything yet */
+    f = fdopen(dup(fd), "r");
+    if (!f) {
+        perror("fdopen");
+        return -1;
+    }
+    rcksum_set_copy_plan(zs->rs, true);
+    rc = rcksum_submit_source_file(zs->rs, f, progress);
+    rcksum_set_copy_plan(zs->rs, zs->copy_plan);
+    fclose(f);
+    if (rc < 0)
+        return -1;
+
+    /* Move it into place */
+    rcksum_get_reusable_range(zs->rs, &rr, &nrr);
+    if (inplace_plan(&plan, rr, nrr, zs->blocksize > INPLACE_PIECE ? zs->blocksize : INPLACE_PIECE,
+                     INPLACE_SCRATCH) != 0)
+        return -1;
+    if (plan.nops && (inplace_write_journal(fd, journal, &plan) != 0 || inplace_replay(fd, journal) != 0)) {
+        inplace_plan_free(&plan);
+        return -1;
+    }
+
+    /* We'll have to get what we couldn't move some other way */
+    for (i = 0; i < plan.ndropped; i++) {
+        const struct reuseable_range *d = &plan.dropped[i];
+        rc -= rcksum_forget_blocks(zs->rs, rcksum_block_at_offset(zs->rs, d->dst),
+                                   rcksum_block_at_offset(zs->rs, d->dst + d->len - 1));
+    }
+    inplace_plan_free(&plan);
+    rcksum_clear_reusable_ranges(zs->rs);
+
+    /* Now that nothing more is to be read from it, clear what were blocks of
+     * zeros in the target */
+    if (rcksum_write_zero_blocks(zs->rs) != 0) {
+        perror("write");
+        return -1;
+    }
+
+    zsync_tree_hash_completed(zs);
+    zsync_sha1_advance(zs);
+    return rc;
+}
+
+/* zsync_submit_source_clone(self, FILE*, progress)
+ * As zsync_submit_source_file, for the first source file: if the filesystem
+ * can, our local copy of the target starts as a clone of it, sharing its
+ * extents, so that data at the same offset in both needn't be written (or
+ * take up any more space). Else as usual. */
+int zsync_submit_source_clone(struct zsync_state *zs, FILE *f, int progress) {
+    int rc;
+
+    if (!zs->rs || rcksum_clone_source(zs->rs, fileno(f)) != 0)
+        return zsync_submit_source_file(zs, f, progress);
+
+    rcksum_set_source_in_place(zs->rs, true);
+    rc = zsync_submit_source_file(zs, f, progress);
+    rcksum_set_source_in_place(zs->rs, false);
+    return rc;
+}
+
+/* zsync_resume(self, filename, map, checks)
+ * Take over the file left by an interrupted run for this target, with the
+ * map of what it had saved by zsync_save_map, rather than reading it as a
+ * seed file: it becomes our working copy of the target, and the blocks in the
+ * map are known, once a sample of them (of at most checks blocks) has been
+ * checked. Call this before submitting any source file. Returns the number of
+ * blocks that it gave us, or -1 if it can't be used. */
+int zsync_resume(struct zsync_state *zs, const char *filename, const char *map, int checks) {
+    int fd, rc;
+
+    if (!zs->rs || zs->no_output || zs->sink)
+        return -1;
+    fd = open(map, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    rc = rcksum_resume(zs->rs, filename, fd, checks);
+    close(fd);
+    return rc;
+}
+
+/* zsync_save_map(self, map)
+ * Save the map of the blocks of the target that we have, for zsync_resume to
+ * carry on from if we are interrupted. It is written to a new file that then
+ * replaces the old, so there is always a whole map there. Returns 0 or -1. */
+int zsync_save_map(struct zsync_state *zs, const char *map) {
+    char *tmp;
+    int fd, rc = -1;
+
+    if (!zs->rs)
+        return -1;
+    tmp = malloc(strlen(map) + 5);
+    if (!tmp)
+        return -1;
+    strcpy(tmp, map);
+    strcat(tmp, ".new");
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        rc = rcksum_save_known(zs->rs, fd);
+        if (close(fd) != 0)
+            rc = -1;
+        if (rc == 0 && rename(tmp, map) != 0)
+            rc = -1;
+        if (rc != 0)
+            unlink(tmp);
+    }
+    if (rc != 0)
+        perror(map);
+    free(tmp);
+    return rc;
 }
 
 static char *zsync_cur_filename(struct zsync_state *zs) {
@@ -418,56 +1089,161 @@ int zsync_rename_file(struct zsync_state *zs, const char *f) {
  */
 int zsync_complete(struct zsync_state *zs) {
     int rc = 0;
+    int fh = -1;
+
+    /* We've finished with the rsync algorithm. Truncate the target to the
+     * exact length (to remove any trailing NULs from the last block), ready to
+     * verify: in the caller's sink, through librcksum; or we take over the
+     * local copy from librcksum and free our rcksum state. */
+    if (zs->sink) {
+        if (rcksum_truncate_target(zs->rs, zs->filelen) != 0) {
+            perror("truncate");
+            rc = -1;
+        }
+    } else {
+        fh = rcksum_filehandle(zs->rs);
+        zsync_cur_filename(zs);
+        rcksum_end(zs->rs);
+        zs->rs = NULL;
 
-    /* We've finished with the rsync algorithm. Take over the local copy from
-     * librcksum and free our rcksum state. */
-    int fh = rcksum_filehandle(zs->rs);
-    zsync_cur_filename(zs);
-    rcksum_end(zs->rs);
-    zs->rs = NULL;
-
-    if (fh) {
-        /* Truncate the file to the exact length (to remove any trailing NULs from
-         * the last block); return to the start of the file ready to verify. */
+        if (fh == -1)
+            return 0;
         if (ftruncate(fh, zs->filelen) != 0) {
             perror("ftruncate");
             rc = -1;
         }
-        if (lseek(fh, 0, SEEK_SET) != 0) {
-            perror("lseek");
-            rc = -1;
-        }
+    }
 
-        /* Do checksum check */
-        if (rc == 0 && zs->checksum && !strcmp(zs->checksum_method, ckmeth_sha1)) {
+    { /* Do checksum check. The tree hash, if we have it, needs only the
+       * leaves we haven't verified already; else the SHA-1 of it all. */
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (rc == 0 && zs->tree_leafsize) {
+            rc = zsync_tree_hash(zs, zs->rs, fh);
+        } else if (rc == 0 && zs->checksum && !strcmp(zs->checksum_method, ckmeth_sha1)) {
             rc = zsync_sha1(zs, fh);
         }
-        close(fh);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        zs->verify_secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
     }
 
+    if (fh != -1)
+        close(fh);
+    if (zs->rs) {
+        rcksum_end(zs->rs);
+        zs->rs = NULL;
+    }
     return rc;
 }
 
+/* zsync_sha1_advance(self)
+ * Add to the running SHA-1 any data at the start of the target that we have
+ * all got now and haven't hashed yet, while it's still in the cache; so that
+ * zsync_sha1 at the end has only the rest to do. Only once there is at least
+ * SHA1_ADVANCE_STEP of it, or it is all the rest of the target. */
+static void zsync_sha1_advance(struct zsync_state *zs) {
+    off_t end;
+    unsigned char *buf;
+    size_t bufsize = 1024 * 1024;
+
+    /* Only if the SHA-1 is what we will check at the end */
+    if (!zs->rs || zs->no_output || zs->tree_leafsize || !zs->checksum || strcmp(zs->checksum_method, ckmeth_sha1))
+        return;
+
+    end = rcksum_block_offset(zs->rs, rcksum_known_prefix(zs->rs));
+    if (end > zs->filelen)
+        end = zs->filelen; /* The last block is padded */
+    if (end <= zs->sha1_frontier || (end - zs->sha1_frontier < SHA1_ADVANCE_STEP && end < zs->filelen))
+        return;
+    rcksum_flush(zs->rs);
+
+    if ((off_t)bufsize > end - zs->sha1_frontier)
+        bufsize = end - zs->sha1_frontier;
+    buf = malloc(bufsize);
+    if (!buf)
+        return;
+    while (zs->sha1_frontier < end) {
+        size_t len = end - zs->sha1_frontier < (off_t)bufsize ? (size_t)(end - zs->sha1_frontier) : bufsize;
+        ssize_t rc = rcksum_read_target(zs->rs, buf, len, zs->sha1_frontier);
+
+        if (rc <= 0)
+            break; /* zsync_sha1 will read it later */
+        SHA1Update(&zs->sha1_ctx, buf, rc);
+        zs->sha1_frontier += rc;
+    }
+    free(buf);
+}
+
+/* zsync_sha1_file(self, SHA1_CTX*, filedesc, start)
+ * Add the file from offset start to the end of the target to the SHA-1.
+ * We map it and let the kernel read ahead of us, so this goes as fast as the
+ * disk or SHA-1, whichever is slower; or if we can't map it, read it in large
+ * pieces. Returns 0, or -1 on a read error. */
+static int zsync_sha1_file(struct zsync_state *zs, SHA1_CTX *shactx, int fh, off_t start) {
+    const size_t piece = 1024 * 1024;
+    off_t map_start = start & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t map_len = zs->filelen - map_start;
+    unsigned char *map;
+
+    if (start >= zs->filelen)
+        return 0;
+    zs->verify_bytes += zs->filelen - start;
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fh, map_start);
+    if (map != MAP_FAILED) {
+        size_t off = start - map_start;
+
+        posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+        for (; off < map_len; off += piece)
+            SHA1Update(shactx, map + off, map_len - off < piece ? map_len - off : piece);
+        munmap(map, map_len);
+        return 0;
+    }
+
+    { /* No mmap; read it, with the kernel reading ahead */
+        unsigned char *buf = malloc(piece);
+        ssize_t rc = 0;
+
+        if (!buf)
+            return -1;
+        posix_fadvise(fh, start, zs->filelen - start, POSIX_FADV_SEQUENTIAL);
+        for (; start < zs->filelen; start += rc) {
+            rc = pread(fh, buf, piece, start);
+            if (rc <= 0)
+                break;
+            SHA1Update(shactx, buf, rc);
+        }
+        free(buf);
+        if (rc < 0) {
+            perror("read");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /* zsync_sha1(self, filedesc)
- * Given the currently-open-and-at-start-of-file complete local copy of the
- * target, read it and compare the SHA1 checksum with the one from the .zsync.
+ * Given the complete local copy of the target, read whatever of it is not
+ * already in the running SHA-1 and compare the SHA1 checksum with the one from
+ * the .zsync. If filedesc is -1, it's read back through our rcksum_state.
  * Returns -1 or 1 as per zsync_complete.
  */
 static int zsync_sha1(struct zsync_state *zs, int fh) {
     SHA1_CTX shactx;
 
-    { /* Do SHA1 of file contents */
-        unsigned char buf[4096];
-        int rc;
+    /* Do SHA1 of the rest of the file contents */
+    if (fh == -1) {
+        off_t from = zs->sha1_frontier;
 
-        SHA1Init(&shactx);
-        while (0 < (rc = read(fh, buf, sizeof buf))) {
-            SHA1Update(&shactx, buf, rc);
-        }
-        if (rc < 0) {
-            perror("read");
+        zsync_sha1_advance(zs); /* We know all the blocks by now */
+        zs->verify_bytes += zs->sha1_frontier - from;
+        if (zs->sha1_frontier != zs->filelen)
+            return -1;
+        shactx = zs->sha1_ctx;
+    } else {
+        shactx = zs->sha1_ctx;
+        if (zsync_sha1_file(zs, &shactx, fh, zs->sha1_frontier) != 0)
             return -1;
-        }
     }
 
     { /* And compare result of the SHA1 with the one from the .zsync */
@@ -487,6 +1263,153 @@ static int zsync_sha1(struct zsync_state *zs, int fh) {
     }
 }
 
+/* The leaves of the tree hash to do, shared between the threads hashing them */
+struct tree_hash_job {
+    const struct zsync_state *zs;
+    const struct rcksum_state *rs; /* Read the data through this, */
+    int fh;                        /* or if it is NULL, from this file */
+    const size_t *todo;
+    size_t ntodo;
+    size_t next; /* Next entry in todo[] to take; atomic */
+    int err;
+};
+
+/* tree_hash_worker(job)
+ * Thread body: take leaves from the job until there are none left, read them
+ * from the target and hash them. */
+static void *tree_hash_worker(void *arg) {
+    struct tree_hash_job *job = arg;
+    const struct zsync_state *zs = job->zs;
+    unsigned char *buf = malloc(zs->tree_leafsize);
+    size_t i;
+
+    if (!buf) {
+        job->err = 1;
+        return NULL;
+    }
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->ntodo) {
+        size_t leaf = job->todo[i];
+        off_t offset = (off_t)leaf * zs->tree_leafsize;
+        size_t len = zs->filelen - offset < (off_t)zs->tree_leafsize ? (size_t)(zs->filelen - offset)
+                                                                     : zs->tree_leafsize;
+        size_t got = 0;
+
+        while (got < len) {
+            ssize_t rc = job->rs ? rcksum_read_target(job->rs, buf + got, len - got, offset + got)
+                                 : pread(job->fh, buf + got, len - got, offset + got);
+            if (rc <= 0) {
+                job->err = 1;
+                break;
+            }
+            got += rc;
+        }
+        tree_hash_leaf(zs->tree_leaves[leaf], buf, got);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* zsync_tree_hash_leaves(self, rcksum_state, fh, todo[], ntodo)
+ * Hash the given leaves of the target, in parallel, reading the data through
+ * the rcksum_state or (if NULL) from the file handle. Returns 0, or -1 if we
+ * couldn't read it all. The leaves are then done, if successful. */
+static int zsync_tree_hash_leaves(struct zsync_state *zs, const struct rcksum_state *rs, int fh, const size_t *todo,
+                                  size_t ntodo) {
+    struct tree_hash_job job = {zs, rs, fh, todo, ntodo, 0, 0};
+    pthread_t threads[8];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 1 ? 1 : ncpu > 8 ? 8 : ncpu;
+    int started = 0, i;
+    size_t l;
+
+    if ((size_t)nthreads > ntodo)
+        nthreads = ntodo;
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, tree_hash_worker, &job) != 0)
+            break;
+        started++;
+    }
+    tree_hash_worker(&job); /* This thread helps too */
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    if (job.err)
+        return -1;
+    for (l = 0; l < ntodo; l++)
+        zs->tree_leaf_done[todo[l]] = 1;
+    return 0;
+}
+
+/* zsync_tree_hash_completed(self)
+ * Hash any leaves of the tree hash that we now have all the data for and
+ * haven't hashed yet, so that there is less to do at the end. */
+static void zsync_tree_hash_completed(struct zsync_state *zs) {
+    off_t *ranges;
+    int nrange, r = 0;
+    size_t leaf, ntodo = 0;
+    size_t *todo;
+
+    if (!zs->tree_leafsize || !zs->rs || zs->no_output)
+        return;
+    ranges = zsync_needed_byte_ranges(zs, &nrange);
+    if (!ranges)
+        return;
+    todo = malloc(zs->tree_nleaves * sizeof *todo);
+    if (!todo) {
+        free(ranges);
+        return;
+    }
+
+    /* Walk the leaves and the (sorted) needed ranges together */
+    for (leaf = 0; leaf < zs->tree_nleaves; leaf++) {
+        off_t start = (off_t)leaf * zs->tree_leafsize;
+        off_t end = start + zs->tree_leafsize - 1;
+
+        while (r < nrange && ranges[2 * r + 1] < start)
+            r++;
+        if (zs->tree_leaf_done[leaf] || (r < nrange && ranges[2 * r] <= end))
+            continue;
+        todo[ntodo++] = leaf;
+    }
+    if (ntodo) {
+        rcksum_flush(zs->rs);
+        zsync_tree_hash_leaves(zs, zs->rs, -1, todo, ntodo);
+    }
+    free(todo);
+    free(ranges);
+}
+
+/* zsync_tree_hash(self, rcksum_state, filedesc)
+ * Verify the completed target against the Tree-Hash from the .zsync, hashing
+ * whatever leaves we haven't already, reading them through the rcksum_state
+ * or (if NULL) the file handle. Returns -1 for a mismatch, 1 if OK. */
+static int zsync_tree_hash(struct zsync_state *zs, const struct rcksum_state *rs, int fh) {
+    size_t *todo = malloc(zs->tree_nleaves * sizeof *todo);
+    uint8_t(*leaves)[SHA256_DIGEST_LENGTH] = malloc(zs->tree_nleaves * sizeof *leaves);
+    uint8_t root[SHA256_DIGEST_LENGTH];
+    size_t leaf, ntodo = 0;
+    int rc = -1;
+
+    if (todo && leaves) {
+        for (leaf = 0; leaf < zs->tree_nleaves; leaf++)
+            if (!zs->tree_leaf_done[leaf]) {
+                off_t offset = (off_t)leaf * zs->tree_leafsize;
+                todo[ntodo++] = leaf;
+                zs->verify_bytes +=
+                    zs->filelen - offset < (off_t)zs->tree_leafsize ? zs->filelen - offset : (off_t)zs->tree_leafsize;
+            }
+        if (zsync_tree_hash_leaves(zs, rs, fh, todo, ntodo) == 0) {
+            /* Combining the leaves overwrites them; keep ours */
+            memcpy(leaves, zs->tree_leaves, zs->tree_nleaves * sizeof *leaves);
+            tree_hash_root(root, leaves, zs->tree_nleaves);
+            rc = memcmp(root, zs->tree_root, sizeof root) ? -1 : 1;
+        }
+    }
+    free(todo);
+    free(leaves);
+    return rc;
+}
+
 /* Destructor */
 char *zsync_end(struct zsync_state *zs) {
     int i;
@@ -502,8 +1425,11 @@ char *zsync_end(struct zsync_state *zs) {
 
     /* And the rest. */
     free(zs->url);
+    free(zs->cache_dir);
     free(zs->checksum);
     free(zs->filename);
+    free(zs->tree_leaves);
+    free(zs->tree_leaf_done);
     free(zs);
     return f;
 }
@@ -517,7 +1443,7 @@ char *zsync_end(struct zsync_state *zs) {
  * the given number of blocks at the given offset (must be block-aligned), data
  * in buf[].  */
 static int zsync_submit_data(struct zsync_state *zs, const unsigned char *buf, off_t offset, int blocks) {
-    zs_blockid blstart = offset / zs->blocksize;
+    zs_blockid blstart = rcksum_block_at_offset(zs->rs, offset);
     zs_blockid blend = blstart + blocks - 1;
 
     return rcksum_submit_blocks(zs->rs, buf, blstart, blend);
@@ -560,6 +1486,50 @@ struct zsync_receiver *zsync_begin_receive(struct zsync_state *zs) {
     return zr;
 }
 
+/* zsync_receive_chunks(self, buf[], offset, buflen)
+ * zsync_receive_data for content-defined chunks: submit each whole chunk in
+ * the data, and collect the pieces of any that is split across calls. */
+static int zsync_receive_chunks(struct zsync_receiver *zr, const unsigned char *buf, off_t offset, size_t len) {
+    struct rcksum_state *rs = zr->zs->rs;
+    int ret = 0;
+
+    while (len && offset < zr->zs->filelen) {
+        zs_blockid id = rcksum_block_at_offset(rs, offset);
+        off_t start = rcksum_block_offset(rs, id);
+        off_t end = rcksum_block_offset(rs, id + 1);
+
+        if (offset == start && offset + (off_t)len >= end) {
+            /* One or more whole chunks */
+            zs_blockid last = offset + (off_t)len >= zr->zs->filelen
+                                  ? zr->zs->blocks - 1
+                                  : rcksum_block_at_offset(rs, offset + len) - 1;
+            size_t n = rcksum_block_offset(rs, last + 1) - offset;
+
+            if (rcksum_submit_blocks(rs, buf, id, last))
+                ret = 1;
+            buf += n;
+            len -= n;
+            offset += n;
+        } else {
+            /* Part of a chunk; we can only use it if we have the rest of the
+             * chunk before it */
+            size_t n = end - offset < (off_t)len ? (size_t)(end - offset) : len;
+
+            if (offset == start || zr->outoffset == offset) {
+                memcpy(zr->outbuf + (offset - start), buf, n);
+                if (offset + (off_t)n == end)
+                    if (rcksum_submit_blocks(rs, zr->outbuf, id, id))
+                        ret = 1;
+            }
+            buf += n;
+            len -= n;
+            offset += n;
+        }
+    }
+    zr->outoffset = offset;
+    return ret;
+}
+
 /* zsync_receive_data(self, buf[], offset, buflen)
  * Adds the data in buf (buflen bytes) to this file at the given offset.
  * Returns 0 unless there's an error (e.g. the submitted data doesn't match the
@@ -569,6 +1539,12 @@ int zsync_receive_data(struct zsync_receiver *zr, const unsigned char *buf, off_
     int ret = 0;
     size_t blocksize = zr->zs->blocksize;
 
+    if (zr->zs->chunk_avg) {
+        ret = zsync_receive_chunks(zr, buf, offset, len);
+        zsync_sha1_advance(zr->zs);
+        return ret;
+    }
+
     if (0 != (offset % blocksize)) {
         size_t x = len;
 
@@ -612,11 +1588,17 @@ int zsync_receive_data(struct zsync_receiver *zr, const unsigned char *buf, off_
     }
 
     zr->outoffset = offset;
+    zsync_sha1_advance(zr->zs);
     return ret;
 }
 
 off_t zsync_get_filelength(const struct zsync_state *zs) { return zs->filelen; }
 
+void zsync_verify_stats(const struct zsync_state *zs, long long *bytes, double *secs) {
+    *bytes = zs->verify_bytes;
+    *secs = zs->verify_secs;
+}
+
 void zsync_get_checksum(struct zsync_state *zs, const char **checksum, const char **checksum_method) {
     *checksum = zs->checksum;
     *checksum_method = zs->checksum_method;
@@ -624,6 +1606,8 @@ void zsync_get_checksum(struct zsync_state *zs, const char **checksum, const cha
 
 /* Destructor */
 void zsync_end_receive(struct zsync_receiver *zr) {
+    /* Verify what we can of what we downloaded */
+    zsync_tree_hash_completed(zr->zs);
     free(zr->outbuf);
     free(zr);
 }
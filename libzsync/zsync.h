@@ -19,11 +19,17 @@
 
 struct zsync_state;
 struct reuseable_range;
+struct rcksum_sink;
 
 /* zsync_begin - load a zsync file and return data structure to use for the rest of the process.
  */
 struct zsync_state *zsync_begin(FILE *cf, bool no_output);
 
+/* zsync_begin_sink - as zsync_begin, but write the target to the given sink
+ * (see rcksum.h) rather than a temporary file. It's verified in place by
+ * zsync_complete; zsync_rename_file and zsync_end then have no file to give. */
+struct zsync_state *zsync_begin_sink(FILE *cf, const struct rcksum_sink *sink);
+
 /* zsync_filename - return the suggested filename from the .zsync file */
 char *zsync_filename(const struct zsync_state *);
 /* zsync_mtime - return the suggested mtime from the .zsync file */
@@ -48,10 +54,57 @@ int zsync_status(const struct zsync_state *zs);
  * and the total (roughly, the file length) in *total */
 void zsync_progress(const struct zsync_state *zs, long long *got, long long *total);
 
+/* zsync_set_scan_stride - only look for data in the source files at offsets
+ * that are multiples of stride. Returns 0 if OK, -1 if not usable. */
+int zsync_set_scan_stride(struct zsync_state *zs, int stride);
+
+/* zsync_set_copy_plan - copy data from each source file into place in bulk
+ * after scanning it, rather than as it is found */
+void zsync_set_copy_plan(struct zsync_state *zs, bool on);
+
+/* zsync_use_match_cache - keep what is found in each seed file in a cache in
+ * dir (NULL for the usual ~/.cache/zsync), and use that instead of scanning a
+ * seed file again while it's unchanged. Call before submitting any file.
+ * Returns 0, or -1 if there is nowhere for the cache. */
+int zsync_use_match_cache(struct zsync_state *zs, const char *dir);
+
+/* zsync_use_io_uring - queue writes with io_uring if available (returns 0) */
+int zsync_use_io_uring(struct zsync_state *zs);
+
 /* zsync_submit_source_file - submit local file data to zsync
  */
 int zsync_submit_source_file(struct zsync_state *zs, FILE *f, int progress);
 
+/* zsync_submit_source_file_multi - zsync_submit_source_file for each of n
+ * targets, reading the file once for (most of) them */
+int zsync_submit_source_file_multi(struct zsync_state **zs, int n, FILE *f, int progress);
+
+/* zsync_submit_source_join - as zsync_submit_source_file, for a file whose
+ * own .zsync is on cf: what it has of the target is found by comparing the two
+ * .zsyncs, and only the rest of the file is scanned */
+int zsync_submit_source_join(struct zsync_state *zs, FILE *f, FILE *cf, int progress);
+
+/* zsync_submit_source_clone - as zsync_submit_source_file, for the first
+ * source file; where the filesystem can, the target starts as a reflink of it,
+ * and only data that has moved or changed is written */
+int zsync_submit_source_clone(struct zsync_state *zs, FILE *f, int progress);
+
+/* zsync_submit_in_place - update the file open read-write on fd into the
+ * target in place, using the journal to finish any interrupted update; then
+ * the target is written to fd. Call before submitting any other file. */
+int zsync_submit_in_place(struct zsync_state *zs, int fd, const char *journal, int progress);
+
+/* zsync_resume - take over the file left by an interrupted run, trusting the
+ * map that it saved with zsync_save_map (after checking up to checks blocks)
+ * instead of reading it all again. Call before submitting any other file. */
+int zsync_resume(struct zsync_state *zs, const char *filename, const char *map, int checks);
+int zsync_save_map(struct zsync_state *zs, const char *map);
+
+/* zsync_diff - the reusable ranges that the old version of the target, whose
+ * .zsync is in old, has at the offsets of its blocks, from the .zsyncs alone.
+ * Thread-safe, for comparing with many old versions at once. */
+int zsync_diff(struct zsync_state *zs, const struct zsync_state *old, struct reuseable_range **rr, size_t *n);
+
 void zsync_get_reuseable_ranges(struct zsync_state *zs, struct reuseable_range **bpr_out, size_t *len_bpr_out);
 
 /* zsync_get_url - returns a URL from which to get needed data.
@@ -74,6 +127,10 @@ off_t *zsync_needed_byte_ranges(struct zsync_state *zs, int *num);
  * Returns -1 for failure, 1 for success, 0 for unable to verify (e.g. no checksum in the .zsync) */
 int zsync_complete(struct zsync_state *zs);
 
+/* zsync_verify_stats - how many bytes zsync_complete had to read back from the
+ * file to verify it (the rest was checked as it came in), and in how long */
+void zsync_verify_stats(const struct zsync_state *zs, long long *bytes, double *secs);
+
 /* Clean up and free all resources. The pointer is freed by this call.
  * Returns a strdup()d pointer to the name of the file resulting from the process. */
 char *zsync_end(struct zsync_state *zs);
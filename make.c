@@ -34,6 +34,8 @@
 #include "format_string.h"
 #include "librcksum/rcksum.h"
 #include "libzsync/sha1.h"
+#include "libzsync/treehash.h"
+#include "libzsync/zstdfile.h"
 
 /* We're only doing one file per run, so these are global state for the current
  * file being processed */
@@ -41,8 +43,24 @@ SHA1_CTX shactx;
 size_t blocksize = 0;
 off_t len = 0;
 
+/* -T: also write a Tree-Hash with leaves of this size, which we build up as
+ * we go through the file */
+size_t tree_leafsize = 0;
+SHA256_CTX tree_ctx;
+size_t tree_leaf_fill = 0; /* bytes in the current leaf so far */
+uint8_t (*tree_leaves)[SHA256_DIGEST_LENGTH] = NULL;
+size_t tree_nleaves = 0;
+
+/* -C: split into content-defined chunks of about this size instead of blocks */
+size_t chunk_avg = 0;
+int nchunks = 0;
+
 /* And settings from the command line */
 int verbose = 0;
+int crc32c_len = 0; /* -c: add a CRC32C column of this many bytes per block */
+bool table = false; /* -2: write the checksums as a binary table, with the hash tables */
+bool table_zstd = false; /* -z: and compress it, without the hash tables */
+int scan_stride = 0; /* -S: tell clients the data only moves in steps of this */
 
 /* stream_error(function, stream) - Exit with IO-related error message */
 void __attribute__((noreturn)) stream_error(const char *func, FILE *stream) {
@@ -50,12 +68,56 @@ void __attribute__((noreturn)) stream_error(const char *func, FILE *stream) {
     exit(2);
 }
 
+/* tree_add_leaf()
+ * Finish the current leaf of the tree hash and start the next. */
+static void tree_add_leaf(void) {
+    tree_leaves = realloc(tree_leaves, (tree_nleaves + 1) * sizeof *tree_leaves);
+    if (!tree_leaves) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    SHA256Final(tree_leaves[tree_nleaves++], &tree_ctx);
+    tree_leaf_fill = 0;
+}
+
+/* tree_finish()
+ * Finish the last leaf, which may be partial (or empty, for an empty file). */
+static void tree_finish(void) {
+    if (tree_nleaves && !tree_leaf_fill)
+        return;
+    if (!tree_leaf_fill) {
+        SHA256Init(&tree_ctx);
+        SHA256Update(&tree_ctx, (const uint8_t *)"\0", 1);
+    }
+    tree_add_leaf();
+}
+
+/* tree_update(buffer[], num_bytes)
+ * Add the next data from the file to the tree hash, if we are doing one. */
+static void tree_update(const unsigned char *buf, size_t got) {
+    while (tree_leafsize && got) {
+        size_t n = tree_leafsize - tree_leaf_fill < got ? tree_leafsize - tree_leaf_fill : got;
+
+        if (!tree_leaf_fill) {
+            SHA256Init(&tree_ctx);
+            SHA256Update(&tree_ctx, (const uint8_t *)"\0", 1);
+        }
+        SHA256Update(&tree_ctx, buf, n);
+        tree_leaf_fill += n;
+        buf += n;
+        got -= n;
+        if (tree_leaf_fill == tree_leafsize)
+            tree_add_leaf();
+    }
+}
+
 /* write_block_sums(buffer[], num_bytes, output_stream)
  * Given one block of data, calculate the checksums for this block and write
  * them (as raw bytes) to the given output stream */
 static void write_block_sums(unsigned char *buf, size_t got, FILE *f) {
     struct rsum r;
     unsigned char checksum[CHECKSUM_SIZE];
+    uint32_t crc;
 
     /* Pad for our checksum, if this is a short last block  */
     if (got < blocksize)
@@ -72,6 +134,13 @@ static void write_block_sums(unsigned char *buf, size_t got, FILE *f) {
         stream_error("fwrite", f);
     if (fwrite(checksum, sizeof checksum, 1, f) != 1)
         stream_error("fwrite", f);
+
+    /* And the CRC32C, if requested, also in network endian */
+    if (crc32c_len) {
+        crc = htonl(rcksum_calc_crc32c(buf, blocksize));
+        if (fwrite(&crc, sizeof crc, 1, f) != 1)
+            stream_error("fwrite", f);
+    }
 }
 
 /* read_stream_write_blocksums(data_stream, zsync_stream)
@@ -93,6 +162,7 @@ void read_stream_write_blocksums(FILE *fin, FILE *fout) {
             /* The SHA-1 sum, unlike our internal block-based sums, is on the whole file and nothing else - no padding
              */
             SHA1Update(&shactx, buf, got);
+            tree_update(buf, got);
 
             write_block_sums(buf, got, fout);
             len += got;
@@ -104,6 +174,55 @@ void read_stream_write_blocksums(FILE *fin, FILE *fout) {
     free(buf);
 }
 
+/* read_stream_write_chunksums(data_stream, zsync_stream)
+ * Reads the data stream, splits it into content-defined chunks and writes to
+ * the zsync stream the length and checksum of each chunk. The length goes
+ * where the rsum goes for blocks, so fcopy_hashes works for both.
+ */
+void read_stream_write_chunksums(FILE *fin, FILE *fout) {
+    size_t chunk_min = chunk_avg / 4, chunk_max = chunk_avg * 4;
+    size_t bufsize = chunk_max * 16 < 0x100000 ? 0x100000 : chunk_max * 16;
+    unsigned char *buf = malloc(bufsize);
+    size_t avail = 0;
+
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (;;) {
+        size_t got = fread(buf + avail, 1, bufsize - avail, fin);
+        size_t pos = 0;
+        int eof;
+
+        if (ferror(fin))
+            stream_error("fread", fin);
+        eof = feof(fin);
+        SHA1Update(&shactx, buf + avail, got);
+        tree_update(buf + avail, got);
+        len += got;
+        avail += got;
+
+        /* We need chunk_max bytes to be sure of a boundary, unless at EOF */
+        while (pos < avail && (eof || avail - pos >= chunk_max)) {
+            size_t n = rcksum_cdc_boundary(buf + pos, avail - pos, chunk_min, chunk_avg, chunk_max);
+            unsigned char checksum[CHECKSUM_SIZE];
+            uint32_t l = htonl(n);
+
+            rcksum_calc_checksum(&checksum[0], buf + pos, n);
+            if (fwrite(&l, sizeof l, 1, fout) != 1 || fwrite(checksum, sizeof checksum, 1, fout) != 1)
+                stream_error("fwrite", fout);
+            nchunks++;
+            pos += n;
+        }
+        if (eof)
+            break;
+        memmove(buf, buf + pos, avail - pos);
+        avail -= pos;
+    }
+    free(buf);
+}
+
 /* fcopy(instream, outstream)
  * Copies data from one stream to the other until EOF on the input.
  */
@@ -123,22 +242,26 @@ void fcopy(FILE *fin, FILE *fout) {
     }
 }
 
-/* fcopy_hashes(hash_stream, zsync_stream, rsum_bytes, hash_bytes)
+/* fcopy_hashes(hash_stream, zsync_stream, rsum_bytes, hash_bytes, crc_bytes)
  * Copy the full block checksums from their temporary store file to the .zsync,
- * stripping the hashes down to the desired lengths specified by the last 2
+ * stripping the hashes down to the desired lengths specified by the last 3
  * parameters.
  */
-void fcopy_hashes(FILE *fin, FILE *fout, size_t rsum_bytes, size_t hash_bytes) {
-    unsigned char buf[20];
+void fcopy_hashes(FILE *fin, FILE *fout, size_t rsum_bytes, size_t hash_bytes, size_t crc_bytes) {
+    unsigned char buf[4 + CHECKSUM_SIZE + CRC32C_SIZE];
+    size_t record = 4 + CHECKSUM_SIZE + (crc_bytes ? CRC32C_SIZE : 0);
     size_t len;
 
-    while ((len = fread(buf, 1, sizeof(buf), fin)) > 0) {
+    while ((len = fread(buf, 1, record, fin)) > 0) {
         /* write trailing rsum_bytes of the rsum (trailing because the second part of the rsum is more useful in
          * practice for hashing), and leading checksum_bytes of the checksum */
         if (fwrite(buf + 4 - rsum_bytes, 1, rsum_bytes, fout) < rsum_bytes)
             break;
         if (fwrite(buf + 4, 1, hash_bytes, fout) < hash_bytes)
             break;
+        /* and leading crc_bytes of the CRC32C */
+        if (fwrite(buf + 4 + CHECKSUM_SIZE, 1, crc_bytes, fout) < crc_bytes)
+            break;
     }
     if (ferror(fin)) {
         stream_error("fread", fin);
@@ -148,6 +271,78 @@ void fcopy_hashes(FILE *fin, FILE *fout, size_t rsum_bytes, size_t hash_bytes) {
     }
 }
 
+/* write_table(hash_stream, zsync_stream, rsum_bytes, hash_bytes, seq_matches)
+ * Write the block hashes from the temp file to the .zsync as the binary table
+ * that the client loads without decoding (see librcksum/table.c), with the
+ * hash tables for looking them up, which we build here as the client would.
+ * Or with -z, compressed; then without the hash tables, which would cost more
+ * to download than to build. The rsums and checksums are separate columns in
+ * the table, which compress far better than the rows of a 0.6.2 .zsync. */
+static void write_table(FILE *fin, FILE *fout, int rsum_bytes, int hash_bytes, int seq_matches) {
+    zs_blockid blocks = (len + blocksize - 1) / blocksize;
+    struct rcksum_state *z = rcksum_init(blocks, blocksize, rsum_bytes, hash_bytes, 0, seq_matches, true, NULL, len);
+    unsigned char *records;
+    size_t records_len;
+    FILE *f = open_memstream((char **)&records, &records_len);
+
+    if (!z || !f) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    /* The hashes as they would be in a 0.6.2 .zsync, to load as the client does */
+    fcopy_hashes(fin, f, rsum_bytes, hash_bytes, 0);
+    fclose(f);
+    rcksum_add_target_blocks(z, 0, blocks, records);
+    free(records);
+
+    if (table_zstd) {
+        FILE *zf = zstd_open_write(fout, ZSTD_TABLE_LEVEL);
+        if (!zf || rcksum_write_table(z, zf, 0) != 0 || fclose(zf) != 0)
+            stream_error("zstd", fout);
+    } else if (rcksum_find_zero_blocks(z) < 0 || rcksum_write_table(z, fout, 1) != 0) {
+        stream_error("rcksum_write_table", fout);
+    }
+    rcksum_end(z);
+}
+
+/* calc_hash_lengths(block_size, &seq_matches, &rsum_len, &checksum_len)
+ * Decide how long a rsum hash and checksum hash per block we need for a file
+ * of length len, split into blocks of the given size. */
+static void calc_hash_lengths(size_t bs, int *seq_matches_out, int *rsum_len_out, int *checksum_len_out) {
+    int seq_matches = 1;
+    int rsum_len = ceil(((log(len) + log(bs)) / log(2) - 8.6) / 8);
+    int checksum_len;
+
+    /* For large files, the optimum weak checksum size can be more than
+     * what we have available. Switch to seq_matches for this case. */
+    if (rsum_len > 4) {
+        /* seq_matches > 1 in theory would reduce the amount of rsum_len
+         * needed, since we get effectively rsum_len*seq_matches required
+         * to match before a strong checksum is calculated. In practice,
+         * consecutive blocks in the file can be highly correlated, so we
+         * want to keep the maximum available rsum_len as well.
+         * For each further byte of rsum we would want, require one more
+         * block to match; that also lets us shorten checksum_len below. */
+        seq_matches = min(MAX_SEQ_MATCHES, rsum_len - 3);
+        rsum_len = 4;
+    }
+
+    /* min lengths of rsums to store */
+    rsum_len = max(2, rsum_len);
+
+    /* Now the checksum length; min of two calculations */
+    checksum_len = max(ceil((20 + (log(len) + log(1 + len / bs)) / log(2)) / seq_matches / 8),
+                       ceil((20 + log(1 + len / bs) / log(2)) / 8));
+
+    /* Keep checksum_len within 4-16 bytes */
+    checksum_len = min(16, max(4, checksum_len));
+
+    *seq_matches_out = seq_matches;
+    *rsum_len_out = rsum_len;
+    *checksum_len_out = checksum_len;
+}
+
 /* len = get_len(stream)
  * Returns the length of the file underlying this stream */
 off_t get_len(FILE *f) {
@@ -179,7 +374,7 @@ int main(int argc, char **argv) {
 
     { /* Options parsing */
         int opt;
-        while ((opt = getopt(argc, argv, "b:o:f:u:vM")) != -1) {
+        while ((opt = getopt(argc, argv, "b:C:S:T:o:f:u:vMc2z")) != -1) {
             switch (opt) {
             case 'o':
                 if (outfname) {
@@ -202,6 +397,27 @@ int main(int argc, char **argv) {
                     exit(2);
                 }
                 break;
+            case 'C':
+                chunk_avg = atoi(optarg);
+                if (chunk_avg < 256 || chunk_avg > 0x100000 || (chunk_avg & (chunk_avg - 1)) != 0) {
+                    fprintf(stderr, "average chunk size must be a power of 2 from 256 to 1048576\n");
+                    exit(2);
+                }
+                break;
+            case 'S':
+                scan_stride = atoi(optarg);
+                if (scan_stride < 1 || (scan_stride & (scan_stride - 1)) != 0) {
+                    fprintf(stderr, "scan stride must be a power of 2 (512, 4096, ...)\n");
+                    exit(2);
+                }
+                break;
+            case 'T':
+                tree_leafsize = atoi(optarg);
+                if (tree_leafsize < 1024 || (tree_leafsize & (tree_leafsize - 1)) != 0) {
+                    fprintf(stderr, "tree hash leaf size must be a power of 2, at least 1024\n");
+                    exit(2);
+                }
+                break;
             case 'u':
                 url = realloc(url, (nurls + 1) * sizeof *url);
                 url[nurls++] = optarg;
@@ -213,6 +429,18 @@ int main(int argc, char **argv) {
                 /* Do not set the MTime header */
                 set_mtime = false;
                 break;
+            case 'c':
+                /* Add a CRC32C per block, for the client to check before the MD4 */
+                crc32c_len = CRC32C_SIZE;
+                break;
+            case '2':
+                /* Write the checksums as a binary table, which zsync 0.6.2 can't read */
+                table = true;
+                break;
+            case 'z':
+                /* And compress it */
+                table = table_zstd = true;
+                break;
             }
         }
 
@@ -245,35 +473,39 @@ int main(int argc, char **argv) {
         blocksize = (get_len(instream) < 100000000) ? 2048 : 4096;
     }
 
+    /* Chunks have their own lookup by strong checksum, with no room for the
+     * other per-block extras */
+    if (chunk_avg && (crc32c_len || scan_stride)) {
+        fprintf(stderr, "-C cannot be combined with -c or -S\n");
+        exit(2);
+    }
+    /* The table has only the block checksums */
+    if (table && (chunk_avg || crc32c_len)) {
+        fprintf(stderr, "-2 and -z cannot be combined with -C or -c\n");
+        exit(2);
+    }
+    if ((size_t)scan_stride > blocksize) {
+        fprintf(stderr, "scan stride cannot be more than the blocksize\n");
+        exit(2);
+    }
+
     /* Read the input file and construct the checksum of the whole file, and
      * the per-block checksums */
     SHA1Init(&shactx);
-    read_stream_write_blocksums(instream, tf);
+    if (chunk_avg) {
+        read_stream_write_chunksums(instream, tf);
 
-    { /* Decide how long a rsum hash and checksum hash per block we need for this file */
+        /* Every chunk of the seed is looked up by checksum alone, so it must
+         * rule out a false match between any of the target's chunks and
+         * about as many again from the seed. The 4-byte "rsum" is the length. */
         seq_matches = 1;
-        rsum_len = ceil(((log(len) + log(blocksize)) / log(2) - 8.6) / 8);
-        /* For large files, the optimum weak checksum size can be more than
-         * what we have available. Switch to seq_matches for this case. */
-        if (rsum_len > 4) {
-            /* seq_matches > 1 in theory would reduce the amount of rsum_len
-             * needed, since we get effectively rsum_len*seq_matches required
-             * to match before a strong checksum is calculated. In practice,
-             * consecutive blocks in the file can be highly correlated, so we
-             * want to keep the maximum available rsum_len as well. */
-            seq_matches = 2;
-            rsum_len = 4;
-        }
-
-        /* min lengths of rsums to store */
-        rsum_len = max(2, rsum_len);
-
-        /* Now the checksum length; min of two calculations */
-        checksum_len = max(ceil((20 + (log(len) + log(1 + len / blocksize)) / log(2)) / seq_matches / 8),
-                           ceil((20 + log(1 + len / blocksize) / log(2)) / 8));
-
-        /* Keep checksum_len within 4-16 bytes */
+        rsum_len = 4;
+        checksum_len = ceil((20 + 2 * log(1 + nchunks) / log(2)) / 8);
         checksum_len = min(16, max(4, checksum_len));
+        blocksize = chunk_avg;
+    } else {
+        read_stream_write_blocksums(instream, tf);
+        calc_hash_lengths(blocksize, &seq_matches, &rsum_len, &checksum_len);
     }
 
     if (!outfname && fname) {
@@ -293,6 +525,12 @@ int main(int argc, char **argv) {
         fout = stdout;
     }
 
+    /* The table is aligned to where it is in the file, so we must know that */
+    if (table && !table_zstd && ftell(fout) < 0) {
+        fprintf(stderr, "-2 needs the output to be a file, not a pipe\n");
+        exit(2);
+    }
+
     /* Okay, start writing the zsync file */
     // We use original zsync 0.6.2 format
     fprintf(fout, "zsync: 0.6.2\n");
@@ -314,6 +552,17 @@ int main(int argc, char **argv) {
     fprintf(fout, "Blocksize: " SIZE_T_PF "\n", blocksize);
     fprintf(fout, "Length: " OFF_T_PF "\n", (intmax_t)len);
     fprintf(fout, "Hash-Lengths: %d,%d,%d\n", seq_matches, rsum_len, checksum_len);
+    if (table)
+        fprintf(fout, "Table-Layout: 2\n");
+    if (table_zstd)
+        fprintf(fout, "Table-Compression: zstd\n");
+    if (crc32c_len)
+        fprintf(fout, "CRC32C-Length: %d\n", crc32c_len);
+    if (chunk_avg) {
+        fprintf(fout, "Chunking: gear," SIZE_T_PF "," SIZE_T_PF "," SIZE_T_PF "\n", chunk_avg / 4, chunk_avg,
+                chunk_avg * 4);
+        fprintf(fout, "Chunks: %d\n", nchunks);
+    }
     { /* Write URLs */
         int i;
         for (i = 0; i < nurls; i++)
@@ -343,12 +592,36 @@ int main(int argc, char **argv) {
         fputc('\n', fout);
     }
 
+    /* Clients that don't know these can still scan every offset and check
+     * the SHA-1 */
+    if (scan_stride || tree_leafsize)
+        fprintf(fout, "Safe:%s%s\n", scan_stride ? " Scan-Stride" : "", tree_leafsize ? " Tree-Hash" : "");
+    if (scan_stride)
+        fprintf(fout, "Scan-Stride: %d\n", scan_stride);
+
+    if (tree_leafsize) { /* And the Tree-Hash */
+        uint8_t root[SHA256_DIGEST_LENGTH];
+        unsigned int i;
+
+        tree_finish();
+        tree_hash_root(root, tree_leaves, tree_nleaves);
+
+        fprintf(fout, "Tree-Hash: %s " SIZE_T_PF " ", TREE_HASH_METHOD, tree_leafsize);
+        for (i = 0; i < sizeof root; i++)
+            fprintf(fout, "%02x", root[i]);
+        fputc('\n', fout);
+        free(tree_leaves);
+    }
+
     /* End of headers */
     fputc('\n', fout);
 
     /* Now copy the actual block hashes to the .zsync */
     rewind(tf);
-    fcopy_hashes(tf, fout, rsum_len, checksum_len);
+    if (table)
+        write_table(tf, fout, rsum_len, checksum_len, seq_matches);
+    else
+        fcopy_hashes(tf, fout, rsum_len, checksum_len, crc32c_len);
 
     /* And cleanup */
     fclose(tf);
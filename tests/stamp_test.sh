@@ -0,0 +1,48 @@
+#!/bin/bash
+
+set -euxo pipefail
+
+function separator() { echo -e "\n\n"; }
+
+# The .zsync comes from a file:// URL, for which curl gives a Last-Modified
+# date (the file's mtime) and honours If-Modified-Since, like a web server
+url="file://$TEST_TMPDIR/target.zsync"
+seq 1 20000 >"$TEST_TMPDIR/target"
+./zsyncmake -o "$TEST_TMPDIR/target.zsync" -u "file://$TEST_TMPDIR/target" "$TEST_TMPDIR/target"
+touch -d "2020-01-01 00:00:00 UTC" "$TEST_TMPDIR/target.zsync"
+./zsync -q -o "$TEST_TMPDIR/out" "$url"
+cmp "$TEST_TMPDIR/out" "$TEST_TMPDIR/target"
+
+#----------------------------------------------------------------
+echo The .zsync is not downloaded again while it is unchanged
+# Were it read, this would be no .zsync at all
+cp "$TEST_TMPDIR/target.zsync" "$TEST_TMPDIR/saved.zsync"
+echo "not a .zsync" >"$TEST_TMPDIR/target.zsync"
+touch -d "2020-01-01 00:00:00 UTC" "$TEST_TMPDIR/target.zsync"
+./zsync -q -o "$TEST_TMPDIR/out" "$url"
+cmp "$TEST_TMPDIR/out" "$TEST_TMPDIR/target"
+separator
+
+#----------------------------------------------------------------
+echo A new .zsync dated after the last, by the server, is downloaded
+# Although it is dated long before this machine's clock says we last fetched it
+seq 1 30000 >"$TEST_TMPDIR/target"
+./zsyncmake -o "$TEST_TMPDIR/target.zsync" -u "file://$TEST_TMPDIR/target" "$TEST_TMPDIR/target"
+touch -d "2020-01-02 00:00:00 UTC" "$TEST_TMPDIR/target.zsync"
+./zsync -q -o "$TEST_TMPDIR/out" "$url"
+cmp "$TEST_TMPDIR/out" "$TEST_TMPDIR/target"
+separator
+
+#----------------------------------------------------------------
+echo A .zsync that is a local file is read directly, and dated by its mtime
+# In the binary table layout too, which the client maps
+./zsyncmake -2 -o "$TEST_TMPDIR/local.zsync" -u "file://$TEST_TMPDIR/target" "$TEST_TMPDIR/target"
+touch -d "2020-01-03 00:00:00 UTC" "$TEST_TMPDIR/local.zsync"
+./zsync -q -o "$TEST_TMPDIR/local-out" "$TEST_TMPDIR/local.zsync"
+cmp "$TEST_TMPDIR/local-out" "$TEST_TMPDIR/target"
+cp "$TEST_TMPDIR/local.zsync" "$TEST_TMPDIR/saved.zsync"
+echo "not a .zsync" >"$TEST_TMPDIR/local.zsync"
+touch -d "2020-01-03 00:00:00 UTC" "$TEST_TMPDIR/local.zsync"
+./zsync -q -o "$TEST_TMPDIR/local-out" "$TEST_TMPDIR/local.zsync"
+cmp "$TEST_TMPDIR/local-out" "$TEST_TMPDIR/target"
+separator
@@ -34,6 +34,52 @@ echo zsync: Update from 37 to 63
     -o "$(pwd)/out" \
     https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage.zsync
 test "$(sha1sum out | cut -d' ' -f1)" == "$(sha1sum zsync2-63-1608115-x86_64.AppImage | cut -d' ' -f1)"
+separator
+
+echo zsync: Nothing to do when it is up to date already
+rm out.zs-old
+./zsync \
+    -o "$(pwd)/out" \
+    https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage.zsync
+test ! -e out.zs-old
+rm out*
+separator
+
+echo zsync: Update from 37 to 63, with the .zsync of 37
+./zsync \
+    -i "$(pwd)/zsync2-37-c679907-x86_64.AppImage:$(pwd)/zsync2-37-c679907-x86_64.AppImage.zsync" \
+    -u https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage \
+    -o "$(pwd)/out" \
+    https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage.zsync
+test "$(sha1sum out | cut -d' ' -f1)" == "$(sha1sum zsync2-63-1608115-x86_64.AppImage | cut -d' ' -f1)"
+rm out*
+separator
+
+echo zsync: Update from 37 to 63 in place
+cp zsync2-37-c679907-x86_64.AppImage out
+./zsync \
+    -I \
+    -u https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage \
+    -o "$(pwd)/out" \
+    https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage.zsync
+test "$(sha1sum out | cut -d' ' -f1)" == "$(sha1sum zsync2-63-1608115-x86_64.AppImage | cut -d' ' -f1)"
+test ! -e out.part && test ! -e out.zs-journal
+rm out*
+separator
+
+echo zsync: Resume an interrupted update from 37 to 63
+! ./zsync \
+    -i "$(pwd)/zsync2-37-c679907-x86_64.AppImage" \
+    -u https://github.com/AppImageCommunity/zsync2/releases/download/nonexistent/zsync2-63-1608115-x86_64.AppImage \
+    -o "$(pwd)/out" \
+    https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage.zsync
+test -e out.part && test -e out.zs-resume
+./zsync \
+    -u https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage \
+    -o "$(pwd)/out" \
+    https://github.com/AppImageCommunity/zsync2/releases/download/2.0.0-alpha-1-20230304/zsync2-63-1608115-x86_64.AppImage.zsync
+test "$(sha1sum out | cut -d' ' -f1)" == "$(sha1sum zsync2-63-1608115-x86_64.AppImage | cut -d' ' -f1)"
+test ! -e out.part && test ! -e out.zs-resume
 rm out*
 separator
 
@@ -0,0 +1,34 @@
+#!/bin/bash
+
+set -euxo pipefail
+
+function separator() { echo -e "\n\n"; }
+
+#----------------------------------------------------------------
+echo Same version, need nothing
+out="$(./zsyncdiff "$(pwd)/tests/loremipsum.zsync" "$(pwd)/tests/loremipsum.zsync")"
+test "$out" == '{"length":1057,"checksum":{"SHA-1":"b1b8d0c324b78a99abfd2eec90260b1c2ba02eb8"},"reuse":[[0,0,1057]],"download":[],"bytes":{"aligned":1057,"relocated":0,"download":0}}'
+separator
+
+#----------------------------------------------------------------
+echo Changed version, need partial update, same as zsyncranges finds from the file
+out="$(./zsyncdiff "$(pwd)/tests/loremipsum-edited.zsync" "$(pwd)/tests/loremipsum.zsync")"
+test "$out" == '{"length":1057,"checksum":{"SHA-1":"b1b8d0c324b78a99abfd2eec90260b1c2ba02eb8"},"reuse":[[0,0,200],[200,216,248],[456,472,104],[576,592,224],[808,824,249]],"download":[[448,455],[560,575],[800,807]],"bytes":{"aligned":200,"relocated":825,"download":32}}'
+separator
+
+#----------------------------------------------------------------
+echo Several old versions, one line each, in order
+out="$(./zsyncdiff "$(pwd)/tests/loremipsum.zsync" "$(pwd)/tests/loremipsum-edited.zsync" "$(pwd)/tests/loremipsum-edited.zsync")"
+test "$(echo "$out" | wc -l)" == 2
+test "$(echo "$out" | head -1)" == '{"length":1073,"checksum":{"SHA-1":"79e1bb83a162f3b6e056fdcccdca8a4eb9f32eb1"},"reuse":[[0,0,200],[216,200,248],[472,456,104],[592,576,224],[824,808,249]],"download":[[200,215],[464,471],[576,591],[816,823]],"bytes":{"aligned":200,"relocated":825,"download":48}}'
+test "$(echo "$out" | tail -1)" == '{"length":1073,"checksum":{"SHA-1":"79e1bb83a162f3b6e056fdcccdca8a4eb9f32eb1"},"reuse":[[0,0,1073]],"download":[],"bytes":{"aligned":1073,"relocated":0,"download":0}}'
+separator
+
+#----------------------------------------------------------------
+echo Old version that does not exist
+if out="$(./zsyncdiff /invalid "$(pwd)/tests/loremipsum.zsync" 2>/dev/null)"; then
+    echo "Expected failure, got: $out"
+    exit 1
+fi
+test "$out" == "null"
+separator
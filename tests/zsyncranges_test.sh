@@ -59,3 +59,64 @@ cat tests/files/loremipsum - <<<"This is extra data to be removed" >"$TEST_TMPDI
 ranges="$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")"
 test "$ranges" == '{"length":1057,"checksum":{"SHA-1":"b1b8d0c324b78a99abfd2eec90260b1c2ba02eb8"},"reuse":[[0,0,1056],[1056,1089,1]],"download":[]}'
 separator
+
+#----------------------------------------------------------------
+echo Several targets from one seed, one line for each
+cat <(sed 's/massa/xxxxx/g' tests/files/loremipsum) <(echo "between") tests/files/loremipsum-edited >"$TEST_TMPDIR/seed"
+expected="$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")"
+expected+=$'\n'"$(./zsyncranges "$(pwd)/tests/loremipsum-edited.zsync" "$TEST_TMPDIR/seed")"
+expected+=$'\n'"$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")"
+ranges="$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$(pwd)/tests/loremipsum-edited.zsync" - "$TEST_TMPDIR/seed" <"$(pwd)/tests/loremipsum.zsync")"
+test "$ranges" == "$expected"
+test "$(echo "$ranges" | wc -l)" == 3
+separator
+
+#----------------------------------------------------------------
+echo Same seed again, from the match cache
+export XDG_CACHE_HOME="$TEST_TMPDIR/cache"
+cat <(echo "extra data to be removed") <(sed 's/massa/xxxxx/g' tests/files/loremipsum) >"$TEST_TMPDIR/seed"
+first="$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")"
+test "$(ls "$XDG_CACHE_HOME/zsync" | wc -l)" == 1
+ranges="$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")"
+test "$ranges" == "$first"
+separator
+
+#----------------------------------------------------------------
+echo Changed seed that looks the same, not from the match cache
+touch -r "$TEST_TMPDIR/seed" "$TEST_TMPDIR/stamp"
+sed 's/^extra/EXTRA/; s/sed/xxx/g' "$TEST_TMPDIR/seed" >"$TEST_TMPDIR/changed"
+cp "$TEST_TMPDIR/changed" "$TEST_TMPDIR/seed" # Same inode and size
+touch -r "$TEST_TMPDIR/stamp" "$TEST_TMPDIR/seed"
+ranges="$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")"
+test "$ranges" == "$(./zsyncranges "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/changed")"
+test "$ranges" != "$first"
+separator
+
+#----------------------------------------------------------------
+echo A strided scan of the same seed is not taken from the match cache for a plain one
+# The same blocks, so the same target, but scanned only every 256 bytes: that
+# misses the data moved by the lines added in the seed
+seq 1 40000 >"$TEST_TMPDIR/target"
+./zsyncmake -b 256 -o "$TEST_TMPDIR/plain.zsync" -u target "$TEST_TMPDIR/target"
+./zsyncmake -b 256 -S 256 -o "$TEST_TMPDIR/strided.zsync" -u target "$TEST_TMPDIR/target"
+{
+    echo "extra at the front"
+    head -c 30000 "$TEST_TMPDIR/target"
+    echo "inserted"
+    tail -c +30001 "$TEST_TMPDIR/target"
+} >"$TEST_TMPDIR/seed"
+export XDG_CACHE_HOME="$TEST_TMPDIR/cache-strided"
+strided="$(./zsyncranges "$TEST_TMPDIR/strided.zsync" "$TEST_TMPDIR/seed" | sed 's/.*"download"://')"
+plain="$(./zsyncranges "$TEST_TMPDIR/plain.zsync" "$TEST_TMPDIR/seed" | sed 's/.*"download"://')"
+test "$strided" != "$plain"
+test "$(ls "$XDG_CACHE_HOME/zsync" | wc -l)" == 2
+test "$(./zsyncranges "$TEST_TMPDIR/plain.zsync" "$TEST_TMPDIR/seed" | sed 's/.*"download"://')" == "$plain"
+separator
+
+#----------------------------------------------------------------
+echo Without the match cache, nothing is kept in it
+export XDG_CACHE_HOME="$TEST_TMPDIR/cache-off"
+ranges="$(./zsyncranges -M "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")"
+test "$(./zsyncranges -M "$(pwd)/tests/loremipsum.zsync" "$TEST_TMPDIR/seed")" == "$ranges"
+test ! -e "$XDG_CACHE_HOME/zsync" || test "$(ls "$XDG_CACHE_HOME/zsync" | wc -l)" == 0
+separator
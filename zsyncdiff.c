@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "librcksum/rcksum.h"
+#include "libzsync/zsync.h"
+
+// What updating from each old version to the new one would take, worked out from the .zsync files alone: the data
+// that the old file has where its .zsync says (at the same offset, or moved), and the rest to download.
+// Each old version is compared by one of a few threads, as there may be hundreds of them.
+
+struct job {
+    const char *path; // The old .zsync
+    char *json;       // The result, or NULL on failure
+};
+
+static struct zsync_state *new_zs;
+static off_t *needed; // What we'd download with no old version, as from zsyncranges
+static int num_needed;
+
+static struct job *jobs;
+static int num_jobs, next_job;
+static pthread_mutex_t next_job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_dst(const void *a, const void *b) {
+    const struct reuseable_range *x = a, *y = b;
+    return (x->dst > y->dst) - (x->dst < y->dst);
+}
+
+// The result for one old version, in the same shape as zsyncranges gives, plus the totals
+static char *diff(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    struct zsync_state *old_zs = zsync_begin(f, true);
+    fclose(f);
+    if (!old_zs) {
+        fprintf(stderr, "%s: zsync_begin failed\n", path);
+        return NULL;
+    }
+
+    struct reuseable_range *rr;
+    size_t len_rr;
+    int rc = zsync_diff(new_zs, old_zs, &rr, &len_rr);
+    free(zsync_end(old_zs));
+    if (rc != 0) {
+        fprintf(stderr, "%s: can't be compared with the new .zsync (different blocksize?)\n", path);
+        return NULL;
+    }
+
+    char *json;
+    size_t json_len;
+    FILE *out = open_memstream(&json, &json_len);
+    if (!out) {
+        free(rr);
+        return NULL;
+    }
+
+    fprintf(out, "{\"length\":%ld", zsync_get_filelength(new_zs));
+    const char *checksum = NULL;
+    const char *checksum_method = NULL;
+    zsync_get_checksum(new_zs, &checksum, &checksum_method);
+    fprintf(out, ",\"checksum\":{\"%s\":\"%s\"}", checksum_method, checksum);
+
+    long long aligned = 0, relocated = 0, download = 0;
+    fprintf(out, ",\"reuse\":[");
+    for (size_t i = 0; i < len_rr; i++) {
+        fprintf(out, "%s[%ld,%ld,%zu]", i ? "," : "", rr[i].dst, rr[i].src, rr[i].len);
+        if (rr[i].dst == rr[i].src)
+            aligned += rr[i].len;
+        else
+            relocated += rr[i].len;
+    }
+
+    // The needed ranges, less what the old version has
+    qsort(rr, len_rr, sizeof *rr, compare_dst);
+    fprintf(out, "],\"download\":[");
+    size_t j = 0;
+    bool first = true;
+    for (int i = 0; i < num_needed; i++) {
+        off_t pos = needed[2 * i], end = needed[2 * i + 1];
+        for (; j < len_rr && rr[j].dst <= end; j++) {
+            if (rr[j].dst > pos) {
+                fprintf(out, "%s[%ld,%ld]", first ? "" : ",", pos, rr[j].dst - 1);
+                download += rr[j].dst - pos;
+                first = false;
+            }
+            if (rr[j].dst + (off_t)rr[j].len > pos)
+                pos = rr[j].dst + rr[j].len;
+        }
+        if (pos <= end) {
+            fprintf(out, "%s[%ld,%ld]", first ? "" : ",", pos, end);
+            download += end - pos + 1;
+            first = false;
+        }
+    }
+    fprintf(out, "],\"bytes\":{\"aligned\":%lld,\"relocated\":%lld,\"download\":%lld}}", aligned, relocated,
+            download);
+    fclose(out);
+    free(rr);
+    return json;
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&next_job_lock);
+        int i = next_job++;
+        pthread_mutex_unlock(&next_job_lock);
+        if (i >= num_jobs)
+            return NULL;
+        jobs[i].json = diff(jobs[i].path);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: zsyncdiff old.zsync [old.zsync...] new.zsync\n");
+        exit(2);
+    }
+
+    FILE *zsyncfile_stream = fopen(argv[argc - 1], "r");
+    if (!zsyncfile_stream) {
+        perror(argv[argc - 1]);
+        exit(EXIT_FAILURE);
+    }
+    new_zs = zsync_begin(zsyncfile_stream, true);
+    fclose(zsyncfile_stream);
+    if (!new_zs) {
+        fprintf(stderr, "zsync_begin failed\n");
+        exit(EXIT_FAILURE);
+    }
+    needed = zsync_needed_byte_ranges(new_zs, &num_needed);
+    if (!needed) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    num_jobs = argc - 2;
+    jobs = calloc(num_jobs, sizeof *jobs);
+    for (int i = 0; i < num_jobs; i++)
+        jobs[i].path = argv[i + 1];
+
+    // Threads for all but one of the processors, and this one
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (num_threads > num_jobs - 1)
+        num_threads = num_jobs - 1;
+    pthread_t *threads = num_threads > 0 ? malloc(num_threads * sizeof *threads) : NULL;
+    if (!threads)
+        num_threads = 0;
+    for (long i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            num_threads = i;
+            break;
+        }
+    }
+    worker(NULL);
+    for (long i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    // One line for each old version, in order; null for any that failed
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].json) {
+            printf("%s\n", jobs[i].json);
+            free(jobs[i].json);
+        } else {
+            printf("null\n");
+            status = EXIT_FAILURE;
+        }
+    }
+
+    free(jobs);
+    free(needed);
+    free(zsync_end(new_zs));
+    exit(status);
+}
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -5,41 +6,9 @@
 #include "librcksum/rcksum.h"
 #include "libzsync/zsync.h"
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: zsyncranges file.zsync file\n");
-        exit(2);
-    }
-
-    FILE *zsyncfile_stream;
-    if (strcmp(argv[1], "-") == 0) {
-        zsyncfile_stream = stdin;
-    } else {
-        zsyncfile_stream = fopen(argv[1], "r");
-        if (!zsyncfile_stream) {
-            perror(argv[1]);
-            exit(EXIT_FAILURE);
-        }
-    }
-    struct zsync_state *zs = zsync_begin(zsyncfile_stream, true);
-    fclose(zsyncfile_stream);
-    if (!zs) {
-        fprintf(stderr, "zsync_begin failed\n");
-        exit(EXIT_FAILURE);
-    }
-
-    FILE *seedfile_stream = fopen(argv[2], "r");
-    if (!seedfile_stream) {
-        perror(argv[2]);
-        exit(EXIT_FAILURE);
-    }
-    int num_blocks = zsync_submit_source_file(zs, seedfile_stream, 0);
-    fclose(seedfile_stream);
-    if (num_blocks < 0) {
-        fprintf(stderr, "Error reading seed file\n");
-        exit(EXIT_FAILURE);
-    }
-
+/* Print what of the target of zs we have in the seed file, and where, and what
+ * we need to download, as a line of json */
+static void print_ranges(struct zsync_state *zs) {
     printf("{\"length\":%ld", zsync_get_filelength(zs));
 
     const char *checksum = NULL;
@@ -68,11 +37,80 @@ int main(int argc, char **argv) {
         }
     }
     printf("]}\n");
-
     free(zbyterange);
-    char *temp_file = zsync_end(zs);
-    unlink(temp_file);
-    free(temp_file);
+}
+
+int main(int argc, char **argv) {
+    bool match_cache = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "M")) != -1) {
+        switch (opt) {
+        case 'M':
+            match_cache = false;
+            break;
+        default:
+            exit(2);
+        }
+    }
+    if (argc - optind < 2) {
+        fprintf(stderr, "Usage: zsyncranges [-M] file.zsync [file.zsync ...] file\n");
+        exit(2);
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    /* Any number of targets, all looked for in the one seed file */
+    int n = argc - 2;
+    struct zsync_state **zs = malloc(n * sizeof *zs);
+    if (!zs) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        FILE *zsyncfile_stream;
+        if (strcmp(argv[i + 1], "-") == 0) {
+            zsyncfile_stream = stdin;
+        } else {
+            zsyncfile_stream = fopen(argv[i + 1], "r");
+            if (!zsyncfile_stream) {
+                perror(argv[i + 1]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        zs[i] = zsync_begin(zsyncfile_stream, true);
+        fclose(zsyncfile_stream);
+        if (!zs[i]) {
+            fprintf(stderr, "zsync_begin failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Planning is often followed by the real thing with the same seed file */
+        if (match_cache)
+            zsync_use_match_cache(zs[i], NULL);
+    }
+
+    FILE *seedfile_stream = fopen(argv[argc - 1], "r");
+    if (!seedfile_stream) {
+        perror(argv[argc - 1]);
+        exit(EXIT_FAILURE);
+    }
+    int num_blocks = zsync_submit_source_file_multi(zs, n, seedfile_stream, 0);
+    fclose(seedfile_stream);
+    if (num_blocks < 0) {
+        fprintf(stderr, "Error reading seed file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* One line for each, in order */
+    for (int i = 0; i < n; i++) {
+        print_ranges(zs[i]);
+        char *temp_file = zsync_end(zs[i]);
+        if (temp_file)
+            unlink(temp_file);
+        free(temp_file);
+    }
+    free(zs);
 
     exit(EXIT_SUCCESS);
 }